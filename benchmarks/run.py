@@ -0,0 +1,246 @@
+# -*- coding: utf-8 -*-
+
+"""Measure the per-event overhead of bprof.
+
+Each workload is timed unprofiled, under bprof, under cProfile and under a
+no-op ``sys.setprofile`` hook. A separate counting run records how many
+events of each type the workload produces, which turns the extra time into
+nanoseconds per event. Fitting the overheads of all workloads against their
+event mix estimates the cost of each event type on its own.
+
+Usage::
+
+    python -m benchmarks.run [--size N] [--repeat R] [--json out.json]
+                             [--compare baseline.json]
+"""
+
+import argparse
+import cProfile
+import json
+import platform
+import sys
+import time
+
+import bprof
+
+from .workloads import WORKLOADS
+
+EVENT_TYPES = ('call', 'return', 'line', 'c_call', 'c_return')
+# Event types whose costs are fitted together; a CALL is always paired with a
+# RETURN and a C_CALL with a C_RETURN, so their costs cannot be separated.
+FIT_GROUPS = (('call', 'return'), ('line',), ('c_call', 'c_return'))
+
+
+def count_events(workload, size):
+    counts = dict.fromkeys(EVENT_TYPES, 0)
+
+    def profiler(frame, event, arg):
+        if event == 'c_exception':
+            event = 'c_return'
+        if event in counts:
+            counts[event] += 1
+
+    def tracer(frame, event, arg):
+        if event == 'line':
+            counts['line'] += 1
+        return tracer
+
+    sys.setprofile(profiler)
+    sys.settrace(tracer)
+    try:
+        workload(size)
+    finally:
+        sys.settrace(None)
+        sys.setprofile(None)
+    # Discount the hook installation itself: the C calls to sys.settrace
+    # (twice) and sys.setprofile(None), and the C returns from both
+    # sys.settrace calls.
+    counts['c_call'] -= 3
+    counts['c_return'] -= 2
+    return counts
+
+
+def _noop_profiler(frame, event, arg):
+    pass
+
+
+def _time_bprof(workload, size):
+    bprof.start()
+    begin = time.perf_counter_ns()
+    workload(size)
+    end = time.perf_counter_ns()
+    bprof.stop()
+    return end - begin
+
+
+def _time_cprofile(workload, size):
+    profiler = cProfile.Profile()
+    profiler.enable()
+    begin = time.perf_counter_ns()
+    workload(size)
+    end = time.perf_counter_ns()
+    profiler.disable()
+    return end - begin
+
+
+def _time_setprofile(workload, size):
+    sys.setprofile(_noop_profiler)
+    begin = time.perf_counter_ns()
+    workload(size)
+    end = time.perf_counter_ns()
+    sys.setprofile(None)
+    return end - begin
+
+
+def _time_plain(workload, size):
+    begin = time.perf_counter_ns()
+    workload(size)
+    return time.perf_counter_ns() - begin
+
+
+MODES = {
+    'unprofiled': _time_plain,
+    'bprof': _time_bprof,
+    'cProfile': _time_cprofile,
+    'setprofile': _time_setprofile,
+}
+
+
+def _hook_ns_per_event(before, after):
+    """Time bprof spent inside its hook per event, by event type."""
+    result = {}
+    for event, n in after['events'].items():
+        n -= before['events'][event]
+        if n:
+            ns = after['hook_ns'][event] - before['hook_ns'][event]
+            result[event] = ns / n
+    return result
+
+
+def measure(name, workload, size, repeat):
+    times = {}
+    stats_before = bprof.stats()
+    for mode, timer in MODES.items():
+        times[mode] = min(timer(workload, size) for _ in range(repeat))
+    stats_after = bprof.stats()
+    counts = count_events(workload, size)
+    n_events = sum(counts.values())
+    base = times['unprofiled']
+
+    result = {
+        'workload': name,
+        'size': size,
+        'events': counts,
+        'time_ns': times,
+        'slowdown': {mode: t / base for mode, t in times.items()},
+        'ns_per_event': {
+            mode: (t - base) / n_events
+            for mode, t in times.items() if mode != 'unprofiled'},
+        'bprof_hook_ns_per_event': _hook_ns_per_event(stats_before,
+                                                      stats_after),
+    }
+    return result
+
+
+def _solve(matrix, vector):
+    """Gaussian elimination with partial pivoting."""
+    n = len(vector)
+    rows = [list(matrix[i]) + [vector[i]] for i in range(n)]
+    for col in range(n):
+        pivot = max(range(col, n), key=lambda r: abs(rows[r][col]))
+        rows[col], rows[pivot] = rows[pivot], rows[col]
+        if rows[col][col] == 0:
+            return [float('nan')] * n
+        for r in range(n):
+            if r != col:
+                factor = rows[r][col] / rows[col][col]
+                rows[r] = [x - factor * y for x, y in zip(rows[r], rows[col])]
+    return [rows[i][n] / rows[i][i] for i in range(n)]
+
+
+def fit_event_costs(results, mode='bprof'):
+    """Least-squares ns per event type from the overheads of all workloads."""
+    xs = [[sum(r['events'][t] for t in group) for group in FIT_GROUPS]
+          for r in results]
+    ys = [r['time_ns'][mode] - r['time_ns']['unprofiled'] for r in results]
+    k = len(FIT_GROUPS)
+    xtx = [[sum(x[i] * x[j] for x in xs) for j in range(k)] for i in range(k)]
+    xty = [sum(x[i] * y for x, y in zip(xs, ys)) for i in range(k)]
+    costs = _solve(xtx, xty)
+    # Costs are per pair of events; report them per single event.
+    return {'/'.join(group): cost / len(group)
+            for group, cost in zip(FIT_GROUPS, costs)}
+
+
+def compare(report, baseline, tolerance):
+    """Print ns/event changes against a previous report; return regressions."""
+    old = {r['workload']: r for r in baseline['results']}
+    regressions = 0
+    for result in report['results']:
+        previous = old.get(result['workload'])
+        if previous is None:
+            continue
+        before = previous['ns_per_event']['bprof']
+        after = result['ns_per_event']['bprof']
+        change = (after - before) / before if before else 0.0
+        flag = ''
+        if change > tolerance:
+            flag = '  REGRESSION'
+            regressions += 1
+        print('%-20s %8.1f -> %8.1f ns/event (%+.1f%%)%s' % (
+            result['workload'], before, after, 100 * change, flag))
+    return regressions
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(prog='python -m benchmarks.run')
+    parser.add_argument('--size', type=int, default=200000,
+                        help='workload size (default: 200000)')
+    parser.add_argument('--repeat', type=int, default=5,
+                        help='timed runs per mode, best is kept (default: 5)')
+    parser.add_argument('--workload', action='append',
+                        choices=sorted(WORKLOADS),
+                        help='run only this workload (may be repeated)')
+    parser.add_argument('--json', help='write the report to this file')
+    parser.add_argument('--compare', help='previous report to compare with')
+    parser.add_argument('--tolerance', type=float, default=0.10,
+                        help='relative ns/event increase counted as a '
+                             'regression by --compare (default: 0.10)')
+    args = parser.parse_args(argv)
+
+    names = args.workload or list(WORKLOADS)
+    results = [measure(name, WORKLOADS[name], args.size, args.repeat)
+               for name in names]
+    report = {
+        'python': platform.python_version(),
+        'machine': platform.machine(),
+        'bprof': bprof.__version__,
+        'results': results,
+    }
+    if len(results) >= len(FIT_GROUPS):
+        report['bprof_ns_per_event_type'] = fit_event_costs(results)
+
+    print('%-20s %10s %9s %9s %9s %12s' % (
+        'workload', 'events', 'bprof', 'cProfile', 'setprof', 'bprof ns/ev'))
+    for r in results:
+        print('%-20s %10d %8.1fx %8.1fx %8.1fx %12.1f' % (
+            r['workload'], sum(r['events'].values()), r['slowdown']['bprof'],
+            r['slowdown']['cProfile'], r['slowdown']['setprofile'],
+            r['ns_per_event']['bprof']))
+    for group, cost in report.get('bprof_ns_per_event_type', {}).items():
+        print('bprof %-18s %8.1f ns/event' % (group, cost))
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+
+    if args.compare:
+        with open(args.compare) as f:
+            baseline = json.load(f)
+        if compare(report, baseline, args.tolerance):
+            return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
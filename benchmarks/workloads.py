@@ -0,0 +1,104 @@
+# -*- coding: utf-8 -*-
+
+"""Workloads that stress one kind of profiler event each.
+
+Every workload takes a size argument so the driver can scale it; the event
+mix of a workload does not depend on the size.
+"""
+
+
+def tight_loop(n):
+    """LINE events with almost no work between them."""
+    total = 0
+    for i in range(n):
+        total += i
+    return total
+
+
+def _fib(n):
+    if n < 2:
+        return n
+    return _fib(n - 1) + _fib(n - 2)
+
+
+def deep_recursion(n):
+    """CALL/RETURN events on a deep, branching Python stack."""
+    total = 0
+    for _ in range(max(1, n // 5000)):
+        total += _fib(18)
+    return total
+
+
+def builtin_heavy(n):
+    """C_CALL/C_RETURN events for cheap builtins."""
+    values = list(range(16))
+    total = 0
+    for i in range(n // 8):
+        total += len(values) + abs(-i) + min(i, 3) + max(i, 3)
+        total += (hash(i) & 1) + isinstance(i, int) + sum(values[:2])
+    return total
+
+
+def _numbers(n):
+    for i in range(n):
+        yield i
+
+
+def _squares(values):
+    for value in values:
+        yield value * value
+
+
+def _evens(values):
+    for value in values:
+        if value % 2 == 0:
+            yield value
+
+
+def generator_pipeline(n):
+    """Generator resumptions: CALL/RETURN for every yielded value."""
+    total = 0
+    for value in _evens(_squares(_numbers(n))):
+        total += value
+    return total
+
+
+def _many_lines(x):
+    a = x + 1
+    b = a * 2
+    c = b - 3
+    d = c // 2
+    e = d + a
+    f = e * b
+    g = f - c
+    h = g + d
+    i = h % 97
+    j = i + e
+    k = j * 3
+    m = k - f
+    n = m + g
+    o = n // 5
+    p = o + h
+    q = p * i
+    r = q - j
+    s = r + k
+    t = s % 89
+    u = t + m
+    return u
+
+
+def many_lines(n):
+    """Long straight-line functions: many LINE events per CALL."""
+    total = 0
+    for i in range(n // 20):
+        total += _many_lines(i)
+    return total
+
+
+WORKLOADS = {
+    'tight_loop': tight_loop,
+    'deep_recursion': deep_recursion,
+    'builtin_heavy': builtin_heavy,
+    'generator_pipeline': generator_pipeline,
+    'many_lines': many_lines,
+}
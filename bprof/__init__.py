@@ -6,4 +6,7 @@ __author__ = """Joel Frederico"""
 __email__ = 'joelfrederico@gmail.com'
 __version__ = '0.5.2'
 
-from ._bprof import start, stop, dump
+from ._bprof import (start, stop, dump, tables, load, merge, stats,
+                     set_limits, configure, enable, disable, set_gil,
+                     set_native, set_opcodes, set_timeline, write_timeline)
+from .scope import region, profiled, pause, resume
@@ -0,0 +1,144 @@
+# -*- coding: utf-8 -*-
+
+"""Periodic dumps from a background thread.
+
+Every *interval* seconds the thread writes ``<directory>/bprof-<pid>-<seq>.bprof``
+through a temporary file and a rename, so a reader never sees a partial
+file. The copy of the profiler tables holds the GIL for at most *slice_us*
+microseconds at a time; serializing and writing the file run without it.
+"""
+
+import os
+import re
+import threading
+
+from . import _bprof
+
+MODES = ('cumulative', 'delta')
+EXTENSION = 'bprof'
+
+_dumper = None
+
+
+def dump_path(directory, seq, pid=None):
+    """Path of dump number *seq* of process *pid* (default: this one)."""
+    if pid is None:
+        pid = os.getpid()
+    return os.path.join(directory, 'bprof-%d-%d.%s' % (pid, seq, EXTENSION))
+
+
+class _AutoDump(object):
+
+    def __init__(self, directory, interval, mode, max_files, max_bytes,
+                 slice_us):
+        self.directory = directory
+        self.interval = interval
+        self.delta = mode == 'delta'
+        self.max_files = max_files
+        self.max_bytes = max_bytes
+        self.slice_us = slice_us
+        self.seq = 0
+        # dump_now() and the signal helper dump from other threads, and the
+        # snapshot gives up the GIL between slices.
+        self.lock = threading.Lock()
+        self.stopping = threading.Event()
+        self.thread = threading.Thread(
+            target=self._run, name='bprof-autodump', daemon=True)
+
+    def _run(self):
+        while not self.stopping.wait(self.interval):
+            self.dump()
+
+    def dump(self):
+        with self.lock:
+            path = dump_path(self.directory, self.seq)
+            _bprof.snapshot(path, delta=self.delta, slice_us=self.slice_us)
+            self.seq += 1
+            self._retain()
+
+    def _retain(self):
+        if self.max_files is None and self.max_bytes is None:
+            return
+        pattern = re.compile(r'bprof-%d-(\d+)\.%s$' % (os.getpid(), EXTENSION))
+        dumps = []
+        for name in os.listdir(self.directory):
+            match = pattern.match(name)
+            if match:
+                path = os.path.join(self.directory, name)
+                try:
+                    dumps.append((int(match.group(1)), path,
+                                  os.path.getsize(path)))
+                except OSError:
+                    pass
+        dumps.sort()
+        total = sum(size for _, _, size in dumps)
+        # The newest dump is always kept.
+        for _, path, size in dumps[:-1]:
+            over_files = (self.max_files is not None and
+                          len(dumps) > self.max_files)
+            over_bytes = self.max_bytes is not None and total > self.max_bytes
+            if not over_files and not over_bytes:
+                break
+            try:
+                os.remove(path)
+            except OSError:
+                pass
+            dumps.pop(0)
+            total -= size
+
+
+def start(directory, interval=600, mode='cumulative', max_files=None,
+          max_bytes=None, slice_us=1000):
+    """Dump the profile every *interval* seconds until :func:`stop`.
+
+    ``'cumulative'`` dumps hold everything since profiling started,
+    ``'delta'`` dumps only what changed since the previous one. Once there
+    are more than *max_files* dumps of this process, or they take more than
+    *max_bytes*, the oldest are removed.
+    """
+    global _dumper
+    if mode not in MODES:
+        raise ValueError('mode must be one of %s' % (MODES,))
+    if interval <= 0:
+        raise ValueError('interval must be positive')
+    stop(final=False)
+    os.makedirs(directory, exist_ok=True)
+    _dumper = _AutoDump(directory, interval, mode, max_files, max_bytes,
+                        slice_us)
+    _dumper.thread.start()
+
+
+def stop(final=True):
+    """Stop the background thread, writing one last dump if *final*."""
+    global _dumper
+    dumper, _dumper = _dumper, None
+    if dumper is None:
+        return
+    dumper.stopping.set()
+    if dumper.thread is not threading.current_thread():
+        dumper.thread.join()
+    if final:
+        dumper.dump()
+
+
+def dump_now():
+    """Write the next dump immediately, outside the regular schedule."""
+    dumper = _dumper
+    if dumper is None:
+        raise RuntimeError('autodump is not running')
+    dumper.dump()
+
+
+def _after_fork_child():
+    # The thread does not survive fork(); restart it under the child's pid.
+    global _dumper
+    dumper = _dumper
+    if dumper is None:
+        return
+    _dumper = None
+    start(dumper.directory, dumper.interval,
+          'delta' if dumper.delta else 'cumulative', dumper.max_files,
+          dumper.max_bytes, dumper.slice_us)
+
+
+os.register_at_fork(after_in_child=_after_fork_child)
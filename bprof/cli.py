@@ -2,20 +2,372 @@
 
 """Console script for bprof."""
 import argparse
+import glob
+import os
 import sys
 
 
-def main():
-    """Console script for bprof."""
-    parser = argparse.ArgumentParser()
-    parser.add_argument('_', nargs='*')
-    args = parser.parse_args()
+def run(args):
+    """Run a script or module under the profiler and dump on exit."""
+    # Only the native module is imported before the target starts.
+    from . import _bprof
+    if args.output:
+        output = args.output
+    elif args.module:
+        output = args.target + '.bprof'
+    else:
+        output = os.path.splitext(os.path.basename(args.target))[0] + '.bprof'
+    # The frames running the target, from the console script down to this
+    # one, are bootstrapped onto the shadow stack; leave them out of the dump.
+    runner = [glob.escape(path)
+              for path in (sys.argv[0], run.__code__.co_filename)
+              if os.path.isfile(path)]
+    _bprof.configure(clock=args.clock, lines=args.mode == 'lines',
+                     include=args.include, exclude=args.exclude + runner)
+    if args.opcodes:
+        _bprof.set_opcodes(args.opcodes)
+    if args.native:
+        _bprof.set_native(args.native)
+    if args.gil:
+        _bprof.set_gil(True)
+    if args.timeline:
+        _bprof.set_timeline(args.timeline_events, args.timeline_threshold)
+
+    # Like python -m and python SCRIPT, the target's imports start from the
+    # current directory or the script's, not from where bprof is installed.
+    sys.argv[:] = [args.target] + args.args
+    if args.module:
+        sys.path[0] = os.getcwd()
+        import runpy
+
+        def target():
+            runpy.run_module(args.target, run_name='__main__', alter_sys=True)
+    else:
+        sys.path[0] = os.path.dirname(os.path.abspath(args.target))
+        with open(args.target, 'rb') as f:
+            code = compile(f.read(), args.target, 'exec')
+        globs = {'__file__': args.target, '__name__': '__main__',
+                 '__package__': None, '__cached__': None}
+
+        def target():
+            exec(code, globs)
+
+    status = 0
+    _bprof.start()
+    try:
+        target()
+    except SystemExit as e:
+        status = e.code
+    finally:
+        _bprof.stop()
+        _bprof.snapshot(output, slice_us=0)
+        if args.timeline:
+            _bprof.write_timeline(args.timeline, args.timeline_format)
+    return status
+
+
+def merge(args):
+    """Combine dumps from several processes into one profile."""
+    from ._bprof import merge
+    merge(args.output, args.inputs, threads=args.threads)
+    return 0
+
+
+def _format_delta(key, value):
+    if key == 'calls':
+        return '%+d' % value
+    return '%+.3f' % (value / 1e6)
+
+
+def _format_relative(value):
+    return 'new' if value == float('inf') else '%+.1f%%' % (100 * value)
+
+
+def diff(args):
+    """Rank what got slower between two dumps."""
+    from .profile import diff
+    result = diff(args.a, args.b, key=args.key, limit=args.limit)
+    delta = {'self': 'delta_self_ns', 'total': 'delta_total_ns',
+             'calls': 'delta_calls'}[args.key]
+    relative = 'relative_total' if args.key == 'total' else 'relative_self'
+    unit = '' if args.key == 'calls' else ' ms'
+
+    print('%14s %8s  %s' % ('delta ' + args.key + unit, 'rel', 'function'))
+    for func in result.functions:
+        print('%14s %8s  %s (%s:%s)' % (
+            _format_delta(args.key, getattr(func, delta)),
+            _format_relative(getattr(func, relative)), func.name,
+            func.filename, func.first_line_b or func.first_line_a))
+
+    if args.lines:
+        print()
+        print('%14s %8s  %s' % ('delta ' + args.key + unit, 'rel', 'line'))
+        for line in result.lines:
+            print('%14s %8s  %s:%s  %s' % (
+                _format_delta(args.key, getattr(line, delta)),
+                _format_relative(getattr(line, relative)), line.filename,
+                line.line_b or line.line_a, line.text.strip()))
+    return 0
+
+
+def report(args):
+    """Print the hottest functions and lines of a dump."""
+    import dis
+    from ._bprof import report
+    result = report(args.dump, key=args.key, limit=args.limit,
+                    annotate=args.annotate)
+
+    print('%10s %10s %10s  %s' % ('self ms', 'total ms', 'calls', 'function'))
+    for func in result['functions']:
+        print('%10.3f %10.3f %10d  %s (%s:%d)' % (
+            func['self_ns'] / 1e6, func['total_ns'] / 1e6, func['n_calls'],
+            func['name'], func['filename'], func['first_line']))
+
+    print()
+    print('%10s %10s %10s  %s' % ('self ms', 'total ms', 'calls', 'line'))
+    for line in result['lines']:
+        print('%10.3f %10.3f %10d  %s:%d  %s' % (
+            line['internal_ns'] / 1e6,
+            (line['internal_ns'] + line['external_ns']) / 1e6,
+            line['n_calls'], line['filename'], line['line_number'],
+            line['text'].strip()))
+
+    for func in result['functions']:
+        if 'lines' not in func:
+            break
+        print()
+        print('%s (%s:%d)' % (func['name'], func['filename'],
+                              func['first_line']))
+        print('%10s %10s %10s %6s  %s' % ('self ms', 'ext ms', 'calls',
+                                          'line', 'source'))
+        for line in func['lines']:
+            print('%10.3f %10.3f %10d %6d  %s' % (
+                line['internal_ns'] / 1e6, line['external_ns'] / 1e6,
+                line['n_calls'], line['line_number'], line['text'].rstrip()))
+            for opcode in line.get('opcodes', ()):
+                print('%10.3f %10.3f %10d %6s    %4d %s' % (
+                    opcode['internal_ns'] / 1e6, opcode['external_ns'] / 1e6,
+                    opcode['n_calls'], '', opcode['offset'],
+                    dis.opname[opcode['opcode']]))
+
+    if result['native']:
+        print()
+        print('%10s %10s  %s' % ('sampled ms', 'samples', 'native stack'))
+        for stack in result['native']:
+            print('%10.3f %10d  %s' % (stack['ns'] / 1e6, stack['samples'],
+                                       stack['name']))
+            for frame in stack['frames']:
+                print('%22s    %s' % ('', frame))
+
+    if result['gil_waits']:
+        print()
+        print('%10s %10s %10s  %s' % ('GIL ms', 'off-CPU ms', 'waits', 'line'))
+        for wait in result['gil_waits']:
+            print('%10.3f %10.3f %10d  %s:%d (%s)' % (
+                wait['wait_ns'] / 1e6, wait['off_cpu_ns'] / 1e6,
+                wait['n_waits'], wait['filename'], wait['line_number'],
+                wait['name']))
+    if result['gil_threads']:
+        print()
+        print('%10s %10s %10s %10s  %s' % ('wait ms', 'hold ms', 'off-CPU ms',
+                                           'waits', 'thread'))
+        for thread in result['gil_threads']:
+            # Switches that were not seen leave the hold time overstated.
+            hold = '%10.3f' % (thread['hold_ns'] / 1e6)
+            if not thread['hold_exact']:
+                hold = '%10s' % '-'
+            print('%10.3f %s %10.3f %10d  %d' % (
+                thread['wait_ns'] / 1e6, hold, thread['off_cpu_ns'] / 1e6,
+                thread['n_waits'], thread['thread_id']))
+    return 0
+
 
-    print("Arguments: " + str(args._))
-    print("Replace this message by putting your code into "
-          "bprof.cli.main")
+def html(args):
+    """Write a self-contained HTML report of a dump."""
+    from ._bprof import html
+    output = args.output or os.path.splitext(args.dump)[0] + '.html'
+    html(args.dump, output, limit=args.limit)
+    print('Wrote %s' % output)
     return 0
 
 
+def pstats(args):
+    """Write a dump in the format pstats, snakeviz and gprof2dot read."""
+    from ._bprof import export_pstats
+    output = args.output or os.path.splitext(args.dump)[0] + '.prof'
+    export_pstats(args.dump, output)
+    print('Wrote %s' % output)
+    return 0
+
+
+def pprof(args):
+    """Write a dump as a gzip-compressed pprof profile."""
+    from ._bprof import export_pprof
+    output = args.output or os.path.splitext(args.dump)[0] + '.pb.gz'
+    export_pprof(args.dump, output)
+    print('Wrote %s' % output)
+    return 0
+
+
+def callgrind(args):
+    """Write a dump in the Callgrind format for KCachegrind."""
+    from ._bprof import export_callgrind
+    output = args.output or 'callgrind.out.' + os.path.splitext(
+        os.path.basename(args.dump))[0]
+    export_callgrind(args.dump, output)
+    print('Wrote %s' % output)
+    return 0
+
+
+def speedscope(args):
+    """Write a dump as a sampled speedscope profile."""
+    from ._bprof import export_speedscope
+    output = args.output or os.path.splitext(args.dump)[0] + '.speedscope.json'
+    export_speedscope(args.dump, output)
+    print('Wrote %s' % output)
+    return 0
+
+
+def main(argv=None):
+    """Console script for bprof."""
+    parser = argparse.ArgumentParser(prog='bprof')
+    commands = parser.add_subparsers(dest='command')
+    commands.required = True
+
+    merge_parser = commands.add_parser(
+        'merge', help='merge dump files from several processes')
+    merge_parser.add_argument('-o', '--output', required=True,
+                              help='combined dump file to write')
+    merge_parser.add_argument('-j', '--threads', type=int, default=0,
+                              help='reader/merge threads (default: all cores)')
+    merge_parser.add_argument('inputs', nargs='+', help='dump files to merge')
+    merge_parser.set_defaults(func=merge)
+
+    diff_parser = commands.add_parser(
+        'diff', help='rank regressions between dump A and dump B')
+    diff_parser.add_argument('a', help='baseline dump')
+    diff_parser.add_argument('b', help='dump to compare against A')
+    diff_parser.add_argument('-k', '--key', default='self',
+                             choices=('self', 'total', 'calls'),
+                             help='statistic to rank by (default: self)')
+    diff_parser.add_argument('-n', '--limit', type=int, default=20,
+                             help='rows to show, 0 for all (default: 20)')
+    diff_parser.add_argument('-l', '--lines', action='store_true',
+                             help='also rank individual lines')
+    diff_parser.set_defaults(func=diff)
+
+    report_parser = commands.add_parser(
+        'report', help='show the hottest functions and lines of a dump')
+    report_parser.add_argument('dump', help='dump file to report on')
+    report_parser.add_argument('-k', '--key', default='self',
+                               choices=('self', 'total', 'calls'),
+                               help='statistic to rank by (default: self)')
+    report_parser.add_argument('-n', '--limit', type=int, default=20,
+                               help='functions and lines to show '
+                               '(default: 20)')
+    report_parser.add_argument('-a', '--annotate', type=int, default=3,
+                               help='hottest functions to print with their '
+                               'source (default: 3)')
+    report_parser.set_defaults(func=report)
+
+    html_parser = commands.add_parser(
+        'html', help='write a self-contained HTML report of a dump')
+    html_parser.add_argument('dump', help='dump file to report on')
+    html_parser.add_argument('-o', '--output',
+                             help='HTML file to write (default: DUMP with '
+                             'an .html extension)')
+    html_parser.add_argument('-n', '--limit', type=int, default=100,
+                             help='hottest lines to list (default: 100)')
+    html_parser.set_defaults(func=html)
+
+    pstats_parser = commands.add_parser(
+        'pstats', help='convert a dump for pstats, snakeviz and gprof2dot')
+    pstats_parser.add_argument('dump', help='dump file to convert')
+    pstats_parser.add_argument('-o', '--output',
+                               help='file to write (default: DUMP with a '
+                               '.prof extension)')
+    pstats_parser.set_defaults(func=pstats)
+
+    pprof_parser = commands.add_parser(
+        'pprof', help='convert a dump to pprof profile.proto')
+    pprof_parser.add_argument('dump', help='dump file to convert')
+    pprof_parser.add_argument('-o', '--output',
+                              help='file to write (default: DUMP with a '
+                              '.pb.gz extension)')
+    pprof_parser.set_defaults(func=pprof)
+
+    callgrind_parser = commands.add_parser(
+        'callgrind', help='convert a dump for KCachegrind')
+    callgrind_parser.add_argument('dump', help='dump file to convert')
+    callgrind_parser.add_argument('-o', '--output',
+                                  help='file to write (default: '
+                                  'callgrind.out.DUMP)')
+    callgrind_parser.set_defaults(func=callgrind)
+
+    speedscope_parser = commands.add_parser(
+        'speedscope', help='convert a dump for speedscope')
+    speedscope_parser.add_argument('dump', help='dump file to convert')
+    speedscope_parser.add_argument('-o', '--output',
+                                   help='file to write (default: DUMP with '
+                                   'a .speedscope.json extension)')
+    speedscope_parser.set_defaults(func=speedscope)
+
+    run_parser = commands.add_parser(
+        'run', help='run a script or module under the profiler')
+    run_parser.add_argument('-m', dest='module', action='store_true',
+                            help='run TARGET as a module, like python -m')
+    run_parser.add_argument('-o', '--output',
+                            help='dump file to write (default: '
+                            'TARGET.bprof in the current directory)')
+    run_parser.add_argument('--clock', default='wall', choices=('wall', 'cpu'),
+                            help='time source (default: wall)')
+    run_parser.add_argument('--mode', default='lines',
+                            choices=('lines', 'calls'),
+                            help='trace every line, or only calls and '
+                            'returns at lower overhead (default: lines)')
+    run_parser.add_argument('--include', action='append', default=[],
+                            metavar='PATTERN',
+                            help='only keep functions whose filename matches '
+                            'this glob; may repeat')
+    run_parser.add_argument('--exclude', action='append', default=[],
+                            metavar='PATTERN',
+                            help='drop functions whose filename matches this '
+                            'glob; may repeat')
+    run_parser.add_argument('--opcodes', action='append', default=[],
+                            metavar='PATTERN',
+                            help='also time each bytecode instruction of the '
+                            'functions whose name matches this glob; may '
+                            'repeat')
+    run_parser.add_argument('--native', type=int, default=0, metavar='US',
+                            help='also sample the native stacks of C calls '
+                            'every US microseconds of the profiling clock')
+    run_parser.add_argument('--gil', action='store_true',
+                            help='also time waits to reacquire the GIL, per '
+                            'line and per thread')
+    run_parser.add_argument('--timeline', metavar='FILE',
+                            help='also record every call and write them as '
+                            'Chrome trace JSON, for chrome://tracing or '
+                            'the Perfetto UI')
+    run_parser.add_argument('--timeline-format', default='chrome',
+                            choices=('chrome', 'speedscope'),
+                            help='timeline file format (default: chrome)')
+    run_parser.add_argument('--timeline-events', type=int, default=1000000,
+                            metavar='N',
+                            help='timeline events kept per thread; later '
+                            'calls are dropped and counted (default: '
+                            '1000000)')
+    run_parser.add_argument('--timeline-threshold', type=int, default=0,
+                            metavar='US',
+                            help='leave calls shorter than this many '
+                            'microseconds off the timeline (default: 0)')
+    run_parser.add_argument('target', help='script path or module name')
+    run_parser.add_argument('args', nargs=argparse.REMAINDER,
+                            help='arguments passed to the target')
+    run_parser.set_defaults(func=run)
+
+    args = parser.parse_args(argv)
+    return args.func(args)
+
+
 if __name__ == "__main__":
     sys.exit(main())  # pragma: no cover
@@ -0,0 +1,91 @@
+# -*- coding: utf-8 -*-
+
+"""Per-process profiles for programs that fork.
+
+The native module always drops the statistics a child inherits from its
+parent, so nothing is counted twice. :func:`enable` additionally decides
+whether children keep profiling and writes one dump per process on exit.
+"""
+
+import atexit
+import os
+import sys
+
+from . import _bprof
+
+POLICIES = ('continue', 'stop')
+
+_directory = None
+_policy = None
+# The process that wrote its dump already; multiprocessing children can
+# reach _dump_at_exit through both atexit and a finalizer.
+_dumped_pid = None
+
+
+def dump_path(directory, pid=None):
+    """Path of the dump written for process *pid* (default: this one)."""
+    if pid is None:
+        pid = os.getpid()
+    return os.path.join(directory, 'bprof-%d.bprof' % pid)
+
+
+def _dump_at_exit():
+    global _dumped_pid
+    if _directory is None or _dumped_pid == os.getpid():
+        return
+    _dumped_pid = os.getpid()
+    try:
+        _bprof.stop()
+    except RuntimeError:
+        # The hooks belong to a thread that is still running, such as a
+        # daemon thread; write what has been recorded so far anyway.
+        pass
+    _bprof.snapshot(dump_path(_directory), slice_us=0)
+
+
+def _install_finalizer(module):
+    module.Finalize(None, _dump_at_exit, exitpriority=0)
+
+
+def _after_fork_child():
+    global _directory
+    if _directory is None:
+        return
+    if _policy == 'stop':
+        _bprof.stop()
+        _directory = None
+        atexit.unregister(_dump_at_exit)
+        return
+    # multiprocessing children leave through os._exit(), which skips atexit.
+    # Process._bootstrap clears the finalizers inherited from the parent and
+    # then runs the after-fork hooks, so the finalizer that dumps is
+    # installed from one of those.
+    util = sys.modules.get('multiprocessing.util')
+    if util is not None:
+        util.register_after_fork(util, _install_finalizer)
+
+
+def enable(directory, policy='continue'):
+    """Write ``<directory>/bprof-<pid>.bprof`` for this and forked processes.
+
+    *policy* decides what a forked child does: ``'continue'`` keeps the
+    inherited hooks and profiles the child from the fork onwards, ``'stop'``
+    removes the hooks in the child and writes nothing for it.
+    """
+    global _directory, _policy
+    if policy not in POLICIES:
+        raise ValueError('policy must be one of %s' % (POLICIES,))
+    os.makedirs(directory, exist_ok=True)
+
+    first = _directory is None
+    _directory = directory
+    _policy = policy
+    if first:
+        os.register_at_fork(after_in_child=_after_fork_child)
+        atexit.register(_dump_at_exit)
+
+
+def disable():
+    """Stop writing per-process dumps."""
+    global _directory
+    _directory = None
@@ -45,6 +45,69 @@ class Lines:
         return self.internal + self.external
 
 
+class LineTable:
+    """Struct-of-arrays view of the native line statistics.
+
+    Every column is a memoryview over a contiguous uint64 array owned by the
+    native snapshot; ``numpy.asarray`` consumes them without copying.
+    """
+
+    _columns = ('function', 'line_number', 'n_calls', 'internal_ns',
+                'external_ns')
+
+    def __init__(self, columns):
+        for name in self._columns:
+            setattr(self, '_' + name, memoryview(columns[name]))
+
+    def __len__(self):
+        return len(self._n_calls)
+
+    @property
+    def function(self):
+        return self._function
+
+    @property
+    def line_number(self):
+        return self._line_number
+
+    @property
+    def n_calls(self):
+        return self._n_calls
+
+    @property
+    def internal_ns(self):
+        return self._internal_ns
+
+    @property
+    def external_ns(self):
+        return self._external_ns
+
+    def rows(self, begin, count):
+        return _TableLines(self, begin, count)
+
+
+class _TableLines:
+    """Lazy sequence of Lines backed by a LineTable slice."""
+
+    def __init__(self, table, begin, count):
+        self._table = table
+        self._begin = begin
+        self._count = count
+
+    def __len__(self):
+        return self._count
+
+    def __getitem__(self, i):
+        if i < 0:
+            i += self._count
+        if not 0 <= i < self._count:
+            raise IndexError(i)
+        row = self._begin + i
+        table = self._table
+        return Lines(None, table.n_calls[row], table.internal_ns[row],
+                     table.external_ns[row])
+
+
 class Function(BaseFunction):
     def __init__(self, name, lines, n_calls, internal_ns):
         self._name = name
@@ -81,7 +144,8 @@ class Profile:
     def from_data(data):
         profile = Profile()
         profile._functions = []
-        
+        profile._line_table = None
+
         for key, fdata in data['functions'].items():
             lines = []
             for line in fdata['lines']:
@@ -96,6 +160,107 @@ class Profile:
 
         return profile
 
+    @staticmethod
+    def from_tables(tables):
+        profile = Profile()
+        profile._functions = []
+        profile._line_table = LineTable(tables['lines'])
+
+        ftable = tables['functions']
+        fcolumns = zip(ftable['name'], memoryview(ftable['line_begin']),
+                       memoryview(ftable['line_count']),
+                       memoryview(ftable['n_calls']),
+                       memoryview(ftable['internal_ns']))
+        for name, begin, count, n_calls, internal_ns in fcolumns:
+            lines = profile._line_table.rows(begin, count)
+            func = Function(lines=lines, name=name, n_calls=n_calls,
+                            internal_ns=internal_ns)
+            profile._functions.append(func)
+
+        return profile
+
+    @staticmethod
+    def from_file(path):
+        from ._bprof import load
+        return Profile.from_tables(load(path))
+
+    @property
+    def line_table(self):
+        return self._line_table
+
     @property
     def functions(self):
         return self._functions
+
+
+class Delta:
+    """Change of one function or line between profiles A and B.
+
+    Statistics of a side the record does not exist in are None.
+    """
+
+    def __init__(self, data):
+        self._data = data
+
+    def __getattr__(self, name):
+        try:
+            return self._data[name]
+        except KeyError:
+            raise AttributeError(name)
+
+    def _delta(self, stat):
+        return (self._data[stat + '_b'] or 0) - (self._data[stat + '_a'] or 0)
+
+    def _relative(self, stat):
+        before = self._data[stat + '_a']
+        if not before:
+            return float('inf') if self._delta(stat) else 0.0
+        return self._delta(stat) / before
+
+    @property
+    def delta_calls(self):
+        return self._delta('calls')
+
+    @property
+    def delta_self_ns(self):
+        return self._delta('self_ns')
+
+    @property
+    def delta_total_ns(self):
+        return self._delta('total_ns')
+
+    @property
+    def relative_self(self):
+        return self._relative('self_ns')
+
+    @property
+    def relative_total(self):
+        return self._relative('total_ns')
+
+
+class ProfileDiff:
+    """Functions and lines of two dumps ranked by their regression."""
+
+    def __init__(self, data):
+        self._functions = [Delta(d) for d in data['functions']]
+        self._lines = [Delta(d) for d in data['lines']]
+
+    @property
+    def functions(self):
+        return self._functions
+
+    @property
+    def lines(self):
+        return self._lines
+
+
+def diff(a, b, key='self', limit=None):
+    """Compare dump files *a* and *b*.
+
+    Functions are matched by file, name and first line, and lines by their
+    source text. Both lists are ordered by the increase of *key* (``'self'``,
+    ``'total'`` or ``'calls'``), largest regression first, and truncated to
+    *limit* entries.
+    """
+    from ._bprof import diff as native_diff
+    return ProfileDiff(native_diff(a, b, key=key, limit=limit or 0))
@@ -0,0 +1,51 @@
+# -*- coding: utf-8 -*-
+
+"""Profile selected parts of a program.
+
+Scopes share one nested counter in the native module. The hooks are
+installed the first time a scope is entered and stay installed; while no
+scope is active they only keep the shadow stack in step with the
+interpreter, so entering and leaving a scope is cheap enough to wrap a
+request handler that runs thousands of times per second.
+
+The hooks profile the thread that installed them. Until that thread calls
+``stop()`` or exits, entering a scope on any other thread raises
+:exc:`RuntimeError`.
+"""
+
+import functools
+
+from ._bprof import enable, disable
+
+pause = disable
+resume = enable
+
+
+class region(object):
+    """Context manager profiling the code inside its ``with`` block.
+
+    Regions nest, and :func:`pause` inside a region stops profiling until
+    the matching :func:`resume`.
+    """
+
+    __slots__ = ()
+
+    def __enter__(self):
+        enable()
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        disable()
+        return False
+
+
+def profiled(func):
+    """Decorator profiling every call of *func*."""
+    @functools.wraps(func)
+    def wrapper(*args, **kwargs):
+        enable()
+        try:
+            return func(*args, **kwargs)
+        finally:
+            disable()
+    return wrapper
@@ -0,0 +1,48 @@
+# -*- coding: utf-8 -*-
+
+"""Control profiling of a running process with signals.
+
+After :func:`install`, ``kill -USR1 <pid>`` starts or stops profiling and
+``kill -USR2 <pid>`` writes ``<directory>/bprof-<pid>-signal-<seq>.bprof``.
+The native handlers only set a flag; a helper thread writes the dump, and a
+toggle takes effect on the main thread at its next safe point (a thread
+blocked in a long C call picks it up when the call returns).
+"""
+
+import atexit
+import os
+import signal
+
+from . import _bprof
+
+_installed = None
+
+
+def install(directory, toggle=signal.SIGUSR1, dump=signal.SIGUSR2):
+    """Bind *toggle* and *dump*; pass 0 (or None) to leave one unbound."""
+    global _installed
+    os.makedirs(directory, exist_ok=True)
+    first = _installed is None
+    _installed = (directory, int(toggle or 0), int(dump or 0))
+    _bprof.install_signals(*_installed)
+    if first:
+        atexit.register(uninstall)
+
+
+def uninstall():
+    """Restore the previous handlers and stop the helper thread."""
+    global _installed
+    if _installed is None:
+        return
+    _installed = None
+    atexit.unregister(uninstall)
+    _bprof.remove_signals()
+
+
+def _after_fork_child():
+    # The helper thread does not survive fork(); start a new one.
+    if _installed is not None:
+        _bprof.install_signals(*_installed)
+
+
+os.register_at_fork(after_in_child=_after_fork_child)
@@ -23,17 +23,35 @@ module1 = Extension('bprof._bprof',
                     sources=[
                         'src/function.cpp',
                         'src/frame.cpp',
+                        'src/callgrind.cpp',
+                        'src/column.cpp',
+                        'src/diff.cpp',
+                        'src/dump_file.cpp',
+                        'src/gil.cpp',
+                        'src/html.cpp',
+                        'src/json_writer.cpp',
+                        'src/merge.cpp',
+                        'src/native.cpp',
+                        'src/pprof.cpp',
+                        'src/pstats.cpp',
+                        'src/report.cpp',
+                        'src/signals.cpp',
+                        'src/source.cpp',
+                        'src/speedscope.cpp',
+                        'src/timeline.cpp',
                         'src/_bprof.cpp',
                         'src/_bprof_bridge.cpp',
                         ],
                     include_dirs=['./src'],
-                    extra_compile_args=['-std=c++17']
+                    extra_compile_args=['-std=c++17', '-pthread'],
+                    extra_link_args=['-pthread'],
+                    libraries=['z'],
                     )
 
 setup(
     author="Joel Frederico",
     author_email='joelfrederico@gmail.com',
-    python_requires='>=3.7',
+    python_requires='>=3.7, <3.11',
     classifiers=[
         'Development Status :: 2 - Pre-Alpha',
         'Intended Audience :: Developers',
@@ -1,10 +1,28 @@
 #include "_bprof.h"
 
+#include <fnmatch.h>
+#include <time.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "dump_file.h"
+#include "source.h"
+
 std::string PyCode_GetName(PyCodeObject* code) {
   Py_ssize_t size;
   const char* method_name_char = PyUnicode_AsUTF8AndSize(code->co_name, &size);
   return std::string(method_name_char, size);
 }
+std::string PyCode_GetFilename(PyCodeObject* code) {
+  Py_ssize_t size;
+  const char* filename_char = PyUnicode_AsUTF8AndSize(code->co_filename, &size);
+  if (filename_char == NULL) {
+    PyErr_Clear();
+    return std::string();
+  }
+  return std::string(filename_char, size);
+}
 std::string PyFrame_GetName(PyFrameObject* frame) {
   return PyCode_GetName(frame->f_code);
 }
@@ -13,14 +31,20 @@ static int profile_func(PyObject*, PyFrameObject*, int, PyObject*);
 static int trace_func(PyObject*, PyFrameObject*, int, PyObject*);
 
 Module::Module(PyObject* m) : parent_(m) {
-  inspect_ = PyImport_ImportModule("inspect");
-  if (inspect_ == NULL) {
-    throw std::runtime_error("Could not import `inspect'");
+  linecache_ = PyImport_ImportModule("linecache");
+  if (linecache_ == NULL) {
+    throw std::runtime_error("Could not import `linecache'");
   }
 }
 
 Module::~Module() {
-  Py_XDECREF(inspect_);
+  Py_XDECREF(linecache_);
+  for (auto&& function_pair : functions_) {
+    Py_DECREF(function_pair.first);
+  }
+  for (auto code : opcode_codes_) {
+    Py_DECREF(code);
+  }
 }
 
 duration Module::elapsed() {
@@ -28,25 +52,219 @@ duration Module::elapsed() {
       last_instruction_end_ - last_instruction_start_);
 }
 
-void Module::emplace_frame(PyFrameObject* frame) {
-  size_t starting_line = 0;
-  auto lines = get_lines(frame, &starting_line);
-  frame_stack_.emplace(frame->f_code, lines.size(), starting_line);
+void Module::emplace_frame(PyFrameObject* frame, Function& function) {
+  frame_stack_.emplace(frame, function.line_map());
+  frame_stack_.top().set_start(last_instruction_end_);
+  if (function.opcode_selection() == OpcodeSelection::kUnknown) {
+    function.select_opcodes(
+        traces_opcodes() && opcodes_selected(frame->f_code, function.name()),
+        frame->f_code);
+  }
+  frame->f_trace_opcodes = function.traces_opcodes();
+  if (function.traces_opcodes()) {
+    frame_stack_.top().set_opcodes(function.opcodes());
+  }
+  ++stats_.frames_allocated;
+  stats_.frame_stack_bytes += frame_stack_.top().bytes();
 }
 
 void Module::start() {
-  last_instruction_ = Instruction::kOrigin;
+  if (gil_enabled_) {
+    gil_.install();
+    // Waits from before start() belong to no line.
+    GilMonitor::take_pending();
+  }
+  enable();
+}
+
+Module::time_point Module::now() const {
+  if (clock_ == ClockKind::kCpu) {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return time_point(std::chrono::duration_cast<clock::duration>(
+        std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)));
+  }
+  return clock::now();
+}
+
+void Module::set_clock(ClockKind clock) {
+  stop();
+  clock_ = clock;
+}
+
+void Module::set_line_events(bool line_events) {
+  stop();
+  line_events_ = line_events;
+}
+
+void Module::set_filters(std::vector<std::string> include,
+                         std::vector<std::string> exclude) {
+  include_ = std::move(include);
+  exclude_ = std::move(exclude);
+}
 
-  PyEval_SetProfile(profile_func, parent_);
-  PyEval_SetTrace(trace_func, parent_);
+void Module::set_opcodes(std::vector<PyCodeObject*> codes,
+                         std::vector<std::string> names) {
+  stop();
+  for (auto code : codes) {
+    Py_INCREF(code);
+  }
+  for (auto code : opcode_codes_) {
+    Py_DECREF(code);
+  }
+  opcode_codes_ = std::unordered_set<PyCodeObject*>(codes.begin(), codes.end());
+  opcode_names_ = std::move(names);
+  for (auto&& function_pair : functions_) {
+    function_pair.second.reset_opcode_selection();
+  }
+}
+
+void Module::set_native(duration interval) {
+  stop();
+  native_.configure(interval, clock_ == ClockKind::kCpu);
+}
+
+void Module::set_gil(bool enabled) {
+  stop();
+  gil_enabled_ = enabled;
+  if (enabled) {
+    gil_.install();
+  } else {
+    gil_.uninstall();
+  }
+}
+
+void Module::arm_native(const void* hook_stack) {
+  if (last_instruction_ == Instruction::kCCall &&
+      native_.on_sampled_thread()) {
+    native_.arm(last_c_entry_, hook_stack);
+  }
+}
+
+bool Module::opcodes_selected(
+    PyCodeObject* code, const std::string& name) const {
+  return opcode_codes_.count(code) != 0 ||
+      std::any_of(opcode_names_.begin(), opcode_names_.end(),
+                  [&name](const std::string& pattern) {
+                    return fnmatch(pattern.c_str(), name.c_str(), 0) == 0;
+                  });
+}
+
+bool Module::included(const std::string& filename) const {
+  auto matches = [&filename](const std::string& pattern) {
+    return fnmatch(pattern.c_str(), filename.c_str(), 0) == 0;
+  };
+  if (!include_.empty() &&
+      std::none_of(include_.begin(), include_.end(), matches)) {
+    return false;
+  }
+  return std::none_of(exclude_.begin(), exclude_.end(), matches);
+}
+
+void Module::check_thread() {
+  PyThreadState* tstate = PyThreadState_GET();
+  if (hooked_thread_ == 0 || tstate->id == hooked_thread_) {
+    return;
+  }
+  for (PyThreadState* thread = PyInterpreterState_ThreadHead(tstate->interp);
+       thread != nullptr; thread = PyThreadState_Next(thread)) {
+    if (thread->id == hooked_thread_) {
+      throw ThreadError("bprof is profiling another thread");
+    }
+  }
+  // The hooked thread exited; its frames will never return.
+  last_instruction_end_ = now();
+  close_frames();
+}
+
+void Module::enable() {
+  check_thread();
+  // Bootstrapping may run Python code (linecache); it must not be profiled
+  // while the stack is half built, so it happens before the hooks go live.
+  if (enabled_ == 0) {
+    bootstrap_frames(PyEval_GetFrame());
+  }
+  PyThreadState* tstate = PyThreadState_GET();
+  if (tstate->c_profilefunc != profile_func ||
+      tstate->c_profileobj != parent_) {
+    PyEval_SetProfile(profile_func, parent_);
+    if (line_events_ || traces_opcodes()) {
+      PyEval_SetTrace(trace_func, parent_);
+    }
+  }
+  hooked_thread_ = tstate->id;
+  if (gil_enabled_) {
+    GilMonitor::begin_span();
+  }
+  if (enabled_++ == 0) {
+    last_instruction_ = Instruction::kOrigin;
+  }
+}
+
+// Pushes the live frames between frame and the innermost one already on the
+// shadow stack, so returns into code that was running before profiling
+// started are attributed. A long-running caller stays on the stack while
+// profiling is paused, so later resumes only walk the frames above it.
+void Module::bootstrap_frames(PyFrameObject* frame) {
+  std::vector<PyFrameObject*> missing;
+  for (; frame != nullptr && !is_top(frame); frame = frame->f_back) {
+    missing.push_back(frame);
+  }
+  auto start = now();
+  for (auto it = missing.rbegin(); it != missing.rend(); ++it) {
+    auto& function = add_function(*it);
+    function.enter();
+    emplace_frame(*it, function);
+    frame_stack_.top().set_start(start);
+    frame_stack_.top().set_partial();
+    frame_stack_.top().set_current_instruction((*it)->f_lasti);
+  }
+}
+
+void Module::disable() {
+  if (enabled_ == 0) {
+    return;
+  }
+  check_thread();
+  if (enabled_ == 0 || --enabled_ != 0) {
+    return;
+  }
+  // Close the pending instruction, normally the call to disable() itself, so
+  // the paused time is not attributed to it.
+  last_instruction_end_ = now();
+  finish(PyEval_GetFrame());
+  last_instruction_ = Instruction::kInvalid;
 }
 
 void Module::finish_origin(PyFrameObject* frame) {
 }
 
 void Module::stop() {
+  check_thread();
+  native_.disarm();
   PyEval_SetProfile(NULL, NULL);
   PyEval_SetTrace(NULL, NULL);
+  if (gil_enabled_) {
+    GilMonitor::end_span();
+  }
+
+  last_instruction_end_ = now();
+  if (enabled_ != 0) {
+    finish(PyEval_GetFrame());
+  }
+  close_frames();
+}
+
+void Module::close_frames() {
+  // The frames still open would return unseen; fold them into their
+  // functions now rather than leave them for the next start().
+  while (!frame_stack_.empty()) {
+    pop_frame();
+  }
+  last_instruction_ = Instruction::kInvalid;
+  enabled_ = 0;
+  hooked_thread_ = 0;
+  c_calls_.clear();
 }
 
 PyObject* CreateFunctionDict(const BaseFunction& function) {
@@ -62,32 +280,107 @@ PyObject* CreateFunctionDict(const BaseFunction& function) {
   Py_DECREF(n_calls);
   PyDict_SetItemString(function_py, "internal_ns", internal);
   Py_DECREF(internal);
+  PyObject* error_calls = PyLong_FromSize_t(function.error_calls());
+  PyDict_SetItemString(function_py, "error_calls", error_calls);
+  Py_DECREF(error_calls);
 
   return function_py;
 }
 
+static void SetStat(PyObject* dict, const char* name, uint64_t value);
+
+// Instructions that ran, keyed by bytecode offset (f_lasti).
+static PyObject* CreateOpcodeDict(const OpcodeRecord& opcode, size_t index) {
+  PyObject* opcode_py = PyDict_New();
+  SetStat(opcode_py, "offset", index * sizeof(_Py_CODEUNIT));
+  SetStat(opcode_py, "opcode", opcode.opcode);
+  SetStat(opcode_py, "line_number", opcode.line);
+  SetStat(opcode_py, "n_calls", opcode.n_calls);
+  SetStat(opcode_py, "internal_ns", opcode.internal.count());
+  SetStat(opcode_py, "external_ns", opcode.external.count());
+  return opcode_py;
+}
+
+// One native stack, frames innermost first.
+static PyObject* CreateNativeDict(const std::vector<std::string>& frames,
+                                  const NativeCount& count) {
+  PyObject* stack_py = PyDict_New();
+  PyObject* frames_py = PyList_New(frames.size());
+  for (size_t i = 0; i < frames.size(); ++i) {
+    PyList_SET_ITEM(frames_py, i, PyUnicode_DecodeUTF8(
+        frames[i].data(), frames[i].size(), "replace"));
+  }
+  PyDict_SetItemString(stack_py, "frames", frames_py);
+  Py_DECREF(frames_py);
+  SetStat(stack_py, "samples", count.samples);
+  SetStat(stack_py, "ns", count.time.count());
+  return stack_py;
+}
+
+std::map<std::vector<std::string>, NativeCount> Module::native_stacks(
+    const BaseFunction& function) const {
+  std::map<std::vector<std::string>, NativeCount> stacks;
+  for (auto&& stack_pair : function.native()) {
+    std::vector<std::string> frames;
+    frames.reserve(stack_pair.first.size());
+    for (auto address : stack_pair.first) {
+      frames.push_back(symbols_.name(address));
+    }
+    NativeCount& count = stacks[std::move(frames)];
+    count.samples += stack_pair.second.samples;
+    count.time += stack_pair.second.time;
+  }
+  return stacks;
+}
+
 PyObject* Module::dump(const char* path) {
-  PyObject* functions = PyDict_New();
+  if (path != nullptr && path[0] != '\0') {
+    WriteDump(snapshot(), path);
+  }
+
+  // Text lookups run linecache, whose calls the hooks add to functions_
+  // when this thread is profiled. The table is walked by a copy of its keys
+  // and the text filled in afterwards, once no record is referenced.
+  std::vector<PyCodeObject*> keys;
+  keys.reserve(functions_.size());
   for (auto&& function_pair : functions_) {
-    Function& function = function_pair.second;
+    keys.push_back(function_pair.first);
+  }
+  struct LineText {
+    size_t file;
+    size_t line_number;
+    PyObject* line_dict;
+  };
+  std::vector<std::string> filenames;
+  std::vector<LineText> texts;
+
+  PyObject* functions = PyDict_New();
+  for (auto key : keys) {
+    auto it = functions_.find(key);
+    if (it == functions_.end()) {
+      continue;
+    }
+    const Function& function = it->second;
+    if (!included(function.filename())) {
+      continue;
+    }
     PyObject* function_py = CreateFunctionDict(function);
+    size_t file = filenames.size();
+    filenames.push_back(function.filename());
 
-    const auto& lines = function.lines();
-    PyObject* lines_py = PyList_New(lines.size());
+    PyObject* lines_py = PyList_New(function.span());
     size_t j = 0;
-    for (auto&& line : lines) {
-      const auto& line_str = line.text();
+    function.for_each_line([&](size_t line_number, const LineRecord& line) {
       PyObject* line_dict = PyDict_New();
-      PyObject* line_str_py = 
-	PyUnicode_DecodeUTF8(line_str.data(), line_str.size(), NULL);
+      texts.push_back(LineText{file, line_number, line_dict});
       PyObject* line_n_calls = PyLong_FromUnsignedLongLong(line.n_calls());
       PyObject* line_internal =
 	PyLong_FromUnsignedLongLong(line.internal().count());
       PyObject* line_external =
 	PyLong_FromUnsignedLongLong(line.external().count());
 
-      PyDict_SetItemString(line_dict, "line_str", line_str_py);
-      Py_DECREF(line_str_py);
+      // Keeps line_str the first key; the text replaces it below.
+      PyDict_SetItemString(line_dict, "line_str", Py_None);
       PyDict_SetItemString(line_dict, "n_calls", line_n_calls);
       Py_DECREF(line_n_calls);
       PyDict_SetItemString(line_dict, "internal_ns", line_internal);
@@ -96,20 +389,63 @@ PyObject* Module::dump(const char* path) {
       Py_DECREF(line_external);
 
       PyList_SET_ITEM(lines_py, j++, line_dict);
-    }
+    });
     PyDict_SetItemString(function_py, "lines", lines_py);
     Py_DECREF(lines_py);
 
-    PyObject* key = PyLong_FromUnsignedLongLong(
-	reinterpret_cast<size_t>(function_pair.first));
-    PyDict_SetItem(functions, key, function_py);
-    Py_DECREF(key);
+    const auto& opcodes = function.opcodes();
+    if (!opcodes.empty()) {
+      PyObject* opcodes_py = PyList_New(0);
+      for (size_t i = 0; i < opcodes.size(); ++i) {
+        if (opcodes[i].n_calls == 0) {
+          continue;
+        }
+        PyObject* opcode_dict = CreateOpcodeDict(opcodes[i], i);
+        PyList_Append(opcodes_py, opcode_dict);
+        Py_DECREF(opcode_dict);
+      }
+      PyDict_SetItemString(function_py, "opcodes", opcodes_py);
+      Py_DECREF(opcodes_py);
+    }
+
+    PyObject* first_line = PyLong_FromSize_t(function.first_line());
+    PyDict_SetItemString(function_py, "first_line", first_line);
+    Py_DECREF(first_line);
+    PyObject* partial_calls = PyLong_FromSize_t(function.partial_calls());
+    PyDict_SetItemString(function_py, "partial_calls", partial_calls);
+    Py_DECREF(partial_calls);
+
+    PyObject* key_py = PyLong_FromUnsignedLongLong(
+	reinterpret_cast<size_t>(key));
+    PyDict_SetItem(functions, key_py, function_py);
+    Py_DECREF(key_py);
     Py_DECREF(function_py);
   }
 
+  SourceCache source;
+  for (auto&& text : texts) {
+    auto line_str = source.line(filenames[text.file], text.line_number);
+    PyObject* line_str_py =
+        PyUnicode_DecodeUTF8(line_str.data(), line_str.size(), NULL);
+    PyDict_SetItemString(text.line_dict, "line_str", line_str_py);
+    Py_DECREF(line_str_py);
+  }
+
   PyObject* c_functions = PyDict_New();
   for (auto&& function_pair : c_functions_) {
     PyObject* function_py = CreateFunctionDict(function_pair.second);
+    if (!function_pair.second.native().empty()) {
+      PyObject* native = PyList_New(0);
+      for (auto&& stack : native_stacks(function_pair.second)) {
+        PyObject* stack_py = CreateNativeDict(stack.first, stack.second);
+        PyList_Append(native, stack_py);
+        Py_DECREF(stack_py);
+      }
+      PyDict_SetItemString(function_py, "native", native);
+      Py_DECREF(native);
+      SetStat(function_py, "native_dropped",
+              function_pair.second.native_dropped());
+    }
     auto& name_str = function_pair.first;
     PyObject* name = PyUnicode_DecodeUTF8(name_str.data(), name_str.size(), NULL);
     PyDict_SetItem(c_functions, name, function_py);
@@ -122,13 +458,428 @@ PyObject* Module::dump(const char* path) {
   Py_DECREF(functions);
   PyDict_SetItemString(result, "c_functions", c_functions);
   Py_DECREF(c_functions);
+  PyObject* bounded = bounded_dict();
+  PyDict_SetItemString(result, "bounded", bounded);
+  Py_DECREF(bounded);
+  PyObject* gil = gil_dict();
+  PyDict_SetItemString(result, "gil", gil);
+  Py_DECREF(gil);
 
   return result;
 }
 
-void Module::profile(int what, PyFrameObject* frame, PyObject* arg) {
-  last_instruction_end_ = clock::now();
+static const std::pair<const char*, uint64_t EvictedTotals::*>
+kEvictedCounters[] = {
+  {"evicted_functions", &EvictedTotals::functions},
+  {"evicted_calls", &EvictedTotals::calls},
+  {"evicted_internal_ns", &EvictedTotals::internal_ns},
+  {"evicted_external_ns", &EvictedTotals::external_ns},
+  {"evicted_c_functions", &EvictedTotals::c_functions},
+  {"evicted_c_calls", &EvictedTotals::c_calls},
+  {"evicted_c_internal_ns", &EvictedTotals::c_internal_ns},
+  {"error_bound_calls", &EvictedTotals::error_bound_calls},
+};
+
+PyObject* Module::bounded_dict() const {
+  PyObject* bounded = PyDict_New();
+  PyObject* max_functions = PyLong_FromSize_t(max_functions_);
+  PyDict_SetItemString(bounded, "max_functions", max_functions);
+  Py_DECREF(max_functions);
+  PyObject* max_lines = PyLong_FromSize_t(max_lines_);
+  PyDict_SetItemString(bounded, "max_lines", max_lines);
+  Py_DECREF(max_lines);
+  for (auto&& counter : kEvictedCounters) {
+    PyObject* value = PyLong_FromUnsignedLongLong(evicted_.*counter.second);
+    PyDict_SetItemString(bounded, counter.first, value);
+    Py_DECREF(value);
+  }
+  return bounded;
+}
+
+template <typename Map>
+static size_t MapBytes(const Map& map) {
+  // Node, stored pair and bucket array; the allocator's own overhead is not
+  // counted.
+  return map.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void*)) +
+      map.bucket_count() * sizeof(void*);
+}
+
+static size_t StringBytes(const std::string& str) {
+  // Short strings live inside the std::string itself.
+  return str.capacity() > 15 ? str.capacity() + 1 : 0;
+}
+
+static PyObject* CreateEventDict(
+    const uint64_t (&values)[ProfilerStats::kEventTypes]) {
+  static const char* names[ProfilerStats::kEventTypes] = {
+    "call", "exception", "line", "return",
+    "c_call", "c_exception", "c_return", "opcode",
+  };
+  PyObject* dict = PyDict_New();
+  for (int i = 0; i < ProfilerStats::kEventTypes; ++i) {
+    PyObject* value = PyLong_FromUnsignedLongLong(values[i]);
+    PyDict_SetItemString(dict, names[i], value);
+    Py_DECREF(value);
+  }
+  return dict;
+}
+
+static void SetStat(PyObject* dict, const char* name, uint64_t value) {
+  PyObject* value_py = PyLong_FromUnsignedLongLong(value);
+  PyDict_SetItemString(dict, name, value_py);
+  Py_DECREF(value_py);
+}
+
+// Waits by line, keyed like the functions of dump(), and per-thread totals.
+PyObject* Module::gil_dict() const {
+  PyObject* waits = PyList_New(0);
+  for (auto&& wait_pair : gil_waits_) {
+    if (wait_pair.first.code == nullptr) {
+      continue;
+    }
+    PyObject* wait = PyDict_New();
+    SetStat(wait, "function", reinterpret_cast<size_t>(wait_pair.first.code));
+    SetStat(wait, "line_number", wait_pair.first.line);
+    SetStat(wait, "n_waits", wait_pair.second.n_waits);
+    SetStat(wait, "wait_ns", wait_pair.second.wait.count());
+    SetStat(wait, "off_cpu_ns", wait_pair.second.off_cpu.count());
+    PyList_Append(waits, wait);
+    Py_DECREF(wait);
+  }
+  PyObject* threads = PyList_New(0);
+  if (gil_enabled_) {
+    for (auto&& thread : GilMonitor::threads()) {
+      PyObject* thread_py = PyDict_New();
+      SetStat(thread_py, "thread_id", thread.id);
+      SetStat(thread_py, "n_waits", thread.n_waits);
+      SetStat(thread_py, "wait_ns", thread.wait.count());
+      SetStat(thread_py, "hold_ns", thread.hold.count());
+      SetStat(thread_py, "profiled_ns", thread.profiled.count());
+      SetStat(thread_py, "cpu_ns", thread.cpu.count());
+      SetStat(thread_py, "released_ns", thread.released.count());
+      PyDict_SetItemString(thread_py, "hold_exact",
+                           thread.hold_exact ? Py_True : Py_False);
+      PyList_Append(threads, thread_py);
+      Py_DECREF(thread_py);
+    }
+  }
+  PyObject* gil = PyDict_New();
+  PyDict_SetItemString(gil, "waits", waits);
+  Py_DECREF(waits);
+  PyDict_SetItemString(gil, "threads", threads);
+  Py_DECREF(threads);
+  return gil;
+}
+
+PyObject* Module::stats() const {
+  size_t function_bytes = MapBytes(functions_);
+  for (auto&& function_pair : functions_) {
+    const Function& function = function_pair.second;
+    function_bytes += StringBytes(function.name());
+    function_bytes += StringBytes(function.filename());
+    function_bytes += function.lines().capacity() * sizeof(LineRecord);
+    function_bytes += function.line_map().bytes();
+    function_bytes += function.opcodes().capacity() * sizeof(OpcodeRecord);
+    function_bytes += MapBytes(function.callers());
+  }
+  size_t c_function_bytes = MapBytes(c_functions_);
+  for (auto&& function_pair : c_functions_) {
+    c_function_bytes += 2 * StringBytes(function_pair.first);
+    c_function_bytes += MapBytes(function_pair.second.callers());
+    c_function_bytes += MapBytes(function_pair.second.native());
+    for (auto&& stack_pair : function_pair.second.native()) {
+      c_function_bytes += stack_pair.first.capacity() * sizeof(uintptr_t);
+    }
+  }
+
+  PyObject* result = PyDict_New();
+  PyObject* events = CreateEventDict(stats_.events);
+  PyDict_SetItemString(result, "events", events);
+  Py_DECREF(events);
+  PyObject* hook_ns = CreateEventDict(stats_.hook_ns);
+  PyDict_SetItemString(result, "hook_ns", hook_ns);
+  Py_DECREF(hook_ns);
+
+  SetStat(result, "source_lookups", stats_.source_lookups);
+  SetStat(result, "source_ns", stats_.source_ns);
+  SetStat(result, "frames_allocated", stats_.frames_allocated);
+  SetStat(result, "frame_depth", frame_stack_.size());
+  SetStat(result, "functions", functions_.size());
+  SetStat(result, "c_functions", c_functions_.size());
+
+  PyObject* bytes = PyDict_New();
+  SetStat(bytes, "functions", function_bytes);
+  SetStat(bytes, "c_functions", c_function_bytes);
+  SetStat(bytes, "frame_stack", stats_.frame_stack_bytes);
+  PyDict_SetItemString(result, "bytes", bytes);
+  Py_DECREF(bytes);
+
+  PyObject* timeline = PyDict_New();
+  SetStat(timeline, "max_events", timeline_.max_events());
+  SetStat(timeline, "events", timeline_.events());
+  SetStat(timeline, "dropped", timeline_.dropped());
+  PyDict_SetItemString(result, "timeline", timeline);
+  Py_DECREF(timeline);
+
+  PyObject* native = PyDict_New();
+  SetStat(native, "interval_ns", native_.interval().count());
+  SetStat(native, "samples", native_.samples());
+  SetStat(native, "dropped", native_.dropped());
+  PyDict_SetItemString(result, "native", native);
+  Py_DECREF(native);
+
+  PyObject* gil = PyDict_New();
+  SetStat(gil, "slots", gil_.n_slots());
+  SetStat(gil, "sites", gil_waits_.size());
+  PyDict_SetItemString(result, "gil", gil);
+  Py_DECREF(gil);
+
+  return result;
+}
+
+namespace {
+
+// Lets other threads take the GIL once slice has passed since the last
+// release. A zero slice never releases it.
+class GilSlicer {
+ public:
+  explicit GilSlicer(duration slice)
+      : slice_(slice), start_(Module::clock::now()) {}
+
+  void poll() {
+    if (slice_.count() == 0 || Module::clock::now() - start_ < slice_) {
+      return;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    std::this_thread::yield();
+    Py_END_ALLOW_THREADS
+    start_ = Module::clock::now();
+  }
 
+ private:
+  duration slice_;
+  Module::time_point start_;
+};
+
+}  // namespace
+
+// Appends the caller edges of one function, with callers still given as
+// code object addresses.
+static void AddCallers(ProfileData& data, const BaseFunction& function,
+                       size_t index, bool c) {
+  for (auto&& edge_pair : function.callers()) {
+    const CallSite& site = edge_pair.first;
+    const CallEdge& edge = edge_pair.second;
+    data.calls.push_back(
+        site.code == nullptr ? CallTable::kNoCaller :
+            reinterpret_cast<size_t>(site.code),
+        site.line, index, c, edge.n_calls, edge.primitive_calls,
+        edge.internal.count(), edge.total.count());
+  }
+}
+
+ProfileData Module::snapshot(bool with_text, duration slice) const {
+  SourceCache source;
+  GilSlicer slicer(slice);
+  ProfileData data;
+  auto& f = data.functions;
+  auto& l = data.lines;
+
+  // Records are looked up again by key after every slice; the hooks may have
+  // added or evicted some in between.
+  std::vector<PyCodeObject*> keys;
+  keys.reserve(functions_.size());
+  size_t n_lines = 0;
+  for (auto&& function_pair : functions_) {
+    keys.push_back(function_pair.first);
+    n_lines += function_pair.second.span();
+  }
+  l.function.reserve(n_lines);
+  l.line_number.reserve(n_lines);
+  l.n_calls.reserve(n_lines);
+  l.internal_ns.reserve(n_lines);
+  l.external_ns.reserve(n_lines);
+  l.text_offset.reserve(n_lines);
+  l.text_size.reserve(n_lines);
+  TextPool text(data);
+
+  for (auto key : keys) {
+    slicer.poll();
+    auto it = functions_.find(key);
+    if (it == functions_.end()) {
+      continue;
+    }
+    const Function& function = it->second;
+    if (!included(function.filename())) {
+      continue;
+    }
+    size_t index = f.size();
+    f.key.push_back(reinterpret_cast<size_t>(key));
+    f.name.push_back(function.name());
+    f.filename.push_back(function.filename());
+    f.first_line.push_back(function.first_line());
+    f.n_calls.push_back(function.n_calls());
+    f.internal_ns.push_back(function.overhead().count());
+    f.line_begin.push_back(l.size());
+    f.line_count.push_back(function.span());
+
+    function.for_each_line([&](size_t line_number, const LineRecord& line) {
+      l.function.push_back(index);
+      l.line_number.push_back(line_number);
+      l.n_calls.push_back(line.n_calls());
+      l.internal_ns.push_back(line.internal().count());
+      l.external_ns.push_back(line.external().count());
+    });
+    const auto& opcodes = function.opcodes();
+    for (size_t i = 0; i < opcodes.size(); ++i) {
+      const OpcodeRecord& opcode = opcodes[i];
+      if (opcode.n_calls != 0) {
+        data.opcodes.push_back(
+            index, i * sizeof(_Py_CODEUNIT), opcode.opcode, opcode.line,
+            opcode.n_calls, opcode.internal.count(), opcode.external.count());
+      }
+    }
+    AddCallers(data, function, index, false);
+  }
+
+  // Text lookups run linecache, during which other threads may run and the
+  // profiled one evict records, so they only read the copied rows.
+  for (size_t i = 0; i < l.size(); ++i) {
+    if (!with_text) {
+      text.add(std::string_view());
+      continue;
+    }
+    slicer.poll();
+    text.add(source.line(f.filename[l.function[i]], l.line_number[i]));
+  }
+
+  slicer.poll();
+  auto& c = data.c_functions;
+  for (auto&& function_pair : c_functions_) {
+    const BaseFunction& function = function_pair.second;
+    AddCallers(data, function, c.size(), true);
+    for (auto&& stack : native_stacks(function)) {
+      data.native.push_back(c.size(), stack.second.samples,
+                            stack.second.time.count(), stack.first.begin(),
+                            stack.first.end());
+    }
+    c.name.push_back(function.name());
+    c.n_calls.push_back(function.n_calls());
+    c.internal_ns.push_back(function.overhead().count());
+    c.native_dropped.push_back(function.native_dropped());
+  }
+
+  // Callers were recorded by code object; point them at function rows.
+  // Callers that were evicted or filtered out count as calls from outside.
+  std::unordered_map<uint64_t, uint64_t> rows;
+  rows.reserve(f.size());
+  for (size_t i = 0; i < f.size(); ++i) {
+    rows.emplace(f.key[i], i);
+  }
+  for (auto& caller : data.calls.caller) {
+    auto it = rows.find(caller);
+    caller = it == rows.end() ? CallTable::kNoCaller : it->second;
+  }
+
+  // Waits outside any profiled frame only count in the thread totals.
+  for (auto&& wait_pair : gil_waits_) {
+    auto it = rows.find(reinterpret_cast<size_t>(wait_pair.first.code));
+    if (it != rows.end()) {
+      data.gil_waits.push_back(it->second, wait_pair.first.line,
+                               wait_pair.second.n_waits,
+                               wait_pair.second.wait.count(),
+                               wait_pair.second.off_cpu.count());
+    }
+  }
+  if (gil_enabled_) {
+    for (auto&& thread : GilMonitor::threads()) {
+      data.gil_threads.push_back(thread.id, thread.n_waits,
+                                 thread.wait.count(), thread.hold.count(),
+                                 thread.profiled.count(), thread.cpu.count(),
+                                 thread.released.count(), thread.hold_exact);
+    }
+  }
+
+  if (max_functions_ != 0 || max_lines_ != 0 || evicted_.functions != 0 ||
+      evicted_.c_functions != 0) {
+    for (auto&& counter : kEvictedCounters) {
+      data.counters[counter.first] = evicted_.*counter.second;
+    }
+  }
+
+  return data;
+}
+
+void Module::after_fork_child() {
+  // The parent's tables are parked and never freed: swapping a map only
+  // exchanges its bucket array, whereas clearing or destroying it would
+  // write to, and so copy, every page the parent's records live on.
+  struct ParkedTables {
+    std::unordered_map<PyCodeObject*, Function> functions;
+    std::unordered_map<std::string, BaseFunction> c_functions;
+    std::unordered_map<CallSite, GilWait, CallSiteHash> gil_waits;
+    ProfileData dump_base;
+    Timeline timeline;
+  };
+  auto* parked = new ParkedTables;
+  parked->functions.swap(functions_);
+  parked->c_functions.swap(c_functions_);
+  parked->gil_waits.swap(gil_waits_);
+  GilMonitor::reset();
+  std::swap(parked->dump_base, dump_base_);
+  std::swap(parked->timeline, timeline_);
+  timeline_.configure(parked->timeline.max_events(),
+                      parked->timeline.threshold(), now());
+
+  // Frames that were live at fork() return in the child too. Keep them with
+  // zeroed counters and give each a fresh function record to return into.
+  std::vector<FrameState> frames;
+  while (!frame_stack_.empty()) {
+    frames.push_back(std::move(frame_stack_.top()));
+    frame_stack_.pop();
+  }
+  // Only the forking thread exists in the child, which may run without the
+  // GIL; another thread's shadow stack goes with that thread.
+  PyThreadState* tstate = _PyThreadState_UncheckedGet();
+  if (hooked_thread_ != 0 &&
+      (tstate == nullptr || tstate->id != hooked_thread_)) {
+    frames.clear();
+    stats_.frame_stack_bytes = 0;
+    last_instruction_ = Instruction::kInvalid;
+    enabled_ = 0;
+    hooked_thread_ = 0;
+  }
+  for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+    it->reset();
+    it->set_partial();
+    if (functions_.count(it->key()) == 0) {
+      Py_INCREF(it->key());
+      functions_.emplace(
+          it->key(), parked->functions.at(it->key()).cleared());
+    }
+    Function& function = functions_.at(it->key());
+    function.enter();
+    if (function.traces_opcodes()) {
+      it->set_opcodes(function.opcodes());
+    }
+    frame_stack_.push(std::move(*it));
+  }
+  n_lines_tracked_ = 0;
+  for (auto&& function_pair : functions_) {
+    n_lines_tracked_ += function_pair.second.n_lines();
+  }
+  evicted_ = EvictedTotals();
+  native_.after_fork();
+  c_calls_.clear();
+
+  // fork() itself is normally the pending C call.
+  if (last_instruction_ == Instruction::kCCall) {
+    add_c_function(last_c_name_);
+  }
+}
+
+// Attributes the time since the last event to the instruction it started.
+void Module::finish(PyFrameObject* frame) {
   switch (last_instruction_) {
     case Instruction::kOrigin:
       finish_origin(frame);
@@ -152,11 +903,40 @@ void Module::profile(int what, PyFrameObject* frame, PyObject* arg) {
       break;
     case Instruction::kCException:
       break;
+    case Instruction::kOpcode:
+      finish_opcode(frame);
+      break;
     case Instruction::kInvalid:
       break;
     default:
       throw std::runtime_error("Should not get here");
   }
+}
+
+void Module::profile(int what, PyFrameObject* frame, PyObject* arg) {
+  // The hooks' own time is not the C function's.
+  native_.disarm();
+  GilWait wait = gil_enabled_ ? GilMonitor::take_pending() : GilWait();
+  if (enabled_ == 0) {
+    // Paused: only keep the shadow stack in step with the interpreter.
+    if (what == PyTrace_RETURN && is_top(frame)) {
+      if (timeline_.recording()) {
+        last_instruction_end_ = now();
+      }
+      pop_frame();
+    } else if (what == PyTrace_C_RETURN || what == PyTrace_C_EXCEPTION) {
+      end_c_call(frame, arg, false);
+    }
+    return;
+  }
+  last_instruction_end_ = now();
+  if (wait.n_waits != 0) {
+    // The instruction that just finished is the one that waited.
+    GilWait& site = gil_waits_[call_site()];
+    site.n_waits += wait.n_waits;
+    site.wait += wait.wait;
+  }
+  finish(frame);
 
   switch (what) {
     case PyTrace_LINE:
@@ -172,49 +952,90 @@ void Module::profile(int what, PyFrameObject* frame, PyObject* arg) {
       profile_c_call(frame, arg);
       break;
     case PyTrace_C_RETURN:
-      profile_c_return(frame);
+      profile_c_return(frame, arg);
       break;
     case PyTrace_EXCEPTION:
       break;
     case PyTrace_C_EXCEPTION:
-      profile_c_return(frame);
+      profile_c_return(frame, arg);
       break;
     case PyTrace_OPCODE:
+      profile_opcode(frame);
       break;
     default:
       throw std::runtime_error("Should not get here");
   }
-  last_instruction_start_ = clock::now();
+  last_instruction_start_ = now();
+
+  ++stats_.events[what];
+  stats_.hook_ns[what] += std::chrono::duration_cast<duration>(
+      last_instruction_start_ - last_instruction_end_).count();
 }
 
 void Module::profile_call(PyFrameObject* frame) {
   auto& function = add_function(frame);
   function.add_call();
-  frame->f_trace_opcodes = 0;
-  emplace_frame(frame);
+  function.enter();
+  emplace_frame(frame, function);
   last_instruction_ = Instruction::kCall;
 }
 
 void Module::finish_call(PyFrameObject* frame) {
-  functions_.at(frame->f_code).add_elapsed_internal(elapsed());
+  functions_.at(frame_stack_.top().key()).add_elapsed_internal(elapsed());
 }
 
 void Module::profile_line(PyFrameObject* frame) {
+  if (!is_top(frame)) {
+    last_instruction_ = Instruction::kInvalid;
+    return;
+  }
   last_instruction_ = Instruction::kLine;
 
-  if (frame_stack_.empty()) {
+  auto& line = frame_stack_.top().set_current_instruction(frame->f_lasti);
+  line.add_call();
+}
+
+void Module::profile_opcode(PyFrameObject* frame) {
+  OpcodeRecord* opcode = is_top(frame) ?
+      frame_stack_.top().set_current_opcode(
+          InstructionIndex(frame->f_lasti)) : nullptr;
+  if (opcode == nullptr) {
+    last_instruction_ = Instruction::kInvalid;
     return;
   }
+  last_instruction_ = Instruction::kOpcode;
+  ++opcode->n_calls;
+}
 
-  auto line_number = PyFrame_GetLineNumber(frame);
-  auto& line = frame_stack_.top().set_current_line(line_number);
-  line.add_call();
+// Instruction time also counts towards its line, so line totals read the same
+// with and without opcode tracing.
+void Module::finish_opcode(PyFrameObject*) {
+  FrameState& top = frame_stack_.top();
+  top.current_opcode()->internal += elapsed();
+  if (line_events_) {
+    top.current_line().add_internal(elapsed());
+  } else {
+    top.add_internal(elapsed());
+  }
 }
 
 void Module::profile_c_call(PyFrameObject* frame, PyObject* arg) {
   PyObject* module = PyObject_GetAttrString(arg, "__module__");
   PyObject* qualname = PyObject_GetAttrString(arg, "__qualname__");
-  PyObject* name = PyUnicode_FromFormat("<C-function %U.%U>", module, qualname);
+  PyErr_Clear();
+
+  // Builtin methods such as lock.acquire have no module; name them by their
+  // qualified name alone.
+  PyObject* name;
+  if (qualname == NULL || !PyUnicode_Check(qualname)) {
+    name = PyUnicode_FromFormat("<C-function %s>", Py_TYPE(arg)->tp_name);
+  } else if (module == NULL || !PyUnicode_Check(module)) {
+    name = PyUnicode_FromFormat("<C-function %U>", qualname);
+  } else {
+    name = PyUnicode_FromFormat("<C-function %U.%U>", module, qualname);
+  }
+  Py_XDECREF(qualname);
+  Py_XDECREF(module);
   if (name == NULL) {
     throw std::runtime_error("Could not get C call name");
   }
@@ -222,29 +1043,57 @@ void Module::profile_c_call(PyFrameObject* frame, PyObject* arg) {
   Py_ssize_t size;
   const char* name_char = PyUnicode_AsUTF8AndSize(name, &size);
   last_c_name_ = std::string(name_char, size);
+  last_c_entry_ = PyCFunction_Check(arg) ?
+      reinterpret_cast<const void*>(PyCFunction_GET_FUNCTION(arg)) : nullptr;
   auto& c_function = add_c_function(last_c_name_);
   c_function.add_call();
+  c_call_in_top_ = is_top(frame);
+  c_calls_.push_back(OpenCCall{frame, arg, last_c_name_, CallSite{nullptr, 0},
+                               time_point(), duration(0),
+                               gil_enabled_ ? ThreadClock::now()
+                                            : ThreadClock()});
   last_instruction_ = Instruction::kCCall;
 
   Py_DECREF(name);
-  Py_DECREF(qualname);
-  Py_DECREF(module);
 }
 
 void Module::finish_ccall(PyFrameObject* frame) {
-  c_functions_.at(last_c_name_).add_elapsed_internal(elapsed());
-  frame_stack_.top().current_line().add_external(elapsed());
+  auto& c_function = c_functions_.at(last_c_name_);
+  c_function.add_elapsed_internal(elapsed());
+  native_.disarm();
+  c_function.add_native_dropped(native_.drain(
+      [&](const uintptr_t* frames, size_t depth, uint64_t weight) {
+        c_function.add_native_sample(NativeStack(frames, frames + depth),
+                                     native_.interval(), weight);
+      }));
+  if (c_call_in_top_) {
+    frame_stack_.top().current_line().add_external(elapsed());
+    if (OpcodeRecord* opcode = frame_stack_.top().current_opcode()) {
+      opcode->external += elapsed();
+    }
+  }
+  CallSite site = c_call_in_top_ ? call_site() : CallSite{nullptr, 0};
+  c_function.caller(site).add(true, elapsed(), elapsed());
+  if (!c_calls_.empty()) {
+    OpenCCall& open = c_calls_.back();
+    open.site = site;
+    open.start = last_instruction_start_;
+    open.counted = elapsed();
+  }
+  if (timeline_.recording()) {
+    timeline_.record(timeline_.c_function_name(last_c_name_),
+                     frame_stack_.size(), last_instruction_start_,
+                     last_instruction_end_);
+  }
 }
 
 void Module::finish_line(PyFrameObject* frame) {
-  if (frame_stack_.empty()) {
-    return;
-  }
   frame_stack_.top().current_line().add_internal(elapsed());
 }
 
 void Module::profile_return(PyFrameObject* frame) {
-  last_instruction_ = Instruction::kReturn;
+  last_instruction_ =
+      is_top(frame) ? Instruction::kReturn : Instruction::kInvalid;
 }
 
 void Module::finish_return(PyFrameObject*) {
@@ -252,8 +1101,39 @@ void Module::finish_return(PyFrameObject*) {
   pop_frame();
 }
 
-void Module::profile_c_return(PyFrameObject* frame) {
-  last_instruction_ = Instruction::kCReturn;
+void Module::profile_c_return(PyFrameObject* frame, PyObject* arg) {
+  last_instruction_ =
+      is_top(frame) ? Instruction::kCReturn : Instruction::kInvalid;
+  end_c_call(frame, arg, true);
+}
+
+// Closes the innermost open call of function from frame, and any calls
+// opened after it whose return went unseen. A return that matches nothing,
+// such as that of the call which started profiling, is ignored.
+void Module::end_c_call(PyFrameObject* frame, PyObject* function,
+                        bool charge) {
+  for (size_t i = c_calls_.size(); i-- > 0;) {
+    const OpenCCall& open = c_calls_[i];
+    if (open.frame != frame || open.function != function) {
+      continue;
+    }
+    duration rest = std::chrono::duration_cast<duration>(
+        last_instruction_end_ - open.start) - open.counted;
+    if (charge && rest.count() > 0) {
+      auto it = c_functions_.find(open.name);
+      if (it != c_functions_.end()) {
+        it->second.caller(open.site).total += rest;
+      }
+    }
+    if (charge && gil_enabled_) {
+      duration off_cpu = ThreadClock::now().off_cpu_since(open.clock);
+      if (off_cpu.count() > 0) {
+        gil_waits_[open.site].off_cpu += off_cpu;
+      }
+    }
+    c_calls_.resize(i);
+    return;
+  }
 }
 
 void Module::finish_creturn(PyFrameObject*) {
@@ -263,53 +1143,64 @@ void Module::finish_creturn(PyFrameObject*) {
 void Module::pop_frame() {
   FrameState& frame = frame_stack_.top();
   Function& function = functions_.at(frame.key());
+  function.leave();
+  if (frame.partial()) {
+    function.add_partial_call();
+  }
   function.add_elapsed_internal(frame.internal());
   size_t i = 0;
+  auto self = frame.internal();
   for (auto&& line : frame.lines()) {
     LineRecord& line_record = function.line(i++);
     line_record += line;
+    self += line.internal();
   }
   auto total = frame.total_time();
+  auto cumulative = frame.internal() + total;
+  bool partial = frame.partial();
+  if (timeline_.recording()) {
+    timeline_.record(
+        timeline_.function_name(frame.key(), function.name(),
+                                function.filename(), function.first_line()),
+        frame_stack_.size() - 1, frame.start(), last_instruction_end_);
+  }
 
+  stats_.frame_stack_bytes -= frame.bytes();
   frame_stack_.pop();
 
+  // Frames already running when profiling started were never seen called,
+  // so they have no caller edge.
+  if (!partial) {
+    function.caller(call_site()).add(!function.active(), self, cumulative);
+  }
   if (!frame_stack_.empty()) {
     frame_stack_.top().current_line().add_external(total);
+    if (OpcodeRecord* opcode = frame_stack_.top().current_opcode()) {
+      opcode->external += total;
+    }
   }
 }
 
-std::vector<std::string> Module::get_lines(
-    PyFrameObject* frame, size_t* line_start) {
-  PyCodeObject* code = frame->f_code;
-  PyObject* method_name_py = PyUnicode_FromString("getsourcelines");
-  if (method_name_py == NULL) {
-    throw std::runtime_error("Could not create str");
+// Lets linecache find the source of files loaded through import hooks (zip
+// imports and the like) at dump time. It only records the module's loader, so
+// it is cheap enough to do once per file from the hook.
+void Module::register_source(PyFrameObject* frame) {
+  auto lookup_start = clock::now();
+  auto filename = PyCode_GetFilename(frame->f_code);
+  if (!source_files_.insert(filename).second) {
+    return;
   }
-
-  PyObject* result = PyObject_CallMethodObjArgs(inspect_, method_name_py, (PyObject*)code, NULL);
+  PyObject* result = PyObject_CallMethod(
+      linecache_, "lazycache", "OO", frame->f_code->co_filename,
+      frame->f_globals);
   if (result == NULL) {
-    Py_DECREF(method_name_py);
-    throw std::runtime_error("Could not get `inspect.getsourcelines' method");
-  }
-  PyObject* lines_py = PyTuple_GetItem(result, 0);
-
-  if (line_start != nullptr) {
-    PyObject* line_start_py = PyTuple_GetItem(result, 1);
-    *line_start = PyLong_AsUnsignedLongLong(line_start_py);
+    PyErr_Clear();
   }
+  Py_XDECREF(result);
 
-  auto n_lines = PyList_Size(lines_py);
-  std::vector<std::string> lines;
-  lines.reserve(n_lines);
-  for (decltype(n_lines) i=1; i < n_lines; ++i) {
-    PyObject* line_py = PyList_GetItem(lines_py, i);
-    Py_ssize_t size;
-    const char* line_char = PyUnicode_AsUTF8AndSize(line_py, &size);
-    lines.emplace_back(std::string(line_char, size));
-  }
-  Py_DECREF(result);
-  Py_DECREF(method_name_py);
-  return lines;
+  ++stats_.source_lookups;
+  stats_.source_ns += std::chrono::duration_cast<duration>(
+      clock::now() - lookup_start).count();
 }
 
 Function& Module::add_function(PyFrameObject* frame) {
@@ -317,30 +1208,171 @@ Function& Module::add_function(PyFrameObject* frame) {
   if (functions_.count(code) != 0) {
     return functions_.at(code);
   }
-  auto lines = get_lines(frame);
+  register_source(frame);
+  auto line_map = std::make_shared<const LineMap>(code);
+  size_t n_lines = line_map->n_slots();
+  make_room_for_function(n_lines);
+  n_lines_tracked_ += n_lines;
+  Py_INCREF(code);
   auto pair = 
     functions_.emplace(
-	code, Function(PyFrame_GetName(frame), std::move(lines), code));
+	code, Function(PyFrame_GetName(frame), PyCode_GetFilename(code), code,
+                       std::move(line_map)));
+  pair.first->second.set_error_calls(evicted_.error_bound_calls);
   return pair.first->second;
 }
 
 BaseFunction& Module::add_c_function(std::string name) {
+  auto it = c_functions_.find(name);
+  if (it != c_functions_.end()) {
+    return it->second;
+  }
+  make_room_for_c_function();
   auto pair = c_functions_.emplace(name, BaseFunction(name));
+  pair.first->second.set_error_calls(evicted_.error_bound_calls);
   return pair.first->second;
 }
 
+void Module::set_timeline(size_t max_events, duration threshold) {
+  timeline_.configure(max_events, threshold, now());
+}
+
+void Module::set_limits(size_t max_functions, size_t max_lines) {
+  max_functions_ = max_functions;
+  max_lines_ = max_lines;
+}
+
+// Bounded mode keeps the heaviest hitters in the spirit of the space-saving
+// algorithm: when a table is full, the records with the fewest calls are
+// folded into the "other" totals, and anything admitted afterwards carries
+// the largest evicted count as its error bound. Eviction runs in batches
+// down to 7/8 of the limit, so its sort is amortized over many insertions.
+void Module::make_room_for_function(size_t n_lines) {
+  bool over_functions =
+      max_functions_ != 0 && functions_.size() + 1 > max_functions_;
+  bool over_lines =
+      max_lines_ != 0 && n_lines_tracked_ + n_lines > max_lines_;
+  if (!over_functions && !over_lines) {
+    return;
+  }
+
+  size_t target_functions = max_functions_ == 0 ?
+      functions_.size() : max_functions_ - max_functions_ / 8 - 1;
+  size_t target_lines = max_lines_ == 0 ? n_lines_tracked_ :
+      max_lines_ - std::min(max_lines_, max_lines_ / 8 + n_lines);
+
+  std::vector<std::pair<size_t, PyCodeObject*>> candidates;
+  for (auto&& function_pair : functions_) {
+    if (!function_pair.second.active()) {
+      candidates.emplace_back(
+          function_pair.second.n_calls(), function_pair.first);
+    }
+  }
+  std::sort(candidates.begin(), candidates.end());
+
+  std::unordered_set<PyCodeObject*> evicted;
+  for (auto&& candidate : candidates) {
+    if (functions_.size() <= target_functions &&
+        n_lines_tracked_ <= target_lines) {
+      break;
+    }
+    auto it = functions_.find(candidate.second);
+    const Function& function = it->second;
+    ++evicted_.functions;
+    evicted_.calls += function.n_calls();
+    evicted_.internal_ns += function.overhead().count();
+    for (auto&& line : function.lines()) {
+      evicted_.internal_ns += line.internal().count();
+      evicted_.external_ns += line.external().count();
+    }
+    evicted_.error_bound_calls = std::max<uint64_t>(
+        evicted_.error_bound_calls, function.n_calls() + function.error_calls());
+    n_lines_tracked_ -= function.n_lines();
+    evicted.insert(it->first);
+    functions_.erase(it);
+  }
+
+  // Edges, GIL waits and timeline names are also keyed by code object and
+  // outlive the records; once the references go, a new code object at the
+  // same address would inherit them.
+  for (auto&& function_pair : functions_) {
+    function_pair.second.forget_callers(evicted);
+  }
+  for (auto&& function_pair : c_functions_) {
+    function_pair.second.forget_callers(evicted);
+  }
+  GilWait outside;
+  for (auto it = gil_waits_.begin(); it != gil_waits_.end();) {
+    if (evicted.count(it->first.code) != 0) {
+      outside.n_waits += it->second.n_waits;
+      outside.wait += it->second.wait;
+      outside.off_cpu += it->second.off_cpu;
+      it = gil_waits_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  if (outside.n_waits != 0 || outside.off_cpu.count() != 0) {
+    GilWait& site = gil_waits_[CallSite{nullptr, 0}];
+    site.n_waits += outside.n_waits;
+    site.wait += outside.wait;
+    site.off_cpu += outside.off_cpu;
+  }
+  for (auto code : evicted) {
+    timeline_.forget_function(code);
+    Py_DECREF(code);
+  }
+}
+
+void Module::make_room_for_c_function() {
+  if (max_functions_ == 0 || c_functions_.size() + 1 <= max_functions_) {
+    return;
+  }
+  size_t target = max_functions_ - max_functions_ / 8 - 1;
+
+  std::vector<std::pair<size_t, std::string>> candidates;
+  for (auto&& function_pair : c_functions_) {
+    candidates.emplace_back(
+        function_pair.second.n_calls(), function_pair.first);
+  }
+  std::sort(candidates.begin(), candidates.end());
+
+  for (auto&& candidate : candidates) {
+    if (c_functions_.size() <= target) {
+      break;
+    }
+    auto it = c_functions_.find(candidate.second);
+    const BaseFunction& function = it->second;
+    ++evicted_.c_functions;
+    evicted_.c_calls += function.n_calls();
+    evicted_.c_internal_ns += function.overhead().count();
+    evicted_.error_bound_calls = std::max<uint64_t>(
+        evicted_.error_bound_calls, function.n_calls() + function.error_calls());
+    c_functions_.erase(it);
+  }
+}
+
 static int
 profile_func(PyObject* obj, PyFrameObject* frame, int what, PyObject *arg) {
   Module* mod = (Module*)PyModule_GetState(obj);
   mod->profile(what, frame, arg);
+  if (what == PyTrace_C_CALL) {
+    // The C function's frames take the place of the hook's, just below
+    // the interpreter frame that called both.
+    mod->arm_native(__builtin_dwarf_cfa());
+  }
   return 0;
 }
 
 static int
 trace_func(PyObject* obj, PyFrameObject* frame, int what, PyObject *arg) {
-  // We are uninterested in these events
-  if (what != PyTrace_LINE) {
+  // The profile hook sees every other event. Opcode events only come from
+  // frames selected for them, but line events come from every frame, even
+  // when the hook is installed for opcodes alone.
+  Module* mod = (Module*)PyModule_GetState(obj);
+  if (what == PyTrace_LINE ? !mod->line_events() : what != PyTrace_OPCODE) {
     return 0;
   }
-  return profile_func(obj, frame, what, arg);
+  mod->profile(what, frame, arg);
+  return 0;
 }
@@ -1,18 +1,33 @@
 #pragma once
 
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <frameobject.h>
 
 #include <chrono>
+#include <map>
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <stack>
+#include <stdexcept>
 
 #include "function.h"
 #include "frame.h"
+#include "gil.h"
+#include "native.h"
+#include "profile_data.h"
+#include "stats.h"
+#include "timeline.h"
 
 
+enum class ClockKind {
+  kWall,
+  // CPU time of the profiled thread.
+  kCpu,
+};
+
 enum class Instruction {
   kOrigin,
   kLine,
@@ -22,9 +37,32 @@ enum class Instruction {
   kCCall,
   kCReturn,
   kCException,
+  kOpcode,
   kInvalid,
 };
 
+// Totals of the records bounded mode dropped. They are reported as one
+// "other" record so the profile still accounts for all time.
+struct EvictedTotals {
+  uint64_t functions = 0;
+  uint64_t calls = 0;
+  uint64_t internal_ns = 0;
+  uint64_t external_ns = 0;
+  uint64_t c_functions = 0;
+  uint64_t c_calls = 0;
+  uint64_t c_internal_ns = 0;
+  // Largest call count any evicted record had. A record's true call count is
+  // at most n_calls + error_calls, and error_calls never exceeds this.
+  uint64_t error_bound_calls = 0;
+};
+
+// Thrown when a thread tries to install or remove the hooks while they are
+// installed on another, live, thread.
+class ThreadError : public std::runtime_error {
+ public:
+  using std::runtime_error::runtime_error;
+};
+
 class Module {
  public:
   using clock = std::chrono::high_resolution_clock;
@@ -32,17 +70,94 @@ class Module {
   using time_point = clock::time_point;
   Module(PyObject*);
   ~Module();
+  // start() installs the hooks on the calling thread and enables them;
+  // stop() removes them and closes every frame still on the shadow stack.
+  // The shadow stack and the pending instruction belong to one thread, so
+  // the hooks are installed on one thread at a time: until that thread
+  // stop()s or exits, start(), stop(), enable() and disable() from any other
+  // thread throw ThreadError, as do the setters that stop().
   void start();
   void stop();
+  // Nested enable counter checked by the hooks. Hooks stay installed while
+  // the counter is zero and only keep the shadow stack in step, so pausing
+  // and resuming costs next to nothing. enable() installs the hooks if
+  // needed.
+  void enable();
+  void disable();
+  bool running() const { return enabled_ != 0; }
   PyObject* dump(const char*);
+  PyObject* stats() const;
+
+  // The clock and line events may only change while profiling is off; the
+  // setters stop() to drop paused hooks, so the next start() installs hooks
+  // to match. Filters are fnmatch(3)
+  // patterns on the filename, applied when the tables are read out: a
+  // function is kept if it matches some include pattern (or there are none)
+  // and no exclude pattern.
+  void set_clock(ClockKind);
+  void set_line_events(bool);
+  void set_filters(std::vector<std::string> include,
+                   std::vector<std::string> exclude);
+  bool included(const std::string& filename) const;
+  bool line_events() const { return line_events_; }
+
+  // Selects functions for per-instruction (PyTrace_OPCODE) tracing, by code
+  // object or by fnmatch(3) pattern on the function name; empty lists select
+  // none. Like set_line_events() it stop()s, since the trace hook is only
+  // installed when lines or opcodes are traced. Holds a reference to every
+  // code object until the selection changes.
+  void set_opcodes(std::vector<PyCodeObject*> codes,
+                   std::vector<std::string> names);
+
+  // Samples the native stack of C calls every interval of the profiling
+  // clock, attributing the stacks to the C function running; 0 stops
+  // sampling. Only the thread that calls it is sampled. Throws
+  // std::runtime_error if the timer cannot be set up.
+  void set_native(duration interval);
+  // Called by the profile hook right after a C_CALL event, with an address
+  // above the frames the C function will use.
+  void arm_native(const void* hook_stack);
+
+  // Times every wait to reacquire the GIL (see GilMonitor), attributing it
+  // to the line that resumed after it and to per-thread totals. Also charges
+  // each C call's off-CPU time to its line, and measures it across the
+  // hooked thread's profiled spans, which catches waits the wrappers miss.
+  // start() patches objects loaded since. Like set_line_events() it stop()s.
+  void set_gil(bool enabled);
+
+  // Caps the number of tracked functions (and, separately, C functions) and
+  // of tracked source lines, counting only lines with code; 0 means
+  // unbounded.
+  void set_limits(size_t max_functions, size_t max_lines);
+  // with_text resolves every line's source text through linecache. A
+  // non-zero slice bounds how long the GIL is held at a time: the copy drops
+  // and retakes it whenever a slice is used up, so the caller must not hold
+  // pointers into the tables across the call.
+  ProfileData snapshot(bool with_text = true,
+                       duration slice = duration(0)) const;
+
+  // Records every Python and C call lasting at least threshold into
+  // per-thread buffers of max_events; 0 stops recording. Restarts the
+  // timeline either way.
+  void set_timeline(size_t max_events, duration threshold);
+  TimelineData timeline() const { return timeline_.snapshot(); }
+
+  // Base of delta auto-dumps: the cumulative snapshot of the previous dump.
+  ProfileData& dump_base() { return dump_base_; }
+
+  // Runs in a forked child before any Python code. Drops the statistics
+  // inherited from the parent while keeping the shadow stack usable.
+  void after_fork_child();
 
   void profile(int what, PyFrameObject* frame, PyObject* arg);
   void profile_call(PyFrameObject*);
   void profile_return(PyFrameObject*);
   void profile_c_call(PyFrameObject*, PyObject*);
-  void profile_c_return(PyFrameObject*);
+  void profile_c_return(PyFrameObject*, PyObject*);
   void profile_line(PyFrameObject*);
+  void profile_opcode(PyFrameObject*);
 
+  void finish(PyFrameObject*);
   void finish_origin(PyFrameObject*);
   void finish_line(PyFrameObject*);
   void finish_call(PyFrameObject*);
@@ -51,8 +166,12 @@ class Module {
   void finish_ccall(PyFrameObject*);
   void finish_creturn(PyFrameObject*);
   void finish_cexception(PyFrameObject*);
+  void finish_opcode(PyFrameObject*);
 
-  void emplace_frame(PyFrameObject*);
+  void end_c_call(PyFrameObject*, PyObject*, bool charge);
+
+  void emplace_frame(PyFrameObject*, Function&);
+  void bootstrap_frames(PyFrameObject*);
   void pop_frame();
 
   Function& add_function(PyFrameObject*);
@@ -63,16 +182,93 @@ class Module {
   const auto& c_functions() const { return c_functions_; }
 
  private:
-  std::vector<std::string> get_lines(
-      PyFrameObject* lines, size_t* line_start=nullptr);
+  void register_source(PyFrameObject*);
+  // Throws ThreadError if the hooks are installed on another thread that is
+  // still alive. Frames left by a thread that exited are closed.
+  void check_thread();
+  // Closes every frame on the shadow stack and forgets the hooked thread.
+  void close_frames();
+  time_point now() const;
+  bool traces_opcodes() const {
+    return !opcode_codes_.empty() || !opcode_names_.empty();
+  }
+  bool opcodes_selected(PyCodeObject* code, const std::string& name) const;
+  bool is_top(PyFrameObject* frame) const {
+    return !frame_stack_.empty() && frame_stack_.top().frame() == frame;
+  }
+  // The top frame's function and current line, where a call it makes is
+  // attributed.
+  CallSite call_site() const {
+    if (frame_stack_.empty()) {
+      return CallSite{nullptr, 0};
+    }
+    const FrameState& top = frame_stack_.top();
+    return CallSite{top.key(), top.current_line_number()};
+  }
+
+  // A C function's native stacks by frame names; stacks through different
+  // addresses of the same functions are summed.
+  std::map<std::vector<std::string>, NativeCount> native_stacks(
+      const BaseFunction&) const;
+
+  void make_room_for_function(size_t n_lines);
+  void make_room_for_c_function();
+  PyObject* bounded_dict() const;
+  PyObject* gil_dict() const;
 
   PyObject* parent_;
+  // Each key holds a reference, so a freed code object's address cannot be
+  // reused by another one while its record is still in the table. Eviction
+  // forgets the edges, GIL waits and timeline names keyed by it first.
   std::unordered_map<PyCodeObject*, Function> functions_;
   std::unordered_map<std::string, BaseFunction> c_functions_;
+  // Shadows a subsequence of the live interpreter frames, outermost first.
+  // Events from frames that are not on top are not attributed.
   std::stack<FrameState> frame_stack_;
-  PyObject* inspect_;
+  size_t enabled_ = 0;
+  // PyThreadState id of the thread the hooks are installed on, or 0. Ids
+  // are never reused, unlike thread states and pthread ids.
+  uint64_t hooked_thread_ = 0;
+  ClockKind clock_ = ClockKind::kWall;
+  bool line_events_ = true;
+  std::vector<std::string> include_;
+  std::vector<std::string> exclude_;
+  std::unordered_set<PyCodeObject*> opcode_codes_;
+  std::vector<std::string> opcode_names_;
+  bool c_call_in_top_ = false;
+  // A C call that has not returned yet. Its caller edge first gets the time
+  // up to the next event; at return it is topped up to the whole span, so
+  // Python code the C function calls back counts towards it.
+  struct OpenCCall {
+    PyFrameObject* frame;
+    PyObject* function;
+    std::string name;
+    CallSite site;
+    time_point start;
+    duration counted;
+    // Read at the call when set_gil() is on, to charge its off-CPU time.
+    ThreadClock clock;
+  };
+  std::vector<OpenCCall> c_calls_;
+  PyObject* linecache_;
+  std::unordered_set<std::string> source_files_;
   Instruction last_instruction_ = Instruction::kInvalid;
   time_point last_instruction_start_;
   time_point last_instruction_end_;
   std::string last_c_name_;
+  // Entry point of the pending C call when it is a builtin, else null.
+  const void* last_c_entry_ = nullptr;
+  NativeSampler native_;
+  bool gil_enabled_ = false;
+  GilMonitor gil_;
+  std::unordered_map<CallSite, GilWait, CallSiteHash> gil_waits_;
+  mutable NativeSymbolizer symbols_;
+  ProfilerStats stats_;
+
+  size_t max_functions_ = 0;
+  size_t max_lines_ = 0;
+  size_t n_lines_tracked_ = 0;
+  EvictedTotals evicted_;
+  ProfileData dump_base_;
+  Timeline timeline_;
 };
@@ -1,25 +1,104 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <pthread.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
 #include "_bprof.h"
+#include "callgrind.h"
+#include "column.h"
+#include "diff.h"
+#include "dump_file.h"
+#include "html.h"
+#include "merge.h"
+#include "pprof.h"
+#include "pstats.h"
+#include "report.h"
+#include "signals.h"
+#include "speedscope.h"
+
+// Module whose tables are reset in forked children.
+static Module* fork_module = nullptr;
+
+static void
+module_after_fork_child() {
+  if (fork_module != nullptr) {
+    fork_module->after_fork_child();
+  }
+}
 
 static int
 module_exec(PyObject *m)
 {
-  new(PyModule_GetState(m)) Module(m);
+  if (Column_Ready() < 0) {
+    return -1;
+  }
+  Module* mod = new(PyModule_GetState(m)) Module(m);
+
+  static bool atfork_registered = false;
+  if (!atfork_registered) {
+    if (pthread_atfork(NULL, NULL, module_after_fork_child) != 0) {
+      PyErr_SetString(PyExc_OSError, "Could not register fork handler");
+      return -1;
+    }
+    atfork_registered = true;
+  }
+  fork_module = mod;
   return 0;
 }
 
 static PyObject*
 module_start(PyObject* m, PyObject*) {
   Module* mod = (Module*)PyModule_GetState(m);
-  mod->start();
+  try {
+    mod->start();
+  } catch (const ThreadError& e) {
+    PyErr_SetString(PyExc_RuntimeError, e.what());
+    return NULL;
+  }
   Py_RETURN_NONE;
 }
 
 static PyObject*
 module_stop(PyObject* m, PyObject*) {
   Module* mod = (Module*)PyModule_GetState(m);
-  mod->stop();
+  try {
+    mod->stop();
+  } catch (const ThreadError& e) {
+    PyErr_SetString(PyExc_RuntimeError, e.what());
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+module_enable(PyObject* m, PyObject*) {
+  Module* mod = (Module*)PyModule_GetState(m);
+  try {
+    mod->enable();
+  } catch (const ThreadError& e) {
+    PyErr_SetString(PyExc_RuntimeError, e.what());
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+module_disable(PyObject* m, PyObject*) {
+  Module* mod = (Module*)PyModule_GetState(m);
+  try {
+    mod->disable();
+  } catch (const ThreadError& e) {
+    PyErr_SetString(PyExc_RuntimeError, e.what());
+    return NULL;
+  }
   Py_RETURN_NONE;
 }
 
@@ -34,10 +113,1037 @@ module_dump(PyObject* m, PyObject* path) {
 
   char* bytes_data = PyBytes_AsString(bytes);
   if (bytes_data == NULL) {
+    Py_DECREF(bytes);
+    return NULL;
+  }
+
+  PyObject* result = NULL;
+  try {
+    result = mod->dump(bytes_data);
+  } catch (const std::exception& e) {
+    PyErr_SetString(PyExc_OSError, e.what());
+  }
+  Py_DECREF(bytes);
+  return result;
+}
+
+static bool
+path_list(PyObject* paths, std::vector<std::string>* result) {
+  PyObject* iter = PyObject_GetIter(paths);
+  if (iter == NULL) {
+    return false;
+  }
+  PyObject* item;
+  while ((item = PyIter_Next(iter)) != NULL) {
+    PyObject* bytes;
+    int ok = PyUnicode_FSConverter(item, &bytes);
+    Py_DECREF(item);
+    if (!ok) {
+      Py_DECREF(iter);
+      return false;
+    }
+    result->emplace_back(PyBytes_AS_STRING(bytes), PyBytes_GET_SIZE(bytes));
+    Py_DECREF(bytes);
+  }
+  Py_DECREF(iter);
+  return !PyErr_Occurred();
+}
+
+static PyObject*
+module_merge(PyObject*, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {"output", "inputs", "threads", NULL};
+  PyObject* output_bytes;
+  PyObject* inputs_py;
+  Py_ssize_t n_threads = 0;
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "O&O|n", const_cast<char**>(keywords),
+        PyUnicode_FSConverter, &output_bytes, &inputs_py, &n_threads)) {
+    return NULL;
+  }
+  std::string output(
+      PyBytes_AS_STRING(output_bytes), PyBytes_GET_SIZE(output_bytes));
+  Py_DECREF(output_bytes);
+
+  std::vector<std::string> inputs;
+  if (!path_list(inputs_py, &inputs)) {
+    return NULL;
+  }
+  if (n_threads < 0) {
+    PyErr_SetString(PyExc_ValueError, "threads must be non-negative");
+    return NULL;
+  }
+
+  std::string error;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    MergeDumps(inputs, output, n_threads);
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  if (!error.empty()) {
+    PyErr_SetString(PyExc_OSError, error.c_str());
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+module_snapshot(PyObject* m, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {"path", "delta", "slice_us", NULL};
+  PyObject* path_bytes;
+  int delta = 0;
+  Py_ssize_t slice_us = 1000;
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "O&|pn", const_cast<char**>(keywords),
+        PyUnicode_FSConverter, &path_bytes, &delta, &slice_us)) {
+    return NULL;
+  }
+  std::string path(PyBytes_AS_STRING(path_bytes), PyBytes_GET_SIZE(path_bytes));
+  Py_DECREF(path_bytes);
+  if (slice_us < 0) {
+    PyErr_SetString(PyExc_ValueError, "slice_us must be non-negative");
+    return NULL;
+  }
+
+  Module* mod = (Module*)PyModule_GetState(m);
+  ProfileData data = mod->snapshot(true, std::chrono::microseconds(slice_us));
+  ProfileData base;
+  if (delta) {
+    std::swap(base, mod->dump_base());
+  }
+
+  std::string error;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    WriteDumpAtomic(delta ? SubtractProfiles(data, base) : data, path);
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  if (delta) {
+    mod->dump_base() = error.empty() ? std::move(data) : std::move(base);
+  }
+  if (!error.empty()) {
+    PyErr_SetString(PyExc_OSError, error.c_str());
     return NULL;
   }
+  Py_RETURN_NONE;
+}
 
-  return mod->dump(bytes_data);
+static PyObject*
+module_install_signals(PyObject* m, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {"directory", "toggle", "dump", NULL};
+  PyObject* directory_bytes;
+  int toggle = SIGUSR1;
+  int dump = SIGUSR2;
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "O&|ii", const_cast<char**>(keywords),
+        PyUnicode_FSConverter, &directory_bytes, &toggle, &dump)) {
+    return NULL;
+  }
+  std::string directory(
+      PyBytes_AS_STRING(directory_bytes), PyBytes_GET_SIZE(directory_bytes));
+  Py_DECREF(directory_bytes);
+  if (toggle < 0 || toggle >= NSIG || dump < 0 || dump >= NSIG ||
+      (toggle != 0 && toggle == dump)) {
+    PyErr_SetString(PyExc_ValueError, "invalid signal numbers");
+    return NULL;
+  }
+
+  Module* mod = (Module*)PyModule_GetState(m);
+  try {
+    InstallSignalHandlers(mod, toggle, dump, directory);
+  } catch (const std::exception& e) {
+    PyErr_SetString(PyExc_OSError, e.what());
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+module_remove_signals(PyObject*, PyObject*) {
+  RemoveSignalHandlers();
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+module_configure(PyObject* m, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {
+    "clock", "lines", "include", "exclude", NULL};
+  const char* clock = nullptr;
+  PyObject* lines = Py_None;
+  PyObject* include_py = Py_None;
+  PyObject* exclude_py = Py_None;
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "|zOOO", const_cast<char**>(keywords),
+        &clock, &lines, &include_py, &exclude_py)) {
+    return NULL;
+  }
+  Module* mod = (Module*)PyModule_GetState(m);
+  if ((clock != nullptr || lines != Py_None) && mod->running()) {
+    PyErr_SetString(PyExc_ValueError,
+                    "clock and lines cannot change while profiling");
+    return NULL;
+  }
+
+  ClockKind clock_kind = ClockKind::kWall;
+  if (clock != nullptr) {
+    if (std::strcmp(clock, "wall") == 0) {
+      clock_kind = ClockKind::kWall;
+    } else if (std::strcmp(clock, "cpu") == 0) {
+      clock_kind = ClockKind::kCpu;
+    } else {
+      PyErr_SetString(PyExc_ValueError, "clock must be 'wall' or 'cpu'");
+      return NULL;
+    }
+  }
+  int line_events = lines == Py_None ? 0 : PyObject_IsTrue(lines);
+  if (line_events < 0) {
+    return NULL;
+  }
+  std::vector<std::string> include;
+  std::vector<std::string> exclude;
+  if ((include_py != Py_None && !path_list(include_py, &include)) ||
+      (exclude_py != Py_None && !path_list(exclude_py, &exclude))) {
+    return NULL;
+  }
+
+  try {
+    if (clock != nullptr) {
+      mod->set_clock(clock_kind);
+    }
+    if (lines != Py_None) {
+      mod->set_line_events(line_events);
+    }
+  } catch (const ThreadError& e) {
+    PyErr_SetString(PyExc_RuntimeError, e.what());
+    return NULL;
+  }
+  if (include_py != Py_None || exclude_py != Py_None) {
+    mod->set_filters(std::move(include), std::move(exclude));
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+module_set_limits(PyObject* m, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {"max_functions", "max_lines", NULL};
+  Py_ssize_t max_functions = 0;
+  Py_ssize_t max_lines = 0;
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "|nn", const_cast<char**>(keywords),
+        &max_functions, &max_lines)) {
+    return NULL;
+  }
+  if (max_functions < 0 || max_lines < 0) {
+    PyErr_SetString(PyExc_ValueError, "limits must be non-negative");
+    return NULL;
+  }
+  Module* mod = (Module*)PyModule_GetState(m);
+  mod->set_limits(max_functions, max_lines);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+module_set_native(PyObject* m, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {"interval_us", NULL};
+  Py_ssize_t interval_us = 0;
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "|n", const_cast<char**>(keywords), &interval_us)) {
+    return NULL;
+  }
+  if (interval_us < 0) {
+    PyErr_SetString(PyExc_ValueError, "interval_us must be non-negative");
+    return NULL;
+  }
+  Module* mod = (Module*)PyModule_GetState(m);
+  if (mod->running()) {
+    PyErr_SetString(PyExc_ValueError,
+                    "native sampling cannot change while profiling");
+    return NULL;
+  }
+  try {
+    mod->set_native(std::chrono::microseconds(interval_us));
+  } catch (const ThreadError& e) {
+    PyErr_SetString(PyExc_RuntimeError, e.what());
+    return NULL;
+  } catch (const std::exception& e) {
+    PyErr_SetString(PyExc_OSError, e.what());
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+module_set_gil(PyObject* m, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {"enabled", NULL};
+  int enabled = 1;
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "|p", const_cast<char**>(keywords), &enabled)) {
+    return NULL;
+  }
+  Module* mod = (Module*)PyModule_GetState(m);
+  if (mod->running()) {
+    PyErr_SetString(PyExc_ValueError,
+                    "GIL accounting cannot change while profiling");
+    return NULL;
+  }
+  try {
+    mod->set_gil(enabled);
+  } catch (const ThreadError& e) {
+    PyErr_SetString(PyExc_RuntimeError, e.what());
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+module_set_opcodes(PyObject* m, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {"functions", NULL};
+  PyObject* functions;
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "O", const_cast<char**>(keywords), &functions)) {
+    return NULL;
+  }
+  Module* mod = (Module*)PyModule_GetState(m);
+  if (mod->running()) {
+    PyErr_SetString(PyExc_ValueError,
+                    "opcodes cannot change while profiling");
+    return NULL;
+  }
+  PyObject* iter = PyObject_GetIter(functions);
+  if (iter == NULL) {
+    return NULL;
+  }
+  // Items are name patterns, code objects or anything with a __code__.
+  std::vector<PyCodeObject*> codes;
+  std::vector<std::string> names;
+  std::vector<PyObject*> owned;
+  PyObject* item;
+  bool ok = true;
+  while (ok && (item = PyIter_Next(iter)) != NULL) {
+    owned.push_back(item);
+    if (PyUnicode_Check(item)) {
+      Py_ssize_t size;
+      const char* name = PyUnicode_AsUTF8AndSize(item, &size);
+      ok = name != NULL;
+      if (ok) {
+        names.emplace_back(name, size);
+      }
+      continue;
+    }
+    PyObject* code = item;
+    if (!PyCode_Check(item)) {
+      code = PyObject_GetAttrString(item, "__code__");
+      if (code == NULL || !PyCode_Check(code)) {
+        Py_XDECREF(code);
+        PyErr_Format(PyExc_TypeError,
+                     "expected a name pattern, function or code object, "
+                     "not %.200s", Py_TYPE(item)->tp_name);
+        ok = false;
+        continue;
+      }
+      owned.push_back(code);
+    }
+    codes.push_back(reinterpret_cast<PyCodeObject*>(code));
+  }
+  Py_DECREF(iter);
+  ok = ok && !PyErr_Occurred();
+  if (ok) {
+    try {
+      mod->set_opcodes(std::move(codes), std::move(names));
+    } catch (const ThreadError& e) {
+      PyErr_SetString(PyExc_RuntimeError, e.what());
+      ok = false;
+    }
+  }
+  for (auto object : owned) {
+    Py_DECREF(object);
+  }
+  if (!ok) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+module_set_timeline(PyObject* m, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {"max_events", "threshold_us", NULL};
+  Py_ssize_t max_events = 0;
+  Py_ssize_t threshold_us = 0;
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "|nn", const_cast<char**>(keywords),
+        &max_events, &threshold_us)) {
+    return NULL;
+  }
+  if (max_events < 0 || threshold_us < 0) {
+    PyErr_SetString(PyExc_ValueError,
+                    "max_events and threshold_us must be non-negative");
+    return NULL;
+  }
+  Module* mod = (Module*)PyModule_GetState(m);
+  mod->set_timeline(max_events, std::chrono::microseconds(threshold_us));
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+module_write_timeline(PyObject* m, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {"path", "format", NULL};
+  PyObject* bytes;
+  const char* format = "chrome";
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "O&|s", const_cast<char**>(keywords),
+        PyUnicode_FSConverter, &bytes, &format)) {
+    return NULL;
+  }
+  std::string path(PyBytes_AS_STRING(bytes), PyBytes_GET_SIZE(bytes));
+  Py_DECREF(bytes);
+  void (*write)(const TimelineData&, const std::string&);
+  if (std::strcmp(format, "chrome") == 0) {
+    write = WriteChromeTrace;
+  } else if (std::strcmp(format, "speedscope") == 0) {
+    write = WriteSpeedscopeTimeline;
+  } else {
+    PyErr_SetString(PyExc_ValueError,
+                    "format must be 'chrome' or 'speedscope'");
+    return NULL;
+  }
+
+  Module* mod = (Module*)PyModule_GetState(m);
+  TimelineData data = mod->timeline();
+  std::string error;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    write(data, path);
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  if (!error.empty()) {
+    PyErr_SetString(PyExc_OSError, error.c_str());
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+module_stats(PyObject* m, PyObject*) {
+  Module* mod = (Module*)PyModule_GetState(m);
+  return mod->stats();
+}
+
+static PyObject*
+module_tables(PyObject* m, PyObject*) {
+  Module* mod = (Module*)PyModule_GetState(m);
+  auto data = std::make_shared<const ProfileData>(mod->snapshot(false));
+  return CreateTablesDict(std::move(data));
+}
+
+static PyObject*
+module_load(PyObject*, PyObject* args) {
+  PyObject* bytes;
+  if (!PyArg_ParseTuple(args, "O&", PyUnicode_FSConverter, &bytes)) {
+    return NULL;
+  }
+  std::string path(PyBytes_AS_STRING(bytes), PyBytes_GET_SIZE(bytes));
+  Py_DECREF(bytes);
+
+  std::shared_ptr<const ProfileData> data;
+  try {
+    data = std::make_shared<const ProfileData>(ReadDump(path));
+  } catch (const std::exception& e) {
+    PyErr_SetString(PyExc_OSError, e.what());
+    return NULL;
+  }
+  return CreateTablesDict(std::move(data));
+}
+
+static int
+set_item(PyObject* dict, const char* key, PyObject* value) {
+  if (value == NULL) {
+    return -1;
+  }
+  int result = PyDict_SetItemString(dict, key, value);
+  Py_DECREF(value);
+  return result;
+}
+
+static PyObject*
+optional_u64(uint64_t row, uint64_t value) {
+  if (row == DeltaRow::kMissing) {
+    Py_RETURN_NONE;
+  }
+  return PyLong_FromUnsignedLongLong(value);
+}
+
+static PyObject*
+utf8(std::string_view str) {
+  return PyUnicode_DecodeUTF8(str.data(), str.size(), "replace");
+}
+
+static int
+set_stats(PyObject* dict, const DeltaRow& row) {
+  return set_item(dict, "calls_a", optional_u64(row.a, row.calls_a)) ||
+      set_item(dict, "calls_b", optional_u64(row.b, row.calls_b)) ||
+      set_item(dict, "self_ns_a", optional_u64(row.a, row.self_ns_a)) ||
+      set_item(dict, "self_ns_b", optional_u64(row.b, row.self_ns_b)) ||
+      set_item(dict, "total_ns_a", optional_u64(row.a, row.total_ns_a)) ||
+      set_item(dict, "total_ns_b", optional_u64(row.b, row.total_ns_b));
+}
+
+static PyObject*
+create_function_delta(
+    const DeltaRow& row, const ProfileData& a, const ProfileData& b) {
+  bool in_b = row.b != DeltaRow::kMissing;
+  const FunctionTable& f = in_b ? b.functions : a.functions;
+  size_t i = in_b ? row.b : row.a;
+
+  PyObject* dict = PyDict_New();
+  if (dict == NULL ||
+      set_item(dict, "name", utf8(f.name[i])) ||
+      set_item(dict, "filename", utf8(f.filename[i])) ||
+      set_item(dict, "first_line_a",
+               optional_u64(row.a, row.a == DeltaRow::kMissing ?
+                            0 : a.functions.first_line[row.a])) ||
+      set_item(dict, "first_line_b",
+               optional_u64(row.b, row.b == DeltaRow::kMissing ?
+                            0 : b.functions.first_line[row.b])) ||
+      set_stats(dict, row)) {
+    Py_XDECREF(dict);
+    return NULL;
+  }
+  return dict;
+}
+
+static PyObject*
+create_line_delta(
+    const DeltaRow& row, const ProfileData& a, const ProfileData& b) {
+  bool in_b = row.b != DeltaRow::kMissing;
+  const ProfileData& data = in_b ? b : a;
+  size_t i = in_b ? row.b : row.a;
+  size_t function = data.lines.function[i];
+
+  PyObject* dict = PyDict_New();
+  if (dict == NULL ||
+      set_item(dict, "name", utf8(data.functions.name[function])) ||
+      set_item(dict, "filename", utf8(data.functions.filename[function])) ||
+      set_item(dict, "text", utf8(data.line_text(i))) ||
+      set_item(dict, "line_a",
+               optional_u64(row.a, row.a == DeltaRow::kMissing ?
+                            0 : a.lines.line_number[row.a])) ||
+      set_item(dict, "line_b",
+               optional_u64(row.b, row.b == DeltaRow::kMissing ?
+                            0 : b.lines.line_number[row.b])) ||
+      set_stats(dict, row)) {
+    Py_XDECREF(dict);
+    return NULL;
+  }
+  return dict;
+}
+
+template <typename Create>
+static PyObject*
+create_delta_list(
+    const std::vector<DeltaRow>& rows, const ProfileData& a,
+    const ProfileData& b, Create create) {
+  PyObject* list = PyList_New(rows.size());
+  if (list == NULL) {
+    return NULL;
+  }
+  size_t i = 0;
+  for (auto&& row : rows) {
+    PyObject* item = create(row, a, b);
+    if (item == NULL) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i++, item);
+  }
+  return list;
+}
+
+static bool
+parse_diff_key(const char* key_str, DiffKey* key) {
+  if (std::strcmp(key_str, "self") == 0) {
+    *key = DiffKey::kSelf;
+  } else if (std::strcmp(key_str, "total") == 0) {
+    *key = DiffKey::kTotal;
+  } else if (std::strcmp(key_str, "calls") == 0) {
+    *key = DiffKey::kCalls;
+  } else {
+    PyErr_SetString(PyExc_ValueError,
+                    "key must be 'self', 'total' or 'calls'");
+    return false;
+  }
+  return true;
+}
+
+static PyObject*
+module_diff(PyObject*, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {"a", "b", "key", "limit", NULL};
+  PyObject* a_bytes;
+  PyObject* b_bytes;
+  const char* key_str = "self";
+  Py_ssize_t limit = 0;
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "O&O&|sn", const_cast<char**>(keywords),
+        PyUnicode_FSConverter, &a_bytes, PyUnicode_FSConverter, &b_bytes,
+        &key_str, &limit)) {
+    return NULL;
+  }
+  std::string a_path(PyBytes_AS_STRING(a_bytes), PyBytes_GET_SIZE(a_bytes));
+  std::string b_path(PyBytes_AS_STRING(b_bytes), PyBytes_GET_SIZE(b_bytes));
+  Py_DECREF(a_bytes);
+  Py_DECREF(b_bytes);
+
+  DiffKey key;
+  if (!parse_diff_key(key_str, &key)) {
+    return NULL;
+  }
+  if (limit < 0) {
+    PyErr_SetString(PyExc_ValueError, "limit must be non-negative");
+    return NULL;
+  }
+
+  ProfileData a;
+  ProfileData b;
+  ProfileDiff diff;
+  std::string error;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    a = ReadDump(a_path);
+    b = ReadDump(b_path);
+    diff = DiffProfiles(a, b);
+    RankDeltas(diff.functions, key, limit);
+    RankDeltas(diff.lines, key, limit);
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  if (!error.empty()) {
+    PyErr_SetString(PyExc_OSError, error.c_str());
+    return NULL;
+  }
+
+  PyObject* result = PyDict_New();
+  if (result == NULL ||
+      set_item(result, "functions", create_delta_list(
+          diff.functions, a, b, create_function_delta)) ||
+      set_item(result, "lines", create_delta_list(
+          diff.lines, a, b, create_line_delta))) {
+    Py_XDECREF(result);
+    return NULL;
+  }
+  return result;
+}
+
+static PyObject*
+create_report_line(const MappedDump& dump, uint64_t row) {
+  auto functions = dump.records<DumpFunction>(DumpSection::kFunctions);
+  const DumpLine& line = dump.records<DumpLine>(DumpSection::kLines)[row];
+  if (line.function >= functions.size()) {
+    throw std::runtime_error("Corrupt bprof dump line");
+  }
+  const DumpFunction& function = functions[line.function];
+  PyObject* dict = PyDict_New();
+  if (dict == NULL ||
+      set_item(dict, "name", utf8(dump.string(function.name))) ||
+      set_item(dict, "filename", utf8(dump.string(function.filename))) ||
+      set_item(dict, "line_number",
+               PyLong_FromUnsignedLongLong(line.line_number)) ||
+      set_item(dict, "n_calls", PyLong_FromUnsignedLongLong(line.n_calls)) ||
+      set_item(dict, "internal_ns",
+               PyLong_FromUnsignedLongLong(line.internal_ns)) ||
+      set_item(dict, "external_ns",
+               PyLong_FromUnsignedLongLong(line.external_ns)) ||
+      set_item(dict, "text", utf8(dump.string(line.text)))) {
+    Py_XDECREF(dict);
+    return NULL;
+  }
+  return dict;
+}
+
+static PyObject*
+create_report_native(const MappedDump& dump, uint64_t row) {
+  auto c_functions = dump.records<DumpCFunction>(DumpSection::kCFunctions);
+  auto frames = dump.records<DumpString>(DumpSection::kNativeFrames);
+  const DumpNativeStack& stack =
+      dump.records<DumpNativeStack>(DumpSection::kNativeStacks)[row];
+  if (stack.c_function >= c_functions.size() ||
+      stack.frame_begin > frames.size() ||
+      stack.frame_count > frames.size() - stack.frame_begin) {
+    throw std::runtime_error("Corrupt bprof dump native stack");
+  }
+  PyObject* dict = PyDict_New();
+  PyObject* frames_py = PyList_New(stack.frame_count);
+  if (set_item(dict, "frames", frames_py) ||
+      set_item(dict, "name",
+               utf8(dump.string(c_functions[stack.c_function].name))) ||
+      set_item(dict, "samples", PyLong_FromUnsignedLongLong(stack.samples)) ||
+      set_item(dict, "ns", PyLong_FromUnsignedLongLong(stack.ns))) {
+    Py_XDECREF(dict);
+    return NULL;
+  }
+  for (uint64_t i = 0; i < stack.frame_count; ++i) {
+    PyObject* frame = utf8(dump.string(frames[stack.frame_begin + i]));
+    if (frame == NULL) {
+      Py_DECREF(dict);
+      return NULL;
+    }
+    PyList_SET_ITEM(frames_py, i, frame);
+  }
+  return dict;
+}
+
+static PyObject*
+create_report_gil_wait(const MappedDump& dump, uint64_t row) {
+  auto functions = dump.records<DumpFunction>(DumpSection::kFunctions);
+  auto waits = dump.records<DumpGilWait>(DumpSection::kGilWaits,
+                                        offsetof(DumpGilWait, off_cpu_ns));
+  const DumpGilWait& wait = waits[row];
+  uint64_t off_cpu_ns =
+      waits.covers(offsetof(DumpGilWait, off_cpu_ns) + sizeof(uint64_t)) ?
+      wait.off_cpu_ns : 0;
+  if (wait.function >= functions.size()) {
+    throw std::runtime_error("Corrupt bprof dump GIL wait");
+  }
+  const DumpFunction& function = functions[wait.function];
+  PyObject* dict = PyDict_New();
+  if (dict == NULL ||
+      set_item(dict, "name", utf8(dump.string(function.name))) ||
+      set_item(dict, "filename", utf8(dump.string(function.filename))) ||
+      set_item(dict, "line_number",
+               PyLong_FromUnsignedLongLong(wait.line_number)) ||
+      set_item(dict, "n_waits", PyLong_FromUnsignedLongLong(wait.n_waits)) ||
+      set_item(dict, "wait_ns", PyLong_FromUnsignedLongLong(wait.wait_ns)) ||
+      set_item(dict, "off_cpu_ns", PyLong_FromUnsignedLongLong(off_cpu_ns))) {
+    Py_XDECREF(dict);
+    return NULL;
+  }
+  return dict;
+}
+
+// Every thread's GIL totals, longest wait first. hold_exact is false where
+// the thread's switches were not all seen, or the dump predates checking.
+static PyObject*
+create_report_gil_threads(const MappedDump& dump) {
+  auto threads = dump.records<DumpGilThread>(
+      DumpSection::kGilThreads, offsetof(DumpGilThread, profiled_ns));
+  bool has_spans = threads.covers(sizeof(DumpGilThread));
+  std::vector<size_t> order(threads.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return threads[a].wait_ns > threads[b].wait_ns;
+  });
+  PyObject* list = PyList_New(order.size());
+  for (size_t i = 0; list != NULL && i < order.size(); ++i) {
+    const DumpGilThread& thread = threads[order[i]];
+    bool exact = has_spans && thread.hold_exact != 0;
+    uint64_t off_cpu_ns = 0;
+    if (has_spans && thread.profiled_ns > thread.cpu_ns) {
+      off_cpu_ns = thread.profiled_ns - thread.cpu_ns;
+    }
+    PyObject* dict = PyDict_New();
+    if (dict == NULL ||
+        set_item(dict, "thread_id",
+                 PyLong_FromUnsignedLongLong(thread.thread_id)) ||
+        set_item(dict, "n_waits", PyLong_FromUnsignedLongLong(thread.n_waits)) ||
+        set_item(dict, "wait_ns", PyLong_FromUnsignedLongLong(thread.wait_ns)) ||
+        set_item(dict, "hold_ns", PyLong_FromUnsignedLongLong(thread.hold_ns)) ||
+        set_item(dict, "hold_exact", PyBool_FromLong(exact)) ||
+        set_item(dict, "off_cpu_ns", PyLong_FromUnsignedLongLong(off_cpu_ns))) {
+      Py_XDECREF(dict);
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i, dict);
+  }
+  return list;
+}
+
+// The rows of opcodes belonging to function, which are sorted by function.
+static std::pair<size_t, size_t>
+opcode_rows(const MappedDump::Records<DumpOpcode>& opcodes, uint64_t function) {
+  size_t begin = 0;
+  size_t end = opcodes.size();
+  while (begin < end) {
+    size_t middle = begin + (end - begin) / 2;
+    if (opcodes[middle].function < function) {
+      begin = middle + 1;
+    } else {
+      end = middle;
+    }
+  }
+  end = begin;
+  while (end < opcodes.size() && opcodes[end].function == function) {
+    ++end;
+  }
+  return {begin, end};
+}
+
+// The instructions of rows that belong to line_number, in offset order.
+static PyObject*
+create_report_opcodes(const MappedDump::Records<DumpOpcode>& opcodes,
+                      std::pair<size_t, size_t> rows, uint64_t line_number) {
+  PyObject* list = PyList_New(0);
+  if (list == NULL) {
+    return NULL;
+  }
+  for (size_t i = rows.first; i < rows.second; ++i) {
+    const DumpOpcode& opcode = opcodes[i];
+    if (opcode.line_number != line_number) {
+      continue;
+    }
+    PyObject* dict = PyDict_New();
+    if (dict == NULL ||
+        set_item(dict, "offset", PyLong_FromUnsignedLongLong(opcode.offset)) ||
+        set_item(dict, "opcode", PyLong_FromUnsignedLongLong(opcode.opcode)) ||
+        set_item(dict, "n_calls",
+                 PyLong_FromUnsignedLongLong(opcode.n_calls)) ||
+        set_item(dict, "internal_ns",
+                 PyLong_FromUnsignedLongLong(opcode.internal_ns)) ||
+        set_item(dict, "external_ns",
+                 PyLong_FromUnsignedLongLong(opcode.external_ns)) ||
+        PyList_Append(list, dict)) {
+      Py_XDECREF(dict);
+      Py_DECREF(list);
+      return NULL;
+    }
+    Py_DECREF(dict);
+  }
+  return list;
+}
+
+static PyObject*
+create_report_function(
+    const MappedDump& dump, const FunctionSummary& summary, bool annotate) {
+  const DumpFunction& function =
+      dump.records<DumpFunction>(DumpSection::kFunctions)[summary.function];
+  PyObject* dict = PyDict_New();
+  if (dict == NULL ||
+      set_item(dict, "name", utf8(dump.string(function.name))) ||
+      set_item(dict, "filename", utf8(dump.string(function.filename))) ||
+      set_item(dict, "first_line",
+               PyLong_FromUnsignedLongLong(function.first_line)) ||
+      set_item(dict, "n_calls", PyLong_FromUnsignedLongLong(summary.n_calls)) ||
+      set_item(dict, "self_ns", PyLong_FromUnsignedLongLong(summary.self_ns)) ||
+      set_item(dict, "total_ns",
+               PyLong_FromUnsignedLongLong(summary.total_ns))) {
+    Py_XDECREF(dict);
+    return NULL;
+  }
+  if (!annotate) {
+    return dict;
+  }
+  PyObject* lines = PyList_New(function.line_count);
+  if (set_item(dict, "lines", lines)) {
+    Py_DECREF(dict);
+    return NULL;
+  }
+  // Functions traced per opcode break each line down by instruction.
+  auto opcodes = dump.records<DumpOpcode>(DumpSection::kOpcodes);
+  auto rows = opcode_rows(opcodes, summary.function);
+  auto records = dump.records<DumpLine>(DumpSection::kLines);
+  for (uint64_t i = 0; i < function.line_count; ++i) {
+    PyObject* line = create_report_line(dump, function.line_begin + i);
+    if (line == NULL) {
+      Py_DECREF(dict);
+      return NULL;
+    }
+    PyList_SET_ITEM(lines, i, line);
+    if (rows.first != rows.second &&
+        set_item(line, "opcodes", create_report_opcodes(
+            opcodes, rows, records[function.line_begin + i].line_number))) {
+      Py_DECREF(dict);
+      return NULL;
+    }
+  }
+  return dict;
+}
+
+static PyObject*
+module_report(PyObject*, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {"path", "key", "limit", "annotate", NULL};
+  PyObject* path_bytes;
+  const char* key_str = "self";
+  Py_ssize_t limit = 20;
+  Py_ssize_t annotate = 3;
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "O&|snn", const_cast<char**>(keywords),
+        PyUnicode_FSConverter, &path_bytes, &key_str, &limit, &annotate)) {
+    return NULL;
+  }
+  std::string path(PyBytes_AS_STRING(path_bytes), PyBytes_GET_SIZE(path_bytes));
+  Py_DECREF(path_bytes);
+  DiffKey key;
+  if (!parse_diff_key(key_str, &key)) {
+    return NULL;
+  }
+  if (limit < 0 || annotate < 0) {
+    PyErr_SetString(PyExc_ValueError, "limit and annotate must be non-negative");
+    return NULL;
+  }
+
+  std::unique_ptr<MappedDump> dump;
+  Report report;
+  std::string error;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    dump = std::make_unique<MappedDump>(path);
+    report = BuildReport(*dump, key, limit);
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  if (!error.empty()) {
+    PyErr_SetString(PyExc_OSError, error.c_str());
+    return NULL;
+  }
+
+  try {
+    PyObject* functions = PyList_New(report.functions.size());
+    PyObject* lines = PyList_New(report.lines.size());
+    PyObject* native = PyList_New(report.native.size());
+    PyObject* gil_waits = PyList_New(report.gil_waits.size());
+    PyObject* result = PyDict_New();
+    if (set_item(result, "functions", functions) ||
+        set_item(result, "lines", lines) ||
+        set_item(result, "native", native) ||
+        set_item(result, "gil_waits", gil_waits) ||
+        set_item(result, "gil_threads", create_report_gil_threads(*dump))) {
+      Py_XDECREF(result);
+      return NULL;
+    }
+    for (size_t i = 0; i < report.functions.size(); ++i) {
+      PyObject* function = create_report_function(
+          *dump, report.functions[i], i < size_t(annotate));
+      if (function == NULL) {
+        Py_DECREF(result);
+        return NULL;
+      }
+      PyList_SET_ITEM(functions, i, function);
+    }
+    for (size_t i = 0; i < report.lines.size(); ++i) {
+      PyObject* line = create_report_line(*dump, report.lines[i]);
+      if (line == NULL) {
+        Py_DECREF(result);
+        return NULL;
+      }
+      PyList_SET_ITEM(lines, i, line);
+    }
+    for (size_t i = 0; i < report.native.size(); ++i) {
+      PyObject* stack = create_report_native(*dump, report.native[i]);
+      if (stack == NULL) {
+        Py_DECREF(result);
+        return NULL;
+      }
+      PyList_SET_ITEM(native, i, stack);
+    }
+    for (size_t i = 0; i < report.gil_waits.size(); ++i) {
+      PyObject* wait = create_report_gil_wait(*dump, report.gil_waits[i]);
+      if (wait == NULL) {
+        Py_DECREF(result);
+        return NULL;
+      }
+      PyList_SET_ITEM(gil_waits, i, wait);
+    }
+    return result;
+  } catch (const std::exception& e) {
+    PyErr_SetString(PyExc_OSError, e.what());
+    return NULL;
+  }
+}
+
+// Reads the dump at the first path argument and hands it to write along
+// with the second, without the GIL.
+static PyObject*
+export_dump(PyObject* args, void (*write)(const ProfileData&, const std::string&)) {
+  PyObject* path_bytes;
+  PyObject* output_bytes;
+  if (!PyArg_ParseTuple(args, "O&O&", PyUnicode_FSConverter, &path_bytes,
+                        PyUnicode_FSConverter, &output_bytes)) {
+    return NULL;
+  }
+  std::string path(PyBytes_AS_STRING(path_bytes), PyBytes_GET_SIZE(path_bytes));
+  std::string output(PyBytes_AS_STRING(output_bytes),
+                     PyBytes_GET_SIZE(output_bytes));
+  Py_DECREF(path_bytes);
+  Py_DECREF(output_bytes);
+
+  std::string error;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    write(ReadDump(path), output);
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  if (!error.empty()) {
+    PyErr_SetString(PyExc_OSError, error.c_str());
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+module_export_pstats(PyObject*, PyObject* args) {
+  return export_dump(args, WritePstats);
+}
+
+static PyObject*
+module_export_callgrind(PyObject*, PyObject* args) {
+  return export_dump(args, WriteCallgrind);
+}
+
+static PyObject*
+module_export_speedscope(PyObject*, PyObject* args) {
+  return export_dump(args, WriteSpeedscopeProfile);
+}
+
+static PyObject*
+module_export_pprof(PyObject*, PyObject* args) {
+  return export_dump(args, WritePprof);
+}
+
+static PyObject*
+module_html(PyObject*, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {"path", "output", "limit", NULL};
+  PyObject* path_bytes;
+  PyObject* output_bytes;
+  Py_ssize_t limit = 100;
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "O&O&|n", const_cast<char**>(keywords),
+        PyUnicode_FSConverter, &path_bytes,
+        PyUnicode_FSConverter, &output_bytes, &limit)) {
+    return NULL;
+  }
+  std::string path(PyBytes_AS_STRING(path_bytes), PyBytes_GET_SIZE(path_bytes));
+  std::string output(PyBytes_AS_STRING(output_bytes),
+                     PyBytes_GET_SIZE(output_bytes));
+  Py_DECREF(path_bytes);
+  Py_DECREF(output_bytes);
+  if (limit < 0) {
+    PyErr_SetString(PyExc_ValueError, "limit must be non-negative");
+    return NULL;
+  }
+
+  std::string error;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    MappedDump dump(path);
+    WriteHtmlReport(dump, output, limit);
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  if (!error.empty()) {
+    PyErr_SetString(PyExc_OSError, error.c_str());
+    return NULL;
+  }
+  Py_RETURN_NONE;
 }
 
 PyDoc_STRVAR(module_doc,
@@ -48,8 +1154,84 @@ static PyMethodDef module_methods[] = {
         PyDoc_STR("start() -> None")},
     {"stop", module_stop, METH_NOARGS,
         PyDoc_STR("stop() -> None")},
+    {"enable", module_enable, METH_NOARGS,
+        PyDoc_STR("enable() -> None; resumes profiling, nests")},
+    {"disable", module_disable, METH_NOARGS,
+        PyDoc_STR("disable() -> None; pauses profiling, nests")},
     {"dump", module_dump, METH_VARARGS,
         PyDoc_STR("dump() -> None")},
+    {"diff", (PyCFunction)(void(*)(void))module_diff,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("diff(a, b, key='self', limit=0) -> dict of ranked deltas")},
+    {"load", module_load, METH_VARARGS,
+        PyDoc_STR("load(path) -> dict of buffer-protocol columns")},
+    {"merge", (PyCFunction)(void(*)(void))module_merge,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("merge(output, inputs, threads=0) -> None")},
+    {"snapshot", (PyCFunction)(void(*)(void))module_snapshot,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("snapshot(path, delta=False, slice_us=1000) -> None; "
+                  "writes a dump atomically, holding the GIL for at most "
+                  "slice_us at a time while copying")},
+    {"configure", (PyCFunction)(void(*)(void))module_configure,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("configure(clock=None, lines=None, include=None, "
+                  "exclude=None) -> None; clock is 'wall' or 'cpu', None "
+                  "leaves a setting unchanged")},
+    {"export_pstats", module_export_pstats, METH_VARARGS,
+        PyDoc_STR("export_pstats(path, output) -> None; writes a dump in "
+                  "the marshal format pstats.Stats loads")},
+    {"export_callgrind", module_export_callgrind, METH_VARARGS,
+        PyDoc_STR("export_callgrind(path, output) -> None; writes a dump "
+                  "in the Callgrind format for KCachegrind")},
+    {"export_pprof", module_export_pprof, METH_VARARGS,
+        PyDoc_STR("export_pprof(path, output) -> None; writes a dump as "
+                  "gzip-compressed pprof profile.proto")},
+    {"export_speedscope", module_export_speedscope, METH_VARARGS,
+        PyDoc_STR("export_speedscope(path, output) -> None; writes a dump "
+                  "as a sampled speedscope profile")},
+    {"html", (PyCFunction)(void(*)(void))module_html,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("html(path, output, limit=100) -> None; writes a "
+                  "self-contained HTML report of a dump")},
+    {"install_signals", (PyCFunction)(void(*)(void))module_install_signals,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("install_signals(directory, toggle=SIGUSR1, dump=SIGUSR2) "
+                  "-> None; 0 leaves a signal unbound")},
+    {"remove_signals", module_remove_signals, METH_NOARGS,
+        PyDoc_STR("remove_signals() -> None")},
+    {"report", (PyCFunction)(void(*)(void))module_report,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("report(path, key='self', limit=20, annotate=3) -> dict of "
+                  "the hottest functions and lines of a mapped dump")},
+    {"set_gil", (PyCFunction)(void(*)(void))module_set_gil,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("set_gil(enabled=True) -> None; times waits to reacquire "
+                  "the GIL per line and per thread")},
+    {"set_limits", (PyCFunction)(void(*)(void))module_set_limits,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("set_limits(max_functions=0, max_lines=0) -> None")},
+    {"set_native", (PyCFunction)(void(*)(void))module_set_native,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("set_native(interval_us=0) -> None; samples the native "
+                  "stacks of C calls on the calling thread every interval "
+                  "of the profiling clock, 0 stops")},
+    {"set_opcodes", (PyCFunction)(void(*)(void))module_set_opcodes,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("set_opcodes(functions) -> None; traces the given "
+                  "functions, code objects and fnmatch patterns on function "
+                  "names per instruction")},
+    {"set_timeline", (PyCFunction)(void(*)(void))module_set_timeline,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("set_timeline(max_events=0, threshold_us=0) -> None")},
+    {"stats", module_stats, METH_NOARGS,
+        PyDoc_STR("stats() -> dict describing the profiler's own cost")},
+    {"tables", module_tables, METH_NOARGS,
+        PyDoc_STR("tables() -> dict of buffer-protocol columns")},
+    {"write_timeline", (PyCFunction)(void(*)(void))module_write_timeline,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("write_timeline(path, format='chrome') -> None; writes the "
+                  "recorded calls as Chrome trace or speedscope JSON")},
     {NULL,              NULL}           /* sentinel */
 };
 
@@ -59,6 +1241,9 @@ static void module_free(void* m) {
   }
   Module* mod = (Module*)PyModule_GetState((PyObject*)m);
   if (mod != NULL) {
+    if (fork_module == mod) {
+      fork_module = nullptr;
+    }
     mod->~Module();
   }
 }
@@ -0,0 +1,174 @@
+#include "callgrind.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+constexpr std::string_view kBuiltinFile = "<built-in>";
+
+// Callgrind name compression: the first use of a name writes "(id) name",
+// later uses only "(id)".
+class NameIds {
+ public:
+  void write(std::string& out, std::string_view name) {
+    auto pair = ids_.emplace(name, ids_.size() + 1);
+    out += '(';
+    out += std::to_string(pair.first->second);
+    out += ')';
+    if (pair.second) {
+      out += ' ';
+      out.append(name.data(), name.size());
+    }
+    out += '\n';
+  }
+
+ private:
+  std::unordered_map<std::string, size_t> ids_;
+};
+
+class CallgrindWriter {
+ public:
+  explicit CallgrindWriter(const std::string& path)
+      : path_(path), file_(path, std::ios::binary | std::ios::trunc) {
+    if (!file_) {
+      throw std::runtime_error("Could not open `" + path + "' for writing");
+    }
+  }
+
+  void raw(std::string_view text) {
+    out_.append(text.data(), text.size());
+  }
+  void file(std::string_view key, std::string_view name) {
+    raw(key);
+    files_.write(out_, name);
+  }
+  void function(std::string_view key, std::string_view name) {
+    raw(key);
+    functions_.write(out_, name);
+  }
+  // A cost line: position followed by up to two event values; trailing
+  // zero events are left out.
+  void cost(uint64_t position, uint64_t time, uint64_t hits) {
+    char line[64];
+    int n = hits != 0 ?
+        std::snprintf(line, sizeof(line), "%llu %llu %llu\n",
+                      static_cast<unsigned long long>(position),
+                      static_cast<unsigned long long>(time),
+                      static_cast<unsigned long long>(hits)) :
+        std::snprintf(line, sizeof(line), "%llu %llu\n",
+                      static_cast<unsigned long long>(position),
+                      static_cast<unsigned long long>(time));
+    out_.append(line, n);
+    flush_if_full();
+  }
+  void calls(uint64_t count, uint64_t target) {
+    raw("calls=" + std::to_string(count) + " " + std::to_string(target) +
+        "\n");
+  }
+
+  void finish() {
+    flush();
+    file_.flush();
+    if (!file_) {
+      throw std::runtime_error("Could not write `" + path_ + "'");
+    }
+  }
+
+ private:
+  void flush_if_full() {
+    if (out_.size() >= (1 << 16)) {
+      flush();
+    }
+  }
+  void flush() {
+    file_.write(out_.data(), out_.size());
+    out_.clear();
+  }
+
+  std::string path_;
+  std::ofstream file_;
+  std::string out_;
+  NameIds files_;
+  NameIds functions_;
+};
+
+std::string PythonName(const FunctionTable& f, size_t i) {
+  return f.name[i] + ":" + std::to_string(f.first_line[i]);
+}
+
+}  // namespace
+
+void WriteCallgrind(const ProfileData& data, const std::string& path) {
+  const auto& f = data.functions;
+  const auto& l = data.lines;
+  const auto& c = data.c_functions;
+  const auto& k = data.calls;
+
+  // Call sites grouped by calling function, then line.
+  std::vector<size_t> calls;
+  for (size_t i = 0; i < k.size(); ++i) {
+    if (k.caller[i] != CallTable::kNoCaller) {
+      calls.push_back(i);
+    }
+  }
+  std::sort(calls.begin(), calls.end(), [&k](size_t a, size_t b) {
+    return k.caller[a] != k.caller[b] ? k.caller[a] < k.caller[b] :
+        k.caller_line[a] < k.caller_line[b];
+  });
+
+  CallgrindWriter out(path);
+  out.raw("# callgrind format\nversion: 1\ncreator: bprof\n"
+          "positions: line\nevents: Time Hits\n\n");
+
+  auto next_call = calls.begin();
+  for (size_t i = 0; i < f.size(); ++i) {
+    out.file("fl=", f.filename[i]);
+    out.function("fn=", PythonName(f, i));
+    size_t begin = f.line_begin[i];
+    size_t end = begin + f.line_count[i];
+    for (size_t row = begin; row < end; ++row) {
+      uint64_t time = l.internal_ns[row];
+      if (row == begin) {
+        time += f.internal_ns[i];
+      }
+      if (time != 0 || l.n_calls[row] != 0) {
+        out.cost(l.line_number[row], time, l.n_calls[row]);
+      }
+    }
+
+    for (; next_call != calls.end() && k.caller[*next_call] < i; ++next_call) {
+    }
+    for (; next_call != calls.end() && k.caller[*next_call] == i;
+         ++next_call) {
+      size_t call = *next_call;
+      size_t callee = k.callee[call];
+      if (k.callee_c[call]) {
+        out.file("cfi=", kBuiltinFile);
+        out.function("cfn=", c.name[callee]);
+        out.calls(k.n_calls[call], 0);
+      } else {
+        out.file("cfi=", f.filename[callee]);
+        out.function("cfn=", PythonName(f, callee));
+        out.calls(k.n_calls[call], f.first_line[callee]);
+      }
+      // Recursive calls add no inclusive time of their own.
+      out.cost(k.caller_line[call], k.total_ns[call], 0);
+    }
+    out.raw("\n");
+  }
+
+  for (size_t i = 0; i < c.size(); ++i) {
+    out.file("fl=", kBuiltinFile);
+    out.function("fn=", c.name[i]);
+    out.cost(0, c.internal_ns[i], c.n_calls[i]);
+    out.raw("\n");
+  }
+
+  out.finish();
+}
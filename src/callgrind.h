@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+
+#include "profile_data.h"
+
+// Writes data in the Callgrind format KCachegrind reads, with line
+// positions. Each source line carries its self Time (nanoseconds of the
+// profile's clock) and Hits (times it ran); each call site becomes a
+// calls= record from the calling line with the callee's inclusive time.
+// File and function names are compressed to ids after their first use.
+// Python functions are named "name:first_line" so functions sharing a name
+// in one file stay apart. Throws std::runtime_error on I/O errors.
+void WriteCallgrind(const ProfileData& data, const std::string& path);
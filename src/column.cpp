@@ -0,0 +1,253 @@
+#include "column.h"
+
+struct ColumnObject {
+  PyObject_HEAD
+  std::shared_ptr<const ProfileData> owner;
+  const std::vector<uint64_t>* values;
+  Py_ssize_t shape;
+  Py_ssize_t stride;
+};
+
+static void
+column_dealloc(ColumnObject* self) {
+  self->owner.~shared_ptr();
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static Py_ssize_t
+column_length(ColumnObject* self) {
+  return self->shape;
+}
+
+static int
+column_getbuffer(ColumnObject* self, Py_buffer* view, int flags) {
+  if (flags & PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "Column is read-only");
+    return -1;
+  }
+  view->obj = (PyObject*)self;
+  Py_INCREF(self);
+  view->buf = (void*)self->values->data();
+  view->len = self->shape * sizeof(uint64_t);
+  view->readonly = 1;
+  view->itemsize = sizeof(uint64_t);
+  view->format = (flags & PyBUF_FORMAT) ? (char*)"Q" : NULL;
+  view->ndim = 1;
+  view->shape = (flags & PyBUF_ND) ? &self->shape : NULL;
+  view->strides = (flags & PyBUF_STRIDES) ? &self->stride : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  return 0;
+}
+
+static PySequenceMethods column_as_sequence = {
+  (lenfunc)column_length,
+};
+
+static PyBufferProcs column_as_buffer = {
+  (getbufferproc)column_getbuffer,
+  NULL,
+};
+
+PyTypeObject ColumnType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "bprof._bprof.Column",
+};
+
+int Column_Ready() {
+  ColumnType.tp_basicsize = sizeof(ColumnObject);
+  ColumnType.tp_dealloc = (destructor)column_dealloc;
+  ColumnType.tp_as_sequence = &column_as_sequence;
+  ColumnType.tp_as_buffer = &column_as_buffer;
+  ColumnType.tp_flags = Py_TPFLAGS_DEFAULT;
+  ColumnType.tp_doc = "Read-only uint64 column of a profile snapshot.";
+  return PyType_Ready(&ColumnType);
+}
+
+PyObject* Column_New(
+    std::shared_ptr<const ProfileData> owner, const std::vector<uint64_t>& values) {
+  ColumnObject* self = PyObject_New(ColumnObject, &ColumnType);
+  if (self == NULL) {
+    return NULL;
+  }
+  new(&self->owner) std::shared_ptr<const ProfileData>(std::move(owner));
+  self->values = &values;
+  self->shape = values.size();
+  self->stride = sizeof(uint64_t);
+  return (PyObject*)self;
+}
+
+static int SetColumn(
+    PyObject* dict, const char* name,
+    const std::shared_ptr<const ProfileData>& data,
+    const std::vector<uint64_t>& values) {
+  PyObject* column = Column_New(data, values);
+  if (column == NULL) {
+    return -1;
+  }
+  int result = PyDict_SetItemString(dict, name, column);
+  Py_DECREF(column);
+  return result;
+}
+
+static PyObject* CreateNameList(const std::vector<std::string>& names) {
+  PyObject* list = PyList_New(names.size());
+  if (list == NULL) {
+    return NULL;
+  }
+  size_t i = 0;
+  for (auto&& name : names) {
+    PyObject* name_py = PyUnicode_DecodeUTF8(name.data(), name.size(), NULL);
+    if (name_py == NULL) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i++, name_py);
+  }
+  return list;
+}
+
+static int SetNames(
+    PyObject* dict, const char* name, const std::vector<std::string>& names) {
+  PyObject* list = CreateNameList(names);
+  if (list == NULL) {
+    return -1;
+  }
+  int result = PyDict_SetItemString(dict, name, list);
+  Py_DECREF(list);
+  return result;
+}
+
+PyObject* CreateTablesDict(std::shared_ptr<const ProfileData> data) {
+  PyObject* functions = PyDict_New();
+  PyObject* lines = PyDict_New();
+  PyObject* c_functions = PyDict_New();
+  PyObject* calls = PyDict_New();
+  PyObject* opcodes = PyDict_New();
+  PyObject* native = PyDict_New();
+  PyObject* gil_waits = PyDict_New();
+  PyObject* gil_threads = PyDict_New();
+  PyObject* result = PyDict_New();
+  if (functions == NULL || lines == NULL || c_functions == NULL ||
+      calls == NULL || opcodes == NULL || native == NULL ||
+      gil_waits == NULL || gil_threads == NULL || result == NULL) {
+    goto error;
+  }
+
+  {
+    const auto& f = data->functions;
+    if (SetColumn(functions, "key", data, f.key) ||
+        SetNames(functions, "name", f.name) ||
+        SetNames(functions, "filename", f.filename) ||
+        SetColumn(functions, "first_line", data, f.first_line) ||
+        SetColumn(functions, "n_calls", data, f.n_calls) ||
+        SetColumn(functions, "internal_ns", data, f.internal_ns) ||
+        SetColumn(functions, "line_begin", data, f.line_begin) ||
+        SetColumn(functions, "line_count", data, f.line_count)) {
+      goto error;
+    }
+
+    const auto& l = data->lines;
+    if (SetColumn(lines, "function", data, l.function) ||
+        SetColumn(lines, "line_number", data, l.line_number) ||
+        SetColumn(lines, "n_calls", data, l.n_calls) ||
+        SetColumn(lines, "internal_ns", data, l.internal_ns) ||
+        SetColumn(lines, "external_ns", data, l.external_ns)) {
+      goto error;
+    }
+
+    const auto& c = data->c_functions;
+    if (SetNames(c_functions, "name", c.name) ||
+        SetColumn(c_functions, "n_calls", data, c.n_calls) ||
+        SetColumn(c_functions, "internal_ns", data, c.internal_ns) ||
+        SetColumn(c_functions, "native_dropped", data, c.native_dropped)) {
+      goto error;
+    }
+
+    const auto& k = data->calls;
+    if (SetColumn(calls, "caller", data, k.caller) ||
+        SetColumn(calls, "caller_line", data, k.caller_line) ||
+        SetColumn(calls, "callee", data, k.callee) ||
+        SetColumn(calls, "callee_c", data, k.callee_c) ||
+        SetColumn(calls, "n_calls", data, k.n_calls) ||
+        SetColumn(calls, "primitive_calls", data, k.primitive_calls) ||
+        SetColumn(calls, "internal_ns", data, k.internal_ns) ||
+        SetColumn(calls, "total_ns", data, k.total_ns)) {
+      goto error;
+    }
+
+    const auto& o = data->opcodes;
+    if (SetColumn(opcodes, "function", data, o.function) ||
+        SetColumn(opcodes, "offset", data, o.offset) ||
+        SetColumn(opcodes, "opcode", data, o.opcode) ||
+        SetColumn(opcodes, "line_number", data, o.line_number) ||
+        SetColumn(opcodes, "n_calls", data, o.n_calls) ||
+        SetColumn(opcodes, "internal_ns", data, o.internal_ns) ||
+        SetColumn(opcodes, "external_ns", data, o.external_ns)) {
+      goto error;
+    }
+
+    const auto& n = data->native;
+    if (SetColumn(native, "c_function", data, n.c_function) ||
+        SetColumn(native, "samples", data, n.samples) ||
+        SetColumn(native, "ns", data, n.ns) ||
+        SetColumn(native, "frame_begin", data, n.frame_begin) ||
+        SetColumn(native, "frame_count", data, n.frame_count) ||
+        SetNames(native, "frames", n.frames)) {
+      goto error;
+    }
+
+    const auto& g = data->gil_waits;
+    if (SetColumn(gil_waits, "function", data, g.function) ||
+        SetColumn(gil_waits, "line_number", data, g.line_number) ||
+        SetColumn(gil_waits, "n_waits", data, g.n_waits) ||
+        SetColumn(gil_waits, "wait_ns", data, g.wait_ns) ||
+        SetColumn(gil_waits, "off_cpu_ns", data, g.off_cpu_ns)) {
+      goto error;
+    }
+
+    const auto& t = data->gil_threads;
+    if (SetColumn(gil_threads, "thread_id", data, t.thread_id) ||
+        SetColumn(gil_threads, "n_waits", data, t.n_waits) ||
+        SetColumn(gil_threads, "wait_ns", data, t.wait_ns) ||
+        SetColumn(gil_threads, "hold_ns", data, t.hold_ns) ||
+        SetColumn(gil_threads, "profiled_ns", data, t.profiled_ns) ||
+        SetColumn(gil_threads, "cpu_ns", data, t.cpu_ns) ||
+        SetColumn(gil_threads, "released_ns", data, t.released_ns) ||
+        SetColumn(gil_threads, "hold_exact", data, t.hold_exact)) {
+      goto error;
+    }
+  }
+
+  if (PyDict_SetItemString(result, "functions", functions) ||
+      PyDict_SetItemString(result, "lines", lines) ||
+      PyDict_SetItemString(result, "c_functions", c_functions) ||
+      PyDict_SetItemString(result, "calls", calls) ||
+      PyDict_SetItemString(result, "opcodes", opcodes) ||
+      PyDict_SetItemString(result, "native", native) ||
+      PyDict_SetItemString(result, "gil_waits", gil_waits) ||
+      PyDict_SetItemString(result, "gil_threads", gil_threads)) {
+    goto error;
+  }
+  Py_DECREF(functions);
+  Py_DECREF(lines);
+  Py_DECREF(c_functions);
+  Py_DECREF(calls);
+  Py_DECREF(opcodes);
+  Py_DECREF(native);
+  Py_DECREF(gil_waits);
+  Py_DECREF(gil_threads);
+  return result;
+
+error:
+  Py_XDECREF(functions);
+  Py_XDECREF(lines);
+  Py_XDECREF(c_functions);
+  Py_XDECREF(calls);
+  Py_XDECREF(opcodes);
+  Py_XDECREF(native);
+  Py_XDECREF(gil_waits);
+  Py_XDECREF(gil_threads);
+  Py_XDECREF(result);
+  return NULL;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "profile_data.h"
+
+// Read-only uint64 column exporting the buffer protocol. The column keeps the
+// snapshot it points into alive, so memoryview/numpy consumers never copy.
+extern PyTypeObject ColumnType;
+
+int Column_Ready();
+
+PyObject* Column_New(
+    std::shared_ptr<const ProfileData> owner, const std::vector<uint64_t>& values);
+PyObject* CreateTablesDict(std::shared_ptr<const ProfileData> data);
@@ -1,3 +1,4 @@
 #include <chrono>
 
 using duration = std::chrono::nanoseconds;
+using time_point = std::chrono::high_resolution_clock::time_point;
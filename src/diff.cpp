@@ -0,0 +1,312 @@
+#include "diff.h"
+
+#include <algorithm>
+#include <iterator>
+#include <set>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+
+std::string_view Trim(std::string_view text) {
+  const char* whitespace = " \t\r\n\f\v";
+  auto begin = text.find_first_not_of(whitespace);
+  if (begin == std::string_view::npos) {
+    return std::string_view();
+  }
+  auto end = text.find_last_not_of(whitespace);
+  return text.substr(begin, end - begin + 1);
+}
+
+// Rows sharing a name or a text, ordered by line, so the unused row nearest
+// to a line is found in logarithmic time however many share it. Rows used
+// by another match since they were added are dropped as the search meets
+// them.
+class NearestRows {
+ public:
+  void add(uint64_t line, size_t row) { rows_.emplace(line, row); }
+
+  // Removes and returns the row nearest to line for which used(row) is
+  // false, preferring the lower line on a tie; kMissing if there is none.
+  template <typename Used>
+  size_t take(uint64_t line, Used used) {
+    while (!rows_.empty()) {
+      auto next = rows_.lower_bound(std::make_pair(line, size_t(0)));
+      auto best = next;
+      if (next == rows_.end() ||
+          (next != rows_.begin() &&
+           line - std::prev(next)->first <= next->first - line)) {
+        best = std::prev(next);
+      }
+      size_t row = best->second;
+      rows_.erase(best);
+      if (!used(row)) {
+        return row;
+      }
+    }
+    return DeltaRow::kMissing;
+  }
+
+ private:
+  std::set<std::pair<uint64_t, size_t>> rows_;
+};
+
+struct FunctionTotals {
+  uint64_t self_ns = 0;
+  uint64_t total_ns = 0;
+};
+
+FunctionTotals Totals(const ProfileData& data, size_t i) {
+  FunctionTotals totals;
+  totals.self_ns = data.functions.internal_ns[i];
+  size_t begin = data.functions.line_begin[i];
+  size_t end = begin + data.functions.line_count[i];
+  uint64_t external_ns = 0;
+  for (size_t row = begin; row < end; ++row) {
+    totals.self_ns += data.lines.internal_ns[row];
+    external_ns += data.lines.external_ns[row];
+  }
+  totals.total_ns = totals.self_ns + external_ns;
+  return totals;
+}
+
+void SetA(DeltaRow& row, const ProfileData& a, size_t i) {
+  auto totals = Totals(a, i);
+  row.a = i;
+  row.calls_a = a.functions.n_calls[i];
+  row.self_ns_a = totals.self_ns;
+  row.total_ns_a = totals.total_ns;
+}
+
+void SetB(DeltaRow& row, const ProfileData& b, size_t i) {
+  auto totals = Totals(b, i);
+  row.b = i;
+  row.calls_b = b.functions.n_calls[i];
+  row.self_ns_b = totals.self_ns;
+  row.total_ns_b = totals.total_ns;
+}
+
+bool LineActive(const LineTable& lines, size_t row) {
+  return lines.n_calls[row] || lines.internal_ns[row] ||
+      lines.external_ns[row];
+}
+
+void SetLineA(DeltaRow& row, const LineTable& lines, size_t i) {
+  row.a = i;
+  row.calls_a = lines.n_calls[i];
+  row.self_ns_a = lines.internal_ns[i];
+  row.total_ns_a = lines.internal_ns[i] + lines.external_ns[i];
+}
+
+void SetLineB(DeltaRow& row, const LineTable& lines, size_t i) {
+  row.b = i;
+  row.calls_b = lines.n_calls[i];
+  row.self_ns_b = lines.internal_ns[i];
+  row.total_ns_b = lines.internal_ns[i] + lines.external_ns[i];
+}
+
+void AppendUnmatchedLines(
+    std::vector<DeltaRow>& out, const ProfileData& data, size_t function,
+    bool is_a) {
+  size_t begin = data.functions.line_begin[function];
+  size_t end = begin + data.functions.line_count[function];
+  for (size_t row = begin; row < end; ++row) {
+    if (!LineActive(data.lines, row)) {
+      continue;
+    }
+    DeltaRow delta;
+    if (is_a) {
+      SetLineA(delta, data.lines, row);
+    } else {
+      SetLineB(delta, data.lines, row);
+    }
+    out.push_back(delta);
+  }
+}
+
+// Matches the lines of function fa in a against function fb in b. A line is
+// first looked up where the shift between the two first lines puts it; if
+// the text differs there, the nearest unused line with the same text wins.
+void DiffLines(
+    std::vector<DeltaRow>& out, const ProfileData& a, size_t fa,
+    const ProfileData& b, size_t fb) {
+  const LineTable& la = a.lines;
+  const LineTable& lb = b.lines;
+  size_t a_begin = a.functions.line_begin[fa];
+  size_t a_end = a_begin + a.functions.line_count[fa];
+  size_t b_begin = b.functions.line_begin[fb];
+  size_t b_end = b_begin + b.functions.line_count[fb];
+  int64_t shift = int64_t(b.functions.first_line[fb]) -
+      int64_t(a.functions.first_line[fa]);
+
+  std::vector<bool> used(a_end - a_begin, false);
+  auto is_used = [&](size_t i) -> bool { return used[i - a_begin]; };
+  std::unordered_map<std::string_view, NearestRows> by_text;
+  bool indexed = false;
+
+  auto find_at = [&](uint64_t line_number) -> size_t {
+    auto first = la.line_number.begin() + a_begin;
+    auto last = la.line_number.begin() + a_end;
+    auto it = std::lower_bound(first, last, line_number);
+    if (it == last || *it != line_number) {
+      return DeltaRow::kMissing;
+    }
+    return it - la.line_number.begin();
+  };
+
+  for (size_t row = b_begin; row < b_end; ++row) {
+    auto text = Trim(b.line_text(row));
+    int64_t expected = int64_t(lb.line_number[row]) - shift;
+    size_t match = expected > 0 ? find_at(expected) : DeltaRow::kMissing;
+    if (match != DeltaRow::kMissing &&
+        (used[match - a_begin] || Trim(a.line_text(match)) != text)) {
+      match = DeltaRow::kMissing;
+    }
+
+    if (match == DeltaRow::kMissing && !text.empty()) {
+      if (!indexed) {
+        for (size_t i = a_begin; i < a_end; ++i) {
+          auto a_text = Trim(a.line_text(i));
+          if (!a_text.empty()) {
+            by_text[a_text].add(la.line_number[i], i);
+          }
+        }
+        indexed = true;
+      }
+      auto it = by_text.find(text);
+      if (it != by_text.end()) {
+        match = it->second.take(uint64_t(std::max<int64_t>(expected, 0)),
+                                is_used);
+      }
+    }
+
+    if (match != DeltaRow::kMissing) {
+      used[match - a_begin] = true;
+      if (!LineActive(la, match) && !LineActive(lb, row)) {
+        continue;
+      }
+      DeltaRow delta;
+      SetLineA(delta, la, match);
+      SetLineB(delta, lb, row);
+      out.push_back(delta);
+    } else if (LineActive(lb, row)) {
+      DeltaRow delta;
+      SetLineB(delta, lb, row);
+      out.push_back(delta);
+    }
+  }
+
+  for (size_t i = a_begin; i < a_end; ++i) {
+    if (!used[i - a_begin] && LineActive(la, i)) {
+      DeltaRow delta;
+      SetLineA(delta, la, i);
+      out.push_back(delta);
+    }
+  }
+}
+
+struct NameKey {
+  std::string_view filename;
+  std::string_view name;
+
+  bool operator==(const NameKey& rhs) const {
+    return name == rhs.name && filename == rhs.filename;
+  }
+};
+
+struct NameKeyHash {
+  size_t operator()(const NameKey& key) const {
+    return std::hash<std::string_view>()(key.filename) * 31 +
+        std::hash<std::string_view>()(key.name);
+  }
+};
+
+}  // namespace
+
+ProfileDiff DiffProfiles(const ProfileData& a, const ProfileData& b) {
+  const auto& fa = a.functions;
+  const auto& fb = b.functions;
+
+  std::unordered_map<FunctionIdentity, size_t, FunctionIdentityHash> exact;
+  std::unordered_map<NameKey, NearestRows, NameKeyHash> by_name;
+  exact.reserve(fa.size());
+  for (size_t i = 0; i < fa.size(); ++i) {
+    exact.emplace(FunctionIdentity(fa, i), i);
+    by_name[NameKey{fa.filename[i], fa.name[i]}].add(fa.first_line[i], i);
+  }
+
+  std::vector<size_t> match(fb.size(), DeltaRow::kMissing);
+  std::vector<bool> used(fa.size(), false);
+  for (size_t j = 0; j < fb.size(); ++j) {
+    auto it = exact.find(FunctionIdentity(fb, j));
+    if (it != exact.end() && !used[it->second]) {
+      match[j] = it->second;
+      used[it->second] = true;
+    }
+  }
+  // Functions whose first line moved: pair them with the closest unmatched
+  // function of the same name in the same file.
+  for (size_t j = 0; j < fb.size(); ++j) {
+    if (match[j] != DeltaRow::kMissing) {
+      continue;
+    }
+    auto it = by_name.find(NameKey{fb.filename[j], fb.name[j]});
+    if (it == by_name.end()) {
+      continue;
+    }
+    match[j] = it->second.take(
+        fb.first_line[j], [&used](size_t i) -> bool { return used[i]; });
+    if (match[j] != DeltaRow::kMissing) {
+      used[match[j]] = true;
+    }
+  }
+
+  ProfileDiff diff;
+  diff.functions.reserve(fb.size());
+  for (size_t j = 0; j < fb.size(); ++j) {
+    DeltaRow row;
+    SetB(row, b, j);
+    if (match[j] != DeltaRow::kMissing) {
+      SetA(row, a, match[j]);
+      DiffLines(diff.lines, a, match[j], b, j);
+    } else {
+      AppendUnmatchedLines(diff.lines, b, j, false);
+    }
+    diff.functions.push_back(row);
+  }
+  for (size_t i = 0; i < fa.size(); ++i) {
+    if (!used[i]) {
+      DeltaRow row;
+      SetA(row, a, i);
+      AppendUnmatchedLines(diff.lines, a, i, true);
+      diff.functions.push_back(row);
+    }
+  }
+
+  return diff;
+}
+
+void RankDeltas(std::vector<DeltaRow>& rows, DiffKey key, size_t limit) {
+  auto delta = [key](const DeltaRow& row) -> int64_t {
+    switch (key) {
+      case DiffKey::kSelf:
+        return row.delta_self_ns();
+      case DiffKey::kTotal:
+        return row.delta_total_ns();
+      case DiffKey::kCalls:
+        return int64_t(row.calls_b - row.calls_a);
+    }
+    return 0;
+  };
+  auto greater = [&delta](const DeltaRow& x, const DeltaRow& y) {
+    return delta(x) > delta(y);
+  };
+
+  if (limit != 0 && limit < rows.size()) {
+    std::partial_sort(rows.begin(), rows.begin() + limit, rows.end(), greater);
+    rows.resize(limit);
+  } else {
+    std::sort(rows.begin(), rows.end(), greater);
+  }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "profile_data.h"
+
+// One matched row of an A/B comparison. a and b index the function (or line)
+// tables of the two profiles; kMissing marks a row that exists on one side
+// only.
+struct DeltaRow {
+  static constexpr uint64_t kMissing = UINT64_MAX;
+
+  uint64_t a = kMissing;
+  uint64_t b = kMissing;
+  uint64_t calls_a = 0;
+  uint64_t calls_b = 0;
+  uint64_t self_ns_a = 0;
+  uint64_t self_ns_b = 0;
+  uint64_t total_ns_a = 0;
+  uint64_t total_ns_b = 0;
+
+  int64_t delta_self_ns() const { return int64_t(self_ns_b - self_ns_a); }
+  int64_t delta_total_ns() const { return int64_t(total_ns_b - total_ns_a); }
+};
+
+struct ProfileDiff {
+  std::vector<DeltaRow> functions;
+  std::vector<DeltaRow> lines;
+};
+
+enum class DiffKey {
+  kSelf,
+  kTotal,
+  kCalls,
+};
+
+// Functions are matched by (filename, name, first line), falling back to the
+// nearest first line among functions of the same filename and name. Lines of
+// matched functions are matched by source text, so edits that shift line
+// numbers still line up.
+ProfileDiff DiffProfiles(const ProfileData& a, const ProfileData& b);
+
+// Orders rows by descending delta of key so the largest regressions come
+// first, keeping only the top limit rows when limit is non-zero.
+void RankDeltas(std::vector<DeltaRow>& rows, DiffKey key, size_t limit);
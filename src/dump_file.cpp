@@ -0,0 +1,423 @@
+#include "dump_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+static_assert(sizeof(DumpHeader) == 16, "unexpected DumpHeader padding");
+static_assert(sizeof(DumpSectionEntry) == 24, "unexpected DumpSectionEntry padding");
+static_assert(sizeof(DumpFunction) == 80, "unexpected DumpFunction padding");
+static_assert(sizeof(DumpLine) == 56, "unexpected DumpLine padding");
+static_assert(sizeof(DumpCFunction) == 40, "unexpected DumpCFunction padding");
+static_assert(sizeof(DumpCounter) == 24, "unexpected DumpCounter padding");
+static_assert(sizeof(DumpCall) == 64, "unexpected DumpCall padding");
+static_assert(sizeof(DumpOpcode) == 56, "unexpected DumpOpcode padding");
+static_assert(sizeof(DumpNativeStack) == 40,
+              "unexpected DumpNativeStack padding");
+static_assert(sizeof(DumpGilWait) == 40, "unexpected DumpGilWait padding");
+static_assert(sizeof(DumpGilThread) == 64, "unexpected DumpGilThread padding");
+
+namespace {
+
+class StringBlob {
+ public:
+  DumpString add(std::string_view str) {
+    auto it = index_.find(str);
+    if (it != index_.end()) {
+      return it->second;
+    }
+    DumpString ref{blob_.size(), str.size()};
+    blob_.append(str.data(), str.size());
+    index_.emplace(str, ref);
+    return ref;
+  }
+  const std::string& blob() const { return blob_; }
+
+ private:
+  std::string blob_;
+  std::unordered_map<std::string_view, DumpString> index_;
+};
+
+uint64_t align8(uint64_t offset) {
+  return (offset + 7) & ~uint64_t(7);
+}
+
+}  // namespace
+
+void WriteDump(const ProfileData& data, const std::string& path) {
+  StringBlob strings;
+  // Line text is written as spans into a single copy of the text pool.
+  DumpString text = strings.add(data.text);
+
+  const auto& f = data.functions;
+  std::vector<DumpFunction> functions(f.size());
+  for (size_t i = 0; i < f.size(); ++i) {
+    auto& record = functions[i];
+    record.name = strings.add(f.name[i]);
+    record.filename = strings.add(f.filename[i]);
+    record.key = f.key[i];
+    record.first_line = f.first_line[i];
+    record.n_calls = f.n_calls[i];
+    record.internal_ns = f.internal_ns[i];
+    record.line_begin = f.line_begin[i];
+    record.line_count = f.line_count[i];
+  }
+
+  const auto& l = data.lines;
+  std::vector<DumpLine> lines(l.size());
+  for (size_t i = 0; i < l.size(); ++i) {
+    auto& record = lines[i];
+    record.function = l.function[i];
+    record.line_number = l.line_number[i];
+    record.n_calls = l.n_calls[i];
+    record.internal_ns = l.internal_ns[i];
+    record.external_ns = l.external_ns[i];
+    record.text = DumpString{text.offset + l.text_offset[i], l.text_size[i]};
+  }
+
+  const auto& c = data.c_functions;
+  std::vector<DumpCFunction> c_functions(c.size());
+  for (size_t i = 0; i < c.size(); ++i) {
+    auto& record = c_functions[i];
+    record.name = strings.add(c.name[i]);
+    record.n_calls = c.n_calls[i];
+    record.internal_ns = c.internal_ns[i];
+    record.native_dropped = c.native_dropped[i];
+  }
+
+  std::vector<DumpCounter> counters;
+  for (auto&& counter : data.counters) {
+    counters.push_back(DumpCounter{strings.add(counter.first), counter.second});
+  }
+
+  const auto& k = data.calls;
+  std::vector<DumpCall> calls(k.size());
+  for (size_t i = 0; i < k.size(); ++i) {
+    calls[i] = DumpCall{k.caller[i], k.callee[i], k.callee_c[i],
+                        k.n_calls[i], k.primitive_calls[i], k.internal_ns[i],
+                        k.total_ns[i], k.caller_line[i]};
+  }
+
+  const auto& o = data.opcodes;
+  std::vector<DumpOpcode> opcodes(o.size());
+  for (size_t i = 0; i < o.size(); ++i) {
+    opcodes[i] = DumpOpcode{o.function[i], o.offset[i], o.opcode[i],
+                            o.line_number[i], o.n_calls[i], o.internal_ns[i],
+                            o.external_ns[i]};
+  }
+
+  const auto& n = data.native;
+  std::vector<DumpNativeStack> native(n.size());
+  for (size_t i = 0; i < n.size(); ++i) {
+    native[i] = DumpNativeStack{n.c_function[i], n.samples[i], n.ns[i],
+                                n.frame_begin[i], n.frame_count[i]};
+  }
+  std::vector<DumpString> native_frames;
+  native_frames.reserve(n.frames.size());
+  for (auto&& frame : n.frames) {
+    native_frames.push_back(strings.add(frame));
+  }
+
+  const auto& g = data.gil_waits;
+  std::vector<DumpGilWait> gil_waits(g.size());
+  for (size_t i = 0; i < g.size(); ++i) {
+    gil_waits[i] = DumpGilWait{g.function[i], g.line_number[i], g.n_waits[i],
+                               g.wait_ns[i], g.off_cpu_ns[i]};
+  }
+  const auto& t = data.gil_threads;
+  std::vector<DumpGilThread> gil_threads(t.size());
+  for (size_t i = 0; i < t.size(); ++i) {
+    gil_threads[i] = DumpGilThread{t.thread_id[i], t.n_waits[i], t.wait_ns[i],
+                                   t.hold_ns[i], t.profiled_ns[i], t.cpu_ns[i],
+                                   t.released_ns[i], t.hold_exact[i]};
+  }
+
+  DumpSectionEntry sections[] = {
+    {static_cast<uint32_t>(DumpSection::kStrings), 1,
+     strings.blob().size(), 0},
+    {static_cast<uint32_t>(DumpSection::kFunctions), sizeof(DumpFunction),
+     functions.size(), 0},
+    {static_cast<uint32_t>(DumpSection::kLines), sizeof(DumpLine),
+     lines.size(), 0},
+    {static_cast<uint32_t>(DumpSection::kCFunctions), sizeof(DumpCFunction),
+     c_functions.size(), 0},
+    {static_cast<uint32_t>(DumpSection::kCounters), sizeof(DumpCounter),
+     counters.size(), 0},
+    {static_cast<uint32_t>(DumpSection::kCalls), sizeof(DumpCall),
+     calls.size(), 0},
+    {static_cast<uint32_t>(DumpSection::kOpcodes), sizeof(DumpOpcode),
+     opcodes.size(), 0},
+    {static_cast<uint32_t>(DumpSection::kNativeStacks), sizeof(DumpNativeStack),
+     native.size(), 0},
+    {static_cast<uint32_t>(DumpSection::kNativeFrames), sizeof(DumpString),
+     native_frames.size(), 0},
+    {static_cast<uint32_t>(DumpSection::kGilWaits), sizeof(DumpGilWait),
+     gil_waits.size(), 0},
+    {static_cast<uint32_t>(DumpSection::kGilThreads), sizeof(DumpGilThread),
+     gil_threads.size(), 0},
+  };
+  const void* payloads[] = {
+    strings.blob().data(), functions.data(), lines.data(), c_functions.data(),
+    counters.data(), calls.data(), opcodes.data(), native.data(),
+    native_frames.data(), gil_waits.data(), gil_threads.data(),
+  };
+  constexpr uint32_t n_sections = sizeof(sections) / sizeof(sections[0]);
+
+  uint64_t offset = sizeof(DumpHeader) + sizeof(sections);
+  for (auto&& section : sections) {
+    offset = align8(offset);
+    section.offset = offset;
+    offset += section.count * section.record_size;
+  }
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::runtime_error("Could not open `" + path + "' for writing");
+  }
+  DumpHeader header;
+  std::memcpy(header.magic, kDumpMagic, sizeof(kDumpMagic));
+  header.version = kDumpVersion;
+  header.n_sections = n_sections;
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(sections), sizeof(sections));
+
+  uint64_t position = sizeof(DumpHeader) + sizeof(sections);
+  static const char padding[8] = {};
+  for (uint32_t i = 0; i < n_sections; ++i) {
+    out.write(padding, sections[i].offset - position);
+    uint64_t size = sections[i].count * sections[i].record_size;
+    out.write(static_cast<const char*>(payloads[i]), size);
+    position = sections[i].offset + size;
+  }
+  if (!out) {
+    throw std::runtime_error("Could not write `" + path + "'");
+  }
+}
+
+void WriteDumpAtomic(const ProfileData& data, const std::string& path) {
+  std::string temp = path + ".tmp";
+  try {
+    WriteDump(data, temp);
+  } catch (...) {
+    std::remove(temp.c_str());
+    throw;
+  }
+  if (std::rename(temp.c_str(), path.c_str()) != 0) {
+    std::remove(temp.c_str());
+    throw std::runtime_error("Could not rename `" + temp + "' to `" + path + "'");
+  }
+}
+
+MappedDump::MappedDump(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("Could not open `" + path + "'");
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("Could not stat `" + path + "'");
+  }
+  size_ = st.st_size;
+  if (size_ < sizeof(DumpHeader)) {
+    close(fd);
+    throw std::runtime_error("Truncated bprof dump");
+  }
+  void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("Could not map `" + path + "'");
+  }
+  data_ = static_cast<const char*>(data);
+
+  try {
+    const auto* header = reinterpret_cast<const DumpHeader*>(data_);
+    if (std::memcmp(header->magic, kDumpMagic, sizeof(kDumpMagic)) != 0) {
+      throw std::runtime_error("Not a bprof dump");
+    }
+    if (header->version != kDumpVersion) {
+      throw std::runtime_error("Unsupported bprof dump version");
+    }
+    n_sections_ = header->n_sections;
+    if (n_sections_ > (size_ - sizeof(DumpHeader)) / sizeof(DumpSectionEntry)) {
+      throw std::runtime_error("Truncated bprof dump directory");
+    }
+    sections_ =
+        reinterpret_cast<const DumpSectionEntry*>(data_ + sizeof(DumpHeader));
+    for (uint32_t i = 0; i < n_sections_; ++i) {
+      const auto& section = sections_[i];
+      if (section.offset > size_ || (section.record_size != 0 &&
+          section.count > (size_ - section.offset) / section.record_size)) {
+        throw std::runtime_error("Corrupt bprof dump section");
+      }
+    }
+    const DumpSectionEntry* strings = find(DumpSection::kStrings);
+    if (strings != nullptr) {
+      strings_ = std::string_view(data_ + strings->offset,
+                                  strings->count * strings->record_size);
+    }
+  } catch (...) {
+    munmap(const_cast<char*>(data_), size_);
+    throw;
+  }
+}
+
+MappedDump::~MappedDump() {
+  munmap(const_cast<char*>(data_), size_);
+}
+
+const DumpSectionEntry* MappedDump::find(DumpSection tag) const {
+  for (uint32_t i = 0; i < n_sections_; ++i) {
+    if (sections_[i].tag == static_cast<uint32_t>(tag)) {
+      return &sections_[i];
+    }
+  }
+  return nullptr;
+}
+
+ProfileData ReadDump(const std::string& path) {
+  MappedDump reader(path);
+
+  ProfileData data;
+  // Line text stays a span into the string blob, which becomes the pool.
+  data.text = std::string(reader.strings());
+  auto& f = data.functions;
+  auto functions = reader.records<DumpFunction>(DumpSection::kFunctions);
+  for (size_t i = 0; i < functions.size(); ++i) {
+    const auto& record = functions[i];
+    f.key.push_back(record.key);
+    f.name.emplace_back(reader.string(record.name));
+    f.filename.emplace_back(reader.string(record.filename));
+    f.first_line.push_back(record.first_line);
+    f.n_calls.push_back(record.n_calls);
+    f.internal_ns.push_back(record.internal_ns);
+    f.line_begin.push_back(record.line_begin);
+    f.line_count.push_back(record.line_count);
+  }
+
+  auto& l = data.lines;
+  auto lines = reader.records<DumpLine>(DumpSection::kLines);
+  for (size_t i = 0; i < lines.size(); ++i) {
+    const auto& record = lines[i];
+    if (record.function >= f.size()) {
+      throw std::runtime_error("Corrupt bprof dump line");
+    }
+    l.function.push_back(record.function);
+    l.line_number.push_back(record.line_number);
+    l.n_calls.push_back(record.n_calls);
+    l.internal_ns.push_back(record.internal_ns);
+    l.external_ns.push_back(record.external_ns);
+    reader.string(record.text);
+    l.text_offset.push_back(record.text.offset);
+    l.text_size.push_back(record.text.size);
+  }
+  for (size_t i = 0; i < f.size(); ++i) {
+    if (f.line_begin[i] + f.line_count[i] > l.size()) {
+      throw std::runtime_error("Corrupt bprof dump function");
+    }
+  }
+
+  auto& c = data.c_functions;
+  auto c_functions = reader.records<DumpCFunction>(
+      DumpSection::kCFunctions, offsetof(DumpCFunction, native_dropped));
+  bool has_native_dropped = c_functions.covers(
+      offsetof(DumpCFunction, native_dropped) + sizeof(uint64_t));
+  for (size_t i = 0; i < c_functions.size(); ++i) {
+    const auto& record = c_functions[i];
+    c.name.emplace_back(reader.string(record.name));
+    c.n_calls.push_back(record.n_calls);
+    c.internal_ns.push_back(record.internal_ns);
+    c.native_dropped.push_back(
+        has_native_dropped ? record.native_dropped : 0);
+  }
+
+  auto& k = data.calls;
+  auto calls = reader.records<DumpCall>(DumpSection::kCalls,
+                                       offsetof(DumpCall, caller_line));
+  bool has_caller_line =
+      calls.covers(offsetof(DumpCall, caller_line) + sizeof(uint64_t));
+  for (size_t i = 0; i < calls.size(); ++i) {
+    const auto& record = calls[i];
+    if ((record.caller != CallTable::kNoCaller && record.caller >= f.size()) ||
+        record.callee >= (record.callee_c ? c.size() : f.size())) {
+      throw std::runtime_error("Corrupt bprof dump call");
+    }
+    k.push_back(record.caller, has_caller_line ? record.caller_line : 0,
+                record.callee, record.callee_c != 0, record.n_calls,
+                record.primitive_calls, record.internal_ns, record.total_ns);
+  }
+
+  auto& o = data.opcodes;
+  auto opcodes = reader.records<DumpOpcode>(DumpSection::kOpcodes);
+  for (size_t i = 0; i < opcodes.size(); ++i) {
+    const auto& record = opcodes[i];
+    if (record.function >= f.size()) {
+      throw std::runtime_error("Corrupt bprof dump opcode");
+    }
+    o.push_back(record.function, record.offset, record.opcode,
+                record.line_number, record.n_calls, record.internal_ns,
+                record.external_ns);
+  }
+
+  auto& n = data.native;
+  auto native_frames = reader.records<DumpString>(DumpSection::kNativeFrames);
+  auto native = reader.records<DumpNativeStack>(DumpSection::kNativeStacks);
+  for (size_t i = 0; i < native.size(); ++i) {
+    const auto& record = native[i];
+    if (record.c_function >= c.size() ||
+        record.frame_begin > native_frames.size() ||
+        record.frame_count > native_frames.size() - record.frame_begin) {
+      throw std::runtime_error("Corrupt bprof dump native stack");
+    }
+    std::vector<std::string> frames;
+    for (size_t j = 0; j < record.frame_count; ++j) {
+      frames.emplace_back(
+          reader.string(native_frames[record.frame_begin + j]));
+    }
+    n.push_back(record.c_function, record.samples, record.ns, frames.begin(),
+                frames.end());
+  }
+
+  auto gil_waits = reader.records<DumpGilWait>(
+      DumpSection::kGilWaits, offsetof(DumpGilWait, off_cpu_ns));
+  bool has_off_cpu =
+      gil_waits.covers(offsetof(DumpGilWait, off_cpu_ns) + sizeof(uint64_t));
+  for (size_t i = 0; i < gil_waits.size(); ++i) {
+    const auto& record = gil_waits[i];
+    if (record.function >= f.size()) {
+      throw std::runtime_error("Corrupt bprof dump GIL wait");
+    }
+    data.gil_waits.push_back(record.function, record.line_number,
+                             record.n_waits, record.wait_ns,
+                             has_off_cpu ? record.off_cpu_ns : 0);
+  }
+  auto gil_threads = reader.records<DumpGilThread>(
+      DumpSection::kGilThreads, offsetof(DumpGilThread, profiled_ns));
+  bool has_spans = gil_threads.covers(sizeof(DumpGilThread));
+  for (size_t i = 0; i < gil_threads.size(); ++i) {
+    const auto& record = gil_threads[i];
+    data.gil_threads.push_back(
+        record.thread_id, record.n_waits, record.wait_ns, record.hold_ns,
+        has_spans ? record.profiled_ns : 0, has_spans ? record.cpu_ns : 0,
+        has_spans ? record.released_ns : 0,
+        has_spans && record.hold_exact != 0);
+  }
+
+  auto counters = reader.records<DumpCounter>(DumpSection::kCounters);
+  for (size_t i = 0; i < counters.size(); ++i) {
+    data.counters[std::string(reader.string(counters[i].name))] +=
+        counters[i].value;
+  }
+
+  return data;
+}
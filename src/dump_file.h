@@ -0,0 +1,213 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "profile_data.h"
+
+// Native dump file layout. A header and a section directory are followed by
+// arrays of fixed-size records in host (little-endian) byte order, so a reader
+// can use the records in place. Strings live in one blob and are referenced by
+// (offset, size). Readers skip unknown sections and accept records that are
+// larger than they expect, which leaves room to grow the format.
+
+constexpr char kDumpMagic[8] = {'B', 'P', 'R', 'O', 'F', 'D', 'M', 'P'};
+constexpr uint32_t kDumpVersion = 1;
+
+enum class DumpSection : uint32_t {
+  kStrings = 1,
+  kFunctions = 2,
+  kLines = 3,
+  kCFunctions = 4,
+  kCounters = 5,
+  kCalls = 6,
+  kOpcodes = 7,
+  kNativeStacks = 8,
+  // DumpString records: the frame names of the native stacks.
+  kNativeFrames = 9,
+  kGilWaits = 10,
+  kGilThreads = 11,
+};
+
+struct DumpHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_sections;
+};
+
+struct DumpSectionEntry {
+  uint32_t tag;
+  uint32_t record_size;
+  uint64_t count;
+  uint64_t offset;
+};
+
+struct DumpString {
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct DumpFunction {
+  DumpString name;
+  DumpString filename;
+  uint64_t key;
+  uint64_t first_line;
+  uint64_t n_calls;
+  uint64_t internal_ns;
+  uint64_t line_begin;
+  uint64_t line_count;
+};
+
+struct DumpLine {
+  uint64_t function;
+  uint64_t line_number;
+  uint64_t n_calls;
+  uint64_t internal_ns;
+  uint64_t external_ns;
+  DumpString text;
+};
+
+struct DumpCFunction {
+  DumpString name;
+  uint64_t n_calls;
+  uint64_t internal_ns;
+  // Absent from dumps written before it was recorded; read as 0.
+  uint64_t native_dropped;
+};
+
+struct DumpCounter {
+  DumpString name;
+  uint64_t value;
+};
+
+struct DumpCall {
+  uint64_t caller;
+  uint64_t callee;
+  uint64_t callee_c;
+  uint64_t n_calls;
+  uint64_t primitive_calls;
+  uint64_t internal_ns;
+  uint64_t total_ns;
+  // Absent from dumps written before call sites were recorded; read as 0.
+  uint64_t caller_line;
+};
+
+struct DumpOpcode {
+  uint64_t function;
+  uint64_t offset;
+  uint64_t opcode;
+  uint64_t line_number;
+  uint64_t n_calls;
+  uint64_t internal_ns;
+  uint64_t external_ns;
+};
+
+struct DumpNativeStack {
+  uint64_t c_function;
+  uint64_t samples;
+  uint64_t ns;
+  // Rows of the kNativeFrames section, innermost frame first.
+  uint64_t frame_begin;
+  uint64_t frame_count;
+};
+
+struct DumpGilWait {
+  uint64_t function;
+  uint64_t line_number;
+  uint64_t n_waits;
+  uint64_t wait_ns;
+  // Absent from dumps written before it was recorded; read as 0.
+  uint64_t off_cpu_ns;
+};
+
+struct DumpGilThread {
+  uint64_t thread_id;
+  uint64_t n_waits;
+  uint64_t wait_ns;
+  uint64_t hold_ns;
+  // Absent from dumps written before they were recorded; read as 0, which
+  // leaves hold_ns marked inexact.
+  uint64_t profiled_ns;
+  uint64_t cpu_ns;
+  uint64_t released_ns;
+  uint64_t hold_exact;
+};
+
+// A dump file mapped read-only into memory. Opening validates the header
+// and the section bounds; records and strings are then used in place, so
+// opening is instant whatever the file size and pages are read on demand.
+class MappedDump {
+ public:
+  // Fixed-size records of one section. Records may be larger than T when
+  // the file was written by a newer version.
+  template <typename T>
+  class Records {
+   public:
+    Records() = default;
+    Records(const char* base, size_t count, size_t stride)
+        : base_(base), count_(count), stride_(stride) {}
+    size_t size() const { return count_; }
+    // Whether the records hold the first `size` bytes of T, for fields
+    // appended to T since older files were written.
+    bool covers(size_t size) const { return stride_ >= size; }
+    const T& operator[](size_t i) const {
+      return *reinterpret_cast<const T*>(base_ + i * stride_);
+    }
+
+   private:
+    const char* base_ = nullptr;
+    size_t count_ = 0;
+    size_t stride_ = 0;
+  };
+
+  // Throws std::runtime_error on I/O or format errors.
+  explicit MappedDump(const std::string& path);
+  ~MappedDump();
+  MappedDump(const MappedDump&) = delete;
+  MappedDump& operator=(const MappedDump&) = delete;
+
+  // Records shorter than T are accepted down to min_size, when the fields
+  // past it were appended later; check them with Records::covers().
+  template <typename T>
+  Records<T> records(DumpSection tag, size_t min_size = sizeof(T)) const {
+    const DumpSectionEntry* section = find(tag);
+    if (section == nullptr) {
+      return Records<T>();
+    }
+    if (section->record_size < min_size ||
+        section->record_size % alignof(T) != 0 ||
+        section->offset % alignof(T) != 0) {
+      throw std::runtime_error("Corrupt bprof dump section");
+    }
+    return Records<T>(data_ + section->offset, section->count,
+                      section->record_size);
+  }
+
+  // The whole string blob, and one string in it.
+  std::string_view strings() const { return strings_; }
+  std::string_view string(const DumpString& ref) const {
+    if (ref.offset > strings_.size() ||
+        ref.size > strings_.size() - ref.offset) {
+      throw std::runtime_error("Corrupt bprof dump string");
+    }
+    return strings_.substr(ref.offset, ref.size);
+  }
+
+ private:
+  const DumpSectionEntry* find(DumpSection tag) const;
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  const DumpSectionEntry* sections_ = nullptr;
+  uint32_t n_sections_ = 0;
+  std::string_view strings_;
+};
+
+// Both throw std::runtime_error on I/O or format errors.
+void WriteDump(const ProfileData& data, const std::string& path);
+// Writes to path + ".tmp" and renames it over path, so readers never see a
+// partial dump.
+void WriteDumpAtomic(const ProfileData& data, const std::string& path);
+ProfileData ReadDump(const std::string& path);
@@ -1,34 +1,88 @@
 #pragma once
 
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <frameobject.h>
+
 #include <vector>
 
 #include "common.h"
+#include "function.h"
 #include "line.h"
 
 class FrameState {
  public:
-  FrameState(PyCodeObject* code, size_t n_lines, size_t starting_line) 
-      : starting_line_(starting_line), function_key_(code) {
-    lines_.resize(n_lines);
+  // line_map is the function's, which stays alive while the frame is on the
+  // stack.
+  FrameState(PyFrameObject* frame, const LineMap& line_map)
+      : line_map_(&line_map), frame_(frame), function_key_(frame->f_code) {
+    lines_.resize(line_map.n_slots());
   }
   PyCodeObject* key() const { return function_key_; }
+  // The interpreter frame this state shadows. Only compared, never
+  // dereferenced, and only with frames of the thread the hooks are on.
+  PyFrameObject* frame() const { return frame_; }
+  // Set for frames that were already running when they were pushed; only the
+  // part of their call after that point is measured.
+  bool partial() const { return partial_; }
+  void set_partial() { partial_ = true; }
+  // When the call started, or when the frame was pushed for partial frames.
+  time_point start() const { return start_; }
+  void set_start(time_point start) { start_ = start; }
 
   duration total_time() const;
-  LineState& current_line() { return lines_.at(current_line_-starting_line_-1); }
-  LineState& set_current_line(size_t line_number) {
-    current_line_ = line_number;
+  // Line statistics are indexed by the slots of the function's LineMap.
+  LineState& current_line() { return lines_[current_slot_]; }
+  size_t current_line_number() const { return line_map_->line(current_slot_); }
+  // Moves to the line of the instruction at f_lasti.
+  LineState& set_current_instruction(int lasti) {
+    current_slot_ = line_map_->slot(lasti);
     return current_line();
   }
 
+  // Per-instruction records of the frame's function when it is traced per
+  // opcode. Unlike lines they are written in place rather than folded in on
+  // return; the function is active, so they stay put.
+  void set_opcodes(std::vector<OpcodeRecord>& opcodes) {
+    opcodes_ = opcodes.data();
+    n_opcodes_ = opcodes.size();
+    current_opcode_ = nullptr;
+  }
+  // Null until the first opcode event, and for out-of-range offsets.
+  OpcodeRecord* current_opcode() const { return current_opcode_; }
+  OpcodeRecord* set_current_opcode(size_t index) {
+    current_opcode_ = index < n_opcodes_ ? opcodes_ + index : nullptr;
+    return current_opcode_;
+  }
+
   void add_internal(const duration& dur) { internal_ += dur; }
   const duration& internal() const { return internal_; }
 
   const auto& lines() const { return lines_; }
+  size_t bytes() const {
+    return sizeof(*this) + lines_.capacity() * sizeof(LineState);
+  }
+
+  void reset() {
+    for (auto&& line : lines_) {
+      line = LineState();
+    }
+    internal_ = duration(0);
+    opcodes_ = nullptr;
+    n_opcodes_ = 0;
+    current_opcode_ = nullptr;
+  }
 
  private:
-  size_t starting_line_ = 0;
-  size_t current_line_ = 0;
+  const LineMap* line_map_;
+  size_t current_slot_ = 0;
+  PyFrameObject* frame_;
   PyCodeObject* function_key_;
+  bool partial_ = false;
+  time_point start_;
   std::vector<LineState> lines_;
+  OpcodeRecord* opcodes_ = nullptr;
+  size_t n_opcodes_ = 0;
+  OpcodeRecord* current_opcode_ = nullptr;
   duration internal_ = duration(0);
 };
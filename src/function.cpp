@@ -1,15 +1,123 @@
 #include "function.h"
 
+#include <algorithm>
+
+// Line of every instruction in the code object, indexed by instruction,
+// decoded from co_linetable on Python 3.10 and from co_lnotab before.
+static std::vector<size_t> InstructionLines(PyCodeObject* code) {
+  std::vector<size_t> lines(
+      PyBytes_GET_SIZE(code->co_code) / sizeof(_Py_CODEUNIT));
+  size_t address = 0;
+  size_t next = 0;
+  long line = code->co_firstlineno;
+#if PY_VERSION_HEX >= 0x030A0000
+  // (byte delta, line delta) pairs, each covering the bytes up to the next
+  // pair at its line. Instructions without a line, such as the cleanup of a
+  // with block, keep the line before them.
+  auto* table = reinterpret_cast<const unsigned char*>(
+      PyBytes_AS_STRING(code->co_linetable));
+  Py_ssize_t size = PyBytes_GET_SIZE(code->co_linetable);
+  for (Py_ssize_t i = 0; i + 1 < size; i += 2) {
+    auto line_delta = static_cast<signed char>(table[i + 1]);
+    if (line_delta != -128) {
+      line += line_delta;
+    }
+    address += table[i];
+    size_t end = std::min(lines.size(), address / sizeof(_Py_CODEUNIT));
+    for (; next < end; ++next) {
+      lines[next] = line;
+    }
+  }
+#else
+  auto* lnotab =
+      reinterpret_cast<const unsigned char*>(PyBytes_AS_STRING(code->co_lnotab));
+  Py_ssize_t size = PyBytes_GET_SIZE(code->co_lnotab);
+  for (Py_ssize_t i = 0; i + 1 < size; i += 2) {
+    address += lnotab[i];
+    size_t end = std::min(lines.size(), address / sizeof(_Py_CODEUNIT));
+    for (; next < end; ++next) {
+      lines[next] = line;
+    }
+    line += static_cast<signed char>(lnotab[i + 1]);
+  }
+#endif
+  for (; next < lines.size(); ++next) {
+    lines[next] = line;
+  }
+  return lines;
+}
+
+LineMap::LineMap(PyCodeObject* code) {
+  auto lines = InstructionLines(code);
+  // Line numbers may step backwards in the line table; nothing lies before the
+  // first line, though.
+  size_t first_line = code->co_firstlineno;
+  for (auto& line : lines) {
+    line = std::max(line, first_line);
+  }
+  lines_ = lines;
+  lines_.push_back(first_line);
+  std::sort(lines_.begin(), lines_.end());
+  lines_.erase(std::unique(lines_.begin(), lines_.end()), lines_.end());
+  lines_.shrink_to_fit();
+  slots_.resize(lines.size());
+  for (size_t i = 0; i < lines.size(); ++i) {
+    slots_[i] = std::lower_bound(lines_.begin(), lines_.end(), lines[i]) -
+        lines_.begin();
+  }
+}
+
 void BaseFunction::add_elapsed_internal(const duration& time) {
   internal_time_ += time;
 }
 
+void BaseFunction::forget_callers(
+    const std::unordered_set<PyCodeObject*>& codes) {
+  CallEdge outside;
+  bool folded = false;
+  for (auto it = callers_.begin(); it != callers_.end();) {
+    if (it->first.code != nullptr && codes.count(it->first.code) != 0) {
+      outside.merge(it->second);
+      it = callers_.erase(it);
+      folded = true;
+    } else {
+      ++it;
+    }
+  }
+  if (folded) {
+    callers_[CallSite{nullptr, 0}].merge(outside);
+  }
+}
+
 Function::Function(
-    std::string name, std::vector<std::string> lines, PyCodeObject* code)
-      : BaseFunction(std::move(name)), code_(code) {
-  auto n_lines = lines_.size();
-  lines_.reserve(n_lines);
-  for (auto&& line : lines) {
-    lines_.emplace_back(line);
+    std::string name, std::string filename, PyCodeObject* code,
+    std::shared_ptr<const LineMap> line_map)
+      : BaseFunction(std::move(name)), code_(code),
+        filename_(std::move(filename)), line_map_(std::move(line_map)),
+        lines_(line_map_->n_slots()) {
+}
+
+void Function::select_opcodes(bool selected, PyCodeObject* code) {
+  opcode_selection_ = selected ? OpcodeSelection::kOn : OpcodeSelection::kOff;
+  if (!selected || !opcodes_.empty()) {
+    return;
+  }
+  auto* instructions =
+      reinterpret_cast<const _Py_CODEUNIT*>(PyBytes_AS_STRING(code->co_code));
+  opcodes_.resize(PyBytes_GET_SIZE(code->co_code) / sizeof(_Py_CODEUNIT));
+  for (size_t i = 0; i < opcodes_.size(); ++i) {
+    opcodes_[i].opcode = _Py_OPCODE(instructions[i]);
+    opcodes_[i].line = line_map_->line(line_map_->instruction_slot(i));
+  }
+}
+
+Function Function::cleared() const {
+  Function function(name(), filename_, code_, line_map_);
+  function.opcode_selection_ = opcode_selection_;
+  function.opcodes_.resize(opcodes_.size());
+  for (size_t i = 0; i < opcodes_.size(); ++i) {
+    function.opcodes_[i].opcode = opcodes_[i].opcode;
+    function.opcodes_[i].line = opcodes_[i].line;
   }
+  return function;
 }
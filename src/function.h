@@ -1,13 +1,126 @@
 #pragma once
 
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
 #include <chrono>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include "line.h"
+#include "native.h"
+
+// Calls into a function from one caller, as pstats reports them: calls,
+// primitive (non-recursive) calls, time in the callee itself and time
+// including its callees. Cumulative time only counts primitive calls, so a
+// recursive function's time is not counted once per level.
+struct CallEdge {
+  size_t n_calls = 0;
+  size_t primitive_calls = 0;
+  duration internal = duration(0);
+  duration total = duration(0);
+
+  void add(bool primitive, const duration& self, const duration& cumulative) {
+    ++n_calls;
+    if (primitive) {
+      ++primitive_calls;
+      total += cumulative;
+    }
+    internal += self;
+  }
+
+  void merge(const CallEdge& other) {
+    n_calls += other.n_calls;
+    primitive_calls += other.primitive_calls;
+    internal += other.internal;
+    total += other.total;
+  }
+};
+
+// Where a call came from: the calling function's code object and the line
+// it was on. A null code object stands for calls from outside any profiled
+// frame.
+struct CallSite {
+  PyCodeObject* code;
+  size_t line;
+
+  bool operator==(const CallSite& rhs) const {
+    return code == rhs.code && line == rhs.line;
+  }
+};
+
+struct CallSiteHash {
+  size_t operator()(const CallSite& site) const {
+    return std::hash<PyCodeObject*>()(site.code) * 31 + site.line;
+  }
+};
+
+// Index of the instruction at f_lasti, which counts bytes before Python 3.10
+// and code units since; negative before the first instruction runs.
+inline int InstructionIndex(int lasti) {
+#if PY_VERSION_HEX >= 0x030A0000
+  return lasti;
+#else
+  return lasti < 0 ? lasti : lasti / static_cast<int>(sizeof(_Py_CODEUNIT));
+#endif
+}
+
+// Dense line slots of a code object, decoded from its line table once when the
+// code object is first seen. The first line and every line with bytecode get
+// a slot, in line order, and every instruction maps to its line's slot, so a
+// line event finds its statistics with one array load and blank lines,
+// comments and docstrings take no room.
+class LineMap {
+ public:
+  explicit LineMap(PyCodeObject* code);
+
+  size_t n_slots() const { return lines_.size(); }
+  // Slot of the instruction at f_lasti; the first slot before the first
+  // instruction runs.
+  size_t slot(int lasti) const {
+    return instruction_slot(InstructionIndex(lasti));
+  }
+  size_t instruction_slot(int index) const {
+    return index < 0 || static_cast<size_t>(index) >= slots_.size() ?
+        0 : slots_[index];
+  }
+  size_t line(size_t slot) const { return lines_[slot]; }
+  size_t first_line() const { return lines_.front(); }
+  size_t last_line() const { return lines_.back(); }
+  size_t bytes() const {
+    return sizeof(*this) + slots_.capacity() * sizeof(uint32_t) +
+        lines_.capacity() * sizeof(size_t);
+  }
+
+ private:
+  // Indexed by instruction, see InstructionIndex().
+  std::vector<uint32_t> slots_;
+  // Line of each slot, ascending.
+  std::vector<size_t> lines_;
+};
+
+// Statistics of one bytecode instruction of a function traced per opcode.
+// The opcode and its line are decoded from the code object when the records
+// are allocated, so they can be dumped after the code object is gone.
+struct OpcodeRecord {
+  uint8_t opcode = 0;
+  size_t line = 0;
+  size_t n_calls = 0;
+  duration internal = duration(0);
+  duration external = duration(0);
+};
+
+// Whether a function is traced per opcode, decided when it is first entered
+// after the selection changed.
+enum class OpcodeSelection : uint8_t {
+  kUnknown,
+  kOff,
+  kOn,
+};
 
 class BaseFunction {
  public:
@@ -20,23 +133,109 @@ class BaseFunction {
   void add_call() { ++n_calls_; }
   size_t n_calls() const { return n_calls_; }
 
+  // In bounded mode, calls this record may have lost while it was evicted.
+  size_t error_calls() const { return error_calls_; }
+  void set_error_calls(size_t error_calls) { error_calls_ = error_calls; }
+
+  CallEdge& caller(const CallSite& site) { return callers_[site]; }
+  const auto& callers() const { return callers_; }
+  // Folds the edges from the given callers into calls from outside, before
+  // their code objects are released and the addresses can be reused.
+  void forget_callers(const std::unordered_set<PyCodeObject*>& codes);
+
+  // Native stacks sampled during calls of a C function. A stack kept for a
+  // long call may stand for several samples.
+  void add_native_sample(NativeStack stack, duration interval,
+                         uint64_t weight) {
+    NativeCount& count = native_[std::move(stack)];
+    count.samples += weight;
+    count.time += interval * weight;
+  }
+  const NativeProfile& native() const { return native_; }
+  // Samples of this C function's calls whose stacks were not kept.
+  void add_native_dropped(uint64_t n) { native_dropped_ += n; }
+  uint64_t native_dropped() const { return native_dropped_; }
+
  private:
   size_t n_calls_ = 0;
+  size_t error_calls_ = 0;
   std::string name_;
   std::chrono::nanoseconds internal_time_ = duration(0);
+  std::unordered_map<CallSite, CallEdge, CallSiteHash> callers_;
+  NativeProfile native_;
+  uint64_t native_dropped_ = 0;
 };
 
 class Function : public BaseFunction {
  public:
-  Function(std::string name, std::vector<std::string> lines, PyCodeObject*);
+  Function(std::string name, std::string filename, PyCodeObject*,
+           std::shared_ptr<const LineMap> line_map);
 
   PyCodeObject* const code() const noexcept { return code_; }
+  const std::string& filename() const { return filename_; }
+  // Line number of lines()[0].
+  size_t first_line() const { return line_map_->first_line(); }
+  // Line records are indexed by the slots of line_map().
   size_t n_lines() const { return lines_.size(); }
   const auto& lines() const { return lines_; }
+  const LineMap& line_map() const { return *line_map_; }
+
+  LineRecord& line(size_t slot) { return lines_[slot]; }
+  // Lines from first_line() to the last line with code. visit(line_number,
+  // record) sees each of them, with an empty record for lines without a
+  // slot, so the source span reads the same as a non-dense table.
+  size_t span() const {
+    return line_map_->last_line() - line_map_->first_line() + 1;
+  }
+  template <typename Visit>
+  void for_each_line(Visit visit) const {
+    static const LineRecord empty;
+    size_t slot = 0;
+    for (size_t line = first_line(); line <= line_map_->last_line(); ++line) {
+      if (line_map_->line(slot) == line) {
+        visit(line, lines_[slot++]);
+      } else {
+        visit(line, empty);
+      }
+    }
+  }
+
+  // Number of frames of this function on the shadow stack. Active functions
+  // are never evicted.
+  void enter() { ++active_frames_; }
+  void leave() { --active_frames_; }
+  bool active() const { return active_frames_ != 0; }
+
+  // Returns of frames that were already running when profiling started, so
+  // their call was never seen.
+  void add_partial_call() { ++partial_calls_; }
+  size_t partial_calls() const { return partial_calls_; }
+
+  OpcodeSelection opcode_selection() const { return opcode_selection_; }
+  void reset_opcode_selection() { opcode_selection_ = OpcodeSelection::kUnknown; }
+  // Selects or deselects the function for opcode tracing. Records are
+  // allocated from code, which must be live, the first time it is selected,
+  // and kept when it is deselected.
+  void select_opcodes(bool selected, PyCodeObject* code);
+  bool traces_opcodes() const {
+    return opcode_selection_ == OpcodeSelection::kOn;
+  }
+  // Per-instruction records, indexed by InstructionIndex(f_lasti).
+  // Empty unless the function was ever selected for opcode tracing.
+  std::vector<OpcodeRecord>& opcodes() { return opcodes_; }
+  const std::vector<OpcodeRecord>& opcodes() const { return opcodes_; }
 
-  LineRecord& line(size_t line_number) { return lines_.at(line_number); }
+  // Same function and line span with all statistics zeroed.
+  Function cleared() const;
 
  private:
   PyCodeObject* code_;
+  std::string filename_;
+  // Shared with the records cleared() makes, and outlives the code object.
+  std::shared_ptr<const LineMap> line_map_;
   std::vector<LineRecord> lines_;
+  std::vector<OpcodeRecord> opcodes_;
+  OpcodeSelection opcode_selection_ = OpcodeSelection::kUnknown;
+  size_t active_frames_ = 0;
+  size_t partial_calls_ = 0;
 };
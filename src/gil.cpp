@@ -0,0 +1,289 @@
+#include "gil.h"
+
+#include <errno.h>
+#include <link.h>
+#include <pythread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <deque>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Every thread that went through a wrapper, in a deque so records keep their
+// address. Only grown by a thread holding the GIL.
+std::deque<GilThread> records;
+thread_local GilThread* current = nullptr;
+
+void (*restore_thread)(PyThreadState*) = nullptr;
+PyThreadState* (*save_thread)() = nullptr;
+
+GilThread& CurrentThread() {
+  if (current == nullptr) {
+    records.emplace_back();
+    records.back().id = PyThread_get_thread_ident();
+    current = &records.back();
+  }
+  return *current;
+}
+
+// Adds the span open since thread.span_start, up to now, to the totals.
+void CloseSpan(GilThread& thread, const ThreadClock& now) {
+  thread.profiled +=
+      std::chrono::duration_cast<duration>(now.wall - thread.span_start.wall);
+  thread.cpu += now.cpu - thread.span_start.cpu;
+}
+
+// Callers check errno right after Py_END_ALLOW_THREADS, so the bookkeeping
+// must leave it alone.
+void RestoreThread(PyThreadState* tstate) {
+  auto start = Clock::now();
+  restore_thread(tstate);
+  auto end = Clock::now();
+  int saved_errno = errno;
+  GilThread& thread = CurrentThread();
+  auto wait = std::chrono::duration_cast<duration>(end - start);
+  ++thread.n_waits;
+  thread.wait += wait;
+  ++thread.pending.n_waits;
+  thread.pending.wait += wait;
+  thread.holding = true;
+  thread.acquired = end;
+  if (thread.releasing && thread.in_span) {
+    thread.released +=
+        std::chrono::duration_cast<duration>(end - thread.released_at);
+  }
+  thread.releasing = false;
+  errno = saved_errno;
+}
+
+PyThreadState* SaveThread() {
+  int saved_errno = errno;
+  GilThread& thread = CurrentThread();
+  auto now = Clock::now();
+  if (thread.holding) {
+    thread.hold += std::chrono::duration_cast<duration>(now - thread.acquired);
+    thread.holding = false;
+  }
+  thread.releasing = true;
+  thread.released_at = now;
+  errno = saved_errno;
+  return save_thread();
+}
+
+void WriteSlot(void** address, void* value, bool read_only) {
+  if (!read_only) {
+    *address = value;
+    return;
+  }
+  uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  void* page = reinterpret_cast<void*>(
+      reinterpret_cast<uintptr_t>(address) & ~(page_size - 1));
+  if (mprotect(page, page_size, PROT_READ | PROT_WRITE) == 0) {
+    *address = value;
+    mprotect(page, page_size, PROT_READ);
+  }
+}
+
+}  // namespace
+
+ThreadClock ThreadClock::now() {
+  ThreadClock clock;
+  clock.wall = Clock::now();
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  clock.cpu = std::chrono::duration_cast<duration>(
+      std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec));
+  return clock;
+}
+
+duration ThreadClock::off_cpu_since(const ThreadClock& start) const {
+  auto off = std::chrono::duration_cast<duration>(wall - start.wall) -
+             (cpu - start.cpu);
+  return off.count() > 0 ? off : duration(0);
+}
+
+GilMonitor::~GilMonitor() {
+  uninstall();
+}
+
+int GilMonitor::patch_object(struct dl_phdr_info* info, size_t, void* arg) {
+#if defined(__x86_64__) || defined(__aarch64__)
+#if defined(__x86_64__)
+  constexpr unsigned kJumpSlot = R_X86_64_JUMP_SLOT;
+#else
+  constexpr unsigned kJumpSlot = R_AARCH64_JUMP_SLOT;
+#endif
+  auto* monitor = static_cast<GilMonitor*>(arg);
+  const ElfW(Dyn)* dynamic = nullptr;
+  uintptr_t relro_begin = 0;
+  uintptr_t relro_end = 0;
+  for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr)& header = info->dlpi_phdr[i];
+    if (header.p_type == PT_DYNAMIC) {
+      dynamic = reinterpret_cast<const ElfW(Dyn)*>(
+          info->dlpi_addr + header.p_vaddr);
+    } else if (header.p_type == PT_GNU_RELRO) {
+      relro_begin = info->dlpi_addr + header.p_vaddr;
+      relro_end = relro_begin + header.p_memsz;
+    }
+  }
+  if (dynamic == nullptr) {
+    return 0;
+  }
+
+  uintptr_t symtab = 0;
+  uintptr_t strtab = 0;
+  uintptr_t jmprel = 0;
+  size_t pltrelsz = 0;
+  for (const ElfW(Dyn)* entry = dynamic; entry->d_tag != DT_NULL; ++entry) {
+    switch (entry->d_tag) {
+      case DT_SYMTAB:
+        symtab = entry->d_un.d_ptr;
+        break;
+      case DT_STRTAB:
+        strtab = entry->d_un.d_ptr;
+        break;
+      case DT_JMPREL:
+        jmprel = entry->d_un.d_ptr;
+        break;
+      case DT_PLTRELSZ:
+        pltrelsz = entry->d_un.d_val;
+        break;
+    }
+  }
+  if (symtab == 0 || strtab == 0 || jmprel == 0) {
+    return 0;
+  }
+  // The loader relocates these entries in place on most targets, but not in
+  // every object (the vDSO).
+  auto relocate = [info](uintptr_t value) {
+    return value < info->dlpi_addr ? value + info->dlpi_addr : value;
+  };
+  auto* symbols = reinterpret_cast<const ElfW(Sym)*>(relocate(symtab));
+  auto* names = reinterpret_cast<const char*>(relocate(strtab));
+  auto* relocations = reinterpret_cast<const ElfW(Rela)*>(relocate(jmprel));
+
+  for (size_t i = 0; i < pltrelsz / sizeof(ElfW(Rela)); ++i) {
+    const ElfW(Rela)& relocation = relocations[i];
+    if (ELF64_R_TYPE(relocation.r_info) != kJumpSlot) {
+      continue;
+    }
+    const char* name = names + symbols[ELF64_R_SYM(relocation.r_info)].st_name;
+    void* wrapper;
+    void* original;
+    if (std::strcmp(name, "PyEval_RestoreThread") == 0) {
+      wrapper = reinterpret_cast<void*>(RestoreThread);
+      original = reinterpret_cast<void*>(restore_thread);
+    } else if (std::strcmp(name, "PyEval_SaveThread") == 0) {
+      wrapper = reinterpret_cast<void*>(SaveThread);
+      original = reinterpret_cast<void*>(save_thread);
+    } else {
+      continue;
+    }
+    auto** address =
+        reinterpret_cast<void**>(info->dlpi_addr + relocation.r_offset);
+    if (*address == wrapper) {
+      continue;
+    }
+    uintptr_t slot = reinterpret_cast<uintptr_t>(address);
+    bool read_only = slot >= relro_begin && slot < relro_end;
+    WriteSlot(address, wrapper, read_only);
+    monitor->slots_.push_back(Slot{address, original, read_only});
+  }
+#else
+  (void)info;
+  (void)arg;
+#endif
+  return 0;
+}
+
+size_t GilMonitor::install() {
+  // The wrappers call the functions through these: the objects' own slots,
+  // this one's included, may already point at the wrappers.
+  restore_thread = PyEval_RestoreThread;
+  save_thread = PyEval_SaveThread;
+  dl_iterate_phdr(patch_object, this);
+  installed_ = true;
+  return slots_.size();
+}
+
+void GilMonitor::uninstall() {
+  for (auto&& slot : slots_) {
+    WriteSlot(slot.address, slot.original, slot.read_only);
+  }
+  slots_.clear();
+  installed_ = false;
+}
+
+GilWait GilMonitor::take_pending() {
+  if (current == nullptr) {
+    return GilWait();
+  }
+  GilWait pending = current->pending;
+  current->pending = GilWait();
+  return pending;
+}
+
+void GilMonitor::begin_span() {
+  GilThread& thread = CurrentThread();
+  if (!thread.in_span) {
+    thread.in_span = true;
+    thread.span_start = ThreadClock::now();
+  }
+}
+
+void GilMonitor::end_span() {
+  if (current != nullptr && current->in_span) {
+    CloseSpan(*current, ThreadClock::now());
+    current->in_span = false;
+  }
+}
+
+std::vector<GilThread> GilMonitor::threads() {
+  // One forced switch costs the thread up to an interval off the CPU; allow
+  // half of one, and a percent of the span for the scheduler's own noise.
+  auto interval = std::chrono::duration_cast<duration>(
+      std::chrono::microseconds(_PyEval_GetSwitchInterval()));
+  std::vector<GilThread> result;
+  result.reserve(records.size());
+  for (auto& thread : records) {
+    result.push_back(thread);
+    GilThread& view = result.back();
+    if (&thread == current && thread.holding) {
+      view.hold += std::chrono::duration_cast<duration>(
+          Clock::now() - thread.acquired);
+    }
+    if (&thread == current && thread.in_span) {
+      CloseSpan(view, ThreadClock::now());
+    }
+    auto unexplained = view.profiled - view.cpu - view.released;
+    view.hold_exact = view.profiled.count() > 0 &&
+                      unexplained <= interval / 2 + view.profiled / 100;
+  }
+  return result;
+}
+
+void GilMonitor::reset() {
+  auto now = Clock::now();
+  for (auto& thread : records) {
+    thread.n_waits = 0;
+    thread.wait = duration(0);
+    thread.hold = duration(0);
+    thread.profiled = duration(0);
+    thread.cpu = duration(0);
+    thread.released = duration(0);
+    thread.pending = GilWait();
+    thread.acquired = now;
+    thread.releasing = false;
+    if (&thread == current && thread.in_span) {
+      thread.span_start = ThreadClock::now();
+    } else {
+      thread.in_span = false;
+    }
+  }
+}
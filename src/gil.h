@@ -0,0 +1,108 @@
+#pragma once
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+
+// Waits for the GIL, of one thread or attributed to one line. off_cpu is
+// the wall time the C calls at a line spent off the CPU: it includes the
+// timed waits, and also waits no wrapper saw.
+struct GilWait {
+  uint64_t n_waits = 0;
+  duration wait = duration(0);
+  duration off_cpu = duration(0);
+};
+
+// Wall and CPU time of the calling thread. Between two readings, the wall
+// time not spent on the CPU is time waiting: for the GIL, in a blocking
+// system call, or for the scheduler.
+struct ThreadClock {
+  std::chrono::steady_clock::time_point wall;
+  duration cpu = duration(0);
+
+  static ThreadClock now();
+  // Wall time since start not spent on the CPU, never negative.
+  duration off_cpu_since(const ThreadClock& start) const;
+};
+
+// GIL totals of one thread. Hold time runs from a reacquire to the next
+// release through PyEval_SaveThread; the eval loop's forced switches between
+// threads running bytecode do not go through it and are not seen. Those
+// show as off-CPU time the thread's releases do not explain, so hold_exact
+// is only set when the profiled spans of the thread have little of it.
+struct GilThread {
+  uint64_t id = 0;
+  uint64_t n_waits = 0;
+  duration wait = duration(0);
+  duration hold = duration(0);
+  // Wall and CPU time while the profiler's hooks were on the thread, and
+  // the part of it from each release through a wrapper to the reacquire.
+  duration profiled = duration(0);
+  duration cpu = duration(0);
+  duration released = duration(0);
+  bool hold_exact = false;
+  // Waits not yet handed to the profiler.
+  GilWait pending;
+  bool holding = false;
+  std::chrono::steady_clock::time_point acquired;
+  bool releasing = false;
+  std::chrono::steady_clock::time_point released_at;
+  bool in_span = false;
+  ThreadClock span_start;
+};
+
+// Measures how long threads wait to get the GIL back. Extension modules and
+// libpython itself call PyEval_SaveThread and PyEval_RestoreThread (what
+// Py_BEGIN/END_ALLOW_THREADS expand to) through their PLT, so install()
+// points those GOT slots of every loaded object at wrappers that time the
+// original. Where the calls are bound directly (a statically linked
+// interpreter) nothing is patched and no waits are seen.
+//
+// The wrappers only touch the records while their thread holds the GIL, as
+// does every reader, so the records need no locks.
+class GilMonitor {
+ public:
+  GilMonitor() = default;
+  ~GilMonitor();
+  GilMonitor(const GilMonitor&) = delete;
+  GilMonitor& operator=(const GilMonitor&) = delete;
+
+  // Patches the objects loaded so far; call again to catch objects loaded
+  // since. Returns the number of GOT slots patched in total.
+  size_t install();
+  // Restores every patched slot.
+  void uninstall();
+  bool installed() const { return installed_; }
+  size_t n_slots() const { return slots_.size(); }
+
+  // Waits of the calling thread since the last call.
+  static GilWait take_pending();
+  // Bracket the time the profiler's hooks are on the calling thread, which
+  // profiled, cpu and released cover.
+  static void begin_span();
+  static void end_span();
+  // Per-thread totals, with the calling thread's current hold and span
+  // included, and hold_exact decided.
+  static std::vector<GilThread> threads();
+  // Zeroes every thread's totals, as after fork(). Only the calling thread
+  // still exists; its open span restarts.
+  static void reset();
+
+ private:
+  struct Slot {
+    void** address;
+    void* original;
+    // In a PT_GNU_RELRO segment, which is read-only after relocation.
+    bool read_only;
+  };
+
+  static int patch_object(struct dl_phdr_info* info, size_t, void* arg);
+
+  bool installed_ = false;
+  std::vector<Slot> slots_;
+};
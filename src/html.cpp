@@ -0,0 +1,286 @@
+#include "html.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include "report.h"
+
+namespace {
+
+const char kHead[] = R"(<!DOCTYPE html>
+<html><head><meta charset="utf-8"><title>bprof report</title>
+<style>
+body{font:13px/1.4 sans-serif;margin:0 1em}
+pre,code,td.src{font-family:monospace;white-space:pre}
+table{border-collapse:collapse}
+td,th{padding:0 .5em;text-align:right}
+td.src,td.name{text-align:left}
+th{cursor:pointer;position:sticky;top:0;background:#eee}
+.file{display:none}
+.file:target,.file.shown{display:block}
+tr:target{outline:2px solid #36c}
+details{margin:.2em 0}
+</style></head><body>
+<h1>bprof report</h1>
+)";
+
+const char kTail[] = R"(<script>
+function show(){
+  document.querySelectorAll('.file.shown').forEach(function(e){
+    e.classList.remove('shown');});
+  var t=document.getElementById(decodeURIComponent(location.hash.slice(1)));
+  var f=t&&t.closest('.file');
+  if(f){f.classList.add('shown');t.scrollIntoView();}
+}
+window.addEventListener('hashchange',show);show();
+document.querySelectorAll('table.sortable th').forEach(function(th,i){
+  th.addEventListener('click',function(){
+    var body=th.closest('table').tBodies[0];
+    var rows=Array.prototype.slice.call(body.rows);
+    var desc=th.dataset.desc!=='1';th.dataset.desc=desc?'1':'0';
+    rows.sort(function(a,b){
+      var x=a.cells[i].dataset.v||a.cells[i].textContent;
+      var y=b.cells[i].dataset.v||b.cells[i].textContent;
+      var nx=parseFloat(x),ny=parseFloat(y);
+      var c=isNaN(nx)||isNaN(ny)?x.localeCompare(y):nx-ny;
+      return desc?-c:c;});
+    rows.forEach(function(r){body.appendChild(r);});
+  });
+});
+</script></body></html>
+)";
+
+class HtmlWriter {
+ public:
+  explicit HtmlWriter(const std::string& path)
+      : path_(path), out_(path, std::ios::binary | std::ios::trunc) {
+    if (!out_) {
+      throw std::runtime_error("Could not open `" + path + "' for writing");
+    }
+  }
+
+  HtmlWriter& operator<<(std::string_view raw) {
+    out_.write(raw.data(), raw.size());
+    return *this;
+  }
+  HtmlWriter& operator<<(uint64_t value) {
+    char buffer[24];
+    int n = std::snprintf(buffer, sizeof(buffer), "%llu",
+                          static_cast<unsigned long long>(value));
+    out_.write(buffer, n);
+    return *this;
+  }
+
+  void escaped(std::string_view text) {
+    size_t start = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+      const char* entity = nullptr;
+      switch (text[i]) {
+        case '&': entity = "&amp;"; break;
+        case '<': entity = "&lt;"; break;
+        case '>': entity = "&gt;"; break;
+        case '"': entity = "&quot;"; break;
+        case '\n': case '\r': entity = ""; break;
+      }
+      if (entity != nullptr) {
+        out_.write(text.data() + start, i - start);
+        *this << entity;
+        start = i + 1;
+      }
+    }
+    out_.write(text.data() + start, text.size() - start);
+  }
+
+  void milliseconds(uint64_t ns) {
+    char buffer[32];
+    int n = std::snprintf(buffer, sizeof(buffer), "%.3f", ns / 1e6);
+    out_.write(buffer, n);
+  }
+
+  // A numeric cell shaded by value relative to max; the square root keeps
+  // moderately hot lines visible next to the hottest one.
+  void heat_cell(uint64_t value, uint64_t max, const char* rgb, bool time) {
+    if (value == 0) {
+      *this << "<td></td>";
+      return;
+    }
+    double heat = std::sqrt(double(value) / double(max));
+    char buffer[64];
+    int n = std::snprintf(buffer, sizeof(buffer),
+                          "<td style=\"background:rgba(%s,%.2f)\">", rgb, heat);
+    out_.write(buffer, n);
+    if (time) {
+      milliseconds(value);
+    } else {
+      *this << value;
+    }
+    *this << "</td>";
+  }
+
+  void finish() {
+    out_.flush();
+    if (!out_) {
+      throw std::runtime_error("Could not write `" + path_ + "'");
+    }
+  }
+
+ private:
+  std::string path_;
+  std::ofstream out_;
+};
+
+const char kInternalRgb[] = "230,80,40";
+const char kExternalRgb[] = "60,110,220";
+const char kCallsRgb[] = "60,170,80";
+
+}  // namespace
+
+void WriteHtmlReport(
+    const MappedDump& dump, const std::string& path, size_t n_hot_lines) {
+  auto functions = dump.records<DumpFunction>(DumpSection::kFunctions);
+  auto lines = dump.records<DumpLine>(DumpSection::kLines);
+  Report report = BuildReport(dump, DiffKey::kTotal, n_hot_lines);
+
+  // Functions grouped by file, and every line row ordered by (file, line),
+  // so each file page is written in one sweep.
+  std::vector<uint64_t> order(functions.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  auto filename = [&](uint64_t f) { return dump.string(functions[f].filename); };
+  std::sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b) {
+    auto fa = filename(a);
+    auto fb = filename(b);
+    return fa != fb ? fa < fb : functions[a].first_line < functions[b].first_line;
+  });
+  struct Row {
+    uint64_t file;
+    uint64_t row;
+  };
+  std::vector<uint64_t> file_of(functions.size());
+  std::vector<Row> rows;
+  rows.reserve(lines.size());
+  uint64_t max_internal = 0;
+  uint64_t max_external = 0;
+  uint64_t max_calls = 0;
+  for (size_t i = 0, file = 0; i < order.size(); ++i) {
+    if (i != 0 && filename(order[i]) != filename(order[i - 1])) {
+      ++file;
+    }
+    file_of[order[i]] = file;
+    const auto& function = functions[order[i]];
+    if (function.line_begin > lines.size() ||
+        function.line_count > lines.size() - function.line_begin) {
+      throw std::runtime_error("Corrupt bprof dump function");
+    }
+    for (uint64_t row = function.line_begin;
+         row < function.line_begin + function.line_count; ++row) {
+      rows.push_back(Row{file, row});
+      max_internal = std::max(max_internal, lines[row].internal_ns);
+      max_external = std::max(max_external, lines[row].external_ns);
+      max_calls = std::max(max_calls, lines[row].n_calls);
+    }
+  }
+  // Rows of one file are contiguous; order them by line number within it.
+  std::stable_sort(rows.begin(), rows.end(), [&](const Row& a, const Row& b) {
+    return a.file != b.file ? a.file < b.file
+        : lines[a.row].line_number < lines[b.row].line_number;
+  });
+
+  HtmlWriter out(path);
+  out << kHead;
+
+  out << "<h2>Hottest lines</h2>\n<table class=\"sortable\"><thead><tr>"
+         "<th>total ms</th><th>self ms</th><th>ext ms</th><th>calls</th>"
+         "<th>function</th><th>line</th><th>source</th></tr></thead><tbody>\n";
+  for (auto row : report.lines) {
+    const auto& line = lines[row];
+    if (line.function >= functions.size()) {
+      throw std::runtime_error("Corrupt bprof dump line");
+    }
+    const auto& function = functions[line.function];
+    out << "<tr><td data-v=\"" << (line.internal_ns + line.external_ns)
+        << "\">";
+    out.milliseconds(line.internal_ns + line.external_ns);
+    out << "</td><td data-v=\"" << line.internal_ns << "\">";
+    out.milliseconds(line.internal_ns);
+    out << "</td><td data-v=\"" << line.external_ns << "\">";
+    out.milliseconds(line.external_ns);
+    out << "</td><td>" << line.n_calls << "</td><td class=\"name\">";
+    out.escaped(dump.string(function.name));
+    out << "</td><td class=\"name\"><a href=\"#f" << file_of[line.function]
+        << "-L" << line.line_number << "\">";
+    out.escaped(dump.string(function.filename));
+    out << ":" << line.line_number << "</a></td><td class=\"src\">";
+    out.escaped(dump.string(line.text));
+    out << "</td></tr>\n";
+  }
+  out << "</tbody></table>\n";
+
+  out << "<h2>Functions</h2>\n";
+  for (size_t i = 0; i < order.size(); ++i) {
+    uint64_t f = order[i];
+    bool first_of_file = i == 0 || file_of[order[i - 1]] != file_of[f];
+    bool last_of_file = i + 1 == order.size() || file_of[order[i + 1]] != file_of[f];
+    if (first_of_file) {
+      out << "<details><summary><a href=\"#f" << file_of[f] << "\">";
+      out.escaped(filename(f));
+      out << "</a></summary><ul>\n";
+    }
+    const auto& function = functions[f];
+    out << "<li><a href=\"#f" << file_of[f] << "-L" << function.first_line
+        << "\">";
+    out.escaped(dump.string(function.name));
+    out << "</a> " << function.n_calls << " calls</li>\n";
+    if (last_of_file) {
+      out << "</ul></details>\n";
+    }
+  }
+
+  for (size_t i = 0, f = 0; i < rows.size();) {
+    uint64_t file = rows[i].file;
+    // order[f] is the first function of this file.
+    while (file_of[order[f]] != file) {
+      ++f;
+    }
+    out << "<section class=\"file\" id=\"f" << file << "\"><h2>";
+    out.escaped(filename(order[f]));
+    out << "</h2>\n<table><thead><tr><th>line</th><th>self ms</th>"
+           "<th>ext ms</th><th>calls</th><th></th></tr></thead><tbody>\n";
+    while (i < rows.size() && rows[i].file == file) {
+      // Lines shared by nested functions are summed into one row.
+      uint64_t line_number = lines[rows[i].row].line_number;
+      uint64_t internal_ns = 0;
+      uint64_t external_ns = 0;
+      uint64_t n_calls = 0;
+      std::string_view text;
+      for (; i < rows.size() && rows[i].file == file &&
+               lines[rows[i].row].line_number == line_number; ++i) {
+        const auto& line = lines[rows[i].row];
+        internal_ns += line.internal_ns;
+        external_ns += line.external_ns;
+        n_calls += line.n_calls;
+        if (text.empty()) {
+          text = dump.string(line.text);
+        }
+      }
+      out << "<tr id=\"f" << file << "-L" << line_number << "\"><td>"
+          << line_number << "</td>";
+      out.heat_cell(internal_ns, max_internal, kInternalRgb, true);
+      out.heat_cell(external_ns, max_external, kExternalRgb, true);
+      out.heat_cell(n_calls, max_calls, kCallsRgb, false);
+      out << "<td class=\"src\">";
+      out.escaped(text);
+      out << "</td></tr>\n";
+    }
+    out << "</tbody></table></section>\n";
+  }
+
+  out << kTail;
+  out.finish();
+}
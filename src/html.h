@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+
+#include "dump_file.h"
+
+// Writes a self-contained HTML report of a mapped dump: one page per source
+// file with every profiled line shaded by its internal time, external time
+// and call count, a collapsible function index and a sortable table of the
+// hottest lines. The HTML is streamed straight to the output file; only the
+// row order (per file, by line number) is held in memory. Throws
+// std::runtime_error on I/O or format errors.
+void WriteHtmlReport(
+    const MappedDump& dump, const std::string& path, size_t n_hot_lines);
@@ -0,0 +1,127 @@
+#include "json_writer.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+namespace {
+
+constexpr size_t kFlushBytes = 1 << 16;
+
+}  // namespace
+
+JsonWriter::JsonWriter(const std::string& path)
+    : path_(path), out_(path, std::ios::binary | std::ios::trunc) {
+  if (!out_) {
+    throw std::runtime_error("Could not open `" + path + "' for writing");
+  }
+  buffer_.reserve(2 * kFlushBytes);
+}
+
+void JsonWriter::separate() {
+  if (after_key_) {
+    after_key_ = false;
+    return;
+  }
+  if (!empty_.empty()) {
+    if (!empty_.back()) {
+      buffer_ += ',';
+    }
+    empty_.back() = false;
+  }
+}
+
+void JsonWriter::flush_if_full() {
+  if (buffer_.size() >= kFlushBytes) {
+    out_.write(buffer_.data(), buffer_.size());
+    buffer_.clear();
+  }
+}
+
+void JsonWriter::begin_object() {
+  separate();
+  buffer_ += '{';
+  empty_.push_back(true);
+}
+
+void JsonWriter::end_object() {
+  buffer_ += '}';
+  empty_.pop_back();
+  flush_if_full();
+}
+
+void JsonWriter::begin_array() {
+  separate();
+  buffer_ += '[';
+  empty_.push_back(true);
+}
+
+void JsonWriter::end_array() {
+  buffer_ += ']';
+  empty_.pop_back();
+  flush_if_full();
+}
+
+void JsonWriter::key(std::string_view name) {
+  value(name);
+  buffer_ += ':';
+  after_key_ = true;
+}
+
+void JsonWriter::value(std::string_view str) {
+  separate();
+  buffer_ += '"';
+  size_t start = 0;
+  for (size_t i = 0; i < str.size(); ++i) {
+    unsigned char ch = str[i];
+    if (ch != '"' && ch != '\\' && ch >= 0x20) {
+      continue;
+    }
+    write(str.substr(start, i - start));
+    start = i + 1;
+    switch (ch) {
+      case '"': write("\\\""); break;
+      case '\\': write("\\\\"); break;
+      case '\n': write("\\n"); break;
+      case '\r': write("\\r"); break;
+      case '\t': write("\\t"); break;
+      default: {
+        char escape[8];
+        std::snprintf(escape, sizeof(escape), "\\u%04x", ch);
+        write(escape);
+      }
+    }
+  }
+  write(str.substr(start));
+  buffer_ += '"';
+  flush_if_full();
+}
+
+void JsonWriter::value(uint64_t number) {
+  separate();
+  char digits[24];
+  int n = std::snprintf(digits, sizeof(digits), "%llu",
+                        static_cast<unsigned long long>(number));
+  write(std::string_view(digits, n));
+}
+
+void JsonWriter::decimal(uint64_t value, int digits) {
+  uint64_t scale = 1;
+  for (int i = 0; i < digits; ++i) {
+    scale *= 10;
+  }
+  separate();
+  char text[48];
+  int n = std::snprintf(text, sizeof(text), "%llu.%0*llu",
+                        static_cast<unsigned long long>(value / scale), digits,
+                        static_cast<unsigned long long>(value % scale));
+  write(std::string_view(text, n));
+}
+
+void JsonWriter::finish() {
+  out_.write(buffer_.data(), buffer_.size());
+  buffer_.clear();
+  out_.flush();
+  if (!out_) {
+    throw std::runtime_error("Could not write `" + path_ + "'");
+  }
+}
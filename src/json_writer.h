@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Streams JSON to a file without building a document in memory. Commas are
+// inserted here; callers are trusted to nest begin/end calls correctly and
+// to give a key before every value inside an object. Throws
+// std::runtime_error on I/O errors.
+class JsonWriter {
+ public:
+  explicit JsonWriter(const std::string& path);
+
+  void begin_object();
+  void end_object();
+  void begin_array();
+  void end_array();
+  void key(std::string_view name);
+
+  void value(std::string_view str);
+  void value(uint64_t number);
+  // value / 10**digits with exactly that many decimals, for fixed-point
+  // quantities such as nanoseconds written as microseconds.
+  void decimal(uint64_t value, int digits);
+
+  // Flushes the file and reports any write error.
+  void finish();
+
+ private:
+  void separate();
+  void write(std::string_view raw) { buffer_.append(raw.data(), raw.size()); }
+  void flush_if_full();
+
+  std::string path_;
+  std::ofstream out_;
+  std::string buffer_;
+  // One entry per open object or array: whether it is still empty.
+  std::vector<bool> empty_;
+  bool after_key_ = false;
+};
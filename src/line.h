@@ -1,5 +1,6 @@
 #pragma once
 
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
 #include "common.h"
@@ -37,15 +38,8 @@ class LineState {
   // std::set<std::string> c_function_keys_;
 };
 
+// Statistics of one source line summed over every call of its function. The
+// text is not kept; it is looked up when the profile is dumped.
 class LineRecord : public LineState {
- public:
-  LineRecord(std::string line) : line_(std::move(line)) {}
-  LineRecord(LineState state, std::string line)
-      : LineState(std::move(state)), line_(std::move(line)) {}
-
-  const std::string& text() const { return line_; }
-
- private:
-  std::string line_;
 };
 
@@ -0,0 +1,637 @@
+#include "merge.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "dump_file.h"
+#include "parallel.h"
+
+namespace {
+
+using Row = std::pair<const ProfileData*, size_t>;
+
+void AppendFunction(
+    ProfileData& result, TextPool& text, const std::vector<Row>& members) {
+  auto& f = result.functions;
+  auto& l = result.lines;
+  const ProfileData& first = *members.front().first;
+  size_t first_index = members.front().second;
+  size_t index = f.size();
+
+  f.key.push_back(first.functions.key[first_index]);
+  f.name.push_back(first.functions.name[first_index]);
+  f.filename.push_back(first.functions.filename[first_index]);
+  f.first_line.push_back(first.functions.first_line[first_index]);
+  uint64_t n_calls = 0;
+  uint64_t internal_ns = 0;
+  for (auto&& member : members) {
+    n_calls += member.first->functions.n_calls[member.second];
+    internal_ns += member.first->functions.internal_ns[member.second];
+  }
+  f.n_calls.push_back(n_calls);
+  f.internal_ns.push_back(internal_ns);
+  f.line_begin.push_back(l.size());
+
+  // Line rows of every member, ordered by line number; equal line numbers
+  // are summed into one row.
+  std::vector<Row> rows;
+  for (auto&& member : members) {
+    const auto& functions = member.first->functions;
+    size_t begin = functions.line_begin[member.second];
+    size_t end = begin + functions.line_count[member.second];
+    for (size_t i = begin; i < end; ++i) {
+      rows.emplace_back(member.first, i);
+    }
+  }
+  std::stable_sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) {
+    return a.first->lines.line_number[a.second] <
+        b.first->lines.line_number[b.second];
+  });
+
+  size_t count = 0;
+  for (size_t begin = 0, end; begin < rows.size(); begin = end) {
+    const LineTable& first_lines = rows[begin].first->lines;
+    uint64_t line_number = first_lines.line_number[rows[begin].second];
+    uint64_t n_calls = 0;
+    uint64_t internal_ns = 0;
+    uint64_t external_ns = 0;
+    std::string_view line_text;
+    for (end = begin; end < rows.size(); ++end) {
+      const ProfileData& data = *rows[end].first;
+      size_t i = rows[end].second;
+      if (data.lines.line_number[i] != line_number) {
+        break;
+      }
+      n_calls += data.lines.n_calls[i];
+      internal_ns += data.lines.internal_ns[i];
+      external_ns += data.lines.external_ns[i];
+      if (line_text.empty()) {
+        line_text = data.line_text(i);
+      }
+    }
+    l.function.push_back(index);
+    l.line_number.push_back(line_number);
+    l.n_calls.push_back(n_calls);
+    l.internal_ns.push_back(internal_ns);
+    l.external_ns.push_back(external_ns);
+    text.add(line_text);
+    ++count;
+  }
+  f.line_count.push_back(count);
+}
+
+constexpr size_t kNoMatch = SIZE_MAX;
+
+uint64_t Since(uint64_t total, uint64_t base) {
+  return total > base ? total - base : 0;
+}
+
+struct CallKey {
+  uint64_t caller;
+  uint64_t caller_line;
+  uint64_t callee;
+  uint64_t callee_c;
+
+  bool operator==(const CallKey& rhs) const {
+    return caller == rhs.caller && caller_line == rhs.caller_line &&
+        callee == rhs.callee && callee_c == rhs.callee_c;
+  }
+};
+
+struct CallKeyHash {
+  size_t operator()(const CallKey& key) const {
+    size_t h = std::hash<uint64_t>()(key.caller) * 31 + key.caller_line;
+    return (h * 31 + std::hash<uint64_t>()(key.callee)) * 31 + key.callee_c;
+  }
+};
+
+using CallIndex = std::unordered_map<CallKey, size_t, CallKeyHash>;
+
+// Key of edge i of from, with rows renumbered through the function and
+// C-function maps. Callers without a row become kNoCaller.
+CallKey MapCall(const CallTable& from, size_t i,
+                const std::vector<size_t>& functions,
+                const std::vector<size_t>& c_functions) {
+  uint64_t caller = from.caller[i];
+  if (caller != CallTable::kNoCaller) {
+    caller = functions[caller] == kNoMatch ?
+        CallTable::kNoCaller : functions[caller];
+  }
+  uint64_t callee = from.callee_c[i] ?
+      c_functions[from.callee[i]] : functions[from.callee[i]];
+  return CallKey{caller, from.caller_line[i], callee, from.callee_c[i]};
+}
+
+// Adds the edges of from to result, summing edges that map to the same key.
+void MergeCalls(ProfileData& result, CallIndex& index, const CallTable& from,
+                const std::vector<size_t>& functions,
+                const std::vector<size_t>& c_functions) {
+  auto& k = result.calls;
+  for (size_t i = 0; i < from.size(); ++i) {
+    CallKey key = MapCall(from, i, functions, c_functions);
+    auto pair = index.emplace(key, k.size());
+    if (pair.second) {
+      k.push_back(key.caller, key.caller_line, key.callee, key.callee_c, 0, 0,
+                  0, 0);
+    }
+    size_t j = pair.first->second;
+    k.n_calls[j] += from.n_calls[i];
+    k.primitive_calls[j] += from.primitive_calls[i];
+    k.internal_ns[j] += from.internal_ns[i];
+    k.total_ns[j] += from.total_ns[i];
+  }
+}
+
+// Appends the opcode rows of both inputs, with functions renumbered through
+// the maps and rows for the same instruction summed, sorted by function and
+// offset.
+void MergeOpcodes(ProfileData& result, const ProfileData& a,
+                  const ProfileData& b,
+                  const std::vector<size_t> (&functions)[2]) {
+  struct OpcodeRow {
+    uint64_t function;
+    const OpcodeTable* table;
+    size_t i;
+  };
+  std::vector<OpcodeRow> rows;
+  rows.reserve(a.opcodes.size() + b.opcodes.size());
+  for (const ProfileData* data : {&a, &b}) {
+    const auto& map = functions[data == &b];
+    const auto& from = data->opcodes;
+    for (size_t i = 0; i < from.size(); ++i) {
+      rows.push_back(OpcodeRow{map[from.function[i]], &from, i});
+    }
+  }
+  std::stable_sort(rows.begin(), rows.end(),
+                   [](const OpcodeRow& x, const OpcodeRow& y) {
+    if (x.function != y.function) {
+      return x.function < y.function;
+    }
+    return x.table->offset[x.i] < y.table->offset[y.i];
+  });
+
+  auto& o = result.opcodes;
+  for (auto&& row : rows) {
+    const OpcodeTable& from = *row.table;
+    if (o.size() != 0 && o.function.back() == row.function &&
+        o.offset.back() == from.offset[row.i]) {
+      o.n_calls.back() += from.n_calls[row.i];
+      o.internal_ns.back() += from.internal_ns[row.i];
+      o.external_ns.back() += from.external_ns[row.i];
+    } else {
+      o.push_back(row.function, from.offset[row.i], from.opcode[row.i],
+                  from.line_number[row.i], from.n_calls[row.i],
+                  from.internal_ns[row.i], from.external_ns[row.i]);
+    }
+  }
+}
+
+// A native stack by C-function row and frame names.
+using NativeKey = std::pair<uint64_t, std::vector<std::string_view>>;
+
+NativeKey MapNative(const NativeTable& from, size_t i,
+                    const std::vector<size_t>& c_functions) {
+  auto first = from.frames.begin() + from.frame_begin[i];
+  return NativeKey(
+      c_functions[from.c_function[i]],
+      std::vector<std::string_view>(first, first + from.frame_count[i]));
+}
+
+// Adds the native stacks of from to result, summing stacks that map to the
+// same key.
+void MergeNative(ProfileData& result, std::map<NativeKey, size_t>& index,
+                 const NativeTable& from,
+                 const std::vector<size_t>& c_functions) {
+  auto& n = result.native;
+  for (size_t i = 0; i < from.size(); ++i) {
+    NativeKey key = MapNative(from, i, c_functions);
+    auto pair = index.emplace(key, n.size());
+    if (pair.second) {
+      n.push_back(key.first, 0, 0, key.second.begin(), key.second.end());
+    }
+    n.samples[pair.first->second] += from.samples[i];
+    n.ns[pair.first->second] += from.ns[i];
+  }
+}
+
+// Adds the GIL waits of from to result, summing waits that map to the same
+// line.
+void MergeGilWaits(
+    ProfileData& result,
+    std::map<std::pair<uint64_t, uint64_t>, size_t>& index,
+    const GilWaitTable& from, const std::vector<size_t>& functions) {
+  auto& g = result.gil_waits;
+  for (size_t i = 0; i < from.size(); ++i) {
+    uint64_t function = functions[from.function[i]];
+    auto pair = index.emplace(std::make_pair(function, from.line_number[i]),
+                              g.size());
+    if (pair.second) {
+      g.push_back(function, from.line_number[i], 0, 0, 0);
+    }
+    g.n_waits[pair.first->second] += from.n_waits[i];
+    g.wait_ns[pair.first->second] += from.wait_ns[i];
+    g.off_cpu_ns[pair.first->second] += from.off_cpu_ns[i];
+  }
+}
+
+}  // namespace
+
+ProfileData MergeProfiles(const ProfileData& a, const ProfileData& b) {
+  std::unordered_map<FunctionIdentity, size_t, FunctionIdentityHash> index;
+  std::vector<std::vector<Row>> groups;
+  // Row of every input function and C function in the result.
+  std::vector<size_t> functions[2];
+  std::vector<size_t> c_functions[2];
+  index.reserve(a.functions.size() + b.functions.size());
+  for (const ProfileData* data : {&a, &b}) {
+    auto& map = functions[data == &b];
+    for (size_t i = 0; i < data->functions.size(); ++i) {
+      auto pair = index.emplace(FunctionIdentity(data->functions, i),
+                                groups.size());
+      if (pair.second) {
+        groups.emplace_back();
+      }
+      groups[pair.first->second].emplace_back(data, i);
+      map.push_back(pair.first->second);
+    }
+  }
+
+  ProfileData result;
+  result.lines.function.reserve(a.lines.size() + b.lines.size());
+  TextPool text(result);
+  for (auto&& members : groups) {
+    AppendFunction(result, text, members);
+  }
+
+  auto& c = result.c_functions;
+  std::unordered_map<std::string_view, size_t> c_index;
+  for (const ProfileData* data : {&a, &b}) {
+    const auto& from = data->c_functions;
+    for (size_t i = 0; i < from.size(); ++i) {
+      auto pair = c_index.emplace(from.name[i], c.size());
+      if (pair.second) {
+        c.name.push_back(from.name[i]);
+        c.n_calls.push_back(0);
+        c.internal_ns.push_back(0);
+        c.native_dropped.push_back(0);
+      }
+      c.n_calls[pair.first->second] += from.n_calls[i];
+      c.internal_ns[pair.first->second] += from.internal_ns[i];
+      c.native_dropped[pair.first->second] += from.native_dropped[i];
+      c_functions[data == &b].push_back(pair.first->second);
+    }
+  }
+
+  CallIndex call_index;
+  MergeCalls(result, call_index, a.calls, functions[0], c_functions[0]);
+  MergeCalls(result, call_index, b.calls, functions[1], c_functions[1]);
+  MergeOpcodes(result, a, b, functions);
+  std::map<NativeKey, size_t> native_index;
+  MergeNative(result, native_index, a.native, c_functions[0]);
+  MergeNative(result, native_index, b.native, c_functions[1]);
+  std::map<std::pair<uint64_t, uint64_t>, size_t> gil_index;
+  MergeGilWaits(result, gil_index, a.gil_waits, functions[0]);
+  MergeGilWaits(result, gil_index, b.gil_waits, functions[1]);
+  // Threads of different processes may share an id; their rows are summed,
+  // and the hold time is exact only if it is in every row.
+  std::map<uint64_t, size_t> thread_index;
+  auto& t = result.gil_threads;
+  for (const ProfileData* data : {&a, &b}) {
+    const auto& from = data->gil_threads;
+    for (size_t i = 0; i < from.size(); ++i) {
+      auto pair = thread_index.emplace(from.thread_id[i], t.size());
+      if (pair.second) {
+        t.push_back(from.thread_id[i], 0, 0, 0, 0, 0, 0, true);
+      }
+      size_t row = pair.first->second;
+      t.n_waits[row] += from.n_waits[i];
+      t.wait_ns[row] += from.wait_ns[i];
+      t.hold_ns[row] += from.hold_ns[i];
+      t.profiled_ns[row] += from.profiled_ns[i];
+      t.cpu_ns[row] += from.cpu_ns[i];
+      t.released_ns[row] += from.released_ns[i];
+      t.hold_exact[row] = t.hold_exact[row] && from.hold_exact[i];
+    }
+  }
+
+  for (const ProfileData* data : {&a, &b}) {
+    for (auto&& counter : data->counters) {
+      result.counters[counter.first] += counter.second;
+    }
+  }
+
+  return result;
+}
+
+ProfileData SubtractProfiles(const ProfileData& total, const ProfileData& base) {
+  std::unordered_map<FunctionIdentity, size_t, FunctionIdentityHash> index;
+  index.reserve(base.functions.size());
+  for (size_t i = 0; i < base.functions.size(); ++i) {
+    index.emplace(FunctionIdentity(base.functions, i), i);
+  }
+
+  ProfileData result;
+  auto& f = result.functions;
+  auto& l = result.lines;
+  const auto& tf = total.functions;
+  const auto& tl = total.lines;
+  // Base row and result row of every function of total, or kNoMatch.
+  std::vector<size_t> base_rows(tf.size(), kNoMatch);
+  std::vector<size_t> result_rows(tf.size(), kNoMatch);
+  TextPool text(result);
+  for (size_t i = 0; i < tf.size(); ++i) {
+    auto it = index.find(FunctionIdentity(tf, i));
+    size_t j = it == index.end() ? kNoMatch : it->second;
+    base_rows[i] = j;
+    uint64_t n_calls = tf.n_calls[i];
+    uint64_t internal_ns = tf.internal_ns[i];
+    size_t b_row = 0;
+    size_t b_end = 0;
+    if (j != kNoMatch) {
+      n_calls = Since(n_calls, base.functions.n_calls[j]);
+      internal_ns = Since(internal_ns, base.functions.internal_ns[j]);
+      b_row = base.functions.line_begin[j];
+      b_end = b_row + base.functions.line_count[j];
+    }
+
+    size_t index_in_result = f.size();
+    size_t line_begin = l.size();
+    bool active = n_calls != 0 || internal_ns != 0;
+    size_t begin = tf.line_begin[i];
+    size_t end = begin + tf.line_count[i];
+    for (size_t row = begin; row < end; ++row) {
+      uint64_t line_number = tl.line_number[row];
+      // Both line lists are sorted by line number.
+      while (b_row < b_end && base.lines.line_number[b_row] < line_number) {
+        ++b_row;
+      }
+      bool matched =
+          b_row < b_end && base.lines.line_number[b_row] == line_number;
+      uint64_t line_calls = tl.n_calls[row];
+      uint64_t line_internal = tl.internal_ns[row];
+      uint64_t line_external = tl.external_ns[row];
+      if (matched) {
+        line_calls = Since(line_calls, base.lines.n_calls[b_row]);
+        line_internal = Since(line_internal, base.lines.internal_ns[b_row]);
+        line_external = Since(line_external, base.lines.external_ns[b_row]);
+      }
+      active = active || line_calls || line_internal || line_external;
+      l.function.push_back(index_in_result);
+      l.line_number.push_back(line_number);
+      l.n_calls.push_back(line_calls);
+      l.internal_ns.push_back(line_internal);
+      l.external_ns.push_back(line_external);
+    }
+    if (!active) {
+      l.function.resize(line_begin);
+      l.line_number.resize(line_begin);
+      l.n_calls.resize(line_begin);
+      l.internal_ns.resize(line_begin);
+      l.external_ns.resize(line_begin);
+      continue;
+    }
+    for (size_t row = begin; row < end; ++row) {
+      text.add(total.line_text(row));
+    }
+    result_rows[i] = f.size();
+    f.key.push_back(tf.key[i]);
+    f.name.push_back(tf.name[i]);
+    f.filename.push_back(tf.filename[i]);
+    f.first_line.push_back(tf.first_line[i]);
+    f.n_calls.push_back(n_calls);
+    f.internal_ns.push_back(internal_ns);
+    f.line_begin.push_back(line_begin);
+    f.line_count.push_back(l.size() - line_begin);
+  }
+
+  std::unordered_map<std::string_view, size_t> c_index;
+  for (size_t i = 0; i < base.c_functions.size(); ++i) {
+    c_index.emplace(base.c_functions.name[i], i);
+  }
+  auto& c = result.c_functions;
+  const auto& tc = total.c_functions;
+  std::vector<size_t> base_c_rows(tc.size(), kNoMatch);
+  std::vector<size_t> result_c_rows(tc.size(), kNoMatch);
+  for (size_t i = 0; i < tc.size(); ++i) {
+    uint64_t n_calls = tc.n_calls[i];
+    uint64_t internal_ns = tc.internal_ns[i];
+    uint64_t native_dropped = tc.native_dropped[i];
+    auto it = c_index.find(tc.name[i]);
+    if (it != c_index.end()) {
+      base_c_rows[i] = it->second;
+      n_calls = Since(n_calls, base.c_functions.n_calls[it->second]);
+      internal_ns =
+          Since(internal_ns, base.c_functions.internal_ns[it->second]);
+      native_dropped = Since(native_dropped,
+                             base.c_functions.native_dropped[it->second]);
+    }
+    if (n_calls == 0 && internal_ns == 0) {
+      continue;
+    }
+    result_c_rows[i] = c.size();
+    c.name.push_back(tc.name[i]);
+    c.n_calls.push_back(n_calls);
+    c.internal_ns.push_back(internal_ns);
+    c.native_dropped.push_back(native_dropped);
+  }
+
+  CallIndex base_calls;
+  const auto& bk = base.calls;
+  for (size_t i = 0; i < bk.size(); ++i) {
+    base_calls.emplace(
+        CallKey{bk.caller[i], bk.caller_line[i], bk.callee[i], bk.callee_c[i]},
+        i);
+  }
+  const auto& tk = total.calls;
+  for (size_t i = 0; i < tk.size(); ++i) {
+    uint64_t n_calls = tk.n_calls[i];
+    uint64_t primitive_calls = tk.primitive_calls[i];
+    uint64_t internal_ns = tk.internal_ns[i];
+    uint64_t total_ns = tk.total_ns[i];
+    // kNoMatch and kNoCaller share a value: a caller missing from base
+    // must not match base's calls from outside.
+    uint64_t caller = tk.caller[i];
+    bool matched = caller == CallTable::kNoCaller ||
+        base_rows[caller] != kNoMatch;
+    if (caller != CallTable::kNoCaller) {
+      caller = base_rows[caller];
+    }
+    uint64_t callee = tk.callee_c[i] ?
+        base_c_rows[tk.callee[i]] : base_rows[tk.callee[i]];
+    auto it = !matched || callee == kNoMatch ? base_calls.end() :
+        base_calls.find(
+            CallKey{caller, tk.caller_line[i], callee, tk.callee_c[i]});
+    if (it != base_calls.end()) {
+      n_calls = Since(n_calls, bk.n_calls[it->second]);
+      primitive_calls =
+          Since(primitive_calls, bk.primitive_calls[it->second]);
+      internal_ns = Since(internal_ns, bk.internal_ns[it->second]);
+      total_ns = Since(total_ns, bk.total_ns[it->second]);
+    }
+    CallKey key = MapCall(tk, i, result_rows, result_c_rows);
+    if (key.callee == kNoMatch || (n_calls == 0 && internal_ns == 0)) {
+      continue;
+    }
+    result.calls.push_back(key.caller, key.caller_line, key.callee,
+                           key.callee_c, n_calls, primitive_calls,
+                           internal_ns, total_ns);
+  }
+
+  std::map<std::pair<uint64_t, uint64_t>, size_t> base_opcodes;
+  const auto& bo = base.opcodes;
+  for (size_t i = 0; i < bo.size(); ++i) {
+    base_opcodes.emplace(std::make_pair(bo.function[i], bo.offset[i]), i);
+  }
+  const auto& to = total.opcodes;
+  for (size_t i = 0; i < to.size(); ++i) {
+    size_t function = result_rows[to.function[i]];
+    if (function == kNoMatch) {
+      continue;
+    }
+    uint64_t n_calls = to.n_calls[i];
+    uint64_t internal_ns = to.internal_ns[i];
+    uint64_t external_ns = to.external_ns[i];
+    auto it = base_opcodes.find(
+        std::make_pair(base_rows[to.function[i]], to.offset[i]));
+    if (it != base_opcodes.end()) {
+      n_calls = Since(n_calls, bo.n_calls[it->second]);
+      internal_ns = Since(internal_ns, bo.internal_ns[it->second]);
+      external_ns = Since(external_ns, bo.external_ns[it->second]);
+    }
+    if (n_calls == 0) {
+      continue;
+    }
+    result.opcodes.push_back(function, to.offset[i], to.opcode[i],
+                             to.line_number[i], n_calls, internal_ns,
+                             external_ns);
+  }
+
+  std::map<NativeKey, size_t> base_native;
+  const auto& bn = base.native;
+  std::vector<size_t> identity(base.c_functions.size());
+  for (size_t i = 0; i < identity.size(); ++i) {
+    identity[i] = i;
+  }
+  for (size_t i = 0; i < bn.size(); ++i) {
+    base_native.emplace(MapNative(bn, i, identity), i);
+  }
+  const auto& tn = total.native;
+  for (size_t i = 0; i < tn.size(); ++i) {
+    NativeKey key = MapNative(tn, i, result_c_rows);
+    if (key.first == kNoMatch) {
+      continue;
+    }
+    uint64_t samples = tn.samples[i];
+    uint64_t ns = tn.ns[i];
+    size_t base_c = base_c_rows[tn.c_function[i]];
+    if (base_c != kNoMatch) {
+      auto it = base_native.find(NativeKey(base_c, key.second));
+      if (it != base_native.end()) {
+        samples = Since(samples, bn.samples[it->second]);
+        ns = Since(ns, bn.ns[it->second]);
+      }
+    }
+    if (samples == 0) {
+      continue;
+    }
+    result.native.push_back(key.first, samples, ns, key.second.begin(),
+                            key.second.end());
+  }
+
+  std::map<std::pair<uint64_t, uint64_t>, size_t> base_waits;
+  const auto& bg = base.gil_waits;
+  for (size_t i = 0; i < bg.size(); ++i) {
+    base_waits.emplace(std::make_pair(bg.function[i], bg.line_number[i]), i);
+  }
+  const auto& tg = total.gil_waits;
+  for (size_t i = 0; i < tg.size(); ++i) {
+    size_t function = result_rows[tg.function[i]];
+    if (function == kNoMatch) {
+      continue;
+    }
+    uint64_t n_waits = tg.n_waits[i];
+    uint64_t wait_ns = tg.wait_ns[i];
+    uint64_t off_cpu_ns = tg.off_cpu_ns[i];
+    auto it = base_waits.find(
+        std::make_pair(base_rows[tg.function[i]], tg.line_number[i]));
+    if (it != base_waits.end()) {
+      n_waits = Since(n_waits, bg.n_waits[it->second]);
+      wait_ns = Since(wait_ns, bg.wait_ns[it->second]);
+      off_cpu_ns = Since(off_cpu_ns, bg.off_cpu_ns[it->second]);
+    }
+    if (n_waits == 0 && off_cpu_ns == 0) {
+      continue;
+    }
+    result.gil_waits.push_back(function, tg.line_number[i], n_waits, wait_ns,
+                               off_cpu_ns);
+  }
+
+  std::map<uint64_t, size_t> base_threads;
+  const auto& bt = base.gil_threads;
+  for (size_t i = 0; i < bt.size(); ++i) {
+    base_threads.emplace(bt.thread_id[i], i);
+  }
+  const auto& tt = total.gil_threads;
+  for (size_t i = 0; i < tt.size(); ++i) {
+    uint64_t n_waits = tt.n_waits[i];
+    uint64_t wait_ns = tt.wait_ns[i];
+    uint64_t hold_ns = tt.hold_ns[i];
+    uint64_t profiled_ns = tt.profiled_ns[i];
+    uint64_t cpu_ns = tt.cpu_ns[i];
+    uint64_t released_ns = tt.released_ns[i];
+    auto it = base_threads.find(tt.thread_id[i]);
+    if (it != base_threads.end()) {
+      n_waits = Since(n_waits, bt.n_waits[it->second]);
+      wait_ns = Since(wait_ns, bt.wait_ns[it->second]);
+      hold_ns = Since(hold_ns, bt.hold_ns[it->second]);
+      profiled_ns = Since(profiled_ns, bt.profiled_ns[it->second]);
+      cpu_ns = Since(cpu_ns, bt.cpu_ns[it->second]);
+      released_ns = Since(released_ns, bt.released_ns[it->second]);
+    }
+    if (n_waits == 0 && hold_ns == 0 && profiled_ns == 0) {
+      continue;
+    }
+    // Whether the total's hold is exact says nothing finer about the slice,
+    // so the slice keeps the total's flag.
+    result.gil_threads.push_back(tt.thread_id[i], n_waits, wait_ns, hold_ns,
+                                 profiled_ns, cpu_ns, released_ns,
+                                 tt.hold_exact[i] != 0);
+  }
+
+  for (auto&& counter : total.counters) {
+    auto it = base.counters.find(counter.first);
+    result.counters[counter.first] = it == base.counters.end() ?
+        counter.second : Since(counter.second, it->second);
+  }
+
+  return result;
+}
+
+void MergeDumps(
+    const std::vector<std::string>& inputs, const std::string& output,
+    size_t n_threads) {
+  std::vector<ProfileData> profiles(inputs.size());
+  ParallelFor(inputs.size(), n_threads, [&](size_t i) {
+    profiles[i] = ReadDump(inputs[i]);
+  });
+
+  // Reduction tree: each round merges disjoint pairs in parallel, halving
+  // the number of partial results.
+  for (size_t stride = 1; stride < profiles.size(); stride *= 2) {
+    size_t n_pairs = (profiles.size() + 2 * stride - 1) / (2 * stride);
+    ParallelFor(n_pairs, n_threads, [&](size_t pair) {
+      size_t left = pair * 2 * stride;
+      size_t right = left + stride;
+      if (right < profiles.size()) {
+        profiles[left] = MergeProfiles(profiles[left], profiles[right]);
+        profiles[right] = ProfileData();
+      }
+    });
+  }
+
+  WriteDump(profiles.empty() ? ProfileData() : profiles.front(), output);
+}
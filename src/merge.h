@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "profile_data.h"
+
+// Combines two profiles. Functions are matched by their stable identity
+// (filename, name, first line) rather than by code object address, lines by
+// line number, instructions by offset, C functions by name, native stacks
+// by their frame names and GIL totals by thread id.
+ProfileData MergeProfiles(const ProfileData& a, const ProfileData& b);
+
+// What total gained since base, an earlier snapshot of the same process.
+// Rows are matched like MergeProfiles; values that went down (a record was
+// evicted and readmitted in between) count from zero. Functions and C
+// functions without any activity in the interval are left out.
+ProfileData SubtractProfiles(const ProfileData& total, const ProfileData& base);
+
+// Reads every input dump on a pool of n_threads threads (0 picks the
+// hardware concurrency), reduces them pairwise in parallel and writes the
+// combined profile to output.
+void MergeDumps(
+    const std::vector<std::string>& inputs, const std::string& output,
+    size_t n_threads);
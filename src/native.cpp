@@ -0,0 +1,868 @@
+#include "native.h"
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+// The sampler whose timer is live; the handler ignores signals from any
+// other timer.
+NativeSampler* volatile current = nullptr;
+bool handler_installed = false;
+struct sigaction old_action;
+
+// Frames walked per sample before cutting. Walking further than kMaxDepth
+// lets the cut find the C function's entry below deep native stacks.
+constexpr size_t kWalkDepth = 64;
+
+struct Walk {
+  uintptr_t ip[kWalkDepth];
+  uintptr_t start[kWalkDepth];
+  uintptr_t cfa[kWalkDepth];
+  size_t n = 0;
+};
+
+// The registers an unwind step needs.
+struct Registers {
+  uintptr_t pc;
+  uintptr_t sp;
+  uintptr_t fp;
+};
+
+// DWARF numbers of the stack and frame pointers and of the return address
+// column.
+#if defined(__x86_64__)
+constexpr uint64_t kSpRegister = 7;
+constexpr uint64_t kFpRegister = 6;
+constexpr uint64_t kRaRegister = 16;
+#endif
+
+bool InterruptedRegisters(void* context, Registers* registers) {
+  auto* ucontext = static_cast<ucontext_t*>(context);
+#if defined(__x86_64__)
+  registers->pc = ucontext->uc_mcontext.gregs[REG_RIP];
+  registers->sp = ucontext->uc_mcontext.gregs[REG_RSP];
+  registers->fp = ucontext->uc_mcontext.gregs[REG_RBP];
+  return true;
+#elif defined(__aarch64__)
+  registers->pc = ucontext->uc_mcontext.pc;
+  return false;
+#else
+  (void)ucontext;
+  registers->pc = 0;
+  return false;
+#endif
+}
+
+// Reads the encodings of .eh_frame and .eh_frame_hdr. Callers only point it
+// at tables of loaded objects.
+class Reader {
+ public:
+  explicit Reader(uintptr_t position) : position_(position) {}
+
+  uintptr_t position() const { return position_; }
+  void skip(uint64_t n) { position_ += n; }
+
+  template <typename T>
+  T read() {
+    T value;
+    std::memcpy(&value, reinterpret_cast<const void*>(position_), sizeof(T));
+    position_ += sizeof(T);
+    return value;
+  }
+
+  uint64_t uleb() {
+    uint64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+      byte = read<uint8_t>();
+      if (shift < 64) {
+        value |= uint64_t(byte & 0x7f) << shift;
+      }
+      shift += 7;
+    } while (byte & 0x80);
+    return value;
+  }
+
+  int64_t sleb() {
+    int64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+      byte = read<uint8_t>();
+      if (shift < 64) {
+        value |= int64_t(byte & 0x7f) << shift;
+      }
+      shift += 7;
+    } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40)) {
+      value |= -(int64_t(1) << shift);
+    }
+    return value;
+  }
+
+  // A DW_EH_PE_* encoded pointer, without following indirect ones. Only
+  // absolute, pc-relative and data-relative pointers are supported.
+  bool pointer(uint8_t encoding, uintptr_t data_base, uintptr_t* value) {
+    uintptr_t base;
+    switch (encoding & 0x70) {
+      case 0x00: base = 0; break;
+      case 0x10: base = position_; break;
+      case 0x30: base = data_base; break;
+      default: return false;
+    }
+    uintptr_t offset;
+    switch (encoding & 0x0f) {
+      case 0x00: offset = read<uint64_t>(); break;
+      case 0x01: offset = uleb(); break;
+      case 0x02: offset = read<uint16_t>(); break;
+      case 0x03: offset = read<uint32_t>(); break;
+      case 0x04: offset = read<uint64_t>(); break;
+      case 0x09: offset = sleb(); break;
+      case 0x0a: offset = read<int16_t>(); break;
+      case 0x0b: offset = read<int32_t>(); break;
+      case 0x0c: offset = read<int64_t>(); break;
+      default: return false;
+    }
+    *value = base + offset;
+    return true;
+  }
+
+ private:
+  uintptr_t position_;
+};
+
+#if defined(__x86_64__)
+
+// Where a register of the caller was saved, by the DWARF CFA rules bprof
+// needs: same value, at an offset from the CFA, or lost.
+struct Rule {
+  enum Kind : uint8_t { kSame, kOffset, kUndefined };
+  Kind kind = kSame;
+  int64_t offset = 0;
+};
+
+// One row of the call frame table, for the registers the walk tracks.
+struct Row {
+  uint64_t cfa_register = kSpRegister;
+  int64_t cfa_offset = 0;
+  Rule fp;
+  Rule ra;
+
+  void set(uint64_t reg, Rule rule) {
+    if (reg == kFpRegister) {
+      fp = rule;
+    } else if (reg == kRaRegister) {
+      ra = rule;
+    }
+  }
+};
+
+struct Cie {
+  uint64_t code_align = 0;
+  int64_t data_align = 0;
+  uint8_t fde_encoding = 0;
+  bool augmented = false;
+  uintptr_t instructions = 0;
+  uintptr_t end = 0;
+};
+
+bool ParseCie(uintptr_t address, Cie* cie) {
+  Reader reader(address);
+  uint32_t length = reader.read<uint32_t>();
+  if (length == 0 || length == 0xffffffff) {
+    return false;
+  }
+  cie->end = reader.position() + length;
+  if (reader.read<uint32_t>() != 0) {
+    return false;
+  }
+  uint8_t version = reader.read<uint8_t>();
+  if (version != 1 && version != 3) {
+    return false;
+  }
+  char augmentation[8];
+  size_t n = 0;
+  for (char c; (c = reader.read<char>()) != '\0';) {
+    if (n == sizeof(augmentation) - 1) {
+      return false;
+    }
+    augmentation[n++] = c;
+  }
+  augmentation[n] = '\0';
+  cie->code_align = reader.uleb();
+  cie->data_align = reader.sleb();
+  if (version == 1) {
+    reader.read<uint8_t>();
+  } else {
+    reader.uleb();
+  }
+  if (augmentation[0] != 'z') {
+    if (n != 0) {
+      return false;
+    }
+    cie->instructions = reader.position();
+    return true;
+  }
+  cie->augmented = true;
+  uint64_t augmentation_length = reader.uleb();
+  uintptr_t instructions = reader.position() + augmentation_length;
+  for (size_t i = 1; i < n; ++i) {
+    uintptr_t ignored;
+    switch (augmentation[i]) {
+      case 'R':
+        cie->fde_encoding = reader.read<uint8_t>();
+        break;
+      case 'P':
+        if (!reader.pointer(reader.read<uint8_t>(), 0, &ignored)) {
+          return false;
+        }
+        break;
+      case 'L':
+        reader.read<uint8_t>();
+        break;
+      case 'S':
+        break;
+      default:
+        return false;
+    }
+  }
+  cie->instructions = instructions;
+  return true;
+}
+
+// Runs call frame instructions from begin to end, stopping at the first
+// row past target. loc is the address the instructions start at.
+bool Execute(const Cie& cie, uintptr_t begin, uintptr_t end, uintptr_t loc,
+             uintptr_t target, const Row& initial, Row* row) {
+  constexpr size_t kMaxRemembered = 8;
+  Row remembered[kMaxRemembered];
+  size_t n_remembered = 0;
+  Reader reader(begin);
+  while (reader.position() < end) {
+    uint8_t op = reader.read<uint8_t>();
+    uint64_t reg;
+    switch (op & 0xc0) {
+      case 0x40:
+        loc += (op & 0x3f) * cie.code_align;
+        if (loc > target) {
+          return true;
+        }
+        continue;
+      case 0x80:
+        row->set(op & 0x3f, Rule{Rule::kOffset, int64_t(reader.uleb()) *
+                                                    cie.data_align});
+        continue;
+      case 0xc0:
+        reg = op & 0x3f;
+        row->set(reg, reg == kFpRegister ? initial.fp : initial.ra);
+        continue;
+    }
+    switch (op) {
+      case 0x00:  // DW_CFA_nop
+        break;
+      case 0x01:  // DW_CFA_set_loc
+        if (!reader.pointer(cie.fde_encoding, 0, &loc)) {
+          return false;
+        }
+        if (loc > target) {
+          return true;
+        }
+        break;
+      case 0x02:  // DW_CFA_advance_loc1
+      case 0x03:  // DW_CFA_advance_loc2
+      case 0x04:  // DW_CFA_advance_loc4
+        loc += (op == 0x02 ? reader.read<uint8_t>() :
+                op == 0x03 ? reader.read<uint16_t>() :
+                reader.read<uint32_t>()) * cie.code_align;
+        if (loc > target) {
+          return true;
+        }
+        break;
+      case 0x05:  // DW_CFA_offset_extended
+        reg = reader.uleb();
+        row->set(reg, Rule{Rule::kOffset,
+                           int64_t(reader.uleb()) * cie.data_align});
+        break;
+      case 0x06:  // DW_CFA_restore_extended
+        reg = reader.uleb();
+        row->set(reg, reg == kFpRegister ? initial.fp : initial.ra);
+        break;
+      case 0x07:  // DW_CFA_undefined
+        row->set(reader.uleb(), Rule{Rule::kUndefined, 0});
+        break;
+      case 0x08:  // DW_CFA_same_value
+        row->set(reader.uleb(), Rule{Rule::kSame, 0});
+        break;
+      case 0x09:  // DW_CFA_register
+        reg = reader.uleb();
+        reader.uleb();
+        row->set(reg, Rule{Rule::kUndefined, 0});
+        break;
+      case 0x0a:  // DW_CFA_remember_state
+        if (n_remembered == kMaxRemembered) {
+          return false;
+        }
+        remembered[n_remembered++] = *row;
+        break;
+      case 0x0b:  // DW_CFA_restore_state
+        if (n_remembered == 0) {
+          return false;
+        }
+        *row = remembered[--n_remembered];
+        break;
+      case 0x0c:  // DW_CFA_def_cfa
+        row->cfa_register = reader.uleb();
+        row->cfa_offset = reader.uleb();
+        break;
+      case 0x0d:  // DW_CFA_def_cfa_register
+        row->cfa_register = reader.uleb();
+        break;
+      case 0x0e:  // DW_CFA_def_cfa_offset
+        row->cfa_offset = reader.uleb();
+        break;
+      case 0x10:  // DW_CFA_expression
+      case 0x16:  // DW_CFA_val_expression
+        reg = reader.uleb();
+        reader.skip(reader.uleb());
+        row->set(reg, Rule{Rule::kUndefined, 0});
+        break;
+      case 0x11:  // DW_CFA_offset_extended_sf
+        reg = reader.uleb();
+        row->set(reg, Rule{Rule::kOffset, reader.sleb() * cie.data_align});
+        break;
+      case 0x12:  // DW_CFA_def_cfa_sf
+        row->cfa_register = reader.uleb();
+        row->cfa_offset = reader.sleb() * cie.data_align;
+        break;
+      case 0x13:  // DW_CFA_def_cfa_offset_sf
+        row->cfa_offset = reader.sleb() * cie.data_align;
+        break;
+      case 0x14:  // DW_CFA_val_offset
+        reg = reader.uleb();
+        reader.uleb();
+        row->set(reg, Rule{Rule::kUndefined, 0});
+        break;
+      case 0x15:  // DW_CFA_val_offset_sf
+        reg = reader.uleb();
+        reader.sleb();
+        row->set(reg, Rule{Rule::kUndefined, 0});
+        break;
+      case 0x2e:  // DW_CFA_GNU_args_size
+        reader.uleb();
+        break;
+      case 0x2f:  // DW_CFA_GNU_negative_offset_extended
+        reg = reader.uleb();
+        row->set(reg, Rule{Rule::kOffset,
+                           -int64_t(reader.uleb()) * cie.data_align});
+        break;
+      default:
+        // DW_CFA_def_cfa_expression and anything unknown.
+        return false;
+    }
+  }
+  return true;
+}
+
+// The call frame table row of the function containing pc, found through
+// the binary search table of .eh_frame_hdr; start is the function's entry.
+bool FindRow(uintptr_t eh_frame_hdr, uintptr_t table, size_t n_entries,
+             uintptr_t pc, Row* row, uintptr_t* start) {
+  size_t lo = 0;
+  size_t hi = n_entries;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    Reader entry(table + mid * 8);
+    if (eh_frame_hdr + entry.read<int32_t>() <= pc) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  if (n_entries == 0) {
+    return false;
+  }
+  Reader entry(table + lo * 8);
+  entry.read<int32_t>();
+  uintptr_t fde = eh_frame_hdr + entry.read<int32_t>();
+
+  Reader reader(fde);
+  uint32_t length = reader.read<uint32_t>();
+  if (length == 0 || length == 0xffffffff) {
+    return false;
+  }
+  uintptr_t end = reader.position() + length;
+  uintptr_t cie_pointer = reader.position();
+  Cie cie;
+  if (!ParseCie(cie_pointer - reader.read<uint32_t>(), &cie)) {
+    return false;
+  }
+  uintptr_t pc_begin;
+  uintptr_t pc_range;
+  if (!reader.pointer(cie.fde_encoding, 0, &pc_begin) ||
+      !reader.pointer(cie.fde_encoding & 0x0f, 0, &pc_range) ||
+      pc < pc_begin || pc - pc_begin >= pc_range) {
+    return false;
+  }
+  if (cie.augmented) {
+    reader.skip(reader.uleb());
+  }
+
+  Row initial;
+  if (!Execute(cie, cie.instructions, cie.end, pc_begin, pc, initial,
+               &initial)) {
+    return false;
+  }
+  *row = initial;
+  *start = pc_begin;
+  return Execute(cie, reader.position(), end, pc_begin, pc, initial, row);
+}
+
+#endif  // __x86_64__
+
+std::string Hex(uintptr_t value) {
+  char buffer[24];
+  std::snprintf(buffer, sizeof(buffer), "0x%lx",
+                static_cast<unsigned long>(value));
+  return buffer;
+}
+
+std::string Demangle(const char* name) {
+  if (std::strncmp(name, "_Z", 2) != 0) {
+    return name;
+  }
+  int status = 0;
+  char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+  if (demangled == nullptr) {
+    return name;
+  }
+  std::string result(demangled);
+  std::free(demangled);
+  return result;
+}
+
+}  // namespace
+
+NativeSampler::~NativeSampler() {
+  delete_timer();
+}
+
+void NativeSampler::handle(int signum, siginfo_t* info, void* context) {
+  NativeSampler* sampler = current;
+  if (info == nullptr || info->si_code != SI_TIMER || sampler == nullptr ||
+      info->si_value.sival_ptr != sampler) {
+    // Not ours: pass it on to whoever handled SIGPROF before.
+    if (old_action.sa_flags & SA_SIGINFO) {
+      if (old_action.sa_sigaction != nullptr) {
+        old_action.sa_sigaction(signum, info, context);
+      }
+    } else if (old_action.sa_handler != SIG_DFL &&
+               old_action.sa_handler != SIG_IGN) {
+      old_action.sa_handler(signum);
+    }
+    return;
+  }
+  if (!sampler->armed_) {
+    return;
+  }
+  int saved_errno = errno;
+  sampler->sample(context);
+  errno = saved_errno;
+}
+
+void NativeSampler::sample(void* context) {
+  ++samples_;
+  ++seen_;
+  // Once the buffer is full, the new sample replaces a random one with
+  // probability kCapacity / seen_.
+  size_t slot = n_samples_;
+  if (slot == kCapacity) {
+    uint64_t pick = random() % seen_;
+    if (pick >= kCapacity) {
+      return;
+    }
+    slot = pick;
+  }
+  Registers registers;
+  bool unwind = InterruptedRegisters(context, &registers) &&
+      registers.sp >= stack_low_ && registers.sp < stack_high_;
+  uintptr_t pc = registers.pc;
+  Walk walk;
+#if defined(__x86_64__)
+  while (unwind && walk.n < kWalkDepth) {
+    // Return addresses are looked up less one, inside the call.
+    uintptr_t lookup = walk.n == 0 ? registers.pc : registers.pc - 1;
+    const CodeRange* range = code_range(lookup);
+    if (range == nullptr) {
+      stale_code_ = 1;
+      break;
+    }
+    Row row;
+    uintptr_t start;
+    if (range->n_entries == 0 ||
+        !FindRow(range->eh_frame_hdr, range->table, range->n_entries,
+                 lookup, &row, &start)) {
+      break;
+    }
+    uintptr_t base;
+    if (row.cfa_register == kSpRegister) {
+      base = registers.sp;
+    } else if (row.cfa_register == kFpRegister) {
+      base = registers.fp;
+    } else {
+      break;
+    }
+    uintptr_t cfa = base + row.cfa_offset;
+    walk.ip[walk.n] = lookup;
+    walk.start[walk.n] = start;
+    walk.cfa[walk.n] = cfa;
+    ++walk.n;
+    if (entry_ != 0 && start == entry_) {
+      break;
+    }
+    // The caller's frame lies above this one, inside the thread's stack.
+    if (cfa <= registers.sp || cfa > stack_high_ ||
+        row.ra.kind != Rule::kOffset) {
+      break;
+    }
+    auto slot = [&](const Rule& rule, uintptr_t* value) {
+      uintptr_t address = cfa + rule.offset;
+      if (address < registers.sp || address > stack_high_ - sizeof(*value)) {
+        return false;
+      }
+      *value = *reinterpret_cast<const uintptr_t*>(address);
+      return true;
+    };
+    uintptr_t ra;
+    if (!slot(row.ra, &ra)) {
+      break;
+    }
+    if (row.fp.kind == Rule::kOffset && !slot(row.fp, &registers.fp)) {
+      break;
+    }
+    if (row.fp.kind == Rule::kUndefined) {
+      registers.fp = 0;
+    }
+    if (ra == 0) {
+      break;
+    }
+    registers.pc = ra;
+    registers.sp = cfa;
+  }
+#else
+  (void)unwind;
+#endif
+  uintptr_t* frames = &frames_[slot * kMaxDepth];
+  size_t depth = 0;
+  if (walk.n == 0) {
+    // No unwind information where the signal landed.
+    if (pc != 0) {
+      frames[depth++] = pc;
+    }
+  } else {
+    size_t cut = walk.n;
+    for (size_t i = 0; i < walk.n; ++i) {
+      if (entry_ != 0 && walk.start[i] == entry_) {
+        cut = i + 1;
+        break;
+      }
+    }
+    if (cut == walk.n) {
+      // Frames below the hook's, and the first one above it, which made
+      // the call.
+      cut = 0;
+      while (cut < walk.n && walk.cfa[cut] < stack_) {
+        ++cut;
+      }
+      cut = std::min(cut + 1, walk.n);
+    }
+    for (; depth < cut && depth < kMaxDepth; ++depth) {
+      frames[depth] = walk.ip[depth];
+    }
+  }
+  depths_[slot] = depth;
+  if (slot == n_samples_) {
+    ++n_samples_;
+  }
+}
+
+const NativeSampler::CodeRange* NativeSampler::code_range(
+    uintptr_t pc) const {
+  // Hand-rolled rather than std::upper_bound, which is not promised to be
+  // safe in a signal handler.
+  size_t lo = 0;
+  size_t hi = code_.size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (code_[mid].begin <= pc) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0 || pc >= code_[lo - 1].end) {
+    return nullptr;
+  }
+  return &code_[lo - 1];
+}
+
+void NativeSampler::load_code_ranges() {
+  std::vector<CodeRange> code;
+  dl_iterate_phdr(
+      [](dl_phdr_info* info, size_t, void* arg) {
+        auto* code = static_cast<std::vector<CodeRange>*>(arg);
+        uintptr_t eh_frame_hdr = 0;
+        uintptr_t table = 0;
+        size_t n_entries = 0;
+        for (int i = 0; i < info->dlpi_phnum; ++i) {
+          const ElfW(Phdr)& header = info->dlpi_phdr[i];
+          if (header.p_type != PT_GNU_EH_FRAME) {
+            continue;
+          }
+          // Version 1, with a table of 4-byte entries relative to the
+          // header, sorted by address.
+          eh_frame_hdr = info->dlpi_addr + header.p_vaddr;
+          Reader reader(eh_frame_hdr);
+          uint8_t version = reader.read<uint8_t>();
+          uint8_t eh_frame_encoding = reader.read<uint8_t>();
+          uint8_t count_encoding = reader.read<uint8_t>();
+          uint8_t table_encoding = reader.read<uint8_t>();
+          uintptr_t eh_frame;
+          uintptr_t count;
+          if (version == 1 && table_encoding == 0x3b &&
+              reader.pointer(eh_frame_encoding, eh_frame_hdr, &eh_frame) &&
+              reader.pointer(count_encoding, eh_frame_hdr, &count)) {
+            table = reader.position();
+            n_entries = count;
+          }
+        }
+        for (int i = 0; i < info->dlpi_phnum; ++i) {
+          const ElfW(Phdr)& header = info->dlpi_phdr[i];
+          if (header.p_type == PT_LOAD && (header.p_flags & PF_X)) {
+            uintptr_t begin = info->dlpi_addr + header.p_vaddr;
+            code->push_back(CodeRange{begin, begin + header.p_memsz,
+                                      eh_frame_hdr, table, n_entries});
+          }
+        }
+        return 0;
+      },
+      &code);
+  std::sort(code.begin(), code.end());
+  code_.swap(code);
+  stale_code_ = 0;
+}
+
+void NativeSampler::configure(duration interval, bool cpu_clock) {
+  delete_timer();
+  interval_ = duration(0);
+  if (interval.count() == 0) {
+    return;
+  }
+  frames_.resize(kCapacity * kMaxDepth);
+  depths_.resize(kCapacity);
+  load_code_ranges();
+  pthread_attr_t attributes;
+  if (pthread_getattr_np(pthread_self(), &attributes) == 0) {
+    void* low;
+    size_t size;
+    pthread_attr_getstack(&attributes, &low, &size);
+    pthread_attr_destroy(&attributes);
+    stack_low_ = reinterpret_cast<uintptr_t>(low);
+    stack_high_ = stack_low_ + size;
+  } else {
+    stack_low_ = stack_high_ = 0;
+  }
+
+  // The handler stays installed once it is: a timer signal still pending
+  // when its timer is deleted would otherwise take the default action and
+  // end the process.
+  if (!handler_installed) {
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handle;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &old_action) != 0) {
+      throw std::runtime_error("Could not install the SIGPROF handler");
+    }
+    handler_installed = true;
+  }
+
+  struct sigevent event;
+  std::memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGPROF;
+  event.sigev_value.sival_ptr = this;
+  event._sigev_un._tid = static_cast<pid_t>(syscall(SYS_gettid));
+  clockid_t clock = cpu_clock ? CLOCK_THREAD_CPUTIME_ID : CLOCK_MONOTONIC;
+  if (timer_create(clock, &event, &timer_) != 0) {
+    throw std::runtime_error("Could not create the native sampling timer");
+  }
+  timer_created_ = true;
+  thread_ = pthread_self();
+  interval_ = interval;
+  current = this;
+
+  auto seconds = std::chrono::duration_cast<std::chrono::seconds>(interval);
+  struct itimerspec spec;
+  spec.it_interval.tv_sec = seconds.count();
+  spec.it_interval.tv_nsec = (interval - seconds).count();
+  spec.it_value = spec.it_interval;
+  if (timer_settime(timer_, 0, &spec, nullptr) != 0) {
+    delete_timer();
+    throw std::runtime_error("Could not start the native sampling timer");
+  }
+}
+
+void NativeSampler::delete_timer() {
+  disarm();
+  if (current == this) {
+    current = nullptr;
+  }
+  if (timer_created_) {
+    timer_delete(timer_);
+    timer_created_ = false;
+  }
+  n_samples_ = 0;
+  seen_ = 0;
+}
+
+void NativeSampler::after_fork() {
+  disarm();
+  if (current == this) {
+    current = nullptr;
+  }
+  timer_created_ = false;
+  interval_ = duration(0);
+  n_samples_ = 0;
+  seen_ = 0;
+}
+
+const std::string& NativeSymbolizer::name(uintptr_t address) {
+  auto it = names_.find(address);
+  if (it != names_.end()) {
+    return it->second;
+  }
+
+  std::string name;
+  Dl_info info;
+  if (dladdr(reinterpret_cast<void*>(address), &info) == 0 ||
+      info.dli_fname == nullptr) {
+    name = Hex(address);
+  } else {
+    // The main program has an empty name in the link map.
+    const Object& object =
+        this->object(info.dli_fname[0] != '\0' ? info.dli_fname :
+                     "/proc/self/exe");
+    uintptr_t base = reinterpret_cast<uintptr_t>(info.dli_fbase);
+    uintptr_t key = object.relative ? address - base : address;
+    const Symbol* symbol = nullptr;
+    auto next = std::upper_bound(object.symbols.begin(), object.symbols.end(),
+                                 Symbol{key, 0, std::string()});
+    if (next != object.symbols.begin()) {
+      const Symbol& candidate = *(next - 1);
+      if (candidate.size == 0 || key - candidate.address < candidate.size) {
+        symbol = &candidate;
+      }
+    }
+    if (symbol != nullptr) {
+      name = Demangle(symbol->name.c_str()) + " (" + object.basename + ")";
+    } else if (info.dli_sname != nullptr) {
+      name = Demangle(info.dli_sname) + " (" + object.basename + ")";
+    } else {
+      name = object.basename + "+" + Hex(address - base);
+    }
+  }
+  return names_.emplace(address, std::move(name)).first->second;
+}
+
+// Reads the function symbols of an ELF object, preferring the full symbol
+// table to the dynamic one. Objects that cannot be read have no symbols and
+// fall back to dladdr's.
+const NativeSymbolizer::Object& NativeSymbolizer::object(const char* path) {
+  auto it = objects_.find(path);
+  if (it != objects_.end()) {
+    return it->second;
+  }
+  Object& object = objects_[path];
+  const char* slash = std::strrchr(path, '/');
+  object.basename = slash != nullptr ? slash + 1 : path;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return object;
+  }
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(ElfW(Ehdr))) {
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    return object;
+  }
+  const char* data = static_cast<const char*>(map);
+  size_t size = st.st_size;
+
+  auto* header = reinterpret_cast<const ElfW(Ehdr)*>(data);
+  if (std::memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 ||
+      header->e_ident[EI_CLASS] != ELFCLASS64 ||
+      header->e_shentsize != sizeof(ElfW(Shdr)) ||
+      header->e_shoff > size ||
+      header->e_shnum > (size - header->e_shoff) / sizeof(ElfW(Shdr))) {
+    munmap(map, size);
+    return object;
+  }
+  object.relative = header->e_type == ET_DYN;
+  auto* sections = reinterpret_cast<const ElfW(Shdr)*>(data + header->e_shoff);
+  const ElfW(Shdr)* table = nullptr;
+  for (unsigned type : {SHT_SYMTAB, SHT_DYNSYM}) {
+    for (size_t i = 0; i < header->e_shnum && table == nullptr; ++i) {
+      if (sections[i].sh_type == type) {
+        table = &sections[i];
+      }
+    }
+  }
+  if (table != nullptr && table->sh_link < header->e_shnum &&
+      table->sh_offset <= size &&
+      table->sh_size <= size - table->sh_offset) {
+    const ElfW(Shdr)& strings = sections[table->sh_link];
+    auto* symbols = reinterpret_cast<const ElfW(Sym)*>(data + table->sh_offset);
+    size_t n_symbols = table->sh_size / sizeof(ElfW(Sym));
+    if (strings.sh_offset <= size && strings.sh_size <= size - strings.sh_offset) {
+      const char* names = data + strings.sh_offset;
+      for (size_t i = 0; i < n_symbols; ++i) {
+        const ElfW(Sym)& symbol = symbols[i];
+        unsigned type = ELF64_ST_TYPE(symbol.st_info);
+        if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+            symbol.st_shndx == SHN_UNDEF || symbol.st_value == 0 ||
+            symbol.st_name >= strings.sh_size) {
+          continue;
+        }
+        const char* name = names + symbol.st_name;
+        object.symbols.push_back(Symbol{
+            symbol.st_value, symbol.st_size,
+            std::string(name, strnlen(name, strings.sh_size - symbol.st_name))});
+      }
+    }
+  }
+  munmap(map, size);
+  std::sort(object.symbols.begin(), object.symbols.end());
+  return object;
+}
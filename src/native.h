@@ -0,0 +1,206 @@
+#pragma once
+
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+// Native stack of one sample, innermost frame first. Frames are code
+// addresses: the interrupted instruction, then return addresses less one, so
+// every address falls inside the instruction that made the call.
+using NativeStack = std::vector<uintptr_t>;
+
+struct NativeStackHash {
+  size_t operator()(const NativeStack& stack) const {
+    size_t h = stack.size();
+    for (auto address : stack) {
+      h = h * 31 + std::hash<uintptr_t>()(address);
+    }
+    return h;
+  }
+};
+
+struct NativeCount {
+  uint64_t samples = 0;
+  // Sampling interval summed over the samples.
+  duration time = duration(0);
+};
+
+// Native stacks sampled while one C function ran.
+using NativeProfile = std::unordered_map<NativeStack, NativeCount, NativeStackHash>;
+
+// Mixed-mode sampling of what C functions do natively. A POSIX timer sends
+// SIGPROF to the thread that configured it every interval; while the hooks
+// have the sampler armed, around a C call, the handler unwinds the native
+// stack into a preallocated buffer. Stacks are cut below the C function, at
+// its entry point when the unwind reaches it, or else where the hook's own
+// frame was. The hooks drain the buffer when the C call ends; nothing is
+// symbolized until the profile is read out.
+//
+// A call that outlasts the buffer keeps a uniform reservoir sample of its
+// stacks (algorithm R), so its end is represented as well as its start, and
+// the drained stacks are weighted to stand for every sample taken.
+//
+// The handler unwinds by itself rather than through libgcc, whose unwinder
+// takes the loader's and its own locks and so can deadlock when the signal
+// lands inside them. It interprets the .eh_frame call frame information of
+// the objects that were loaded when the sampler was configured or last
+// drained, so code built without frame pointers unwinds too. It only reads
+// those tables and the sampled thread's stack, and takes no locks. x86-64
+// only; elsewhere a sample is just the interrupted instruction.
+//
+// The hooks may run on another thread than the one the timer signals; only
+// that thread arms the sampler, so the buffer is only touched by it and by
+// the handler interrupting it, and arming and draining need no locks.
+class NativeSampler {
+ public:
+  static constexpr size_t kMaxDepth = 32;
+  static constexpr size_t kCapacity = 1024;
+
+  NativeSampler() = default;
+  ~NativeSampler();
+  NativeSampler(const NativeSampler&) = delete;
+  NativeSampler& operator=(const NativeSampler&) = delete;
+
+  // Samples the calling thread every interval of wall or thread CPU time; a
+  // zero interval stops sampling. Throws std::runtime_error if the timer
+  // cannot be set up.
+  void configure(duration interval, bool cpu_clock);
+  bool enabled() const { return timer_created_; }
+  // Whether the calling thread is the one the timer signals.
+  bool on_sampled_thread() const {
+    return timer_created_ && pthread_equal(thread_, pthread_self());
+  }
+  duration interval() const { return interval_; }
+  // Timers do not survive fork(); the child forgets the parent's.
+  void after_fork();
+
+  // entry is the C function's address, or null; stack is an address in the
+  // hook's frame, above every frame of the C call.
+  void arm(const void* entry, const void* stack) {
+    entry_ = reinterpret_cast<uintptr_t>(entry);
+    stack_ = reinterpret_cast<uintptr_t>(stack);
+    signal_fence();
+    armed_ = 1;
+    signal_fence();
+  }
+  bool armed() const { return armed_ != 0; }
+  void disarm() {
+    armed_ = 0;
+    signal_fence();
+  }
+
+  // Hands every buffered stack to visit(frames, depth, weight) and empties
+  // the buffer. Weights are whole samples and add up to every sample taken
+  // since the last drain, kept or not. Returns how many samples were not
+  // kept. The sampler must be disarmed.
+  template <typename Visit>
+  uint64_t drain(Visit visit) {
+    if (stale_code_) {
+      // A sample ran into code loaded since; it is unwound from now on.
+      load_code_ranges();
+    }
+    uint64_t dropped = seen_ - n_samples_;
+    for (size_t i = 0; i < n_samples_; ++i) {
+      uint64_t weight = (i + 1) * seen_ / n_samples_ - i * seen_ / n_samples_;
+      visit(&frames_[i * kMaxDepth], depths_[i], weight);
+    }
+    dropped_ += dropped;
+    n_samples_ = 0;
+    seen_ = 0;
+    return dropped;
+  }
+
+  uint64_t samples() const { return samples_; }
+  // Samples whose stacks were not kept because a C call outlasted the
+  // buffer; the kept stacks of the call are weighted to cover them.
+  uint64_t dropped() const { return dropped_; }
+
+ private:
+  static void handle(int signum, siginfo_t* info, void* context);
+  static void signal_fence() { __atomic_signal_fence(__ATOMIC_SEQ_CST); }
+  // Executable segment of a loaded object, with the binary search table of
+  // its .eh_frame_hdr when it has a usable one.
+  struct CodeRange {
+    uintptr_t begin;
+    uintptr_t end;
+    uintptr_t eh_frame_hdr;
+    uintptr_t table;
+    size_t n_entries;
+
+    bool operator<(const CodeRange& rhs) const { return begin < rhs.begin; }
+  };
+
+  void sample(void* context);
+  // xorshift64*, which only does arithmetic and so is safe in the handler.
+  uint64_t random() {
+    random_ ^= random_ >> 12;
+    random_ ^= random_ << 25;
+    random_ ^= random_ >> 27;
+    return random_ * 0x2545f4914f6cdd1dULL;
+  }
+  const CodeRange* code_range(uintptr_t pc) const;
+  void load_code_ranges();
+  void delete_timer();
+
+  duration interval_ = duration(0);
+  bool timer_created_ = false;
+  timer_t timer_;
+  pthread_t thread_;
+  // Bounds of the sampled thread's stack; the unwinder reads nothing else
+  // of it.
+  uintptr_t stack_low_ = 0;
+  uintptr_t stack_high_ = 0;
+
+  volatile sig_atomic_t armed_ = 0;
+  uintptr_t entry_ = 0;
+  uintptr_t stack_ = 0;
+  // Sorted by address; only replaced while the sampler is disarmed.
+  std::vector<CodeRange> code_;
+  // Set by the handler when a frame was outside every known object.
+  volatile sig_atomic_t stale_code_ = 0;
+  std::vector<uintptr_t> frames_;
+  std::vector<uint8_t> depths_;
+  size_t n_samples_ = 0;
+  // Samples taken since the last drain, kept or not.
+  uint64_t seen_ = 0;
+  uint64_t random_ = 0x9e3779b97f4a7c15ULL;
+  uint64_t samples_ = 0;
+  uint64_t dropped_ = 0;
+};
+
+// Names code addresses as "symbol (object)". Symbols come from the object's
+// ELF symbol table, which also lists static functions, or from its dynamic
+// symbols through dladdr(3) when the table was stripped. Objects are read
+// once, on first use, and names are cached per address.
+class NativeSymbolizer {
+ public:
+  const std::string& name(uintptr_t address);
+
+ private:
+  struct Symbol {
+    uintptr_t address;
+    uintptr_t size;
+    std::string name;
+
+    bool operator<(const Symbol& rhs) const { return address < rhs.address; }
+  };
+  struct Object {
+    std::string basename;
+    // Symbol addresses are relative to the load address (shared objects and
+    // position-independent executables).
+    bool relative = false;
+    std::vector<Symbol> symbols;
+  };
+
+  const Object& object(const char* path);
+
+  std::unordered_map<std::string, Object> objects_;
+  std::unordered_map<uintptr_t, std::string> names_;
+};
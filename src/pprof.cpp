@@ -0,0 +1,259 @@
+#include "pprof.h"
+
+#include <zlib.h>
+
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// Field numbers of profile.proto
+// (github.com/google/pprof/blob/main/proto/profile.proto).
+namespace field {
+constexpr int kProfileSampleType = 1;
+constexpr int kProfileSample = 2;
+constexpr int kProfileLocation = 4;
+constexpr int kProfileFunction = 5;
+constexpr int kProfileStringTable = 6;
+constexpr int kProfileDefaultSampleType = 14;
+constexpr int kValueTypeType = 1;
+constexpr int kValueTypeUnit = 2;
+constexpr int kSampleLocationId = 1;
+constexpr int kSampleValue = 2;
+constexpr int kLocationId = 1;
+constexpr int kLocationLine = 4;
+constexpr int kLineFunctionId = 1;
+constexpr int kLineLine = 2;
+constexpr int kFunctionId = 1;
+constexpr int kFunctionName = 2;
+constexpr int kFunctionSystemName = 3;
+constexpr int kFunctionFilename = 4;
+constexpr int kFunctionStartLine = 5;
+}  // namespace field
+
+constexpr int kVarint = 0;
+constexpr int kLengthDelimited = 2;
+
+// Protobuf wire-format encoder for one message. Nested messages are encoded
+// into their own writer and appended with message().
+class ProtoWriter {
+ public:
+  void varint(int number, uint64_t value) {
+    if (value != 0) {
+      tag(number, kVarint);
+      raw_varint(value);
+    }
+  }
+
+  void bytes(int number, std::string_view value) {
+    tag(number, kLengthDelimited);
+    raw_varint(value.size());
+    out_.append(value.data(), value.size());
+  }
+
+  void message(int number, const ProtoWriter& child) {
+    bytes(number, child.data());
+  }
+
+  // A packed repeated varint field.
+  void packed(int number, const std::vector<uint64_t>& values) {
+    ProtoWriter payload;
+    for (auto value : values) {
+      payload.raw_varint(value);
+    }
+    bytes(number, payload.data());
+  }
+
+  const std::string& data() const { return out_; }
+  size_t size() const { return out_.size(); }
+  void clear() { out_.clear(); }
+
+ private:
+  void tag(int number, int wire_type) {
+    raw_varint((uint64_t(number) << 3) | wire_type);
+  }
+  void raw_varint(uint64_t value) {
+    while (value >= 0x80) {
+      out_ += char((value & 0x7f) | 0x80);
+      value >>= 7;
+    }
+    out_ += char(value);
+  }
+
+  std::string out_;
+};
+
+class StringTable {
+ public:
+  StringTable() { add(""); }
+
+  uint64_t add(std::string_view str) {
+    auto pair = index_.emplace(str, strings_.size());
+    if (pair.second) {
+      strings_.push_back(str);
+    }
+    return pair.first->second;
+  }
+  const std::vector<std::string_view>& strings() const { return strings_; }
+
+ private:
+  std::vector<std::string_view> strings_;
+  std::unordered_map<std::string_view, uint64_t> index_;
+};
+
+// Compresses the top-level fields to a gzip file as they are produced.
+class GzipFile {
+ public:
+  explicit GzipFile(const std::string& path)
+      : path_(path), file_(gzopen(path.c_str(), "wb")) {
+    if (file_ == nullptr) {
+      throw std::runtime_error("Could not open `" + path + "' for writing");
+    }
+  }
+  ~GzipFile() {
+    if (file_ != nullptr) {
+      gzclose(file_);
+    }
+  }
+
+  // Writes and clears writer once it holds enough to be worth a call.
+  void drain(ProtoWriter& writer, bool force = false) {
+    if (!force && writer.size() < (1 << 16)) {
+      return;
+    }
+    const auto& data = writer.data();
+    if (!data.empty() &&
+        gzwrite(file_, data.data(), data.size()) != int(data.size())) {
+      throw std::runtime_error("Could not write `" + path_ + "'");
+    }
+    writer.clear();
+  }
+
+  void close() {
+    int result = gzclose(file_);
+    file_ = nullptr;
+    if (result != Z_OK) {
+      throw std::runtime_error("Could not write `" + path_ + "'");
+    }
+  }
+
+ private:
+  std::string path_;
+  gzFile file_;
+};
+
+}  // namespace
+
+void WritePprof(const ProfileData& data, const std::string& path) {
+  const auto& f = data.functions;
+  const auto& l = data.lines;
+  const auto& c = data.c_functions;
+  StringTable strings;
+  GzipFile file(path);
+  ProtoWriter out;
+  ProtoWriter message;
+  ProtoWriter child;
+
+  uint64_t self_type = 0;
+  const std::pair<const char*, const char*> sample_types[] = {
+    {"wall", "nanoseconds"}, {"self", "nanoseconds"}, {"calls", "count"},
+  };
+  for (auto&& type : sample_types) {
+    message.clear();
+    uint64_t name = strings.add(type.first);
+    message.varint(field::kValueTypeType, name);
+    message.varint(field::kValueTypeUnit, strings.add(type.second));
+    out.message(field::kProfileSampleType, message);
+    if (std::string_view(type.first) == "self") {
+      self_type = name;
+    }
+  }
+  out.varint(field::kProfileDefaultSampleType, self_type);
+
+  // pprof ids start at 1. Functions with the same identity share an id.
+  std::vector<uint64_t> function_ids(f.size());
+  std::unordered_map<FunctionIdentity, uint64_t, FunctionIdentityHash> ids;
+  for (size_t i = 0; i < f.size(); ++i) {
+    auto pair = ids.emplace(FunctionIdentity(f, i), ids.size() + 1);
+    function_ids[i] = pair.first->second;
+    if (!pair.second) {
+      continue;
+    }
+    message.clear();
+    uint64_t name = strings.add(f.name[i]);
+    message.varint(field::kFunctionId, function_ids[i]);
+    message.varint(field::kFunctionName, name);
+    message.varint(field::kFunctionSystemName, name);
+    message.varint(field::kFunctionFilename, strings.add(f.filename[i]));
+    message.varint(field::kFunctionStartLine, f.first_line[i]);
+    out.message(field::kProfileFunction, message);
+    file.drain(out);
+  }
+  uint64_t c_function_base = ids.size();
+  for (size_t i = 0; i < c.size(); ++i) {
+    message.clear();
+    uint64_t name = strings.add(c.name[i]);
+    message.varint(field::kFunctionId, c_function_base + i + 1);
+    message.varint(field::kFunctionName, name);
+    message.varint(field::kFunctionSystemName, name);
+    out.message(field::kProfileFunction, message);
+    file.drain(out);
+  }
+
+  // Location ids are line rows, then C functions; each active one gets a
+  // sample.
+  std::vector<uint64_t> values(3);
+  std::vector<uint64_t> location(1);
+  auto add_sample = [&](uint64_t id, uint64_t wall, uint64_t self,
+                        uint64_t calls) {
+    if (wall == 0 && self == 0 && calls == 0) {
+      return;
+    }
+    message.clear();
+    location[0] = id;
+    values[0] = wall;
+    values[1] = self;
+    values[2] = calls;
+    message.packed(field::kSampleLocationId, location);
+    message.packed(field::kSampleValue, values);
+    out.message(field::kProfileSample, message);
+  };
+  auto add_location = [&](uint64_t id, uint64_t function_id,
+                          uint64_t line_number) {
+    child.clear();
+    child.varint(field::kLineFunctionId, function_id);
+    child.varint(field::kLineLine, line_number);
+    message.clear();
+    message.varint(field::kLocationId, id);
+    message.message(field::kLocationLine, child);
+    out.message(field::kProfileLocation, message);
+  };
+  for (size_t i = 0; i < f.size(); ++i) {
+    size_t begin = f.line_begin[i];
+    size_t end = begin + f.line_count[i];
+    for (size_t row = begin; row < end; ++row) {
+      add_location(row + 1, function_ids[i], l.line_number[row]);
+      uint64_t self = l.internal_ns[row];
+      if (row == begin) {
+        self += f.internal_ns[i];
+      }
+      add_sample(row + 1, self + l.external_ns[row], self, l.n_calls[row]);
+      file.drain(out);
+    }
+  }
+  for (size_t i = 0; i < c.size(); ++i) {
+    uint64_t id = l.size() + i + 1;
+    add_location(id, c_function_base + i + 1, 0);
+    add_sample(id, c.internal_ns[i], c.internal_ns[i], c.n_calls[i]);
+    file.drain(out);
+  }
+
+  for (auto str : strings.strings()) {
+    out.bytes(field::kProfileStringTable, str);
+    file.drain(out);
+  }
+  file.drain(out, true);
+  file.close();
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+
+#include "profile_data.h"
+
+// Writes data as a gzip-compressed pprof profile.proto. bprof keeps no
+// stacks, so the profile is flat: one Location per source line (and per C
+// function) and one single-frame Sample for each that saw any activity,
+// valued as [wall nanoseconds, self nanoseconds, calls]. Calls of a line are
+// the times it ran. A function's own call overhead is counted on its first
+// line. Throws std::runtime_error on
+// I/O errors.
+void WritePprof(const ProfileData& data, const std::string& path);
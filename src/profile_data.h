@@ -0,0 +1,257 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Struct-of-arrays copy of the profiler tables. Every numeric column is a
+// contiguous uint64 array so it can be handed out through the buffer protocol
+// without further copies.
+
+struct FunctionTable {
+  std::vector<uint64_t> key;
+  std::vector<std::string> name;
+  std::vector<std::string> filename;
+  std::vector<uint64_t> first_line;
+  std::vector<uint64_t> n_calls;
+  std::vector<uint64_t> internal_ns;
+  // Rows of the line table belonging to this function.
+  std::vector<uint64_t> line_begin;
+  std::vector<uint64_t> line_count;
+
+  size_t size() const { return key.size(); }
+};
+
+struct LineTable {
+  // Index into the function table.
+  std::vector<uint64_t> function;
+  std::vector<uint64_t> line_number;
+  std::vector<uint64_t> n_calls;
+  std::vector<uint64_t> internal_ns;
+  std::vector<uint64_t> external_ns;
+  // Span of the line's source text in ProfileData::text.
+  std::vector<uint64_t> text_offset;
+  std::vector<uint64_t> text_size;
+
+  size_t size() const { return function.size(); }
+};
+
+struct CFunctionTable {
+  std::vector<std::string> name;
+  std::vector<uint64_t> n_calls;
+  std::vector<uint64_t> internal_ns;
+  // Native samples whose stacks were not kept; see NativeSampler.
+  std::vector<uint64_t> native_dropped;
+
+  size_t size() const { return name.size(); }
+};
+
+// Call-site -> callee edges with pstats statistics. Callers index the
+// function table, or are kNoCaller for calls from outside any profiled
+// function, and caller_line is the line the call was made from; callees
+// index the function table, or the C-function table when callee_c is set.
+struct CallTable {
+  static constexpr uint64_t kNoCaller = UINT64_MAX;
+
+  std::vector<uint64_t> caller;
+  std::vector<uint64_t> caller_line;
+  std::vector<uint64_t> callee;
+  std::vector<uint64_t> callee_c;
+  std::vector<uint64_t> n_calls;
+  std::vector<uint64_t> primitive_calls;
+  // Time in the callee itself, and including its callees over primitive
+  // calls only.
+  std::vector<uint64_t> internal_ns;
+  std::vector<uint64_t> total_ns;
+
+  size_t size() const { return caller.size(); }
+  void push_back(uint64_t caller_index, uint64_t line, uint64_t callee_index,
+                 bool c, uint64_t calls, uint64_t primitive, uint64_t internal,
+                 uint64_t total) {
+    caller.push_back(caller_index);
+    caller_line.push_back(line);
+    callee.push_back(callee_index);
+    callee_c.push_back(c);
+    n_calls.push_back(calls);
+    primitive_calls.push_back(primitive);
+    internal_ns.push_back(internal);
+    total_ns.push_back(total);
+  }
+};
+
+// Per-instruction statistics of the functions traced per opcode, sorted by
+// function and offset. Offsets are bytecode offsets (f_lasti) and opcodes the
+// interpreter's numbering, as in dis.opname; only instructions that ran have
+// rows.
+struct OpcodeTable {
+  // Index into the function table.
+  std::vector<uint64_t> function;
+  std::vector<uint64_t> offset;
+  std::vector<uint64_t> opcode;
+  std::vector<uint64_t> line_number;
+  std::vector<uint64_t> n_calls;
+  std::vector<uint64_t> internal_ns;
+  std::vector<uint64_t> external_ns;
+
+  size_t size() const { return function.size(); }
+  void push_back(uint64_t function_index, uint64_t offset_value,
+                 uint64_t opcode_value, uint64_t line, uint64_t calls,
+                 uint64_t internal, uint64_t external) {
+    function.push_back(function_index);
+    offset.push_back(offset_value);
+    opcode.push_back(opcode_value);
+    line_number.push_back(line);
+    n_calls.push_back(calls);
+    internal_ns.push_back(internal);
+    external_ns.push_back(external);
+  }
+};
+
+// Native stacks sampled under C functions (set_native), one row per C
+// function and distinct stack of symbolized frames. Frame names of every row
+// are stored back to back in frames, innermost first.
+struct NativeTable {
+  // Index into the C-function table.
+  std::vector<uint64_t> c_function;
+  std::vector<uint64_t> samples;
+  // Sampling interval summed over the samples.
+  std::vector<uint64_t> ns;
+  std::vector<uint64_t> frame_begin;
+  std::vector<uint64_t> frame_count;
+  std::vector<std::string> frames;
+
+  size_t size() const { return c_function.size(); }
+  template <typename It>
+  void push_back(uint64_t c_function_index, uint64_t n_samples,
+                 uint64_t time_ns, It first, It last) {
+    c_function.push_back(c_function_index);
+    samples.push_back(n_samples);
+    ns.push_back(time_ns);
+    frame_begin.push_back(frames.size());
+    frames.insert(frames.end(), first, last);
+    frame_count.push_back(frames.size() - frame_begin.back());
+  }
+};
+
+// GIL wait (set_gil) attributed to the line that resumed after it, and the
+// off-CPU time of the C calls made at the line. Only lines that waited or
+// made C calls have rows.
+struct GilWaitTable {
+  // Index into the function table.
+  std::vector<uint64_t> function;
+  std::vector<uint64_t> line_number;
+  std::vector<uint64_t> n_waits;
+  std::vector<uint64_t> wait_ns;
+  std::vector<uint64_t> off_cpu_ns;
+
+  size_t size() const { return function.size(); }
+  void push_back(uint64_t function_index, uint64_t line, uint64_t waits,
+                 uint64_t wait, uint64_t off_cpu) {
+    function.push_back(function_index);
+    line_number.push_back(line);
+    n_waits.push_back(waits);
+    wait_ns.push_back(wait);
+    off_cpu_ns.push_back(off_cpu);
+  }
+};
+
+// GIL totals per thread, by PyThread_get_thread_ident(). profiled_ns,
+// cpu_ns and released_ns cover the time the hooks were on the thread;
+// hold_exact is 0 when that time has off-CPU waits the release wrappers did
+// not see, so hold_ns misses switches.
+struct GilThreadTable {
+  std::vector<uint64_t> thread_id;
+  std::vector<uint64_t> n_waits;
+  std::vector<uint64_t> wait_ns;
+  std::vector<uint64_t> hold_ns;
+  std::vector<uint64_t> profiled_ns;
+  std::vector<uint64_t> cpu_ns;
+  std::vector<uint64_t> released_ns;
+  std::vector<uint64_t> hold_exact;
+
+  size_t size() const { return thread_id.size(); }
+  void push_back(uint64_t id, uint64_t waits, uint64_t wait, uint64_t hold,
+                 uint64_t profiled, uint64_t cpu, uint64_t released,
+                 bool exact) {
+    thread_id.push_back(id);
+    n_waits.push_back(waits);
+    wait_ns.push_back(wait);
+    hold_ns.push_back(hold);
+    profiled_ns.push_back(profiled);
+    cpu_ns.push_back(cpu);
+    released_ns.push_back(released);
+    hold_exact.push_back(exact);
+  }
+};
+
+struct ProfileData {
+  FunctionTable functions;
+  LineTable lines;
+  CFunctionTable c_functions;
+  CallTable calls;
+  OpcodeTable opcodes;
+  NativeTable native;
+  GilWaitTable gil_waits;
+  GilThreadTable gil_threads;
+  // Whole-profile counters, such as what bounded mode evicted. Merging
+  // profiles sums them.
+  std::map<std::string, uint64_t> counters;
+  // Pool holding the source text of every line, each distinct line once.
+  std::string text;
+
+  std::string_view line_text(size_t row) const {
+    return std::string_view(text).substr(lines.text_offset[row],
+                                         lines.text_size[row]);
+  }
+};
+
+// Interns line text into a ProfileData text pool. Views passed to add() are
+// used as keys and must outlive the TextPool.
+class TextPool {
+ public:
+  explicit TextPool(ProfileData& data) : data_(data) {}
+
+  void add(std::string_view str) {
+    auto& lines = data_.lines;
+    auto it = index_.find(str);
+    if (it == index_.end()) {
+      it = index_.emplace(str, data_.text.size()).first;
+      data_.text.append(str.data(), str.size());
+    }
+    lines.text_offset.push_back(it->second);
+    lines.text_size.push_back(str.size());
+  }
+
+ private:
+  ProfileData& data_;
+  std::unordered_map<std::string_view, uint64_t> index_;
+};
+
+// Identifies a function across processes and runs, where code object
+// addresses differ. Views point into the FunctionTable it was taken from.
+struct FunctionIdentity {
+  std::string_view filename;
+  std::string_view name;
+  uint64_t first_line;
+
+  FunctionIdentity(const FunctionTable& table, size_t i)
+      : filename(table.filename[i]), name(table.name[i]),
+        first_line(table.first_line[i]) {}
+
+  bool operator==(const FunctionIdentity& rhs) const {
+    return first_line == rhs.first_line && name == rhs.name &&
+        filename == rhs.filename;
+  }
+};
+
+struct FunctionIdentityHash {
+  size_t operator()(const FunctionIdentity& id) const {
+    size_t h = std::hash<std::string_view>()(id.filename);
+    h = h * 31 + std::hash<std::string_view>()(id.name);
+    return h * 31 + std::hash<uint64_t>()(id.first_line);
+  }
+};
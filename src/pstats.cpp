@@ -0,0 +1,186 @@
+#include "pstats.h"
+
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// Just enough of the marshal format for pstats: no references, so any
+// Python 3 can load it.
+class MarshalWriter {
+ public:
+  void begin_dict() { out_ += '{'; }
+  void end_dict() { out_ += '0'; }
+  void begin_tuple(uint32_t size) {
+    out_ += '(';
+    int32(size);
+  }
+
+  void str(std::string_view value) {
+    out_ += 'u';
+    int32(value.size());
+    out_.append(value.data(), value.size());
+  }
+
+  void integer(uint64_t value) {
+    if (value <= INT32_MAX) {
+      out_ += 'i';
+      int32(value);
+      return;
+    }
+    // Arbitrary precision: a digit count, then base 2**15 digits, least
+    // significant first.
+    std::vector<uint16_t> digits;
+    for (; value != 0; value >>= 15) {
+      digits.push_back(value & 0x7fff);
+    }
+    out_ += 'l';
+    int32(digits.size());
+    for (auto digit : digits) {
+      out_ += char(digit & 0xff);
+      out_ += char(digit >> 8);
+    }
+  }
+
+  void real(double value) {
+    char bytes[sizeof(double)];
+    std::memcpy(bytes, &value, sizeof(bytes));
+    out_ += 'g';
+    out_.append(bytes, sizeof(bytes));
+  }
+
+  const std::string& data() const { return out_; }
+
+ private:
+  void int32(uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+      out_ += char((value >> (8 * i)) & 0xff);
+    }
+  }
+
+  std::string out_;
+};
+
+struct Totals {
+  uint64_t primitive_calls = 0;
+  uint64_t n_calls = 0;
+  uint64_t internal_ns = 0;
+  uint64_t total_ns = 0;
+
+  void add(const CallTable& calls, size_t i) {
+    primitive_calls += calls.primitive_calls[i];
+    n_calls += calls.n_calls[i];
+    internal_ns += calls.internal_ns[i];
+    total_ns += calls.total_ns[i];
+  }
+};
+
+struct Entry {
+  std::string_view filename;
+  uint64_t line = 0;
+  std::string name;
+  Totals totals;
+  // Ordered, so the output does not depend on hash order.
+  std::map<size_t, Totals> callers;
+};
+
+void WriteTotals(MarshalWriter& out, const Totals& totals) {
+  out.integer(totals.primitive_calls);
+  out.integer(totals.n_calls);
+  out.real(totals.internal_ns / 1e9);
+  out.real(totals.total_ns / 1e9);
+}
+
+// Caller entries lead with the call count rather than the primitive count,
+// as cProfile writes them.
+void WriteCallerTotals(MarshalWriter& out, const Totals& totals) {
+  out.integer(totals.n_calls);
+  out.integer(totals.primitive_calls);
+  out.real(totals.internal_ns / 1e9);
+  out.real(totals.total_ns / 1e9);
+}
+
+void WriteKey(MarshalWriter& out, const Entry& entry) {
+  out.begin_tuple(3);
+  out.str(entry.filename);
+  out.integer(entry.line);
+  out.str(entry.name);
+}
+
+std::string BuiltinName(std::string_view name) {
+  constexpr std::string_view prefix = "<C-function ";
+  if (name.substr(0, prefix.size()) == prefix && !name.empty() &&
+      name.back() == '>') {
+    name = name.substr(prefix.size(), name.size() - prefix.size() - 1);
+  }
+  return "<built-in method " + std::string(name) + ">";
+}
+
+}  // namespace
+
+void WritePstats(const ProfileData& data, const std::string& path) {
+  const auto& f = data.functions;
+  const auto& c = data.c_functions;
+  const auto& k = data.calls;
+
+  std::vector<Entry> entries;
+  std::vector<size_t> function_entries(f.size());
+  std::unordered_map<FunctionIdentity, size_t, FunctionIdentityHash> index;
+  for (size_t i = 0; i < f.size(); ++i) {
+    auto pair = index.emplace(FunctionIdentity(f, i), entries.size());
+    if (pair.second) {
+      Entry entry;
+      entry.filename = f.filename[i];
+      entry.line = f.first_line[i];
+      entry.name = f.name[i];
+      entries.push_back(std::move(entry));
+    }
+    function_entries[i] = pair.first->second;
+  }
+  size_t c_begin = entries.size();
+  for (size_t i = 0; i < c.size(); ++i) {
+    Entry entry;
+    entry.filename = "~";
+    entry.name = BuiltinName(c.name[i]);
+    entries.push_back(std::move(entry));
+  }
+
+  for (size_t i = 0; i < k.size(); ++i) {
+    Entry& callee = entries[k.callee_c[i] ?
+        c_begin + k.callee[i] : function_entries[k.callee[i]]];
+    callee.totals.add(k, i);
+    if (k.caller[i] != CallTable::kNoCaller) {
+      callee.callers[function_entries[k.caller[i]]].add(k, i);
+    }
+  }
+
+  MarshalWriter out;
+  out.begin_dict();
+  for (auto&& entry : entries) {
+    WriteKey(out, entry);
+    out.begin_tuple(5);
+    WriteTotals(out, entry.totals);
+    out.begin_dict();
+    for (auto&& caller : entry.callers) {
+      WriteKey(out, entries[caller.first]);
+      out.begin_tuple(4);
+      WriteCallerTotals(out, caller.second);
+    }
+    out.end_dict();
+  }
+  out.end_dict();
+
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    throw std::runtime_error("Could not open `" + path + "' for writing");
+  }
+  file.write(out.data().data(), out.data().size());
+  if (!file) {
+    throw std::runtime_error("Could not write `" + path + "'");
+  }
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <string>
+
+#include "profile_data.h"
+
+// Writes data in the marshal format cProfile saves and pstats.Stats loads:
+// {(filename, line, name): (cc, nc, tt, ct, {caller: (cc, nc, tt, ct)})}
+// with times in seconds. Every statistic comes from the call edges;
+// functions with the same identity are combined and C functions are keyed
+// like cProfile's builtins, ('~', 0, '<built-in method NAME>'). Throws
+// std::runtime_error on I/O errors.
+void WritePstats(const ProfileData& data, const std::string& path);
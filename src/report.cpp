@@ -0,0 +1,131 @@
+#include "report.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+// Keeps the limit largest (key, index) pairs seen. The heap's top is the
+// smallest kept entry, so each new candidate costs one comparison unless it
+// makes the cut.
+class TopN {
+ public:
+  explicit TopN(size_t limit) : limit_(limit) {}
+
+  void add(uint64_t key, uint64_t index) {
+    if (limit_ == 0 || key == 0) {
+      return;
+    }
+    if (heap_.size() < limit_) {
+      heap_.emplace(key, index);
+    } else if (key > heap_.top().first) {
+      heap_.pop();
+      heap_.emplace(key, index);
+    }
+  }
+
+  // Indexes, largest key first.
+  std::vector<uint64_t> take() {
+    std::vector<uint64_t> result(heap_.size());
+    for (size_t i = result.size(); i-- > 0; heap_.pop()) {
+      result[i] = heap_.top().second;
+    }
+    return result;
+  }
+
+ private:
+  using Entry = std::pair<uint64_t, uint64_t>;
+  size_t limit_;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap_;
+};
+
+uint64_t SummaryKey(const FunctionSummary& summary, DiffKey key) {
+  switch (key) {
+    case DiffKey::kSelf:
+      return summary.self_ns;
+    case DiffKey::kTotal:
+      return summary.total_ns;
+    case DiffKey::kCalls:
+      return summary.n_calls;
+  }
+  return 0;
+}
+
+uint64_t LineKey(const DumpLine& line, DiffKey key) {
+  switch (key) {
+    case DiffKey::kSelf:
+      return line.internal_ns;
+    case DiffKey::kTotal:
+      return line.internal_ns + line.external_ns;
+    case DiffKey::kCalls:
+      return line.n_calls;
+  }
+  return 0;
+}
+
+}  // namespace
+
+Report BuildReport(const MappedDump& dump, DiffKey key, size_t limit) {
+  auto functions = dump.records<DumpFunction>(DumpSection::kFunctions);
+  auto lines = dump.records<DumpLine>(DumpSection::kLines);
+
+  TopN top_functions(limit);
+  std::vector<FunctionSummary> summaries(functions.size());
+  for (size_t i = 0; i < functions.size(); ++i) {
+    const auto& function = functions[i];
+    if (function.line_begin > lines.size() ||
+        function.line_count > lines.size() - function.line_begin) {
+      throw std::runtime_error("Corrupt bprof dump function");
+    }
+    auto& summary = summaries[i];
+    summary.function = i;
+    summary.n_calls = function.n_calls;
+    summary.self_ns = function.internal_ns;
+    uint64_t external_ns = 0;
+    for (uint64_t row = function.line_begin;
+         row < function.line_begin + function.line_count; ++row) {
+      summary.self_ns += lines[row].internal_ns;
+      external_ns += lines[row].external_ns;
+    }
+    summary.total_ns = summary.self_ns + external_ns;
+    top_functions.add(SummaryKey(summary, key), i);
+  }
+
+  TopN top_lines(limit);
+  for (size_t row = 0; row < lines.size(); ++row) {
+    top_lines.add(LineKey(lines[row], key), row);
+  }
+
+  auto native = dump.records<DumpNativeStack>(DumpSection::kNativeStacks);
+  TopN top_native(limit);
+  for (size_t row = 0; row < native.size(); ++row) {
+    top_native.add(key == DiffKey::kCalls ? native[row].samples : native[row].ns,
+                   row);
+  }
+
+  // Off-CPU time ranks too, so lines whose waits no wrapper saw still show.
+  auto gil_waits = dump.records<DumpGilWait>(
+      DumpSection::kGilWaits, offsetof(DumpGilWait, off_cpu_ns));
+  bool has_off_cpu =
+      gil_waits.covers(offsetof(DumpGilWait, off_cpu_ns) + sizeof(uint64_t));
+  TopN top_waits(limit);
+  for (size_t row = 0; row < gil_waits.size(); ++row) {
+    const DumpGilWait& wait = gil_waits[row];
+    uint64_t time = has_off_cpu ? std::max(wait.wait_ns, wait.off_cpu_ns) :
+                                  wait.wait_ns;
+    top_waits.add(key == DiffKey::kCalls ? wait.n_waits : time, row);
+  }
+
+  Report report;
+  for (auto index : top_functions.take()) {
+    report.functions.push_back(summaries[index]);
+  }
+  report.lines = top_lines.take();
+  report.native = top_native.take();
+  report.gil_waits = top_waits.take();
+  return report;
+}
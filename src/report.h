@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "diff.h"
+#include "dump_file.h"
+
+// Per-function totals as the diff computes them: self is the function's own
+// internal time plus that of its lines, total adds the lines' external time.
+struct FunctionSummary {
+  uint64_t function = 0;
+  uint64_t n_calls = 0;
+  uint64_t self_ns = 0;
+  uint64_t total_ns = 0;
+};
+
+struct Report {
+  // Hottest functions and line rows by the report key, hottest first.
+  std::vector<FunctionSummary> functions;
+  std::vector<uint64_t> lines;
+  // Hottest native stacks by sampled time (by samples for the calls key).
+  std::vector<uint64_t> native;
+  // Lines that waited longest for the GIL.
+  std::vector<uint64_t> gil_waits;
+};
+
+// Ranks a mapped dump in one pass over its records. Only the top limit
+// entries are kept, through a bounded heap, so the cost is linear in the
+// size of the profile and nothing is sorted beyond the rows reported. Rows
+// whose key is zero are left out.
+Report BuildReport(const MappedDump& dump, DiffKey key, size_t limit);
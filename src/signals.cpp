@@ -0,0 +1,187 @@
+#include "signals.h"
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
+
+#include "_bprof.h"
+#include "dump_file.h"
+
+namespace {
+
+volatile sig_atomic_t toggle_pending = 0;
+volatile sig_atomic_t dump_pending = 0;
+int toggle_signal = 0;
+int dump_signal = 0;
+int wake_pipe[2] = {-1, -1};
+
+Module* module = nullptr;
+std::string directory;
+std::thread* helper = nullptr;
+pid_t helper_pid = 0;
+// Set under the GIL; tells the helper to exit.
+bool quitting = false;
+unsigned dump_seq = 0;
+struct sigaction old_toggle_action;
+struct sigaction old_dump_action;
+
+void HandleSignal(int signum) {
+  int saved_errno = errno;
+  if (signum == toggle_signal) {
+    toggle_pending = 1;
+  } else if (signum == dump_signal) {
+    dump_pending = 1;
+  }
+  char byte = 0;
+  ssize_t ignored = write(wake_pipe[1], &byte, 1);
+  (void)ignored;
+  errno = saved_errno;
+}
+
+int Toggle(void*) {
+  if (module == nullptr) {
+    return 0;
+  }
+  try {
+    if (module->running()) {
+      module->stop();
+    } else {
+      module->start();
+    }
+  } catch (const ThreadError& e) {
+    PySys_WriteStderr("bprof: %s\n", e.what());
+  }
+  return 0;
+}
+
+void Dump() {
+  char name[64];
+  std::snprintf(name, sizeof(name), "/bprof-%ld-signal-%u.bprof",
+                static_cast<long>(getpid()), dump_seq++);
+  std::string path = directory + name;
+
+  ProfileData data = module->snapshot(true, std::chrono::milliseconds(1));
+  std::string error;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    WriteDumpAtomic(data, path);
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  if (!error.empty()) {
+    PySys_WriteStderr("bprof: %s\n", error.c_str());
+  }
+}
+
+void RunHelper() {
+  char buffer[64];
+  for (;;) {
+    ssize_t n = read(wake_pipe[0], buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    PyGILState_STATE gil = PyGILState_Ensure();
+    if (quitting || _Py_IsFinalizing()) {
+      PyGILState_Release(gil);
+      return;
+    }
+    if (toggle_pending) {
+      toggle_pending = 0;
+      Py_AddPendingCall(Toggle, nullptr);
+    }
+    if (dump_pending) {
+      dump_pending = 0;
+      Dump();
+    }
+    PyGILState_Release(gil);
+  }
+}
+
+void Bind(int signum, struct sigaction* old_action) {
+  if (signum == 0) {
+    return;
+  }
+  struct sigaction action = {};
+  action.sa_handler = HandleSignal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if (sigaction(signum, &action, old_action) != 0) {
+    throw std::runtime_error("Could not install signal handler");
+  }
+}
+
+void Unbind(int signum, const struct sigaction* old_action) {
+  if (signum != 0) {
+    sigaction(signum, old_action, nullptr);
+  }
+}
+
+}  // namespace
+
+void InstallSignalHandlers(Module* target, int toggle, int dump,
+                           const std::string& dump_directory) {
+  RemoveSignalHandlers();
+  if (pipe(wake_pipe) != 0) {
+    throw std::runtime_error("Could not create signal pipe");
+  }
+  for (int fd : wake_pipe) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  // A burst of signals must never block the handler.
+  fcntl(wake_pipe[1], F_SETFL, fcntl(wake_pipe[1], F_GETFL) | O_NONBLOCK);
+
+  module = target;
+  directory = dump_directory;
+  toggle_signal = toggle;
+  dump_signal = dump;
+  quitting = false;
+  toggle_pending = 0;
+  dump_pending = 0;
+  helper = new std::thread(RunHelper);
+  helper_pid = getpid();
+  try {
+    Bind(toggle_signal, &old_toggle_action);
+    Bind(dump_signal, &old_dump_action);
+  } catch (...) {
+    RemoveSignalHandlers();
+    throw;
+  }
+}
+
+void RemoveSignalHandlers() {
+  if (helper == nullptr) {
+    return;
+  }
+  Unbind(toggle_signal, &old_toggle_action);
+  Unbind(dump_signal, &old_dump_action);
+  toggle_signal = 0;
+  dump_signal = 0;
+  quitting = true;
+  close(wake_pipe[1]);
+
+  if (helper_pid == getpid()) {
+    // The helper may be waiting for the GIL.
+    Py_BEGIN_ALLOW_THREADS
+    helper->join();
+    Py_END_ALLOW_THREADS
+    delete helper;
+  }
+  // Otherwise the handle was inherited across fork() and its thread does
+  // not exist here; the handle is leaked, as destroying it would abort.
+  close(wake_pipe[0]);
+  wake_pipe[0] = wake_pipe[1] = -1;
+  helper = nullptr;
+  module = nullptr;
+}
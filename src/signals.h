@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+class Module;
+
+// Opt-in signal control for long-running processes. The handlers only set a
+// flag and write one byte to a pipe, both async-signal-safe. A helper thread
+// woken by the pipe does the work: it writes dumps itself, holding the GIL in
+// short slices, and hands toggles to the interpreter as a pending call, which
+// starts or stops profiling on the main thread at its next safe point.
+//
+// Install and remove need the GIL and throw std::runtime_error on failure.
+// A signal number of 0 leaves that action unbound.
+void InstallSignalHandlers(Module* module, int toggle_signal, int dump_signal,
+                           const std::string& directory);
+void RemoveSignalHandlers();
@@ -0,0 +1,57 @@
+#include "source.h"
+
+SourceCache::SourceCache() {
+  linecache_ = PyImport_ImportModule("linecache");
+  if (linecache_ == NULL) {
+    PyErr_Clear();
+  }
+}
+
+SourceCache::~SourceCache() {
+  Py_XDECREF(linecache_);
+}
+
+std::string_view SourceCache::line(
+    const std::string& filename, size_t line_number) {
+  const auto& source = file(filename);
+  if (line_number == 0 || line_number >= source.starts.size()) {
+    return std::string_view();
+  }
+  size_t begin = source.starts[line_number - 1];
+  return std::string_view(source.text).substr(
+      begin, source.starts[line_number] - begin);
+}
+
+const SourceCache::File& SourceCache::file(const std::string& filename) {
+  auto pair = files_.emplace(filename, File());
+  auto& source = pair.first->second;
+  if (!pair.second || linecache_ == NULL) {
+    return source;
+  }
+
+  PyObject* lines_py = PyObject_CallMethod(
+      linecache_, "getlines", "s#", filename.data(),
+      (Py_ssize_t)filename.size());
+  if (lines_py == NULL || !PyList_Check(lines_py)) {
+    Py_XDECREF(lines_py);
+    PyErr_Clear();
+    return source;
+  }
+
+  auto n_lines = PyList_GET_SIZE(lines_py);
+  source.starts.reserve(n_lines + 1);
+  source.starts.push_back(0);
+  for (decltype(n_lines) i = 0; i < n_lines; ++i) {
+    Py_ssize_t size;
+    const char* line_char =
+        PyUnicode_AsUTF8AndSize(PyList_GET_ITEM(lines_py, i), &size);
+    if (line_char == NULL) {
+      PyErr_Clear();
+    } else {
+      source.text.append(line_char, size);
+    }
+    source.starts.push_back(source.text.size());
+  }
+  Py_DECREF(lines_py);
+  return source;
+}
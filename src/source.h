@@ -0,0 +1,37 @@
+#pragma once
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Source text fetched through Python's linecache, at most once per file. Each
+// file is kept as one string and its lines are views into it. Only dump and
+// report paths use it, so no source I/O happens inside the hooks. All calls
+// need the GIL.
+class SourceCache {
+ public:
+  SourceCache();
+  ~SourceCache();
+  SourceCache(const SourceCache&) = delete;
+  SourceCache& operator=(const SourceCache&) = delete;
+
+  // Text of line_number (1-based) in filename, or an empty view when the
+  // source is unavailable. Views stay valid for the life of the cache.
+  std::string_view line(const std::string& filename, size_t line_number);
+
+ private:
+  struct File {
+    std::string text;
+    // Offset of every line in text, plus text.size() at the end.
+    std::vector<size_t> starts;
+  };
+
+  const File& file(const std::string& filename);
+
+  PyObject* linecache_;
+  std::unordered_map<std::string, File> files_;
+};
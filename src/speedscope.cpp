@@ -0,0 +1,224 @@
+#include "speedscope.h"
+
+#include <algorithm>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+#include "json_writer.h"
+
+namespace {
+
+void BeginFile(JsonWriter& out) {
+  out.begin_object();
+  out.key("$schema");
+  out.value("https://www.speedscope.app/file-format-schema.json");
+  out.key("exporter");
+  out.value("bprof");
+  out.key("name");
+  out.value("bprof " + std::to_string(getpid()));
+  out.key("activeProfileIndex");
+  out.value(uint64_t(0));
+}
+
+void Frame(JsonWriter& out, std::string_view name, std::string_view file,
+           uint64_t line) {
+  out.begin_object();
+  out.key("name");
+  out.value(name);
+  if (!file.empty()) {
+    out.key("file");
+    out.value(file);
+    out.key("line");
+    out.value(line);
+  }
+  out.end_object();
+}
+
+void BeginProfile(JsonWriter& out, const char* type, std::string_view name,
+                  uint64_t end) {
+  out.begin_object();
+  out.key("type");
+  out.value(type);
+  out.key("name");
+  out.value(name);
+  out.key("unit");
+  out.value("nanoseconds");
+  out.key("startValue");
+  out.value(uint64_t(0));
+  out.key("endValue");
+  out.value(end);
+}
+
+void Event(JsonWriter& out, const char* type, uint32_t frame, uint64_t at) {
+  out.begin_object();
+  out.key("type");
+  out.value(type);
+  out.key("frame");
+  out.value(uint64_t(frame));
+  out.key("at");
+  out.value(at);
+  out.end_object();
+}
+
+// Writes the events of one thread as properly nested open/close pairs.
+// Calls are recorded when they return, so they are ordered by start time
+// (outer calls first on ties) and replayed against a stack.
+void ThreadEvents(JsonWriter& out, const TimelineThread& thread) {
+  const auto& events = thread.events;
+  std::vector<size_t> order(events.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&events](size_t a, size_t b) {
+    return events[a].start_ns != events[b].start_ns ?
+        events[a].start_ns < events[b].start_ns :
+        events[a].depth < events[b].depth;
+  });
+
+  struct Open {
+    uint32_t frame;
+    uint64_t end;
+  };
+  std::vector<Open> stack;
+  auto close_until = [&](uint64_t at) {
+    while (!stack.empty() && stack.back().end <= at) {
+      Event(out, "C", stack.back().frame, stack.back().end);
+      stack.pop_back();
+    }
+  };
+  for (size_t i : order) {
+    const TimelineEvent& event = events[i];
+    close_until(event.start_ns);
+    uint64_t end = event.start_ns + event.duration_ns;
+    // A call cannot outlast its caller; clamp rounding overlaps.
+    if (!stack.empty()) {
+      end = std::min(end, stack.back().end);
+    }
+    Event(out, "O", event.name, event.start_ns);
+    stack.push_back(Open{event.name, end});
+  }
+  close_until(UINT64_MAX);
+}
+
+}  // namespace
+
+void WriteSpeedscopeTimeline(const TimelineData& data, const std::string& path) {
+  JsonWriter out(path);
+  BeginFile(out);
+
+  out.key("shared");
+  out.begin_object();
+  out.key("frames");
+  out.begin_array();
+  for (auto&& name : data.names) {
+    Frame(out, name.name, name.filename, name.line);
+  }
+  out.end_array();
+  out.end_object();
+
+  out.key("profiles");
+  out.begin_array();
+  for (auto&& thread : data.threads) {
+    uint64_t end = 0;
+    for (auto&& event : thread.events) {
+      end = std::max(end, event.start_ns + event.duration_ns);
+    }
+    std::string name = "thread " + std::to_string(thread.id);
+    if (thread.dropped != 0) {
+      name += " (" + std::to_string(thread.dropped) + " calls dropped)";
+    }
+    BeginProfile(out, "evented", name, end);
+    out.key("events");
+    out.begin_array();
+    ThreadEvents(out, thread);
+    out.end_array();
+    out.end_object();
+  }
+  out.end_array();
+  out.end_object();
+  out.finish();
+}
+
+void WriteSpeedscopeProfile(const ProfileData& data, const std::string& path) {
+  const auto& f = data.functions;
+  const auto& l = data.lines;
+  const auto& c = data.c_functions;
+  const auto& k = data.calls;
+
+  // Frames are functions, then C functions. Self time is what the callee
+  // spent in itself, so edges split it between callers.
+  std::vector<uint64_t> unattributed(f.size() + c.size());
+  for (size_t i = 0; i < f.size(); ++i) {
+    unattributed[i] = f.internal_ns[i];
+    size_t begin = f.line_begin[i];
+    for (size_t row = begin; row < begin + f.line_count[i]; ++row) {
+      unattributed[i] += l.internal_ns[row];
+    }
+  }
+  for (size_t i = 0; i < c.size(); ++i) {
+    unattributed[f.size() + i] = c.internal_ns[i];
+  }
+
+  JsonWriter out(path);
+  BeginFile(out);
+  out.key("shared");
+  out.begin_object();
+  out.key("frames");
+  out.begin_array();
+  for (size_t i = 0; i < f.size(); ++i) {
+    Frame(out, f.name[i], f.filename[i], f.first_line[i]);
+  }
+  for (size_t i = 0; i < c.size(); ++i) {
+    Frame(out, c.name[i], std::string_view(), 0);
+  }
+  out.end_array();
+  out.end_object();
+
+  uint64_t total = 0;
+  for (auto value : unattributed) {
+    total += value;
+  }
+  out.key("profiles");
+  out.begin_array();
+  BeginProfile(out, "sampled", "profile", total);
+
+  std::vector<uint64_t> weights;
+  out.key("samples");
+  out.begin_array();
+  for (size_t i = 0; i < k.size(); ++i) {
+    uint64_t callee = k.callee_c[i] ? f.size() + k.callee[i] : k.callee[i];
+    uint64_t weight = std::min(k.internal_ns[i], unattributed[callee]);
+    if (weight == 0) {
+      continue;
+    }
+    unattributed[callee] -= weight;
+    out.begin_array();
+    if (k.caller[i] != CallTable::kNoCaller) {
+      out.value(k.caller[i]);
+    }
+    out.value(callee);
+    out.end_array();
+    weights.push_back(weight);
+  }
+  for (size_t i = 0; i < unattributed.size(); ++i) {
+    if (unattributed[i] != 0) {
+      out.begin_array();
+      out.value(uint64_t(i));
+      out.end_array();
+      weights.push_back(unattributed[i]);
+    }
+  }
+  out.end_array();
+
+  out.key("weights");
+  out.begin_array();
+  for (auto weight : weights) {
+    out.value(weight);
+  }
+  out.end_array();
+  out.end_object();
+  out.end_array();
+  out.end_object();
+  out.finish();
+}
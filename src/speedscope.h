@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+#include "profile_data.h"
+#include "timeline.h"
+
+// Speedscope file format (https://www.speedscope.app/file-format-schema.json)
+// writers. Both stream through JsonWriter and share one frame table of
+// (name, file, line). They throw std::runtime_error on I/O errors.
+
+// One evented profile per thread of the timeline, opening and closing each
+// recorded call.
+void WriteSpeedscopeTimeline(const TimelineData& data, const std::string& path);
+
+// One sampled profile of a dump. bprof keeps no stacks, so samples are at
+// most one call deep: each call edge becomes the stack [caller, callee]
+// weighted by the callee's self time, and self time without an edge (frames
+// that were running when profiling started) a single-frame sample.
+void WriteSpeedscopeProfile(const ProfileData& data, const std::string& path);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+
+// Counters describing the profiler's own cost. They are bumped from the hook
+// of the profiled thread, which holds the GIL, so plain integers suffice.
+// They are per profiler rather than per thread: the hooks are installed on
+// one thread at a time, and Module rejects the others, so everything counted
+// belongs to that thread.
+struct ProfilerStats {
+  // Indexed by the PyTrace_* event type, PyTrace_CALL through PyTrace_OPCODE.
+  static constexpr int kEventTypes = 8;
+
+  uint64_t events[kEventTypes] = {};
+  // Time from entering Module::profile to leaving it, per event type.
+  uint64_t hook_ns[kEventTypes] = {};
+  // Files registered with linecache from the hook and the time it took.
+  uint64_t source_lookups = 0;
+  uint64_t source_ns = 0;
+  uint64_t frames_allocated = 0;
+  // Bytes held by the FrameStates currently on the shadow stack.
+  uint64_t frame_stack_bytes = 0;
+};
@@ -0,0 +1,154 @@
+#include "timeline.h"
+
+#include <pythread.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "json_writer.h"
+
+namespace {
+
+// Buffers grow on demand up to the limit, starting from this many events.
+constexpr size_t kInitialEvents = 1 << 12;
+
+}  // namespace
+
+void Timeline::configure(size_t max_events, duration threshold) {
+  max_events_ = max_events;
+  threshold_ = threshold;
+  threads_.clear();
+  current_ = SIZE_MAX;
+  if (max_events == 0) {
+    names_.clear();
+    function_names_.clear();
+    c_function_names_.clear();
+  }
+}
+
+uint32_t Timeline::function_name(
+    PyCodeObject* key, const std::string& name, const std::string& filename,
+    size_t line) {
+  auto pair = function_names_.emplace(key, names_.size());
+  if (pair.second) {
+    names_.push_back(TimelineName{name, filename, line, false});
+  }
+  return pair.first->second;
+}
+
+uint32_t Timeline::c_function_name(const std::string& name) {
+  auto pair = c_function_names_.emplace(name, names_.size());
+  if (pair.second) {
+    names_.push_back(TimelineName{name, std::string(), 0, true});
+  }
+  return pair.first->second;
+}
+
+void Timeline::add(const TimelineEvent& event) {
+  uint64_t id = PyThread_get_thread_ident();
+  if (current_ == SIZE_MAX || threads_[current_].id != id) {
+    auto it = std::find_if(threads_.begin(), threads_.end(),
+                           [id](const TimelineThread& t) { return t.id == id; });
+    if (it == threads_.end()) {
+      threads_.emplace_back();
+      threads_.back().id = id;
+      threads_.back().events.reserve(std::min(max_events_, kInitialEvents));
+      it = threads_.end() - 1;
+    }
+    current_ = it - threads_.begin();
+  }
+  auto& thread = threads_[current_];
+  if (thread.events.size() >= max_events_) {
+    ++thread.dropped;
+    return;
+  }
+  thread.events.push_back(event);
+}
+
+uint64_t Timeline::events() const {
+  uint64_t total = 0;
+  for (auto&& thread : threads_) {
+    total += thread.events.size();
+  }
+  return total;
+}
+
+uint64_t Timeline::dropped() const {
+  uint64_t total = 0;
+  for (auto&& thread : threads_) {
+    total += thread.dropped;
+  }
+  return total;
+}
+
+TimelineData Timeline::snapshot() const {
+  return TimelineData{names_, threads_};
+}
+
+void WriteChromeTrace(const TimelineData& data, const std::string& path) {
+  uint64_t pid = getpid();
+  uint64_t dropped = 0;
+  JsonWriter out(path);
+  out.begin_object();
+  out.key("traceEvents");
+  out.begin_array();
+  for (auto&& thread : data.threads) {
+    dropped += thread.dropped;
+    out.begin_object();
+    out.key("name");
+    out.value("thread_name");
+    out.key("ph");
+    out.value("M");
+    out.key("pid");
+    out.value(pid);
+    out.key("tid");
+    out.value(thread.id);
+    out.key("args");
+    out.begin_object();
+    out.key("name");
+    out.value("thread " + std::to_string(thread.id));
+    out.key("dropped_events");
+    out.value(thread.dropped);
+    out.end_object();
+    out.end_object();
+
+    for (auto&& event : thread.events) {
+      const TimelineName& name = data.names[event.name];
+      out.begin_object();
+      out.key("name");
+      out.value(name.name);
+      out.key("cat");
+      out.value(name.c ? "c" : "python");
+      out.key("ph");
+      out.value("X");
+      out.key("ts");
+      out.decimal(event.start_ns, 3);
+      out.key("dur");
+      out.decimal(event.duration_ns, 3);
+      out.key("pid");
+      out.value(pid);
+      out.key("tid");
+      out.value(thread.id);
+      if (!name.c) {
+        out.key("args");
+        out.begin_object();
+        out.key("file");
+        out.value(name.filename);
+        out.key("line");
+        out.value(name.line);
+        out.end_object();
+      }
+      out.end_object();
+    }
+  }
+  out.end_array();
+  out.key("displayTimeUnit");
+  out.value("ns");
+  out.key("otherData");
+  out.begin_object();
+  out.key("dropped_events");
+  out.value(dropped);
+  out.end_object();
+  out.end_object();
+  out.finish();
+}
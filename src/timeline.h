@@ -0,0 +1,110 @@
+#pragma once
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+// One finished Python or C call. Times are nanoseconds since the timeline
+// started recording.
+struct TimelineEvent {
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  uint32_t name;
+  uint32_t depth;
+};
+
+struct TimelineName {
+  std::string name;
+  std::string filename;
+  uint64_t line = 0;
+  bool c = false;
+};
+
+struct TimelineThread {
+  uint64_t id = 0;
+  std::vector<TimelineEvent> events;
+  // Events that did not fit in the buffer.
+  uint64_t dropped = 0;
+};
+
+struct TimelineData {
+  std::vector<TimelineName> names;
+  std::vector<TimelineThread> threads;
+};
+
+// Bounded per-thread buffers of call events for timeline views. A call is
+// recorded once it returns, as a complete event, so a duration threshold can
+// be applied before it takes any space. Full buffers drop new events and
+// count them instead of growing.
+class Timeline {
+ public:
+  // max_events is per thread; 0 stops recording and frees the buffers.
+  // Calls shorter than threshold are not recorded. Event times count from
+  // origin, a time point of the profiler's clock; calls already running
+  // then are cut to start at it.
+  template <typename TimePoint>
+  void configure(size_t max_events, duration threshold, TimePoint origin) {
+    configure(max_events, threshold);
+    origin_ns_ = nanoseconds(origin);
+  }
+  bool recording() const { return max_events_ != 0; }
+  size_t max_events() const { return max_events_; }
+  duration threshold() const { return threshold_; }
+
+  // Name ids, assigned the first time a function is seen.
+  uint32_t function_name(PyCodeObject* key, const std::string& name,
+                         const std::string& filename, size_t line);
+  uint32_t c_function_name(const std::string& name);
+  // Lets a later function with the same key get a name of its own; events
+  // already recorded keep the old one.
+  void forget_function(PyCodeObject* key) { function_names_.erase(key); }
+
+  template <typename TimePoint>
+  void record(uint32_t name, size_t depth, TimePoint start, TimePoint end) {
+    uint64_t start_ns = std::max(nanoseconds(start), origin_ns_);
+    uint64_t end_ns = nanoseconds(end);
+    if (end_ns < start_ns ||
+        end_ns - start_ns < static_cast<uint64_t>(threshold_.count())) {
+      return;
+    }
+    add(TimelineEvent{start_ns - origin_ns_, end_ns - start_ns, name,
+                      static_cast<uint32_t>(depth)});
+  }
+
+  uint64_t events() const;
+  uint64_t dropped() const;
+  TimelineData snapshot() const;
+
+ private:
+  template <typename TimePoint>
+  static uint64_t nanoseconds(TimePoint time) {
+    return std::chrono::duration_cast<duration>(time.time_since_epoch())
+        .count();
+  }
+  void configure(size_t max_events, duration threshold);
+  void add(const TimelineEvent& event);
+
+  size_t max_events_ = 0;
+  duration threshold_ = duration(0);
+  uint64_t origin_ns_ = 0;
+  std::vector<TimelineName> names_;
+  std::unordered_map<PyCodeObject*, uint32_t> function_names_;
+  std::unordered_map<std::string, uint32_t> c_function_names_;
+  std::vector<TimelineThread> threads_;
+  // Buffer of the thread that recorded last, so the common case skips the
+  // lookup.
+  size_t current_ = SIZE_MAX;
+};
+
+// Writes the Chrome trace event JSON format, which chrome://tracing and the
+// Perfetto UI load: one complete ("X") event per call, a thread_name record
+// per thread and the drop counters. Throws std::runtime_error on I/O errors.
+void WriteChromeTrace(const TimelineData& data, const std::string& path);
@@ -4,10 +4,168 @@
 """Tests for `bprof` package."""
 
 
+import _thread
+import dis
+import gzip
+import importlib.util
+import json
+import linecache
+import multiprocessing
+import os
+import pstats
+import signal
+import struct
+import sys
+import tempfile
+import threading
+import time
+import traceback
 import unittest
 
-from bprof import start, stop
-from bprof.profile import Profile
+from benchmarks.run import count_events
+from benchmarks.workloads import WORKLOADS
+from bprof import (start, stop, dump, tables, load, merge, stats,
+                   set_limits, configure, region, profiled, pause, resume,
+                   set_gil, set_native, set_opcodes, set_timeline,
+                   write_timeline)
+from bprof import autodump, cli, fork, signals
+from bprof._bprof import (export_callgrind, export_pprof, export_pstats,
+                          export_speedscope, html, report, snapshot)
+from bprof.profile import Profile, diff
+
+
+def _workload(n):
+    total = 0
+    for i in range(n):
+        total += len([i])
+    return total
+
+
+def _workload_calls():
+    return sum(f['n_calls'] for f in dump('')['functions'].values()
+               if f['name'] == '_workload')
+
+
+# profile.proto fields bprof writes: message -> field -> (wire type, nested
+# message or None).
+_PPROF_SCHEMA = {
+    'Profile': {1: (2, 'ValueType'), 2: (2, 'Sample'), 4: (2, 'Location'),
+                5: (2, 'Function'), 6: (2, None), 14: (0, None)},
+    'ValueType': {1: (0, None), 2: (0, None)},
+    'Sample': {1: (2, None), 2: (2, None)},
+    'Location': {1: (0, None), 4: (2, 'Line')},
+    'Line': {1: (0, None), 2: (0, None)},
+    'Function': {1: (0, None), 2: (0, None), 3: (0, None), 4: (0, None),
+                 5: (0, None)},
+}
+
+
+def _varint(data, i):
+    value = shift = 0
+    while True:
+        byte = data[i]
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        i += 1
+        if byte < 0x80:
+            return value, i
+
+
+def _decode_proto(data, message):
+    """Decodes data as message, checking it against _PPROF_SCHEMA."""
+    fields = {}
+    i = 0
+    while i < len(data):
+        key, i = _varint(data, i)
+        number, wire_type = key >> 3, key & 7
+        expected_type, nested = _PPROF_SCHEMA[message][number]
+        assert wire_type == expected_type, (message, number)
+        if wire_type == 0:
+            value, i = _varint(data, i)
+        else:
+            size, i = _varint(data, i)
+            value = data[i:i + size]
+            i += size
+            if nested:
+                value = _decode_proto(value, nested)
+        fields.setdefault(number, []).append(value)
+    return fields
+
+
+def _packed(data):
+    values, i = [], 0
+    while i < len(data):
+        value, i = _varint(data, i)
+        values.append(value)
+    return values
+
+
+def _load_source(directory, name, source):
+    """Imports source as module name from a file linecache has not seen."""
+    path = os.path.join(directory, name + '.py')
+    with open(path, 'w') as f:
+        f.write(source)
+    linecache.checkcache(path)
+    spec = importlib.util.spec_from_file_location(name, path)
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+_STEPS_SOURCE = (
+    'def steps(n):\n'
+    '    """Docstring."""\n'
+    '    total = 0\n'
+    '\n'
+    '    for i in range(n):  # loop\n'
+    '        total += i\n'
+    '    return total\n')
+
+
+class _FreshLoader(object):
+    """Source loader that runs new code objects on every lookup."""
+
+    def __init__(self, source):
+        self.source = source
+        # Kept alive so no later code object reuses an address.
+        self.functions = []
+
+    def get_source(self, name):
+        for _ in range(4):
+            namespace = {}
+            exec('def fresh():\n    pass\n', namespace)
+            namespace['fresh']()
+            self.functions.append(namespace['fresh'])
+        return self.source
+
+
+def _source_lines(path, func):
+    return [linecache.getline(path, func['first_line'] + i)
+            for i in range(len(func['lines']))]
+
+
+def _workload_line_calls(profile):
+    for func in profile.functions:
+        if func.name == '_workload':
+            return [line.n_calls for line in func.lines]
+    return []
+
+
+def _run_in_thread(func):
+    """Calls func on a new thread, re-raising what it raised."""
+    result = []
+
+    def target():
+        try:
+            func()
+        except BaseException as e:
+            result.append(e)
+
+    thread = threading.Thread(target=target)
+    thread.start()
+    thread.join()
+    if result:
+        raise result[0]
 
 
 class TestBprof(unittest.TestCase):
@@ -21,3 +179,1158 @@ class TestBprof(unittest.TestCase):
 
     def test_000_something(self):
         """Test something."""
+
+    def test_tables_buffer_protocol(self):
+        """Line statistics are exported as contiguous uint64 columns."""
+        before = _workload_line_calls(Profile.from_tables(tables()))
+        start()
+        _workload(10)
+        stop()
+
+        data = tables()
+        lines = data['lines']
+        view = memoryview(lines['n_calls'])
+        self.assertEqual(view.format, 'Q')
+        self.assertEqual(view.itemsize, 8)
+        self.assertTrue(view.readonly)
+        for column in ('function', 'line_number', 'internal_ns',
+                       'external_ns'):
+            self.assertEqual(len(lines[column]), len(view))
+
+        after = _workload_line_calls(Profile.from_tables(data))
+        self.assertEqual(sum(after) - sum(before), 1 + 11 + 10 + 1)
+
+    def test_merge_dumps(self):
+        """Dumps merge by function identity and sum their statistics."""
+        with tempfile.TemporaryDirectory() as tmp:
+            paths = [os.path.join(tmp, 'p%d.bprof' % i) for i in range(3)]
+            for path in paths:
+                start()
+                _workload(10)
+                stop()
+                dump(path)
+            output = os.path.join(tmp, 'merged.bprof')
+            merge(output, paths, threads=2)
+
+            calls = [_workload_line_calls(Profile.from_file(path))
+                     for path in paths]
+            merged = _workload_line_calls(Profile.from_file(output))
+
+        self.assertEqual(merged, [sum(n) for n in zip(*calls)])
+
+    def test_dump_older_calls(self):
+        """Call records written without caller_line still load."""
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, 'a.bprof')
+            start()
+            _workload(10)
+            stop()
+            dump(path)
+            expected = load(path)['calls']
+            # Drop the trailing caller_line from every 64-byte call record.
+            with open(path, 'r+b') as f:
+                data = bytearray(f.read())
+                n_sections, = struct.unpack_from('<I', data, 12)
+                for i in range(n_sections):
+                    entry = 16 + 24 * i
+                    tag, size, count, offset = struct.unpack_from(
+                        '<IIQQ', data, entry)
+                    if tag != 6:
+                        continue
+                    self.assertEqual(size, 64)
+                    records = [data[offset + 64 * j:offset + 64 * j + 56]
+                               for j in range(count)]
+                    data[offset:offset + 56 * count] = b''.join(records)
+                    struct.pack_into('<I', data, entry + 4, 56)
+                f.seek(0)
+                f.write(data)
+            calls = load(path)['calls']
+
+        self.assertEqual(list(memoryview(calls['n_calls'])),
+                         list(memoryview(expected['n_calls'])))
+        self.assertEqual(set(memoryview(calls['caller_line'])), {0})
+
+    def test_diff_identical(self):
+        """A dump compared with itself has no deltas."""
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, 'a.bprof')
+            start()
+            _workload(10)
+            stop()
+            dump(path)
+            result = diff(path, path)
+
+        names = [func.name for func in result.functions]
+        self.assertIn('_workload', names)
+        for row in result.functions + result.lines:
+            self.assertEqual(row.delta_self_ns, 0)
+            self.assertEqual(row.delta_calls, 0)
+
+    def _fork_dumps(self, policy):
+        with tempfile.TemporaryDirectory() as tmp:
+            start()
+            _workload(3)
+            fork.enable(tmp, policy)
+            try:
+                pid = os.fork()
+                if pid == 0:
+                    try:
+                        _workload(3)
+                        # What atexit would run; os._exit keeps the
+                        # child out of the parent's test runner.
+                        fork._dump_at_exit()
+                    finally:
+                        os._exit(0)
+                os.waitpid(pid, 0)
+            finally:
+                stop()
+                fork.disable()
+            path = fork.dump_path(tmp, pid)
+            if not os.path.exists(path):
+                return None
+            return [f.n_calls for f in Profile.from_file(path).functions
+                    if f.name == '_workload']
+
+    def test_fork(self):
+        """A forked child dumps only its own counts, unless told to stop."""
+        self.assertEqual(self._fork_dumps('continue'), [1])
+        self.assertIsNone(self._fork_dumps('stop'))
+
+    def test_fork_multiprocessing(self):
+        """multiprocessing children write their dump despite os._exit()."""
+        context = multiprocessing.get_context('fork')
+        with tempfile.TemporaryDirectory() as tmp:
+            start()
+            fork.enable(tmp)
+            try:
+                process = context.Process(target=_workload, args=(3,))
+                process.start()
+                process.join()
+            finally:
+                stop()
+                fork.disable()
+            profile = Profile.from_file(fork.dump_path(tmp, process.pid))
+
+        calls = [f.n_calls for f in profile.functions if f.name == '_workload']
+        self.assertEqual(calls, [1])
+
+    def test_fork_dump_other_thread(self):
+        """The exit dump is written while another thread holds the hooks."""
+        started = threading.Event()
+        done = threading.Event()
+
+        def profiled():
+            start()
+            started.set()
+            done.wait()
+            stop()
+
+        thread = threading.Thread(target=profiled, daemon=True)
+        with tempfile.TemporaryDirectory() as tmp:
+            fork.enable(tmp)
+            thread.start()
+            try:
+                started.wait()
+                fork._dump_at_exit()
+            finally:
+                done.set()
+                thread.join()
+                fork.disable()
+                fork._dumped_pid = None
+            self.assertTrue(os.path.exists(fork.dump_path(tmp)))
+
+    def test_diff_moved(self):
+        """Moved functions and lines still match, and regressions rank first."""
+        source = ('import time\n'
+                  'def target(delay):\n'
+                  '    total = 0\n'
+                  '    for i in range(10):\n'
+                  '        total += i\n'
+                  '    time.sleep(delay)\n'
+                  '    return total\n')
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, '_bprof_moved.py')
+            dumps = []
+            # B has target() three lines lower and its sleep line slower.
+            for prefix, delay in (('', 0), ('\n# moved\n\n', 0.02)):
+                with open(path, 'w') as f:
+                    f.write(prefix + source)
+                linecache.checkcache(path)
+                spec = importlib.util.spec_from_file_location(
+                    '_bprof_moved', path)
+                module = importlib.util.module_from_spec(spec)
+                spec.loader.exec_module(module)
+                dumps.append(os.path.join(tmp, '%d.bprof' % len(dumps)))
+                start()
+                module.target(delay)
+                stop()
+                # Only what ran since the last delta, so B leaves out A's
+                # target().
+                snapshot(dumps[-1], delta=True)
+            result = diff(*dumps, key='total')
+
+        moved = next(func for func in result.functions
+                     if func.name == 'target')
+        self.assertEqual((moved.first_line_a, moved.first_line_b), (2, 5))
+        # The test runner's frames are on the stack throughout; rank only
+        # the moved module's lines.
+        top = next(line for line in result.lines if line.filename == path)
+        self.assertEqual(top.text.strip(), 'time.sleep(delay)')
+        self.assertEqual((top.line_a, top.line_b), (6, 9))
+        self.assertGreater(top.delta_total_ns, 10 ** 7)
+
+    def test_benchmark_workloads(self):
+        """Benchmark workloads give the same answer under the profiler."""
+        for name, workload in WORKLOADS.items():
+            expected = workload(2000)
+            start()
+            result = workload(2000)
+            stop()
+            self.assertEqual(result, expected, name)
+
+            counts = count_events(workload, 2000)
+            self.assertEqual(counts['call'], counts['return'], name)
+            self.assertEqual(counts['c_call'], counts['c_return'], name)
+
+    def test_stats(self):
+        """The profiler counts its own events and hook time."""
+        before = stats()
+        start()
+        _workload(10)
+        stop()
+        after = stats()
+
+        self.assertGreaterEqual(after['events']['line'] -
+                                before['events']['line'], 1 + 11 + 10 + 1)
+        self.assertEqual(after['events']['c_call'] -
+                         before['events']['c_call'], 10 + 1)
+        self.assertGreater(after['hook_ns']['line'], before['hook_ns']['line'])
+        self.assertGreater(after['bytes']['functions'], 0)
+
+    def test_stats_threads(self):
+        """Stats only count the events of the thread being profiled."""
+        # Plain locks, so that the profiled thread makes no Python calls
+        # while the worker runs.
+        go = _thread.allocate_lock()
+        done = _thread.allocate_lock()
+        go.acquire()
+        done.acquire()
+
+        def worker():
+            go.acquire()
+            _workload(10)
+            done.release()
+
+        thread = threading.Thread(target=worker)
+        thread.start()
+        start()
+        try:
+            before = stats()
+            go.release()
+            done.acquire()
+            after = stats()
+        finally:
+            stop()
+            thread.join()
+        self.assertEqual(after['events']['call'], before['events']['call'])
+        self.assertEqual(after['events']['return'],
+                         before['events']['return'])
+
+    def test_bounded_functions(self):
+        """Bounded mode keeps heavy hitters and folds the rest into totals."""
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, '_bprof_rare.py')
+            with open(path, 'w') as f:
+                for i in range(40):
+                    f.write('def rare_%d():\n    return %d\n' % (i, i))
+            spec = importlib.util.spec_from_file_location('_bprof_rare', path)
+            module = importlib.util.module_from_spec(spec)
+            spec.loader.exec_module(module)
+            rare = [getattr(module, 'rare_%d' % i) for i in range(40)]
+
+            self._run_bounded(rare)
+
+    def _run_bounded(self, rare):
+        # Frames already running at start() are tracked too.
+        limit = 16 + len(traceback.extract_stack())
+        set_limits(max_functions=limit)
+        try:
+            start()
+            for _ in range(50):
+                _workload(2)
+            for func in rare:
+                func()
+            stop()
+            data = dump('')
+        finally:
+            set_limits()
+
+        self.assertLessEqual(len(data['functions']), limit)
+        names = [f['name'] for f in data['functions'].values()]
+        self.assertIn('_workload', names)
+        bounded = data['bounded']
+        self.assertGreater(bounded['evicted_functions'], 0)
+        # Functions only seen running at an earlier start() have no calls.
+        self.assertGreater(bounded['evicted_calls'], 0)
+        self.assertGreaterEqual(bounded['error_bound_calls'], 1)
+
+    def test_bounded_callers(self):
+        """Edges from evicted callers are not inherited by new functions."""
+        def callee():
+            pass
+
+        limit = 8 + len(traceback.extract_stack())
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, 'a.bprof')
+            output = os.path.join(tmp, 'a.prof')
+            set_limits(max_functions=limit)
+            try:
+                start()
+                # Each caller is freed once it ran, so later ones are likely
+                # to reuse its address.
+                for i in range(400):
+                    namespace = {'callee': callee}
+                    exec('def gen_%d():\n    callee()\n' % i, namespace)
+                    namespace['gen_%d' % i]()
+                    del namespace
+                stop()
+                snapshot(path, slice_us=0)
+            finally:
+                set_limits()
+            export_pstats(path, output)
+            stats = pstats.Stats(output).stats
+
+        callers = next(value[4] for key, value in stats.items()
+                       if key[2] == 'callee')
+        for key, edge in callers.items():
+            if key in stats:
+                self.assertLessEqual(edge[0], stats[key][1], key)
+
+    def test_region(self):
+        """Scopes nest, pause and resume without losing the shadow stack."""
+        handler = profiled(_workload)
+        before = _workload_calls()
+        for _ in range(5):
+            handler(3)
+        with region():
+            _workload(3)
+            with region():
+                _workload(3)
+            pause()
+            _workload(3)
+            resume()
+            _workload(3)
+        _workload(3)
+
+        self.assertEqual(_workload_calls() - before, 5 + 3)
+        # Frames that were running when the first scope opened stay on the
+        # shadow stack while paused; later scopes must not add to them.
+        depth = stats()['frame_depth']
+        with region():
+            handler(3)
+        self.assertEqual(stats()['frame_depth'], depth)
+        start()
+        stop()
+        self.assertEqual(stats()['frame_depth'], 0)
+
+    def test_region_threads(self):
+        """Scopes only profile on the thread the hooks are installed on."""
+        errors = []
+
+        def worker():
+            try:
+                with region():
+                    _workload(3)
+            except RuntimeError as e:
+                errors.append(e)
+
+        before = _workload_calls()
+        start()
+        try:
+            _run_in_thread(worker)
+            self.assertRaises(RuntimeError, _run_in_thread, stop)
+        finally:
+            stop()
+        self.assertEqual(len(errors), 1)
+        self.assertEqual(_workload_calls(), before)
+
+        # The worker exits with its paused hooks installed; another thread
+        # can take them over.
+        _run_in_thread(worker)
+        self.assertEqual(errors[1:], [])
+        self.assertEqual(_workload_calls(), before + 1)
+        start()
+        _workload(3)
+        stop()
+        self.assertEqual(_workload_calls(), before + 2)
+        self.assertEqual(stats()['frame_depth'], 0)
+
+    def test_region_mid_stack(self):
+        """Bootstrapping a scope's callers runs no profiled Python code."""
+        def lazycache_calls():
+            return sum(f['n_calls'] for f in dump('')['functions'].values()
+                       if f['name'] == 'lazycache')
+
+        with tempfile.TemporaryDirectory() as tmp:
+            # A file linecache has not seen, so bootstrapping its frames
+            # calls into linecache.
+            path = os.path.join(tmp, '_bprof_midstack.py')
+            with open(path, 'w') as f:
+                f.write('from bprof import region\n'
+                        'def inner(work):\n'
+                        '    with region():\n'
+                        '        return work(3)\n'
+                        'def outer(work):\n'
+                        '    return inner(work)\n')
+            spec = importlib.util.spec_from_file_location(
+                '_bprof_midstack', path)
+            module = importlib.util.module_from_spec(spec)
+            spec.loader.exec_module(module)
+
+            start()
+            stop()
+            before = lazycache_calls()
+            module.outer(_workload)
+
+        self.assertEqual(lazycache_calls(), before)
+        # Only the frames below outer() are left on the shadow stack.
+        self.assertEqual(stats()['frame_depth'],
+                         len(traceback.extract_stack()))
+        start()
+        stop()
+
+    def test_start_mid_stack(self):
+        """start() below running frames attributes their returns."""
+        def inner():
+            start()
+            return _workload(3)
+
+        def outer():
+            inner()
+            return _workload(3)
+
+        outer()
+        stop()
+        functions = dump('')['functions'].values()
+        partial = {f['name']: f['partial_calls'] for f in functions}
+        self.assertEqual(partial.get('inner'), 1)
+        self.assertEqual(partial.get('outer'), 1)
+
+    def test_autodump_delta(self):
+        """Delta dumps hold one interval each and old dumps are rotated."""
+        with tempfile.TemporaryDirectory() as tmp:
+            autodump.start(tmp, interval=3600, mode='delta', max_files=2)
+            try:
+                for _ in range(3):
+                    start()
+                    _workload(3)
+                    stop()
+                    autodump.dump_now()
+            finally:
+                autodump.stop(final=False)
+
+            self.assertEqual(sorted(os.listdir(tmp)), [
+                os.path.basename(autodump.dump_path(tmp, seq))
+                for seq in (1, 2)])
+            profile = Profile.from_file(autodump.dump_path(tmp, 2))
+            calls = [f.n_calls for f in profile.functions
+                     if f.name == '_workload']
+            self.assertEqual(calls, [1])
+
+    def test_autodump_concurrent(self):
+        """Dumps requested from several threads each get their own number."""
+        with tempfile.TemporaryDirectory() as tmp:
+            autodump.start(tmp, interval=3600)
+            try:
+                start()
+                threads = [threading.Thread(target=autodump.dump_now)
+                           for _ in range(4)]
+                for thread in threads:
+                    thread.start()
+                _workload(100)
+                for thread in threads:
+                    thread.join()
+                stop()
+            finally:
+                autodump.stop(final=False)
+
+            self.assertEqual(sorted(os.listdir(tmp)), sorted(
+                os.path.basename(autodump.dump_path(tmp, seq))
+                for seq in range(4)))
+
+    def test_signals(self):
+        """SIGUSR1 toggles profiling, SIGUSR2 dumps from a helper thread."""
+        def wait_for(condition):
+            deadline = time.monotonic() + 10
+            while not condition() and time.monotonic() < deadline:
+                time.sleep(0.01)
+            return condition()
+
+        with tempfile.TemporaryDirectory() as tmp:
+            signals.install(tmp)
+            try:
+                os.kill(os.getpid(), signal.SIGUSR1)
+                self.assertTrue(wait_for(lambda: sys.getprofile() is not None))
+                os.kill(os.getpid(), signal.SIGUSR1)
+                self.assertTrue(wait_for(lambda: sys.getprofile() is None))
+                path = os.path.join(
+                    tmp, 'bprof-%d-signal-0.bprof' % os.getpid())
+                os.kill(os.getpid(), signal.SIGUSR2)
+                self.assertTrue(wait_for(lambda: os.path.exists(path)))
+            finally:
+                signals.uninstall()
+            self.assertEqual(os.listdir(tmp), [os.path.basename(path)])
+
+    def test_cli_run(self):
+        """`bprof run` dumps on exit, including through SystemExit."""
+        with tempfile.TemporaryDirectory() as tmp:
+            script = os.path.join(tmp, 'target.py')
+            with open(script, 'w') as f:
+                f.write('import sys\n'
+                        'def work(n):\n'
+                        '    return sum(range(n))\n'
+                        'work(int(sys.argv[1]))\n'
+                        'sys.exit(3)\n')
+            output = os.path.join(tmp, 'out.bprof')
+            argv, path = sys.argv[:], sys.path[:]
+            try:
+                status = cli.main(['run', '-o', output,
+                                   '--include', os.path.join(tmp, '*'),
+                                   script, '10'])
+            finally:
+                sys.argv[:], sys.path[:] = argv, path
+                configure(include=(), exclude=())
+
+            self.assertEqual(status, 3)
+            names = {f.name for f in Profile.from_file(output).functions}
+            self.assertEqual(names, {'<module>', 'work'})
+
+    def test_cli_run_module(self):
+        """`bprof run -m` imports from the current directory, and the
+        runner's own frames stay out of the dump."""
+        with tempfile.TemporaryDirectory() as tmp:
+            with open(os.path.join(tmp, '_bprof_localmod.py'), 'w') as f:
+                f.write('def work(n):\n'
+                        '    return sum(range(n))\n'
+                        'work(10)\n')
+            output = os.path.join(tmp, 'out.bprof')
+            argv, path, cwd = sys.argv[:], sys.path[:], os.getcwd()
+            os.chdir(tmp)
+            try:
+                status = cli.main(['run', '-o', output,
+                                   '-m', '_bprof_localmod'])
+            finally:
+                os.chdir(cwd)
+                sys.argv[:], sys.path[:] = argv, path
+                sys.modules.pop('_bprof_localmod', None)
+                configure(include=(), exclude=())
+
+            self.assertEqual(status, 0)
+            functions = load(output)['functions']
+            self.assertIn('work', functions['name'])
+            self.assertNotIn(cli.__file__, functions['filename'])
+
+    def test_timeline(self):
+        """Timeline events nest, and a full buffer counts what it drops."""
+        def outer():
+            for _ in range(3):
+                _workload(10)
+
+        def record(path, max_events):
+            set_timeline(max_events=max_events)
+            try:
+                start()
+                outer()
+                stop()
+                timeline = stats()['timeline']
+                write_timeline(path)
+            finally:
+                set_timeline(0)
+            with open(path) as f:
+                return timeline, json.load(f)
+
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, 'trace.json')
+            timeline, trace = record(path, 1000)
+            small, small_trace = record(path, 5)
+
+        self.assertEqual(timeline['dropped'], 0)
+        calls = [e for e in trace['traceEvents'] if e['ph'] == 'X']
+        self.assertEqual(len(calls), timeline['events'])
+        workloads = [e for e in calls if e['name'] == '_workload']
+        self.assertEqual(len(workloads), 3)
+        first, last = workloads[0], workloads[-1]
+        self.assertLessEqual(first['ts'] + first['dur'], last['ts'])
+        self.assertEqual(first['args']['file'], __file__)
+        parent = next(e for e in calls if e['name'] == 'outer')
+        self.assertLessEqual(parent['ts'], first['ts'])
+        self.assertGreaterEqual(parent['ts'] + parent['dur'],
+                                last['ts'] + last['dur'])
+        self.assertIn('<C-function builtins.len>',
+                      {e['name'] for e in calls if e['cat'] == 'c'})
+
+        self.assertEqual(small['events'], 5)
+        self.assertEqual(small['dropped'], timeline['events'] - 5)
+        self.assertEqual(small_trace['otherData']['dropped_events'],
+                         small['dropped'])
+
+    def test_speedscope(self):
+        """Speedscope events nest per thread; samples are caller stacks."""
+        def conductor():
+            for _ in range(3):
+                _workload(10)
+
+        with tempfile.TemporaryDirectory() as tmp:
+            events_path = os.path.join(tmp, 'events.json')
+            path = os.path.join(tmp, 'a.bprof')
+            samples_path = os.path.join(tmp, 'samples.json')
+            set_timeline(max_events=1000)
+            try:
+                start()
+                conductor()
+                stop()
+                write_timeline(events_path, format='speedscope')
+            finally:
+                set_timeline(0)
+            dump(path)
+            export_speedscope(path, samples_path)
+            with open(events_path) as f:
+                evented = json.load(f)
+            with open(samples_path) as f:
+                sampled = json.load(f)
+
+        frames = evented['shared']['frames']
+        profile, = evented['profiles']
+        self.assertEqual(profile['type'], 'evented')
+        stack, last, opened = [], 0, []
+        for event in profile['events']:
+            self.assertGreaterEqual(event['at'], last)
+            last = event['at']
+            if event['type'] == 'O':
+                stack.append(event['frame'])
+                opened.append(frames[event['frame']]['name'])
+            else:
+                self.assertEqual(stack.pop(), event['frame'])
+        self.assertEqual(stack, [])
+        self.assertEqual(opened.count('_workload'), 3)
+        self.assertLessEqual(last, profile['endValue'])
+
+        frames = sampled['shared']['frames']
+        profile, = sampled['profiles']
+        self.assertEqual(len(profile['samples']), len(profile['weights']))
+        self.assertEqual(sum(profile['weights']), profile['endValue'])
+        stacks = {tuple(frames[i]['name'] for i in sample)
+                  for sample in profile['samples']}
+        self.assertIn(('conductor', '_workload'), stacks)
+
+    def test_report(self):
+        """The mapped report ranks functions and annotates the hottest."""
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, 'a.bprof')
+            start()
+            _workload(100)
+            stop()
+            dump(path)
+            result = report(path, key='calls', limit=5, annotate=1)
+
+        self.assertLessEqual(len(result['functions']), 5)
+        calls = [f['n_calls'] for f in result['functions']]
+        self.assertEqual(calls, sorted(calls, reverse=True))
+        self.assertIn('lines', result['functions'][0])
+        self.assertNotIn('lines', result['functions'][-1])
+        hottest = result['lines'][0]
+        self.assertEqual(hottest['n_calls'], max(
+            line['n_calls'] for line in result['lines']))
+        self.assertTrue(hottest['text'].strip())
+
+    def test_lazy_text(self):
+        """Text resolved at dump time is the source line linecache sees."""
+        with tempfile.TemporaryDirectory() as tmp:
+            module = _load_source(tmp, '_bprof_steps', _STEPS_SOURCE)
+            start()
+            module.steps(3)
+            stop()
+            func = next(f for f in dump('')['functions'].values()
+                        if f['name'] == 'steps')
+            expected = _source_lines(module.__file__, func)
+
+        self.assertEqual([line['line_str'] for line in func['lines']],
+                         expected)
+        self.assertEqual(expected[5], '        total += i\n')
+
+    def test_dump_while_profiling(self):
+        """Functions first called by dump()'s text lookups lose no record."""
+        def child(functions, output):
+            for function in functions:
+                function()
+            records = dump('')['functions'].values()
+            with open(output, 'w') as f:
+                json.dump([[r['name'], r['lines'][-1]['line_str']]
+                           for r in records if r['name'].startswith('live_')],
+                          f)
+
+        functions = []
+        for i in range(120):
+            source = 'def live_%d():\n    return %d\n' % (i, i)
+            # No such file, so linecache asks the loader.
+            path = os.path.join(os.sep, 'nonexistent', 'live_%d.py' % i)
+            namespace = {'__name__': '_bprof_live_%d' % i,
+                         '__loader__': _FreshLoader(source)}
+            exec(compile(source, path, 'exec'), namespace)
+            functions.append(namespace['live_%d' % i])
+
+        # A forked child starts from an empty table, which the lookups then
+        # grow through several rehashes.
+        context = multiprocessing.get_context('fork')
+        with tempfile.TemporaryDirectory() as tmp:
+            output = os.path.join(tmp, 'live.json')
+            start()
+            try:
+                process = context.Process(target=child,
+                                          args=(functions, output))
+                process.start()
+                process.join()
+            finally:
+                stop()
+            with open(output) as f:
+                live = sorted(json.load(f))
+
+        self.assertEqual(live, sorted(['live_%d' % i, '    return %d\n' % i]
+                                      for i in range(120)))
+
+    def test_line_slots(self):
+        """Lines without bytecode still read as zero rows of the span."""
+        def sparse(n):
+            total = 0
+
+            # Nothing runs here.
+            for i in range(n):
+                total += i
+            return total
+        first = sparse.__code__.co_firstlineno
+
+        start()
+        sparse(7)
+        stop()
+        func = next(f for f in dump('')['functions'].values()
+                    if f['name'] == 'sparse')
+        self.assertEqual(func['first_line'], first)
+        calls = [line['n_calls'] for line in func['lines']]
+        self.assertEqual(calls, [0, 1, 0, 0, 8, 7, 1])
+        self.assertEqual(func['lines'][5]['line_str'].strip(), 'total += i')
+
+    def test_opcodes(self):
+        """Selected functions are broken down per bytecode instruction."""
+        def stepper(n):
+            total = 0
+            for i in range(n):
+                total += i
+            return total
+        add_line = stepper.__code__.co_firstlineno + 3
+
+        set_opcodes([stepper])
+        try:
+            with tempfile.TemporaryDirectory() as tmp:
+                path = os.path.join(tmp, 'a.bprof')
+                start()
+                stepper(50)
+                _workload(5)
+                stop()
+                result = dump(path)
+                annotated = report(path, key='calls', limit=1000,
+                                   annotate=1000)
+        finally:
+            set_opcodes([])
+
+        functions = {f['name']: f for f in result['functions'].values()}
+        self.assertNotIn('opcodes', functions['_workload'])
+        stepper_dict = functions['stepper']
+        opcodes = {dis.opname[o['opcode']]: o for o in stepper_dict['opcodes']}
+        self.assertEqual(opcodes['INPLACE_ADD']['n_calls'], 50)
+        self.assertEqual(opcodes['INPLACE_ADD']['line_number'], add_line)
+        self.assertEqual(opcodes['RETURN_VALUE']['n_calls'], 1)
+        line = stepper_dict['lines'][add_line - stepper_dict['first_line']]
+        self.assertLessEqual(
+            sum(o['internal_ns'] for o in stepper_dict['opcodes']
+                if o['line_number'] == add_line),
+            line['internal_ns'])
+
+        func = next(f for f in annotated['functions']
+                    if f['name'] == 'stepper')
+        line = next(l for l in func['lines'] if l['line_number'] == add_line)
+        self.assertIn('INPLACE_ADD',
+                      [dis.opname[o['opcode']] for o in line['opcodes']])
+        self.assertEqual([o['offset'] for o in line['opcodes']],
+                         sorted(o['offset'] for o in line['opcodes']))
+        workload = next(f for f in annotated['functions']
+                        if f['name'] == '_workload')
+        self.assertNotIn('opcodes', workload['lines'][0])
+
+    def test_native(self):
+        """Native stacks sampled in a C call are kept under that C function."""
+        data = [(i * 7919) % 100003 for i in range(100000)]
+        set_native(100)
+        try:
+            with tempfile.TemporaryDirectory() as tmp:
+                path = os.path.join(tmp, 'a.bprof')
+                merged = os.path.join(tmp, 'b.bprof')
+                start()
+                for _ in range(5):
+                    sorted(data)
+                stop()
+                result = dump(path)
+                annotated = report(path)
+                merge(merged, [path, path])
+                merged_report = report(merged)
+            native_stats = stats()['native']
+        finally:
+            set_native(0)
+
+        stacks = result['c_functions']['<C-function builtins.sorted>']['native']
+        self.assertGreater(sum(s['samples'] for s in stacks), 0)
+        self.assertGreater(native_stats['samples'], 0)
+        for stack in stacks:
+            self.assertTrue(all(isinstance(f, str) for f in stack['frames']))
+            self.assertEqual(stack['ns'], stack['samples'] * 100000)
+        self.assertTrue(any('builtin_sorted' in s['frames'][-1]
+                            for s in stacks))
+        hottest = annotated['native'][0]
+        self.assertEqual(hottest['name'], '<C-function builtins.sorted>')
+        self.assertEqual(merged_report['native'][0]['frames'],
+                         hottest['frames'])
+        self.assertEqual(merged_report['native'][0]['samples'],
+                         2 * hottest['samples'])
+
+    def test_native_long_call(self):
+        """A C call longer than the buffer keeps stacks weighted over it."""
+        name = '<C-function builtins.sorted>'
+        data = [(i * 7919) % 1000003 for i in range(1000000)]
+
+        def counts():
+            function = dump('')['c_functions'].get(name, {})
+            return (sum(s['samples'] for s in function.get('native', [])),
+                    function.get('native_dropped', 0))
+
+        before_samples, before_dropped = counts()
+        set_native(20)
+        try:
+            before = stats()['native']
+            start()
+            sorted(data)
+            stop()
+            after = stats()['native']
+        finally:
+            set_native(0)
+        samples, dropped = counts()
+
+        samples -= before_samples
+        dropped -= before_dropped
+        self.assertGreater(dropped, 0)
+        # Every sample of the call is counted, though only 1024 stacks were
+        # kept; the few left are from stop() itself.
+        self.assertEqual(samples, 1024 + dropped)
+        self.assertEqual(after['dropped'] - before['dropped'], dropped)
+        self.assertLessEqual(samples, after['samples'] - before['samples'])
+
+    def test_native_other_thread(self):
+        """Only the thread the timer signals arms the native sampler."""
+        data = [(i * 7919) % 100003 for i in range(100000)]
+
+        def worker():
+            start()
+            for _ in range(5):
+                sorted(data)
+            stop()
+
+        def samples():
+            functions = dump('')['c_functions']
+            function = functions.get('<C-function builtins.sorted>', {})
+            return sum(s['samples'] for s in function.get('native', []))
+
+        before = samples()
+        set_native(100)
+        try:
+            _run_in_thread(worker)
+        finally:
+            set_native(0)
+        self.assertEqual(samples(), before)
+
+    def test_gil(self):
+        """GIL waits go to the line that resumed and to its thread."""
+        done = threading.Event()
+
+        def spin():
+            while not done.is_set():
+                pass
+
+        def sleeper():
+            for _ in range(5):
+                time.sleep(0.0001)
+        sleep_line = sleeper.__code__.co_firstlineno + 2
+
+        spinner = threading.Thread(target=spin)
+        set_gil(True)
+        try:
+            spinner.start()
+            with tempfile.TemporaryDirectory() as tmp:
+                path = os.path.join(tmp, 'a.bprof')
+                start()
+                sleeper()
+                stop()
+                done.set()
+                spinner.join()
+                result = dump(path)
+                annotated = report(path)
+        finally:
+            done.set()
+            set_gil(False)
+
+        keys = {k: f['name'] for k, f in result['functions'].items()}
+        # Lines whose C calls were only off the CPU have rows too.
+        waits = [w for w in result['gil']['waits']
+                 if keys.get(w['function']) == 'sleeper' and w['n_waits']]
+        self.assertEqual([w['line_number'] for w in waits], [sleep_line])
+        self.assertEqual(waits[0]['n_waits'], 5)
+        self.assertGreater(waits[0]['wait_ns'], 0)
+        threads = {t['thread_id']: t for t in result['gil']['threads']}
+        self.assertGreaterEqual(threads[threading.get_ident()]['n_waits'], 5)
+        self.assertEqual(annotated['gil_waits'][0]['name'], 'sleeper')
+        self.assertEqual(annotated['gil_waits'][0]['line_number'], sleep_line)
+        self.assertIn(threading.get_ident(),
+                      [t['thread_id'] for t in annotated['gil_threads']])
+
+    def test_gil_off_cpu(self):
+        """Off-CPU time shows the switches the GIL wrappers do not see."""
+        done = threading.Event()
+
+        def spin():
+            while not done.is_set():
+                pass
+
+        def nap():
+            time.sleep(0.01)
+        sleep_line = nap.__code__.co_firstlineno + 1
+
+        def busy():
+            end = time.perf_counter() + 0.1
+            while time.perf_counter() < end:
+                pass
+
+        def main_thread(data):
+            t = {name: list(memoryview(column))
+                 for name, column in data['gil_threads'].items()}
+            row = t['thread_id'].index(threading.get_ident())
+            return {name: column[row] for name, column in t.items()}
+
+        spinner = threading.Thread(target=spin)
+        set_gil(True)
+        try:
+            start()
+            nap()
+            stop()
+            alone = tables()
+            # Two threads running bytecode switch inside the eval loop.
+            spinner.start()
+            start()
+            busy()
+            stop()
+            contended = tables()
+        finally:
+            done.set()
+            if spinner.is_alive():
+                spinner.join()
+            set_gil(False)
+
+        g = {name: list(memoryview(column))
+             for name, column in alone['gil_waits'].items()}
+        names = alone['functions']['name']
+        rows = [i for i, function in enumerate(g['function'])
+                if names[function] == 'nap']
+        self.assertEqual([g['line_number'][i] for i in rows], [sleep_line])
+        self.assertGreaterEqual(g['off_cpu_ns'][rows[0]], 5000000)
+        thread = main_thread(alone)
+        self.assertGreater(thread['profiled_ns'], thread['cpu_ns'])
+        self.assertGreaterEqual(thread['released_ns'], 5000000)
+        self.assertTrue(thread['hold_exact'])
+
+        thread = main_thread(contended)
+        self.assertGreater(thread['profiled_ns'] - thread['cpu_ns'],
+                           thread['released_ns'] + 10000000)
+        self.assertFalse(thread['hold_exact'])
+
+    def test_pstats(self):
+        """The pstats export carries call counts and caller edges."""
+        def repeat():
+            for _ in range(3):
+                _workload(10)
+
+        def countdown(n):
+            return countdown(n - 1) if n else 0
+
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, 'a.bprof')
+            output = os.path.join(tmp, 'a.prof')
+            start()
+            repeat()
+            countdown(3)
+            stop()
+            dump(path)
+            merge(os.path.join(tmp, 'b.bprof'), [path, path])
+            export_pstats(path, output)
+            stats = pstats.Stats(output).stats
+            export_pstats(os.path.join(tmp, 'b.bprof'), output)
+            merged = pstats.Stats(output).stats
+
+        def entry(stats, name):
+            return next(value for key, value in stats.items()
+                        if key[2] == name)
+
+        cc, nc, tt, ct, callers = entry(stats, '_workload')
+        self.assertGreaterEqual(nc, 3)
+        self.assertLessEqual(tt, ct)
+        repeat_key = next(key for key in stats if key[2] == 'repeat')
+        self.assertEqual(repeat_key[0], __file__)
+        self.assertEqual(callers[repeat_key][:2], (3, 3))
+        # Caller tuples lead with the call count; only the recursive
+        # self-edge tells it apart from the primitive count.
+        self.assertEqual(entry(stats, 'countdown')[:2], (1, 4))
+        countdown_key = next(key for key in stats if key[2] == 'countdown')
+        edge_nc, edge_cc = entry(stats, 'countdown')[4][countdown_key][:2]
+        self.assertEqual(edge_nc, 3)
+        self.assertLess(edge_cc, edge_nc)
+        self.assertIn(('~', 0, '<built-in method builtins.len>'), stats)
+        self.assertEqual(entry(merged, '_workload')[1], 2 * nc)
+
+    def test_pstats_c_callback(self):
+        """A C function's cumulative time covers the Python it calls."""
+        def key(x):
+            return -_workload(20)
+
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, 'a.bprof')
+            output = os.path.join(tmp, 'a.prof')
+            start()
+            sorted(range(50), key=key)
+            stop()
+            dump(path)
+            export_pstats(path, output)
+            stats = pstats.Stats(output).stats
+
+        key_ct = next(value[3] for name, value in stats.items()
+                      if name[2] == 'key')
+        # Earlier tests call sorted too; only this test's edge is checked.
+        callers = stats[('~', 0, '<built-in method builtins.sorted>')][4]
+        edge = next(value for name, value in callers.items()
+                    if name[2] == 'test_pstats_c_callback')
+        self.assertGreaterEqual(edge[3], key_ct)
+
+    def test_pprof(self):
+        """The pprof export decodes against profile.proto."""
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, 'a.bprof')
+            output = os.path.join(tmp, 'a.pb.gz')
+            start()
+            _workload(100)
+            stop()
+            dump(path)
+            export_pprof(path, output)
+            with gzip.open(output) as f:
+                profile = _decode_proto(f.read(), 'Profile')
+
+        strings = [s.decode() for s in profile[6]]
+        self.assertEqual(strings[0], '')
+        self.assertEqual(len(strings), len(set(strings)))
+        types = [(strings[t[1][0]], strings[t[2][0]]) for t in profile[1]]
+        self.assertEqual(types, [('wall', 'nanoseconds'),
+                                 ('self', 'nanoseconds'), ('calls', 'count')])
+        self.assertEqual(strings[profile[14][0]], 'self')
+
+        functions = {fn[1][0]: fn for fn in profile[5]}
+        locations = {loc[1][0]: loc[4][0] for loc in profile[4]}
+        for line in locations.values():
+            self.assertIn(line[1][0], functions)
+        workload = next(fn for fn in functions.values()
+                        if strings[fn[2][0]] == '_workload')
+        self.assertEqual(strings[workload[4][0]], __file__)
+
+        hits = {}
+        for sample in profile[2]:
+            location, = _packed(sample[1][0])
+            wall, self_ns, calls = _packed(sample[2][0])
+            self.assertGreaterEqual(wall, self_ns)
+            line = locations[location]
+            if line[1][0] == workload[1][0]:
+                hits[line[2][0]] = calls
+        # Earlier tests ran _workload too; the loop body still dominates.
+        first = workload[5][0]
+        self.assertGreaterEqual(hits[first + 3], 100)
+        self.assertGreater(hits[first + 3], hits[first + 1])
+
+    def test_callgrind(self):
+        """Callgrind output has per-line costs and per-call-site calls."""
+        def driver():
+            for _ in range(3):
+                _workload(10)
+        call_line = driver.__code__.co_firstlineno + 2
+
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, 'a.bprof')
+            output = os.path.join(tmp, 'callgrind.out')
+            start()
+            driver()
+            stop()
+            dump(path)
+            export_callgrind(path, output)
+            with open(output) as f:
+                lines = f.read().splitlines()
+
+        self.assertEqual(lines[0], '# callgrind format')
+        self.assertIn('events: Time Hits', lines)
+        names = {}
+        for line in lines:
+            if line.startswith(('fn=', 'cfn=')):
+                key, _, name = line.partition(' ')
+                ident = key.split('=')[1]
+                if name:
+                    self.assertNotIn(ident, names)
+                    names[ident] = name
+                self.assertIn(ident, names)
+        self.assertEqual(len(set(names.values())), len(names))
+
+        driver_name = 'driver:%d' % driver.__code__.co_firstlineno
+        def name_of(line):
+            return names[line.split('=')[1].split(' ')[0]]
+
+        i = next(i for i, line in enumerate(lines)
+                 if line.startswith('fn=') and name_of(line) == driver_name)
+        end = lines.index('', i)
+        block = lines[i:end]
+        j = next(j for j, line in enumerate(block)
+                 if line.startswith('cfn=') and
+                 name_of(line).startswith('_workload:'))
+        self.assertEqual(block[j + 1].split()[0], 'calls=3')
+        position, inclusive = map(int, block[j + 2].split())
+        self.assertEqual(position, call_line)
+        self.assertGreater(inclusive, 0)
+
+    def test_html(self):
+        """The HTML report has a page per file and escapes source text."""
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, 'a.bprof')
+            output = os.path.join(tmp, 'a.html')
+            start()
+            _workload(100)
+            stop()
+            dump(path)
+            html(path, output, limit=10)
+            with open(output, encoding='utf-8') as f:
+                page = f.read()
+
+        self.assertTrue(page.startswith('<!DOCTYPE html>'))
+        self.assertTrue(page.rstrip().endswith('</html>'))
+        self.assertIn('>_workload</a>', page)
+        self.assertIn(os.path.basename(__file__), page)
+        self.assertIn('total += len([i])', page)
+        self.assertIn('class="sortable"', page)
+        self.assertIn('<section class="file"', page)
+        self.assertLessEqual(page.count('<td data-v='), 10 * 3)